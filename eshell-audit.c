@@ -0,0 +1,230 @@
+/*******************************************************************************
+
+  @file        eshell-audit.c
+
+  @brief       Decode eshell's binary audit log into readable lines.
+
+*******************************************************************************/
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include "eshell_audit.h"
+
+/*
+  Working directories by id for each session seen so far. Ids are only unique
+  within a session, which is identified by its pid.
+*/
+struct audit_cwd {
+  uint32_t pid;
+  uint32_t id;
+  char *path;
+};
+
+struct audit_cwd *cwds;
+int num_cwds;
+
+/**
+  @brief      Find a session's working directory by id.
+  @param pid  Session.
+  @param id   Directory id.
+  @return     The path, or "?" if it was never logged.
+*/
+const char *audit_cwd_find(uint32_t pid, uint32_t id) {
+  int i;
+
+  for (i = num_cwds - 1; i >= 0; i--) {
+    if (cwds[i].pid == pid && cwds[i].id == id) {
+      return cwds[i].path;
+    }
+  }
+
+  return "?";
+}
+
+/**
+  @brief     Forget a session's directories when its pid starts a new session.
+  @param pid Session.
+*/
+void audit_cwd_reset(uint32_t pid) {
+  int i, j;
+
+  for (i = j = 0; i < num_cwds; i++) {
+    if (cwds[i].pid == pid) {
+      free(cwds[i].path);
+    } else {
+      cwds[j++] = cwds[i];
+    }
+  }
+
+  num_cwds = j;
+}
+
+/**
+  @brief      Format a wall clock timestamp.
+  @param ns   Nanoseconds since the epoch.
+  @param buf  Buffer to receive the text.
+  @param size Size of the buffer.
+*/
+void audit_time(uint64_t ns, char *buf, size_t size) {
+  time_t secs = ns / 1000000000ULL;
+  struct tm tm;
+  size_t n;
+
+  gmtime_r(&secs, &tm);
+  n = strftime(buf, size, "%Y-%m-%dT%H:%M:%S", &tm);
+  snprintf(buf + n, size - n, ".%06uZ",
+           (unsigned) (ns % 1000000000ULL / 1000));
+}
+
+/**
+  @brief         Print one record.
+  @param payload The record's payload.
+  @param len     Length of the payload.
+  @return        False if the payload doesn't make sense.
+*/
+bool audit_print(const char *payload, size_t len) {
+  struct eshell_audit_record rec;
+  const char *p = payload + sizeof(rec);
+  const char *end = payload + len;
+  char when[64];
+  int i;
+
+  if (len < sizeof(rec)) {
+    return false;
+  }
+
+  memcpy(&rec, payload, sizeof(rec));
+  audit_time(rec.timestamp_ns, when, sizeof(when));
+
+  switch (rec.type) {
+    case ESHELL_AUDIT_SESSION:
+      audit_cwd_reset(rec.pid);
+      printf("%s pid=%u uid=%u session start\n", when, rec.pid, rec.uid);
+
+      return true;
+
+    case ESHELL_AUDIT_CWD:
+      if (memchr(p, '\0', end - p) == NULL) {
+        return false;
+      }
+
+      cwds = realloc(cwds, (num_cwds + 1) * sizeof(struct audit_cwd));
+
+      if (!cwds) {
+        fprintf(stderr, "eshell-audit: allocation error\n");
+
+        exit(EXIT_FAILURE);
+      }
+
+      cwds[num_cwds].pid = rec.pid;
+      cwds[num_cwds].id = rec.cwd_id;
+      cwds[num_cwds].path = strdup(p);
+      num_cwds++;
+
+      return true;
+
+    case ESHELL_AUDIT_COMMAND:
+      printf("%s pid=%u uid=%u cwd=%s status=%d duration=%.3fms argv:", when,
+             rec.pid, rec.uid, audit_cwd_find(rec.pid, rec.cwd_id),
+             rec.status, rec.duration_ns / 1e6);
+
+      for (i = 0; i < rec.argc && p < end; i++) {
+        const char *nul = memchr(p, '\0', end - p);
+
+        if (nul == NULL) {
+          break;
+        }
+
+        printf(" %s", p);
+        p = nul + 1;
+      }
+
+      printf("%s\n", rec.flags & ESHELL_AUDIT_TRUNCATED ? " ..." : "");
+
+      return true;
+  }
+
+  return false;
+}
+
+/**
+  @brief      Main entry point.
+  @param argc Argument count.
+  @param argv Argument vector: the log file, or "-" for stdin.
+  @return     0 if the log decoded cleanly, 1 if damage had to be skipped.
+*/
+int main(int argc, char **argv) {
+  char *data = NULL;
+  size_t len = 0;
+  size_t cap = 0;
+  size_t pos = 0;
+  size_t skipped = 0;
+  ssize_t n;
+  int fd;
+
+  if (argc != 2) {
+    fprintf(stderr, "usage: eshell-audit LOG\n");
+
+    return 2;
+  }
+
+  fd = strcmp(argv[1], "-") == 0 ? STDIN_FILENO : open(argv[1], O_RDONLY);
+
+  if (fd < 0) {
+    perror("eshell-audit");
+
+    return 2;
+  }
+
+  // Slurp the whole log
+  do {
+    if (len == cap) {
+      cap = cap ? cap * 2 : 1 << 20;
+      data = realloc(data, cap);
+
+      if (!data) {
+        fprintf(stderr, "eshell-audit: allocation error\n");
+
+        return 2;
+      }
+    }
+
+    n = read(fd, data + len, cap - len);
+    len += n > 0 ? n : 0;
+  } while (n > 0);
+
+  while (pos + sizeof(struct eshell_audit_frame) <= len) {
+    struct eshell_audit_frame frame;
+
+    memcpy(&frame, data + pos, sizeof(frame));
+
+    // A good frame is decoded and skipped over as a whole
+    if (frame.magic == ESHELL_AUDIT_MAGIC &&
+        frame.length <= len - pos - sizeof(frame) &&
+        eshell_audit_crc32c(data + pos + sizeof(frame), frame.length) ==
+        frame.crc &&
+        audit_print(data + pos + sizeof(frame), frame.length)) {
+      pos += sizeof(frame) + frame.length;
+
+      continue;
+    }
+
+    // Otherwise step forward a byte at a time until the next frame
+    pos++;
+    skipped++;
+  }
+
+  skipped += len - pos;
+
+  if (skipped > 0) {
+    fprintf(stderr, "eshell-audit: skipped %zu damaged bytes\n", skipped);
+  }
+
+  return skipped > 0;
+}
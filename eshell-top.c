@@ -0,0 +1,240 @@
+/*******************************************************************************
+
+  @file        eshell-top.c
+
+  @brief       Show what every running eshell session is doing, from the
+                 metrics they publish.
+
+*******************************************************************************/
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "eshell_metrics.h"
+
+/**
+  @brief      Read one session's metrics file.
+  @param path The file.
+  @param m    Receives a consistent copy of its metrics.
+  @return     False if it isn't a live session's, or couldn't be read.
+*/
+bool top_read(const char *path, struct eshell_metrics *m) {
+  const struct eshell_metrics *shm;
+  struct stat st;
+  bool ok;
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+  if (fd < 0) {
+    return false;
+  }
+
+  if (fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(*shm) ||
+      (shm = mmap(NULL, sizeof(*shm), PROT_READ, MAP_SHARED, fd, 0)) ==
+      MAP_FAILED) {
+    close(fd);
+
+    return false;
+  }
+
+  close(fd);
+  ok = __atomic_load_n(&shm->magic, __ATOMIC_ACQUIRE) ==
+       ESHELL_METRICS_MAGIC && shm->version == ESHELL_METRICS_VERSION &&
+       eshell_metrics_read(shm, m);
+  munmap((void *) shm, sizeof(*shm));
+
+  // Sessions that were killed leave their files behind
+  return ok && !(kill(m->pid, 0) != 0 && errno == ESRCH);
+}
+
+/**
+  @brief     The spawn latency below which a share of spawns fell.
+  @param m   The metrics.
+  @param per The share, in percent.
+  @return    The latency's bucket limit in microseconds, or 0 with no spawns.
+*/
+unsigned long top_percentile(const struct eshell_metrics *m, int per) {
+  uint64_t seen = 0;
+  int k;
+
+  if (m->spawns == 0) {
+    return 0;
+  }
+
+  for (k = 0; k < ESHELL_METRICS_BUCKETS - 1; k++) {
+    seen += m->spawn_buckets[k];
+
+    if (seen * 100 >= m->spawns * per) {
+      break;
+    }
+  }
+
+  return 1UL << k;
+}
+
+/**
+  @brief       Format a hit rate.
+  @param hits  Hits.
+  @param total Lookups.
+  @param buf   Buffer to receive the text.
+  @param size  Size of the buffer.
+  @return      The buffer.
+*/
+const char *top_rate(uint64_t hits, uint64_t total, char *buf, size_t size) {
+  if (total == 0) {
+    snprintf(buf, size, "-");
+  } else {
+    snprintf(buf, size, "%.1f%%", 100.0 * hits / total);
+  }
+
+  return buf;
+}
+
+/**
+  @brief     Print one row.
+  @param m   The metrics.
+  @param pid The session's pid, or NULL for the total.
+  @param now Wall clock now, in nanoseconds.
+*/
+void top_row(const struct eshell_metrics *m, const char *pid, uint64_t now) {
+  char path[16], site[16];
+
+  printf("%-8s %8lu %8lu %6lu %5lu %8lu %7.0f %6lu %6lu %7s %7s  %s\n", pid,
+         m->started_ns ? (unsigned long) ((now - m->started_ns) / 1000000000ULL)
+                       : 0UL,
+         (unsigned long) m->commands, (unsigned long) m->failed,
+         (unsigned long) m->active_jobs, (unsigned long) m->spawns,
+         m->spawns ? m->spawn_ns / 1e3 / m->spawns : 0.0,
+         top_percentile(m, 50), top_percentile(m, 99),
+         top_rate(m->path_hits, m->path_lookups, path, sizeof(path)),
+         top_rate(m->site_hits, m->site_hits + m->site_misses, site,
+                  sizeof(site)),
+         m->command);
+}
+
+/**
+  @brief     Print every live session in a directory, then their total.
+  @param dir The directory.
+  @return    False if it couldn't be read.
+*/
+bool top_show(const char *dir) {
+  struct eshell_metrics total = { 0 };
+  struct timespec ts;
+  struct dirent *ent;
+  uint64_t now;
+  int sessions = 0;
+  DIR *d = opendir(dir);
+
+  if (d == NULL) {
+    perror("eshell-top");
+
+    return false;
+  }
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  now = (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+  printf("%-8s %8s %8s %6s %5s %8s %7s %6s %6s %7s %7s  %s\n", "PID", "UP(s)",
+         "CMDS", "FAILED", "JOBS", "SPAWNS", "AVG(us)", "P50<", "P99<",
+         "PATH", "SITES", "COMMAND");
+
+  while ((ent = readdir(d)) != NULL) {
+    struct eshell_metrics m;
+    char path[PATH_MAX];
+    char pid[16];
+    int k;
+
+    if (strncmp(ent->d_name, "metrics.", 8) != 0) {
+      continue;
+    }
+
+    snprintf(path, sizeof(path), "%s/%s", dir, ent->d_name);
+
+    if (!top_read(path, &m)) {
+      continue;
+    }
+
+    snprintf(pid, sizeof(pid), "%u", m.pid);
+    m.command[sizeof(m.command) - 1] = '\0';
+    top_row(&m, pid, now);
+    sessions++;
+
+    total.commands += m.commands;
+    total.failed += m.failed;
+    total.active_jobs += m.active_jobs;
+    total.spawns += m.spawns;
+    total.spawn_ns += m.spawn_ns;
+    total.path_lookups += m.path_lookups;
+    total.path_hits += m.path_hits;
+    total.site_hits += m.site_hits;
+    total.site_misses += m.site_misses;
+
+    for (k = 0; k < ESHELL_METRICS_BUCKETS; k++) {
+      total.spawn_buckets[k] += m.spawn_buckets[k];
+    }
+  }
+
+  closedir(d);
+
+  if (sessions > 1) {
+    snprintf(total.command, sizeof(total.command), "%d sessions", sessions);
+    top_row(&total, "TOTAL", now);
+  }
+
+  return true;
+}
+
+/**
+  @brief      Main entry point.
+  @param argc Argument count.
+  @param argv Argument vector: [-d DIR] [-n SECONDS].
+  @return     0, or 2 if the sessions couldn't be read.
+*/
+int main(int argc, char **argv) {
+  char dir[PATH_MAX];
+  int interval = 0;
+  int opt;
+
+  if (!eshell_metrics_dir(dir, sizeof(dir))) {
+    snprintf(dir, sizeof(dir), ".");
+  }
+
+  while ((opt = getopt(argc, argv, "d:n:")) != -1) {
+    if (opt == 'd') {
+      snprintf(dir, sizeof(dir), "%s", optarg);
+    } else if (opt == 'n' && atoi(optarg) > 0) {
+      interval = atoi(optarg);
+    } else {
+      fprintf(stderr, "usage: eshell-top [-d DIR] [-n SECONDS]\n");
+
+      return 2;
+    }
+  }
+
+  if (!top_show(dir)) {
+    return 2;
+  }
+
+  // Refresh until interrupted
+  while (interval > 0) {
+    sleep(interval);
+    printf("\033[H\033[J");
+
+    if (!top_show(dir)) {
+      return 2;
+    }
+
+    fflush(stdout);
+  }
+
+  return 0;
+}
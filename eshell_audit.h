@@ -0,0 +1,82 @@
+/*******************************************************************************
+
+  @file        eshell_audit.h
+
+  @brief       Layout of the binary audit log shared by eshell and the
+                 eshell-audit decoder.
+
+*******************************************************************************/
+
+#ifndef ESHELL_AUDIT_H
+#define ESHELL_AUDIT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+  The log is a sequence of frames. Each frame is a header followed by `length`
+  bytes of payload whose CRC32C is `crc`, so a torn or corrupted frame (say
+  from a crash in the middle of a write) is detected and the decoder can scan
+  ahead to the next magic number.
+*/
+#define ESHELL_AUDIT_MAGIC 0x45534841U  // "AHSE" on disk
+
+struct eshell_audit_frame {
+  uint32_t magic;
+  uint32_t length;
+  uint32_t crc;
+};
+
+/*
+  Record types. A session record starts each shell's stream, a cwd record
+  assigns an id to a working directory the first time it's seen, and a
+  command record describes one command.
+*/
+#define ESHELL_AUDIT_SESSION 1
+#define ESHELL_AUDIT_CWD     2
+#define ESHELL_AUDIT_COMMAND 3
+
+/*
+  Every payload starts with this fixed header. For sessions `timestamp_ns` is
+  the start time; for cwd records the path follows; for commands `argc`
+  null-terminated arguments follow. A command with more arguments than `argc`
+  can count has only the first UINT16_MAX logged, and ESHELL_AUDIT_TRUNCATED
+  set in `flags`.
+*/
+#define ESHELL_AUDIT_TRUNCATED 1
+struct eshell_audit_record {
+  uint16_t type;
+  uint16_t argc;
+  uint32_t pid;
+  uint32_t uid;
+  uint32_t cwd_id;
+  int32_t status;
+  uint32_t flags;
+  uint64_t timestamp_ns;            // Wall clock
+  uint64_t duration_ns;
+};
+
+/**
+  @brief       CRC32C (Castagnoli) of a buffer, bit at a time. Records are
+                 short, so this is plenty fast for framing.
+  @param  data Bytes to checksum.
+  @param  len  Number of bytes.
+  @return      The CRC.
+*/
+static inline uint32_t eshell_audit_crc32c(const void *data, size_t len) {
+  const unsigned char *p = data;
+  uint32_t crc = 0xFFFFFFFFU;
+  int k;
+
+  while (len--) {
+    crc ^= *p++;
+
+    for (k = 0; k < 8; k++) {
+      crc = (crc >> 1) ^ (0x82F63B78U & -(crc & 1));
+    }
+  }
+
+  return ~crc;
+}
+
+#endif
@@ -0,0 +1,118 @@
+/*******************************************************************************
+
+  @file        eshell_metrics.h
+
+  @brief       Layout of the live metrics each eshell session publishes, shared
+                 by eshell and the eshell-top reader.
+
+*******************************************************************************/
+
+#ifndef ESHELL_METRICS_H
+#define ESHELL_METRICS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+  Each session maps a file named after its pid, `metrics.PID`, in the
+  directory ESHELL_METRICS names, or else `eshell` under $XDG_RUNTIME_DIR, or
+  /run/user/UID. ESHELL_METRICS=off publishes nothing. The shell is the only
+  writer and never waits for readers: it makes `seq` odd, updates the
+  counters and makes `seq` even again, and a reader copies the whole segment
+  and keeps the copy only if `seq` was the same even number before and after.
+*/
+#define ESHELL_METRICS_MAGIC   0x4D485345U  // "ESHM" on disk
+#define ESHELL_METRICS_VERSION 1
+
+/*
+  Spawn latencies, from asking for a child to the shell getting on with it,
+  by power of two: bucket k counts those under 2^k microseconds (and at least
+  2^(k-1)), the last one everything longer.
+*/
+#define ESHELL_METRICS_BUCKETS 24
+
+struct eshell_metrics {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t seq;                     // Odd while the shell is writing
+  uint32_t pid;
+  uint32_t uid;
+  uint32_t reserved;
+  uint64_t started_ns;              // Wall clock
+  uint64_t updated_ns;              // Wall clock
+  uint64_t commands;
+  uint64_t failed;                  // Finished with a non-zero status
+  uint64_t spawns;
+  uint64_t spawn_ns;                // Total over all spawns
+  uint64_t spawn_buckets[ESHELL_METRICS_BUCKETS];
+  uint64_t active_jobs;             // Children not yet exited
+  uint64_t path_lookups;            // PATH index
+  uint64_t path_hits;
+  uint64_t site_hits;               // Call sites that had their target cached
+  uint64_t site_misses;
+  uint64_t intern_lookups;
+  uint64_t intern_hits;
+  uint64_t memo_hits;
+  uint64_t memo_misses;
+  char command[64];                 // Running, or the last to run
+};
+
+/**
+  @brief      Where sessions publish their metrics.
+  @param  dir  Receives the directory.
+  @param  size Its size.
+  @return      False if metrics are turned off.
+*/
+static inline bool eshell_metrics_dir(char *dir, size_t size) {
+  const char *env = getenv("ESHELL_METRICS");
+  const char *runtime = getenv("XDG_RUNTIME_DIR");
+
+  if (env && strcmp(env, "off") == 0) {
+    return false;
+  }
+
+  if (env && *env) {
+    snprintf(dir, size, "%s", env);
+  } else if (runtime && *runtime) {
+    snprintf(dir, size, "%s/eshell", runtime);
+  } else {
+    snprintf(dir, size, "/run/user/%u/eshell", (unsigned) getuid());
+  }
+
+  return true;
+}
+
+/**
+  @brief     Take a consistent copy of a session's metrics.
+  @param  m    The segment, mapped.
+  @param  copy Receives the copy.
+  @return      False if the shell kept writing while it was tried.
+*/
+static inline bool eshell_metrics_read(const struct eshell_metrics *m,
+                                       struct eshell_metrics *copy) {
+  int tries;
+
+  for (tries = 0; tries < 1000; tries++) {
+    uint32_t seq = __atomic_load_n(&m->seq, __ATOMIC_ACQUIRE);
+
+    if (seq & 1) {
+      continue;
+    }
+
+    memcpy(copy, (const void *) m, sizeof(*copy));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    if (__atomic_load_n(&m->seq, __ATOMIC_RELAXED) == seq) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+#endif
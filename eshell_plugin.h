@@ -0,0 +1,90 @@
+/*******************************************************************************
+
+  @file        eshell_plugin.h
+
+  @brief       The interface between eshell and the builtins it loads from
+                 shared objects with `plugin FILE`.
+
+*******************************************************************************/
+
+#ifndef ESHELL_PLUGIN_H
+#define ESHELL_PLUGIN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+  A plugin is a shared object exporting two symbols:
+
+    const uint32_t eshell_plugin_abi = ESHELL_PLUGIN_ABI;
+    int eshell_plugin_init(const struct eshell_plugin_api *api);
+
+  The shell only loads plugins built for the ABI it speaks, then calls
+  eshell_plugin_init, which registers the plugin's builtins and returns 0, or
+  anything else to be unloaded again. Plugins don't link against the shell:
+  everything they may use is in the table they're given, which stays valid for
+  as long as the shell runs. The ABI number only changes when something in it
+  does; fields are only ever added at the end, and `size` says how much of the
+  table a shell built from a later header has.
+*/
+#define ESHELL_PLUGIN_ABI 1
+
+/*
+  Flags for register_builtin. A thread-safe builtin may run on pfor's threads
+  and as a pipeline stage; it must keep to write, printf, input and status,
+  and to its own memory, as the rest of the table belongs to the shell's
+  thread and fails anywhere else.
+*/
+#define ESHELL_PLUGIN_THREADSAFE 2
+
+struct eshell_plugin_api {
+  uint32_t abi;                     // ESHELL_PLUGIN_ABI
+  uint32_t size;                    // sizeof(struct eshell_plugin_api)
+
+  /*
+    Add a builtin, which is called with the command's expanded words and
+    returns 1 to keep the shell running. Only possible from
+    eshell_plugin_init. Returns 0, or -1 if the name is already a builtin or
+    there's no room for more.
+  */
+  int (*register_builtin)(const char *name, int (*fn)(char **args),
+                          unsigned int flags);
+
+  /*
+    The command's input and output: the terminal, a pipe, or a buffer on one
+    of pfor's threads. write returns 0, or -1 if not everything was written.
+  */
+  int (*write)(const void *buf, size_t len);
+  int (*printf)(const char *fmt, ...)
+    __attribute__((format(printf, 1, 2)));
+  int (*input)(void);               // A descriptor to read
+  void (*status)(int status);       // The command's exit status
+
+  /*
+    The next line of input, without its newline, through the shell's own line
+    buffering, valid until the next call; NULL at the end.
+  */
+  const char *(*read_line)(size_t *len);
+
+  /*
+    Shell variables: the value of one, or the first element of an array, or
+    NULL; and setting one, which returns 0, or -1 if it can't be set here.
+  */
+  const char *(*get)(const char *name);
+  int (*set)(const char *name, const char *value);
+
+  /*
+    The shell's arena. Its space and interned strings (the same pointer for
+    the same string) are freed together when the shell resets the arena, at
+    which point the generation changes; anything kept across commands should
+    be checked against it.
+  */
+  void *(*alloc)(size_t size);
+  const char *(*intern)(const char *s);
+  unsigned long (*generation)(void);
+};
+
+extern const uint32_t eshell_plugin_abi;
+int eshell_plugin_init(const struct eshell_plugin_api *api);
+
+#endif
@@ -10,15 +10,215 @@
 
 *******************************************************************************/
 
+#define _GNU_SOURCE
+
 #include <sys/wait.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <ctype.h>
 #include <stdbool.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <termios.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <time.h>
+#include <fnmatch.h>
+#include <ucontext.h>
+#include <linux/io_uring.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
+
+#include "eshell_audit.h"
+#include "eshell_metrics.h"
+#include "eshell_plugin.h"
+#include <elf.h>
+#include <dlfcn.h>
 
 extern char **environ;
 
+/*
+  Exit status of the last command run. Each thread has its own, so builtins
+  run by pfor's threads report their status independently.
+*/
+__thread int eshell_status = 0;
+
+/**
+  @brief  Read the monotonic clock.
+  @return Nanoseconds since some fixed point.
+*/
+uint64_t eshell_now_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+  @brief      Write all of a buffer to a descriptor.
+  @param fd   Descriptor to write to.
+  @param buf  Bytes to write.
+  @param len  Number of bytes.
+  @return     True if everything was written.
+*/
+bool eshell_write_all(int fd, const void *buf, size_t len) {
+  const char *p = buf;
+
+  while (len > 0) {
+    ssize_t n = write(fd, p, len);
+
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+
+    if (n <= 0) {
+      return false;
+    }
+
+    p += n;
+    len -= n;
+  }
+
+  return true;
+}
+
+/*
+  Where builtins' standard input and output are. Normally the shell's own; a
+  thread running builtins for pfor points eshell_capture at a buffer of its
+  own, so the output can be printed whole and in order later, and a pipeline
+  stage reads and writes its pipes. Worker threads can't start children.
+*/
+struct eshell_buffer {
+  char *data;
+  size_t len;
+  size_t capacity;
+};
+
+__thread struct eshell_buffer *eshell_capture;
+__thread int eshell_in_fd = STDIN_FILENO;
+__thread int eshell_out_fd = STDOUT_FILENO;
+__thread bool eshell_worker;
+
+/**
+  @brief     Make room for bytes at the end of a buffer.
+  @param b   The buffer.
+  @param len How many bytes are about to be added.
+  @return    Where they go.
+*/
+char *eshell_buffer_reserve(struct eshell_buffer *b, size_t len) {
+  if (b->len + len > b->capacity) {
+    while (b->len + len > b->capacity) {
+      b->capacity = b->capacity ? b->capacity * 2 : 4096;
+    }
+
+    if ((b->data = realloc(b->data, b->capacity)) == NULL) {
+      fprintf(stderr, "eshell: allocation error\n");
+
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  return b->data + b->len;
+}
+
+/**
+  @brief      Append bytes to a buffer.
+  @param b    The buffer.
+  @param data Bytes to add.
+  @param len  Number of bytes.
+*/
+void eshell_buffer_append(struct eshell_buffer *b, const void *data,
+                          size_t len) {
+  memcpy(eshell_buffer_reserve(b, len), data, len);
+  b->len += len;
+}
+
+/**
+  @brief      Write a builtin's output.
+  @param buf  Bytes to write.
+  @param len  Number of bytes.
+  @return     True if everything was written.
+*/
+bool eshell_out_write(const void *buf, size_t len) {
+  if (eshell_capture) {
+    eshell_buffer_append(eshell_capture, buf, len);
+
+    return true;
+  }
+
+  fflush(stdout);
+
+  return eshell_write_all(eshell_out_fd, buf, len);
+}
+
+/**
+  @brief      printf for a builtin's output.
+  @param fmt  Format.
+  @return     Number of bytes written.
+*/
+int eshell_out_printf(const char *fmt, ...) {
+  char small[256];
+  char *text = small;
+  va_list ap;
+  int n;
+
+  va_start(ap, fmt);
+
+  if (!eshell_capture && eshell_out_fd == STDOUT_FILENO) {
+    n = vprintf(fmt, ap);
+    va_end(ap);
+
+    return n;
+  }
+
+  n = vsnprintf(small, sizeof(small), fmt, ap);
+  va_end(ap);
+
+  if (n >= (int) sizeof(small)) {
+    if ((text = malloc(n + 1)) == NULL) {
+      fprintf(stderr, "eshell: allocation error\n");
+
+      exit(EXIT_FAILURE);
+    }
+
+    va_start(ap, fmt);
+    vsnprintf(text, n + 1, fmt, ap);
+    va_end(ap);
+  }
+
+  if (n > 0) {
+    eshell_out_write(text, n);
+  }
+
+  if (text != small) {
+    free(text);
+  }
+
+  return n;
+}
+
 /*
   Declare built-in commands
 */
@@ -26,275 +226,13230 @@ int eshell_cd(char **args);
 int eshell_help(char **args);
 int eshell_debug(char **args);
 int eshell_exit(char **args);
+int eshell_hash(char **args);
+int eshell_history(char **args);
+int eshell_stats(char **args);
+int eshell_memo(char **args);
+int eshell_watch_run(char **args);
+int eshell_batch(char **args);
+int eshell_cat(char **args);
+int eshell_io_builtin(char **args);
+int eshell_alias(char **args);
+int eshell_unalias(char **args);
+int eshell_function(char **args);
+int eshell_source(char **args);
+int eshell_mapfile(char **args);
+int eshell_unset(char **args);
+int eshell_read(char **args);
+int eshell_for_lines(char **args);
+int eshell_pfor(char **args);
+int eshell_cut(char **args);
+int eshell_tr(char **args);
+int eshell_uniq(char **args);
+int eshell_csv(char **args);
+int eshell_json(char **args);
+int eshell_checksum(char **args);
+int eshell_du(char **args);
+int eshell_rm(char **args);
+int eshell_cp(char **args);
+int eshell_plugin(char **args);
+int eshell_set(char **args);
+
+/*
+  Room for builtins, counting those plugins add after the ones here
+*/
+#define ESHELL_BUILTIN_MAX 128
 
 /*
   String versions of the built-in commands
 */
-char *builtin_str[] = {
+char *builtin_str[ESHELL_BUILTIN_MAX] = {
   "cd",
   "help",
   "debug",
-  "exit"
+  "exit",
+  "hash",
+  "history",
+  "stats",
+  "memo",
+  "watch-run",
+  "batch",
+  "cat",
+  "io",
+  "alias",
+  "unalias",
+  "function",
+  "source",
+  "mapfile",
+  "unset",
+  "read",
+  "for-lines",
+  "pfor",
+  "cut",
+  "tr",
+  "uniq",
+  "csv",
+  "json",
+  "checksum",
+  "du",
+  "rm",
+  "cp",
+  "plugin",
+  "set"
 };
 
 /*
   Make an array of built-in commands
 */
-int (*builtin_func[]) (char **) = {
+int (*builtin_func[ESHELL_BUILTIN_MAX]) (char **) = {
   &eshell_cd,
   &eshell_help,
   &eshell_debug,
-  &eshell_exit
+  &eshell_exit,
+  &eshell_hash,
+  &eshell_history,
+  &eshell_stats,
+  &eshell_memo,
+  &eshell_watch_run,
+  &eshell_batch,
+  &eshell_cat,
+  &eshell_io_builtin,
+  &eshell_alias,
+  &eshell_unalias,
+  &eshell_function,
+  &eshell_source,
+  &eshell_mapfile,
+  &eshell_unset,
+  &eshell_read,
+  &eshell_for_lines,
+  &eshell_pfor,
+  &eshell_cut,
+  &eshell_tr,
+  &eshell_uniq,
+  &eshell_csv,
+  &eshell_json,
+  &eshell_checksum,
+  &eshell_du,
+  &eshell_rm,
+  &eshell_cp,
+  &eshell_plugin,
+  &eshell_set
 };
 
+/*
+  What each built-in command allows. Constructs take their words unexpanded
+  and expand them as they go. Thread-safe builtins may run on pfor's threads
+  and as pipeline stages, reading eshell_in_fd and writing their output
+  through eshell_out_write and eshell_out_printf; those that hand some options
+  to a program say so in eshell_builtin_inline.
+*/
+#define ESHELL_BUILTIN_CONSTRUCT  1
+#define ESHELL_BUILTIN_THREADSAFE 2
+
+int builtin_flags[ESHELL_BUILTIN_MAX] = {
+  0,                                // cd
+  0,                                // help
+  0,                                // debug
+  0,                                // exit
+  0,                                // hash
+  0,                                // history
+  0,                                // stats
+  0,                                // memo
+  0,                                // watch-run
+  0,                                // batch
+  ESHELL_BUILTIN_THREADSAFE,        // cat
+  0,                                // io
+  0,                                // alias
+  0,                                // unalias
+  0,                                // function
+  0,                                // source
+  0,                                // mapfile
+  0,                                // unset
+  0,                                // read
+  ESHELL_BUILTIN_CONSTRUCT,         // for-lines
+  ESHELL_BUILTIN_CONSTRUCT,         // pfor
+  ESHELL_BUILTIN_THREADSAFE,        // cut
+  ESHELL_BUILTIN_THREADSAFE,        // tr
+  ESHELL_BUILTIN_THREADSAFE,        // uniq
+  ESHELL_BUILTIN_THREADSAFE,        // csv
+  ESHELL_BUILTIN_THREADSAFE,        // json
+  ESHELL_BUILTIN_THREADSAFE,        // checksum
+  ESHELL_BUILTIN_THREADSAFE,        // du
+  ESHELL_BUILTIN_THREADSAFE,        // rm
+  ESHELL_BUILTIN_THREADSAFE,        // cp
+  0,                                // plugin
+  0                                 // set
+};
+
+int builtin_count;
+
 /*
   Return the number of built-in commands
 */
 int eshell_num_builtins() {
-  return sizeof(builtin_str) / sizeof(char *);
+  // The ones compiled in are counted the first time; plugins add to them
+  if (builtin_count == 0) {
+    while (builtin_str[builtin_count]) {
+      builtin_count++;
+    }
+  }
+
+  return __atomic_load_n(&builtin_count, __ATOMIC_ACQUIRE);
 }
 
+/*
+  Bumped whenever what a command name runs may have changed: a function was
+  defined or the PATH index changed. Call sites compare it against the
+  generation they cached their target in.
+*/
+unsigned long eshell_dispatch_generation;
+
+/*
+  Interned strings. Each distinct identifier (command names, builtin names,
+  and later variable and alias names) is stored once in an arena and handed
+  out as a canonical pointer, an atom, so two atoms are equal exactly when the
+  pointers are. Atoms live until eshell_intern_reset() frees the arena and
+  bumps the generation; anything that caches atoms remembers the generation it
+  saw and rebuilds when it changes.
+*/
+#define ESHELL_ARENA_BLOCK (64 * 1024)
+#define ESHELL_INTERN_LIMIT (8 * 1024 * 1024)
+
+struct eshell_arena_block {
+  struct eshell_arena_block *next;
+  size_t used;
+  size_t size;
+  char data[];
+};
+
+struct eshell_atom_slot {
+  const char *atom;
+  uint32_t hash;
+  uint32_t len;
+};
+
+struct eshell_intern {
+  struct eshell_arena_block *blocks;
+  struct eshell_atom_slot *slots;   // Open addressing, at most half full
+  size_t capacity;
+  size_t count;
+  size_t bytes;                     // Arena bytes in use
+  unsigned long generation;
+  unsigned long lookups;
+  unsigned long hits;
+  unsigned long resets;
+} intern;
+
 /**
-  @brief       Change the working directory.
-  @param  args List of arguments, where args[0] is "cd" and args[1] is the
-                 directory to change to.
-  @return      Always return 1 to continue executing the shell.
+  @brief       Carve space out of the intern arena. It never moves, so earlier
+                 allocations stay where they are.
+  @param  size Bytes wanted.
+  @return      The space.
 */
-int eshell_cd(char **args) {
-  if (args[1] == NULL) {
-    // There was no directory passed, so error out
-    fprintf(stderr, "eshell: expected argument for \"cd\"\n");
-  } else {
-    // There was a directory passed, so change the directory
-    if (chdir(args[1]) != 0) {
-      perror("eshell: could not change directory");
+char *eshell_arena_alloc(size_t size) {
+  struct eshell_arena_block *b = intern.blocks;
+
+  if (b == NULL || b->size - b->used < size) {
+    size_t want = size > ESHELL_ARENA_BLOCK ? size : ESHELL_ARENA_BLOCK;
+
+    b = malloc(sizeof(struct eshell_arena_block) + want);
+
+    if (!b) {
+      fprintf(stderr, "eshell: allocation error\n");
+
+      exit(EXIT_FAILURE);
+    }
+
+    b->next = intern.blocks;
+    b->used = 0;
+    b->size = want;
+    intern.blocks = b;
+  }
+
+  b->used += size;
+  intern.bytes += size;
+
+  return b->data + b->used - size;
+}
+
+/**
+  @brief      FNV-1a of a short string.
+  @param  s   The bytes.
+  @param  len How many.
+  @return     The hash.
+*/
+uint32_t eshell_intern_hash(const char *s, size_t len) {
+  uint32_t h = 2166136261U;
+
+  while (len--) {
+    h = (h ^ (unsigned char) *s++) * 16777619U;
+  }
+
+  return h;
+}
+
+/**
+  @brief      Find the slot for a string, which is empty if it isn't interned.
+  @param  s   The bytes.
+  @param  len How many.
+  @param  h   Their hash.
+  @return     The slot.
+*/
+struct eshell_atom_slot *eshell_intern_slot(const char *s, size_t len,
+                                            uint32_t h) {
+  size_t mask = intern.capacity - 1;
+  size_t i;
+
+  for (i = h & mask; intern.slots[i].atom != NULL; i = (i + 1) & mask) {
+    if (intern.slots[i].hash == h && intern.slots[i].len == len &&
+        memcmp(intern.slots[i].atom, s, len) == 0) {
+      break;
+    }
+  }
+
+  return &intern.slots[i];
+}
+
+/**
+  @brief      Look up a string without adding it.
+  @param  s   The string.
+  @return     Its atom, or NULL if it has never been interned.
+*/
+const char *eshell_intern_find(const char *s) {
+  size_t len = strlen(s);
+
+  intern.lookups++;
+
+  if (intern.count == 0) {
+    return NULL;
+  }
+
+  s = eshell_intern_slot(s, len, eshell_intern_hash(s, len))->atom;
+  intern.hits += s != NULL;
+
+  return s;
+}
+
+/**
+  @brief      Intern the first bytes of a string.
+  @param  s   The bytes, which needn't be null terminated.
+  @param  len How many.
+  @return     The atom.
+*/
+const char *eshell_intern_n(const char *s, size_t len) {
+  uint32_t h = eshell_intern_hash(s, len);
+  struct eshell_atom_slot *slot;
+  char *atom;
+
+  intern.lookups++;
+
+  // Double the table before it gets more than half full
+  if ((intern.count + 1) * 2 > intern.capacity) {
+    struct eshell_atom_slot *old = intern.slots;
+    size_t old_capacity = intern.capacity;
+    size_t i;
+
+    intern.capacity = intern.capacity ? intern.capacity * 2 : 1024;
+    intern.slots = calloc(intern.capacity, sizeof(struct eshell_atom_slot));
+
+    if (!intern.slots) {
+      fprintf(stderr, "eshell: allocation error\n");
+
+      exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < old_capacity; i++) {
+      if (old[i].atom != NULL) {
+        *eshell_intern_slot(old[i].atom, old[i].len, old[i].hash) = old[i];
+      }
+    }
+
+    free(old);
+  }
+
+  slot = eshell_intern_slot(s, len, h);
+
+  if (slot->atom != NULL) {
+    intern.hits++;
+
+    return slot->atom;
+  }
+
+  atom = eshell_arena_alloc(len + 1);
+  memcpy(atom, s, len);
+  atom[len] = '\0';
+
+  slot->atom = atom;
+  slot->hash = h;
+  slot->len = len;
+  intern.count++;
+
+  return atom;
+}
+
+/**
+  @brief    Intern a string.
+  @param  s The string.
+  @return   The atom.
+*/
+const char *eshell_intern(const char *s) {
+  return eshell_intern_n(s, strlen(s));
+}
+
+/**
+  @brief Forget every atom and free the arena. Callers must drop or re-intern
+           any atoms they hold; caches notice through the generation.
+*/
+void eshell_intern_reset(void) {
+  while (intern.blocks) {
+    struct eshell_arena_block *next = intern.blocks->next;
+
+    free(intern.blocks);
+    intern.blocks = next;
+  }
+
+  free(intern.slots);
+  intern.slots = NULL;
+  intern.capacity = 0;
+  intern.count = 0;
+  intern.bytes = 0;
+  intern.generation++;
+  intern.resets++;
+}
+
+/*
+  Builtin names as atoms, interned again after a reset
+*/
+const char **builtin_atoms;
+unsigned long builtin_generation;
+
+/**
+  @brief       Find a builtin by name.
+  @param  name Command name.
+  @return      Its index in builtin_str, or -1 if it isn't one.
+*/
+int eshell_builtin_find(const char *name) {
+  const char *atom;
+  int i;
+
+  if (builtin_atoms == NULL || builtin_generation != intern.generation) {
+    free(builtin_atoms);
+    builtin_atoms = malloc(eshell_num_builtins() * sizeof(char *));
+
+    if (!builtin_atoms) {
+      fprintf(stderr, "eshell: allocation error\n");
+
+      exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < eshell_num_builtins(); i++) {
+      builtin_atoms[i] = eshell_intern(builtin_str[i]);
+    }
+
+    builtin_generation = intern.generation;
+  }
+
+  // A name that was never interned can't be a builtin
+  if ((atom = eshell_intern_find(name)) == NULL) {
+    return -1;
+  }
+
+  for (i = 0; i < eshell_num_builtins(); i++) {
+    if (builtin_atoms[i] == atom) {
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+/**
+  @brief       Check whether a command takes its words unexpanded, because it
+                 runs a command of its own once per iteration and expands it
+                 each time.
+  @param  name Command name.
+  @return      True for for-lines and pfor.
+*/
+bool eshell_construct(const char *name) {
+  int i = eshell_builtin_find(name);
+
+  return i >= 0 && (builtin_flags[i] & ESHELL_BUILTIN_CONSTRUCT);
+}
+
+/*
+  Tables keyed by atom. Slots are placed by the atom's address, so a lookup
+  never compares strings. Removing a key just clears its value; the slot is
+  reclaimed the next time the table is rebuilt.
+*/
+struct eshell_atom_entry {
+  const char *name;                 // Atom, or NULL for an empty slot
+  void *value;                      // NULL once removed
+};
+
+struct eshell_atom_map {
+  struct eshell_atom_entry *slots;  // Open addressing, at most half full
+  size_t capacity;
+  size_t used;                      // Slots with a name, removed or not
+};
+
+/**
+  @brief       Find the slot for an atom.
+  @param  map  The table.
+  @param  atom The key.
+  @return      Its slot, which is empty if the key was never added, or NULL if
+                 the table has no slots at all.
+*/
+struct eshell_atom_entry *eshell_atom_map_slot(struct eshell_atom_map *map,
+                                               const char *atom) {
+  size_t mask = map->capacity - 1;
+  size_t i;
+
+  if (map->capacity == 0) {
+    return NULL;
+  }
+
+  for (i = ((uintptr_t) atom >> 4) * 0x9E3779B97F4A7C15ULL >> 17 & mask;
+       map->slots[i].name != NULL && map->slots[i].name != atom;
+       i = (i + 1) & mask);
+
+  return &map->slots[i];
+}
+
+/**
+  @brief          Rebuild a table at a new size, dropping removed keys. Also
+                    needed after the atoms are interned again, since slots are
+                    placed by address.
+  @param map      The table.
+  @param capacity New number of slots, a power of two.
+*/
+void eshell_atom_map_rehash(struct eshell_atom_map *map, size_t capacity) {
+  struct eshell_atom_entry *old = map->slots;
+  size_t old_capacity = map->capacity;
+  size_t i;
+
+  map->slots = calloc(capacity, sizeof(struct eshell_atom_entry));
+  map->capacity = capacity;
+  map->used = 0;
+
+  if (!map->slots) {
+    fprintf(stderr, "eshell: allocation error\n");
+
+    exit(EXIT_FAILURE);
+  }
+
+  for (i = 0; i < old_capacity; i++) {
+    if (old[i].value != NULL) {
+      *eshell_atom_map_slot(map, old[i].name) = old[i];
+      map->used++;
+    }
+  }
+
+  free(old);
+}
+
+/**
+  @brief       Find or add the slot for a name.
+  @param  map  The table.
+  @param  name The key, which is interned.
+  @return      Its slot; the value is NULL if it's new.
+*/
+struct eshell_atom_entry *eshell_atom_map_put(struct eshell_atom_map *map,
+                                              const char *name) {
+  const char *atom = eshell_intern(name);
+  struct eshell_atom_entry *slot;
+
+  if ((map->used + 1) * 2 > map->capacity) {
+    eshell_atom_map_rehash(map, map->capacity ? map->capacity * 2 : 64);
+  }
+
+  slot = eshell_atom_map_slot(map, atom);
+
+  if (slot->name == NULL) {
+    slot->name = atom;
+    map->used++;
+  }
+
+  return slot;
+}
+
+/**
+  @brief       Look up a name.
+  @param  map  The table.
+  @param  name The key.
+  @return      Its value, or NULL if it isn't there.
+*/
+void *eshell_atom_map_get(struct eshell_atom_map *map, const char *name) {
+  const char *atom;
+  struct eshell_atom_entry *slot;
+
+  if (map->capacity == 0 || (atom = eshell_intern_find(name)) == NULL ||
+      (slot = eshell_atom_map_slot(map, atom)) == NULL) {
+    return NULL;
+  }
+
+  return slot->value;
+}
+
+/*
+  Index of every executable found in PATH. Entries are kept sorted by name and
+  then by the position of their directory in PATH, so the first entry for a
+  name is the one that would be run and all names sharing a prefix sit next to
+  each other. inotify keeps the index current as binaries come and go.
+*/
+struct eshell_path_entry {
+  const char *name;                 // Atom
+  int dir;
+};
+
+struct eshell_path_index {
+  char *path;                       // Value of PATH the index was built from
+  char **dirs;                      // Each directory in PATH, in order
+  int *watches;                     // inotify watch for each directory
+  int num_dirs;
+  bool relative;                    // Some directory depends on the cwd
+  struct eshell_path_entry *entries;
+  int num_entries;
+  int capacity;
+  int inotify_fd;
+  bool stale;                       // Rebuild before the next lookup
+  unsigned long generation;         // Bumped whenever the entries change
+  unsigned long intern_generation;  // Atoms the names were interned as
+  unsigned long lookups;
+  unsigned long hits;
+  unsigned long rebuilds;
+  unsigned long updates;
+} path_index = { .inotify_fd = -1, .stale = true };
+
+#define ESHELL_PATH_WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | \
+                                IN_MOVED_TO | IN_ATTRIB | IN_DELETE_SELF | \
+                                IN_MOVE_SELF | IN_ONLYDIR)
+
+/**
+  @brief       Order an entry against a name and directory.
+  @param  name Name to compare.
+  @param  dir  Directory index to compare.
+  @param  e    Entry to compare against.
+  @return      Negative, zero or positive like strcmp.
+*/
+int eshell_path_compare(const char *name, int dir,
+                        const struct eshell_path_entry *e) {
+  int c = strcmp(name, e->name);
+
+  return c != 0 ? c : dir - e->dir;
+}
+
+/**
+  @brief       Find the first entry not ordered before a name and directory.
+  @param  name Name to search for.
+  @param  dir  Directory index to search for, -1 for the first directory.
+  @return      Position in the entries, which may be one past the end.
+*/
+int eshell_path_lower_bound(const char *name, int dir) {
+  int lo = 0;
+  int hi = path_index.num_entries;
+
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+
+    if (eshell_path_compare(name, dir, &path_index.entries[mid]) > 0) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  return lo;
+}
+
+/**
+  @brief       Check whether a directory entry is something we can run.
+  @param  dfd  Open descriptor for the directory.
+  @param  name Name of the entry.
+  @return      True for regular files with an execute bit set.
+*/
+bool eshell_path_executable(int dfd, const char *name) {
+  struct stat st;
+
+  return fstatat(dfd, name, &st, 0) == 0 && S_ISREG(st.st_mode) &&
+         (st.st_mode & 0111) != 0;
+}
+
+/**
+  @brief       Add an entry to the index, keeping it sorted.
+  @param  name Name of the executable.
+  @param  dir  Index of the directory it lives in.
+*/
+void eshell_path_insert(const char *name, int dir) {
+  int i = eshell_path_lower_bound(name, dir);
+
+  // Already indexed
+  if (i < path_index.num_entries &&
+      eshell_path_compare(name, dir, &path_index.entries[i]) == 0) {
+    return;
+  }
+
+  // Grow the entries when they're full
+  if (path_index.num_entries >= path_index.capacity) {
+    path_index.capacity = path_index.capacity ? path_index.capacity * 2 : 256;
+    path_index.entries = realloc(path_index.entries,
+        path_index.capacity * sizeof(struct eshell_path_entry));
+
+    if (!path_index.entries) {
+      fprintf(stderr, "eshell: allocation error\n");
+
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  memmove(&path_index.entries[i + 1], &path_index.entries[i],
+          (path_index.num_entries - i) * sizeof(struct eshell_path_entry));
+  path_index.entries[i].name = eshell_intern(name);
+  path_index.entries[i].dir = dir;
+  path_index.num_entries++;
+}
+
+/**
+  @brief       Remove an entry from the index if it is there.
+  @param  name Name of the executable.
+  @param  dir  Index of the directory it lived in.
+*/
+void eshell_path_remove(const char *name, int dir) {
+  int i = eshell_path_lower_bound(name, dir);
+
+  if (i >= path_index.num_entries ||
+      eshell_path_compare(name, dir, &path_index.entries[i]) != 0) {
+    return;
+  }
+
+  memmove(&path_index.entries[i], &path_index.entries[i + 1],
+          (path_index.num_entries - i - 1) * sizeof(struct eshell_path_entry));
+  path_index.num_entries--;
+}
+
+/**
+  @brief Sort helper for entries appended while scanning.
+*/
+int eshell_path_sort(const void *a, const void *b) {
+  const struct eshell_path_entry *x = a;
+
+  return eshell_path_compare(x->name, x->dir, b);
+}
+
+/**
+  @brief Throw the index away and scan every directory in PATH again.
+*/
+void eshell_path_build(void) {
+  const char *path = getenv("PATH");
+  char *copy;
+  char *dir;
+  int i;
+
+  // Forget everything from the previous build; the names stay interned
+  for (i = 0; i < path_index.num_dirs; i++) {
+    free(path_index.dirs[i]);
+  }
+
+  if (path_index.inotify_fd >= 0) {
+    close(path_index.inotify_fd);
+  }
+
+  free(path_index.path);
+  free(path_index.dirs);
+  free(path_index.watches);
+  path_index.num_entries = 0;
+  path_index.num_dirs = 0;
+  path_index.relative = false;
+
+  path_index.path = strdup(path ? path : "");
+  path_index.dirs = malloc((strlen(path_index.path) + 1) * sizeof(char *));
+  path_index.watches = malloc((strlen(path_index.path) + 1) * sizeof(int));
+  path_index.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+  if (!path_index.path || !path_index.dirs || !path_index.watches) {
+    fprintf(stderr, "eshell: allocation error\n");
+
+    exit(EXIT_FAILURE);
+  }
+
+  // Split PATH on colons; an empty component means the current directory
+  copy = strdup(path_index.path);
+
+  for (dir = copy; dir != NULL; ) {
+    char *next = strchr(dir, ':');
+    DIR *d;
+    struct dirent *ent;
+
+    if (next) {
+      *next++ = '\0';
+    }
+
+    i = path_index.num_dirs++;
+    path_index.dirs[i] = strdup(*dir ? dir : ".");
+    path_index.relative |= path_index.dirs[i][0] != '/';
+    path_index.watches[i] = path_index.inotify_fd < 0 ? -1 :
+        inotify_add_watch(path_index.inotify_fd, path_index.dirs[i],
+                          ESHELL_PATH_WATCH_MASK);
+
+    // Append everything runnable; the whole lot is sorted at the end
+    if ((d = opendir(path_index.dirs[i])) != NULL) {
+      while ((ent = readdir(d)) != NULL) {
+        if (ent->d_name[0] == '.' || ent->d_type == DT_DIR ||
+            !eshell_path_executable(dirfd(d), ent->d_name)) {
+          continue;
+        }
+
+        if (path_index.num_entries >= path_index.capacity) {
+          path_index.capacity = path_index.capacity ? path_index.capacity * 2
+                                                    : 256;
+          path_index.entries = realloc(path_index.entries,
+              path_index.capacity * sizeof(struct eshell_path_entry));
+
+          if (!path_index.entries) {
+            fprintf(stderr, "eshell: allocation error\n");
+
+            exit(EXIT_FAILURE);
+          }
+        }
+
+        path_index.entries[path_index.num_entries].name =
+            eshell_intern(ent->d_name);
+        path_index.entries[path_index.num_entries].dir = i;
+        path_index.num_entries++;
+      }
+
+      closedir(d);
+    }
+
+    dir = next;
+  }
+
+  free(copy);
+
+  qsort(path_index.entries, path_index.num_entries,
+        sizeof(struct eshell_path_entry), eshell_path_sort);
+
+  path_index.stale = false;
+  path_index.intern_generation = intern.generation;
+  path_index.generation++;
+  eshell_dispatch_generation++;
+  path_index.rebuilds++;
+}
+
+/**
+  @brief Bring the index up to date before using it, applying whatever inotify
+           has reported since the last call.
+*/
+void eshell_path_refresh(void) {
+  const char *path = getenv("PATH");
+  char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  ssize_t len;
+
+  // PATH itself changed, the atoms were reset, or the index has never been
+  //   built
+  if (path_index.stale || !path_index.path ||
+      path_index.intern_generation != intern.generation ||
+      strcmp(path ? path : "", path_index.path) != 0) {
+    eshell_path_build();
+
+    return;
+  }
+
+  if (path_index.inotify_fd < 0) {
+    return;
+  }
+
+  // Drain the queued events without blocking
+  while ((len = read(path_index.inotify_fd, buf, sizeof(buf))) > 0) {
+    char *p;
+
+    for (p = buf; p < buf + len; ) {
+      const struct inotify_event *ev = (const struct inotify_event *) p;
+      int i;
+
+      p += sizeof(struct inotify_event) + ev->len;
+
+      // Lost events, or a directory went away; start over
+      if (ev->mask & (IN_Q_OVERFLOW | IN_DELETE_SELF | IN_MOVE_SELF |
+                      IN_IGNORED)) {
+        path_index.stale = true;
+
+        continue;
+      }
+
+      if (ev->len == 0 || (ev->mask & IN_ISDIR) || ev->name[0] == '.') {
+        continue;
+      }
+
+      // A directory may be listed in PATH more than once
+      for (i = 0; i < path_index.num_dirs; i++) {
+        int dfd;
+
+        if (path_index.watches[i] != ev->wd) {
+          continue;
+        }
+
+        if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+          eshell_path_remove(ev->name, i);
+        } else if ((dfd = open(path_index.dirs[i], O_RDONLY | O_DIRECTORY |
+                               O_CLOEXEC)) >= 0) {
+          // Created, moved in or chmodded: index it only if it's runnable
+          if (eshell_path_executable(dfd, ev->name)) {
+            eshell_path_insert(ev->name, i);
+          } else {
+            eshell_path_remove(ev->name, i);
+          }
+
+          close(dfd);
+        }
+      }
+
+      path_index.updates++;
+      path_index.generation++;
+      eshell_dispatch_generation++;
+    }
+  }
+
+  if (path_index.stale) {
+    eshell_path_build();
+  }
+}
+
+/**
+  @brief       Find the executable PATH would run for a command name.
+  @param  name Command name, without any slashes.
+  @param  buf  Buffer to receive the full path.
+  @param  size Size of the buffer.
+  @return      True if the command was found.
+*/
+bool eshell_path_lookup(const char *name, char *buf, size_t size) {
+  const char *atom;
+  int i;
+
+  eshell_path_refresh();
+  path_index.lookups++;
+
+  // Every indexed name is interned, so anything else misses straight away
+  if ((atom = eshell_intern_find(name)) == NULL) {
+    return false;
+  }
+
+  i = eshell_path_lower_bound(name, -1);
+
+  if (i >= path_index.num_entries || path_index.entries[i].name != atom) {
+    return false;
+  }
+
+  path_index.hits++;
+  snprintf(buf, size, "%s/%s", path_index.dirs[path_index.entries[i].dir],
+           name);
+
+  return true;
+}
+
+/**
+  @brief         Find the executables whose names start with a prefix.
+  @param  prefix Prefix to search for.
+  @param  first  Receives the position of the first match.
+  @return        One past the position of the last match; names repeat when
+                   the same command is in several directories.
+*/
+int eshell_path_prefix(const char *prefix, int *first) {
+  size_t n = strlen(prefix);
+  int i;
+
+  eshell_path_refresh();
+
+  *first = i = eshell_path_lower_bound(prefix, -1);
+
+  while (i < path_index.num_entries &&
+         strncmp(path_index.entries[i].name, prefix, n) == 0) {
+    i++;
+  }
+
+  return i;
+}
+
+/*
+  A single background thread for work the shell can get on with while the user
+  is still typing. Jobs run one at a time in the order they were queued.
+*/
+#define ESHELL_BG_QUEUE 16
+
+struct eshell_bg_job {
+  void (*fn)(void *);
+  void *arg;
+};
+
+struct eshell_bg {
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  bool started;
+  struct eshell_bg_job jobs[ESHELL_BG_QUEUE];
+  int head;
+  int count;
+} bg = { .lock = PTHREAD_MUTEX_INITIALIZER,
+         .wake = PTHREAD_COND_INITIALIZER };
+
+/**
+  @brief     Run queued jobs forever.
+  @param arg Unused.
+  @return    Never returns.
+*/
+void *eshell_bg_main(void *arg) {
+  while (1) {
+    struct eshell_bg_job job;
+
+    pthread_mutex_lock(&bg.lock);
+
+    while (bg.count == 0) {
+      pthread_cond_wait(&bg.wake, &bg.lock);
+    }
+
+    job = bg.jobs[bg.head];
+    bg.head = (bg.head + 1) % ESHELL_BG_QUEUE;
+    bg.count--;
+    pthread_mutex_unlock(&bg.lock);
+
+    job.fn(job.arg);
+  }
+
+  return NULL;
+}
+
+/**
+  @brief     Queue a job for the background thread, starting it if needed.
+  @param fn  Function to run.
+  @param arg Argument passed to the function.
+  @return    False if the job couldn't be queued and was dropped.
+*/
+bool eshell_bg_submit(void (*fn)(void *), void *arg) {
+  bool queued = false;
+
+  pthread_mutex_lock(&bg.lock);
+
+  if (!bg.started) {
+    pthread_t thread;
+    sigset_t all, old;
+
+    // Signals are the main thread's business
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    bg.started = pthread_create(&thread, NULL, eshell_bg_main, NULL) == 0;
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if (bg.started) {
+      pthread_detach(thread);
+    }
+  }
+
+  if (bg.started && bg.count < ESHELL_BG_QUEUE) {
+    bg.jobs[(bg.head + bg.count) % ESHELL_BG_QUEUE].fn = fn;
+    bg.jobs[(bg.head + bg.count) % ESHELL_BG_QUEUE].arg = arg;
+    bg.count++;
+    queued = true;
+    pthread_cond_signal(&bg.wake);
+  }
+
+  pthread_mutex_unlock(&bg.lock);
+
+  return queued;
+}
+
+/*
+  Speculative resolution of the command being typed. As the first word of a
+  line is typed, the binary is resolved through the PATH index and checked
+  (stat and, with ESHELL_SPECULATE=open, an open and a look at its header) in
+  the background, so eshell_launch can go straight to fork and exec when the
+  user hits enter.
+*/
+struct eshell_spec {
+  pthread_mutex_t lock;
+  unsigned long ticket;             // Bumped for every new speculation
+  char name[NAME_MAX + 1];          // Command name being resolved
+  char path[PATH_MAX];              // Where it resolved to
+  unsigned long generation;         // PATH index generation it came from
+  bool open_it;                     // ESHELL_SPECULATE=open, read when asked
+  bool ready;                       // The background checks have finished
+  bool valid;                       // ... and the binary looks runnable
+  unsigned long started;
+  unsigned long hits;
+  unsigned long misses;
+} spec = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/**
+  @brief          Check that a file is something exec will accept.
+  @param  path    Path of the file.
+  @param  open_it Also open it and look for an ELF or #! header.
+  @return         True if it looks runnable.
+*/
+bool eshell_runnable(const char *path, bool open_it) {
+  struct stat st;
+  char magic[4];
+  int fd;
+  bool ok;
+
+  if (stat(path, &st) != 0 || !S_ISREG(st.st_mode) ||
+      access(path, X_OK) != 0) {
+    return false;
+  }
+
+  if (!open_it) {
+    return true;
+  }
+
+  if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+    return false;
+  }
+
+  ok = pread(fd, magic, sizeof(magic), 0) >= 2 &&
+       (memcmp(magic, "#!", 2) == 0 || memcmp(magic, "\177ELF", 4) == 0);
+  close(fd);
+
+  return ok;
+}
+
+/**
+  @brief     Background half of a speculation: validate the resolved binary.
+  @param arg Unused.
+*/
+void eshell_spec_job(void *arg) {
+  char path[PATH_MAX];
+  unsigned long ticket;
+  bool open_it;
+  bool valid;
+
+  // The environment is the main thread's; the mode came with the request
+  pthread_mutex_lock(&spec.lock);
+  ticket = spec.ticket;
+  memcpy(path, spec.path, sizeof(path));
+  open_it = spec.open_it;
+  pthread_mutex_unlock(&spec.lock);
+
+  valid = eshell_runnable(path, open_it);
+
+  // Only record the result if nothing newer was asked for meanwhile
+  pthread_mutex_lock(&spec.lock);
+
+  if (spec.ticket == ticket) {
+    spec.ready = true;
+    spec.valid = valid;
+  }
+
+  pthread_mutex_unlock(&spec.lock);
+}
+
+/**
+  @brief      Start resolving a command before it is run.
+  @param name The first word of the line being typed.
+*/
+void eshell_speculate(const char *name) {
+  const char *mode = getenv("ESHELL_SPECULATE");
+  bool open_it = mode != NULL && strcmp(mode, "open") == 0;
+  char path[PATH_MAX];
+  bool fresh;
+
+  if (mode != NULL && strcmp(mode, "off") == 0) {
+    return;
+  }
+
+  // The lookup itself is an in-memory search of the PATH index
+  if (strchr(name, '/') != NULL) {
+    snprintf(path, sizeof(path), "%s", name);
+  } else if (!eshell_path_lookup(name, path, sizeof(path))) {
+    return;
+  }
+
+  pthread_mutex_lock(&spec.lock);
+
+  fresh = strcmp(spec.name, name) != 0 || strcmp(spec.path, path) != 0 ||
+          spec.generation != path_index.generation ||
+          spec.open_it != open_it;
+
+  if (fresh) {
+    snprintf(spec.name, sizeof(spec.name), "%s", name);
+    memcpy(spec.path, path, sizeof(path));
+    spec.generation = path_index.generation;
+    spec.open_it = open_it;
+    spec.ready = false;
+    spec.valid = false;
+    spec.ticket++;
+    spec.started++;
+  }
+
+  pthread_mutex_unlock(&spec.lock);
+
+  if (fresh) {
+    eshell_bg_submit(eshell_spec_job, NULL);
+  }
+}
+
+/**
+  @brief       Resolve a command for launching, using the speculation for it
+                 if there is a finished one that is still current.
+  @param  name Command name, as typed.
+  @param  path Buffer to receive the path of the binary.
+  @param  size Size of the buffer.
+  @return      True if the command resolved to something runnable; otherwise
+                 an error has been printed and eshell_status set to 127 (not
+                 found) or 126 (found but not runnable).
+*/
+bool eshell_resolve(const char *name, char *path, size_t size) {
+  bool claimed;
+
+  // Pick up PATH changes first so a stale speculation is never used
+  eshell_path_refresh();
+
+  pthread_mutex_lock(&spec.lock);
+  claimed = spec.ready && spec.valid && strcmp(spec.name, name) == 0 &&
+            spec.generation == path_index.generation;
+
+  if (claimed) {
+    snprintf(path, size, "%s", spec.path);
+    spec.hits++;
+  } else {
+    spec.misses++;
+  }
+
+  pthread_mutex_unlock(&spec.lock);
+
+  if (claimed) {
+    return true;
+  }
+
+  // Names without a slash are resolved through the PATH index
+  if (strchr(name, '/') != NULL) {
+    snprintf(path, size, "%s", name);
+  } else if (!eshell_path_lookup(name, path, size)) {
+    fprintf(stderr, "eshell: command not found: %s\n", name);
+    eshell_status = 127;
+
+    return false;
+  }
+
+  errno = 0;
+
+  if (!eshell_runnable(path, false)) {
+    // A path that isn't there is as missing as a name that isn't found
+    if (errno == ENOENT || errno == ENOTDIR) {
+      fprintf(stderr, "eshell: command not found: %s\n", name);
+      eshell_status = 127;
+    } else {
+      fprintf(stderr, "eshell: cannot run %s\n", path);
+      eshell_status = 126;
+    }
+
+    return false;
+  }
+
+  return true;
+}
+
+/*
+  Coroutine executor for builtins that spend their time waiting on
+  descriptors, timers and children. Coroutines are stackful (ucontext) and all
+  run on the calling thread; whenever none of them can make progress the
+  executor sleeps in epoll_wait. Child exits arrive through the same epoll
+  set, so reaping happens in the same event loop as the I/O.
+*/
+#define ESHELL_CO_STACK (256 * 1024)
+#define ESHELL_CO_EVENTS 64
+
+struct eshell_co {
+  ucontext_t ctx;
+  void (*fn)(void *);
+  void *arg;
+  void *stack;                      // mmap'd, with a guard page at the bottom
+  bool ready;
+  bool finished;
+  uint32_t revents;                 // What woke a descriptor wait
+  uint64_t wake_at;                 // Deadline of a sleep, 0 if none
+  struct eshell_co *next;
+};
+
+struct eshell_executor {
+  int epfd;
+  ucontext_t main;
+  struct eshell_co *current;        // NULL when the executor itself runs
+  struct eshell_co *list;
+  bool children;                    // The child ring's eventfd is registered
+  bool woken;                       // A coroutine was woken by another one
+  unsigned long spawned;
+  unsigned long switches;
+  unsigned long waits;
+} executor = { .epfd = -1 };
+
+/**
+  @brief Entry point of every coroutine.
+*/
+void eshell_co_trampoline(void) {
+  struct eshell_co *co = executor.current;
+
+  co->fn(co->arg);
+  co->finished = true;
+
+  // Returning resumes the executor through uc_link
+}
+
+/**
+  @brief     Create a coroutine; it first runs inside eshell_co_run().
+  @param fn  Function to run.
+  @param arg Argument passed to it.
+*/
+void eshell_co_spawn(void (*fn)(void *), void *arg) {
+  struct eshell_co *co = calloc(1, sizeof(struct eshell_co));
+
+  if (!co) {
+    fprintf(stderr, "eshell: allocation error\n");
+
+    exit(EXIT_FAILURE);
+  }
+
+  // Stack pages only cost memory once they're touched
+  co->stack = mmap(NULL, ESHELL_CO_STACK, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+  if (co->stack == MAP_FAILED) {
+    fprintf(stderr, "eshell: allocation error\n");
+
+    exit(EXIT_FAILURE);
+  }
+
+  mprotect(co->stack, sysconf(_SC_PAGESIZE), PROT_NONE);
+
+  getcontext(&co->ctx);
+  co->ctx.uc_stack.ss_sp = co->stack;
+  co->ctx.uc_stack.ss_size = ESHELL_CO_STACK;
+  co->ctx.uc_link = &executor.main;
+  makecontext(&co->ctx, eshell_co_trampoline, 0);
+
+  co->fn = fn;
+  co->arg = arg;
+  co->ready = true;
+  co->next = executor.list;
+  executor.list = co;
+  executor.spawned++;
+}
+
+/**
+  @brief Give control back to the executor until this coroutine is woken.
+*/
+void eshell_co_yield(void) {
+  swapcontext(&executor.current->ctx, &executor.main);
+}
+
+/**
+  @brief        Suspend until a descriptor is ready.
+  @param fd     Descriptor to wait for.
+  @param events EPOLLIN, EPOLLOUT or both.
+  @return       The events that were reported.
+*/
+uint32_t eshell_co_wait_fd(int fd, uint32_t events) {
+  struct eshell_co *co = executor.current;
+  struct epoll_event ev;
+
+  if (executor.epfd < 0) {
+    executor.epfd = epoll_create1(EPOLL_CLOEXEC);
+  }
+
+  ev.events = events;
+  ev.data.ptr = co;
+
+  if (epoll_ctl(executor.epfd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+    // Regular files can't be polled but are always ready
+    return events;
+  }
+
+  eshell_co_yield();
+  epoll_ctl(executor.epfd, EPOLL_CTL_DEL, fd, NULL);
+
+  return co->revents;
+}
+
+/**
+  @brief    Suspend for a while.
+  @param ms Milliseconds to sleep.
+*/
+void eshell_co_sleep(int ms) {
+  executor.current->wake_at = eshell_now_ns() + (uint64_t) ms * 1000000;
+  eshell_co_yield();
+}
+
+/**
+  @brief    Make a suspended coroutine runnable now, cutting short a sleep.
+  @param co The coroutine.
+*/
+void eshell_co_wake(struct eshell_co *co) {
+  co->wake_at = 0;
+  co->ready = true;
+  executor.woken = true;
+}
+
+
+/*
+  Child reaping. The SIGCHLD handler reaps every child that has exited and
+  pushes its pid and status onto a single-producer, single-consumer ring, then
+  pokes an eventfd. Nothing in the handler takes a lock or allocates. The
+  shell thread drains the ring into a table keyed by pid, from which
+  foreground waits and coroutines (through the executor's epoll set) pick up
+  their children's statuses.
+*/
+#define ESHELL_CHILD_RING 16384          // Must be a power of two
+
+struct eshell_child_event {
+  pid_t pid;
+  int status;                       // As returned by waitpid
+};
+
+struct eshell_child_ring {
+  struct eshell_child_event events[ESHELL_CHILD_RING];
+  unsigned head;                    // Only written by the consumer
+  unsigned tail;                    // Only written by the producer
+  volatile sig_atomic_t overflow;   // The producer found the ring full
+  int efd;
+  unsigned long delivered;
+  unsigned long overflows;
+} child_ring = { .efd = -1 };
+
+/*
+  Exited children not yet collected, and children being waited on
+*/
+struct eshell_child {
+  pid_t pid;                        // 0 for an empty slot
+  int status;
+  bool exited;
+  struct eshell_co *waiter;         // Coroutine to wake, if any
+};
+
+struct eshell_child_table {
+  struct eshell_child *slots;
+  unsigned capacity;                // Power of two
+  unsigned count;
+} children;
+
+/**
+  @brief Reap every exited child into the ring. Runs in the SIGCHLD handler,
+           or with SIGCHLD blocked, so there is only ever one producer.
+*/
+void eshell_children_reap(void) {
+  unsigned tail = __atomic_load_n(&child_ring.tail, __ATOMIC_RELAXED);
+  bool pushed = false;
+  uint64_t one = 1;
+
+  while (1) {
+    unsigned head = __atomic_load_n(&child_ring.head, __ATOMIC_ACQUIRE);
+    int status;
+    pid_t pid;
+
+    // Leave the rest as zombies; the consumer reaps them after draining
+    if (tail - head == ESHELL_CHILD_RING) {
+      child_ring.overflow = 1;
+
+      break;
+    }
+
+    if ((pid = waitpid(-1, &status, WNOHANG)) <= 0) {
+      break;
+    }
+
+    child_ring.events[tail & (ESHELL_CHILD_RING - 1)].pid = pid;
+    child_ring.events[tail & (ESHELL_CHILD_RING - 1)].status = status;
+    tail++;
+    __atomic_store_n(&child_ring.tail, tail, __ATOMIC_RELEASE);
+    pushed = true;
+  }
+
+  if (pushed && write(child_ring.efd, &one, sizeof(one)) < 0) {
+    // The eventfd is already signalled
+  }
+}
+
+/**
+  @brief     SIGCHLD handler.
+  @param sig Unused.
+*/
+void eshell_sigchld(int sig) {
+  int saved = errno;
+
+  eshell_children_reap();
+  errno = saved;
+}
+
+/**
+  @brief     Find a child's slot in the table.
+  @param pid The child.
+  @param add Create the slot if it isn't there.
+  @return    The slot, or NULL.
+*/
+struct eshell_child *eshell_child_slot(pid_t pid, bool add) {
+  unsigned i;
+
+  // Keep the load under a half
+  if (add && (children.count + 1) * 2 > children.capacity) {
+    struct eshell_child *old = children.slots;
+    unsigned old_capacity = children.capacity;
+
+    children.capacity = old_capacity ? old_capacity * 2 : 64;
+    children.slots = calloc(children.capacity, sizeof(struct eshell_child));
+    children.count = 0;
+
+    if (!children.slots) {
+      fprintf(stderr, "eshell: allocation error\n");
+
+      exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < old_capacity; i++) {
+      if (old[i].pid) {
+        *eshell_child_slot(old[i].pid, true) = old[i];
+      }
+    }
+
+    free(old);
+  }
+
+  if (children.capacity == 0) {
+    return NULL;
+  }
+
+  for (i = (unsigned) pid * 2654435761U & (children.capacity - 1);
+       children.slots[i].pid != 0; i = (i + 1) & (children.capacity - 1)) {
+    if (children.slots[i].pid == pid) {
+      return &children.slots[i];
+    }
+  }
+
+  if (!add) {
+    return NULL;
+  }
+
+  children.slots[i].pid = pid;
+  children.slots[i].exited = false;
+  children.slots[i].waiter = NULL;
+  children.count++;
+
+  return &children.slots[i];
+}
+
+/**
+  @brief    Empty a slot, shifting back any entries that probed past it.
+  @param c  The slot.
+*/
+void eshell_child_remove(struct eshell_child *c) {
+  unsigned mask = children.capacity - 1;
+  unsigned hole = c - children.slots;
+  unsigned i = hole;
+
+  while (1) {
+    unsigned home;
+
+    i = (i + 1) & mask;
+
+    if (children.slots[i].pid == 0) {
+      break;
+    }
+
+    // Move it into the hole if the hole lies between its home and it
+    home = (unsigned) children.slots[i].pid * 2654435761U & mask;
+
+    if (((i - home) & mask) >= ((i - hole) & mask)) {
+      children.slots[hole] = children.slots[i];
+      hole = i;
+    }
+  }
+
+  children.slots[hole].pid = 0;
+  children.count--;
+}
+
+/**
+  @brief Move everything in the ring into the table, waking any coroutines
+           waiting on those children.
+*/
+void eshell_children_drain(void) {
+  uint64_t count;
+
+  if (read(child_ring.efd, &count, sizeof(count)) < 0) {
+    // Nothing signalled; the ring may still hold entries
+  }
+
+  while (1) {
+    unsigned tail = __atomic_load_n(&child_ring.tail, __ATOMIC_ACQUIRE);
+    unsigned head = child_ring.head;
+    sigset_t block, old;
+
+    for (; head != tail; head++) {
+      struct eshell_child_event *ev =
+          &child_ring.events[head & (ESHELL_CHILD_RING - 1)];
+      struct eshell_child *c = eshell_child_slot(ev->pid, true);
+
+      c->exited = true;
+      c->status = ev->status;
+
+      if (c->waiter) {
+        c->waiter->ready = true;
+      }
+
+      child_ring.delivered++;
+    }
+
+    __atomic_store_n(&child_ring.head, head, __ATOMIC_RELEASE);
+
+    if (!child_ring.overflow) {
+      break;
+    }
+
+    // The handler ran out of room, so finish its job with it held off
+    child_ring.overflow = 0;
+    child_ring.overflows++;
+    sigemptyset(&block);
+    sigaddset(&block, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &block, &old);
+    eshell_children_reap();
+    sigprocmask(SIG_SETMASK, &old, NULL);
+  }
+}
+
+/**
+  @brief        Turn a waitpid status into a shell exit status.
+  @param status Status from waitpid.
+  @return       The exit code, or 128 plus the signal that killed it.
+*/
+int eshell_exit_status(int status) {
+  return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+/**
+  @brief         Collect a child's status if it has exited.
+  @param  pid    The child.
+  @param  status Receives its exit status.
+  @return        True if it had exited; it is then forgotten.
+*/
+bool eshell_child_poll(pid_t pid, int *status) {
+  struct eshell_child *c;
+
+  eshell_children_drain();
+  c = eshell_child_slot(pid, false);
+
+  if (c == NULL || !c->exited) {
+    return false;
+  }
+
+  *status = eshell_exit_status(c->status);
+  eshell_child_remove(c);
+
+  return true;
+}
+
+/**
+  @brief     Block until a child exits.
+  @param pid The child.
+  @return    Its exit status.
+*/
+int eshell_wait_child(pid_t pid) {
+  struct pollfd pfd = { child_ring.efd, POLLIN, 0 };
+  int status;
+
+  while (!eshell_child_poll(pid, &status)) {
+    poll(&pfd, 1, -1);
+  }
+
+  return status;
+}
+
+/**
+  @brief Start taking SIGCHLD through the ring.
+*/
+void eshell_children_init(void) {
+  struct sigaction sa;
+
+  child_ring.efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+  if (child_ring.efd < 0) {
+    perror("eshell: eventfd");
+
+    exit(EXIT_FAILURE);
+  }
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = eshell_sigchld;
+  sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+  sigaction(SIGCHLD, &sa, NULL);
+}
+
+/**
+  @brief     Suspend until a child exits. It is reaped by the SIGCHLD handler
+               and the executor wakes us when the ring delivers it.
+  @param pid The child.
+  @return    Its exit status, or 128 plus the signal that killed it.
+*/
+int eshell_co_wait_child(pid_t pid) {
+  struct epoll_event ev;
+  int status;
+
+  if (executor.epfd < 0) {
+    executor.epfd = epoll_create1(EPOLL_CLOEXEC);
+  }
+
+  // The ring's eventfd stays in the epoll set, tagged with the ring itself
+  if (!executor.children) {
+    ev.events = EPOLLIN;
+    ev.data.ptr = &child_ring;
+    executor.children = epoll_ctl(executor.epfd, EPOLL_CTL_ADD, child_ring.efd,
+                                  &ev) == 0;
+  }
+
+  while (!eshell_child_poll(pid, &status)) {
+    eshell_child_slot(pid, true)->waiter = executor.current;
+    eshell_co_yield();
+  }
+
+  return status;
+}
+
+/**
+  @brief Run coroutines until every one of them has finished.
+*/
+void eshell_co_run(void) {
+  struct epoll_event events[ESHELL_CO_EVENTS];
+
+  while (executor.list) {
+    struct eshell_co **link;
+    uint64_t now = eshell_now_ns();
+    uint64_t next_timer = 0;
+    bool any_ready = false;
+    int timeout;
+    int n, i;
+
+    executor.woken = false;
+
+    // Resume everything that's runnable, dropping what finished
+    for (link = &executor.list; *link; ) {
+      struct eshell_co *co = *link;
+
+      if (co->wake_at && co->wake_at <= now) {
+        co->wake_at = 0;
+        co->ready = true;
+      }
+
+      if (co->ready) {
+        co->ready = false;
+        executor.current = co;
+        swapcontext(&executor.main, &co->ctx);
+        executor.current = NULL;
+        executor.switches++;
+      }
+
+      if (co->finished) {
+        *link = co->next;
+        munmap(co->stack, ESHELL_CO_STACK);
+        free(co);
+
+        continue;
+      }
+
+      any_ready |= co->ready;
+
+      if (co->wake_at && (next_timer == 0 || co->wake_at < next_timer)) {
+        next_timer = co->wake_at;
+      }
+
+      link = &co->next;
+    }
+
+    if (executor.list == NULL) {
+      break;
+    }
+
+    // Sleep until a descriptor is ready or the nearest timer expires
+    now = eshell_now_ns();
+
+    if (any_ready || executor.woken) {
+      timeout = 0;
+    } else if (next_timer) {
+      timeout = next_timer > now ? (next_timer - now) / 1000000 + 1 : 0;
+    } else {
+      timeout = -1;
+    }
+
+    if (executor.epfd < 0) {
+      executor.epfd = epoll_create1(EPOLL_CLOEXEC);
+    }
+
+    executor.waits++;
+    n = epoll_wait(executor.epfd, events, ESHELL_CO_EVENTS, timeout);
+
+    for (i = 0; i < n; i++) {
+      struct eshell_co *co = events[i].data.ptr;
+
+      // Children exited; draining the ring wakes their waiters
+      if (events[i].data.ptr == &child_ring) {
+        eshell_children_drain();
+
+        continue;
+      }
+
+      co->revents = events[i].events;
+      co->ready = true;
+    }
+  }
+}
+
+/**
+  @brief       Change the working directory.
+  @param  args List of arguments, where args[0] is "cd" and args[1] is the
+                 directory to change to.
+  @return      Always return 1 to continue executing the shell.
+*/
+int eshell_cd(char **args) {
+  if (args[1] == NULL) {
+    // There was no directory passed, so error out
+    fprintf(stderr, "eshell: expected argument for \"cd\"\n");
+  } else {
+    // There was a directory passed, so change the directory
+    if (chdir(args[1]) != 0) {
+      perror("eshell: could not change directory");
+    } else if (path_index.relative) {
+      // Relative PATH entries now point somewhere else
+      path_index.stale = true;
+    }
+  }
+
+  return 1;
+}
+
+/**
+  @brief       Print a bit of help.
+  @param  args Arguments that are ignored.
+  @return      Always return 1 to continue executing the shell.
+*/
+int eshell_help(char **args) {
+  int i;
+  printf("eshell\n");
+  printf("\n");
+  printf("There are a few programs built-in:\n");
+
+  // Print out all of the built-in commands
+  for (i = 0; i < eshell_num_builtins(); i++) {
+    printf("  %s\n", builtin_str[i]);
+  }
+
+  return 1;
+}
+
+/**
+  @brief       Show some debug information.
+  @param  args Arguments that are ignored.
+  @return      Always return 1 to continue executing the shell.
+*/
+int eshell_debug(char **args) {
+  // Print out all of the environment variables that are currently defined.
+  for(char **current = environ; *current; current++) {
+    puts(*current);
+  }
+
+  return 1;
+}
+
+/**
+  @brief       Exit the shell.
+  @param  args Arguments that are ignored.
+  @return      Always returns 0.
+*/
+int eshell_exit(char **args) {
+  return 0;
+}
+
+/**
+  @brief       Show or reset the PATH index.
+  @param  args List of arguments, where "-r" throws the index away and "-l"
+                 lists every command in it.
+  @return      Always return 1 to continue executing the shell.
+*/
+int eshell_hash(char **args) {
+  int i;
+
+  if (args[1] != NULL && strcmp(args[1], "-r") == 0) {
+    // Rebuild on the next lookup
+    path_index.stale = true;
+
+    return 1;
+  }
+
+  eshell_path_refresh();
+
+  if (args[1] != NULL && strcmp(args[1], "-l") == 0) {
+    // List what would run for each name, skipping shadowed duplicates
+    for (i = 0; i < path_index.num_entries; i++) {
+      if (i > 0 && path_index.entries[i].name ==
+                   path_index.entries[i - 1].name) {
+        continue;
+      }
+
+      printf("%s/%s\n", path_index.dirs[path_index.entries[i].dir],
+             path_index.entries[i].name);
+    }
+
+    return 1;
+  }
+
+  printf("%d commands in %d directories\n", path_index.num_entries,
+         path_index.num_dirs);
+
+  return 1;
+}
+
+/*
+  Audit log. When ESHELL_AUDIT_LOG names a file, every command is recorded in
+  it as a binary record (see eshell_audit.h). Records collect in a per-session
+  buffer that goes out in one O_APPEND write once it fills, once a second has
+  passed since the last write, when the shell is about to wait at the
+  terminal, or when the shell exits, including on SIGHUP and SIGTERM. A
+  record too big for the buffer goes out straight after it, in a write of its
+  own.
+*/
+#define ESHELL_AUDIT_BUFSIZE (64 * 1024)
+#define ESHELL_AUDIT_FLUSH_NS 1000000000ULL
+
+struct eshell_audit {
+  int fd;                           // -1 when auditing is off
+  char *buf;
+  size_t len;
+  uint64_t last_flush;
+  char cwd[PATH_MAX];               // Working directory of the last record
+  uint32_t cwd_id;
+  unsigned long records;
+  unsigned long flushes;
+  unsigned long bytes;
+} audit = { .fd = -1 };
+
+/**
+  @brief Write out the buffered records.
+*/
+void eshell_audit_flush(void) {
+  if (audit.fd < 0 || audit.len == 0) {
+    return;
+  }
+
+  // O_APPEND makes the whole batch land contiguously at the end
+  if (!eshell_write_all(audit.fd, audit.buf, audit.len)) {
+    perror("eshell: audit log");
+  }
+
+  audit.flushes++;
+  audit.bytes += audit.len;
+  audit.len = 0;
+  audit.last_flush = eshell_now_ns();
+}
+
+/**
+  @brief       Frame a record into the buffer, or write it out by itself if
+                 it can't fit there.
+  @param  rec  Fixed part of the record.
+  @param  strs Strings to follow it, each written with its terminator.
+  @param  n    Number of strings.
+*/
+void eshell_audit_append(struct eshell_audit_record *rec, char **strs, int n) {
+  struct eshell_audit_frame frame;
+  size_t payload = sizeof(*rec);
+  char *start;
+  char *p;
+  int i;
+
+  for (i = 0; i < n; i++) {
+    payload += strlen(strs[i]) + 1;
+  }
+
+  // Make room, flushing first if the record won't fit behind what's there
+  if (audit.len + sizeof(frame) + payload > ESHELL_AUDIT_BUFSIZE) {
+    eshell_audit_flush();
+  }
+
+  if (sizeof(frame) + payload > ESHELL_AUDIT_BUFSIZE) {
+    start = malloc(sizeof(frame) + payload);
+
+    if (!start) {
+      fprintf(stderr, "eshell: allocation error\n");
+
+      exit(EXIT_FAILURE);
+    }
+  } else {
+    start = audit.buf + audit.len;
+  }
+
+  p = start + sizeof(frame);
+  memcpy(p, rec, sizeof(*rec));
+  p += sizeof(*rec);
+
+  for (i = 0; i < n; i++) {
+    size_t len = strlen(strs[i]) + 1;
+
+    memcpy(p, strs[i], len);
+    p += len;
+  }
+
+  frame.magic = ESHELL_AUDIT_MAGIC;
+  frame.length = payload;
+  frame.crc = eshell_audit_crc32c(start + sizeof(frame), payload);
+  memcpy(start, &frame, sizeof(frame));
+  audit.records++;
+
+  if (start != audit.buf + audit.len) {
+    // The buffer was flushed above, so this still lands in order
+    if (!eshell_write_all(audit.fd, start, sizeof(frame) + payload)) {
+      perror("eshell: audit log");
+    }
+
+    audit.flushes++;
+    audit.bytes += sizeof(frame) + payload;
+    free(start);
+
+    return;
+  }
+
+  audit.len += sizeof(frame) + payload;
+}
+
+/**
+  @brief  Read the wall clock.
+  @return Nanoseconds since the epoch.
+*/
+uint64_t eshell_wall_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+  @brief     Signal handler for SIGHUP and SIGTERM: write out what's buffered,
+               then die of the signal as before. Only whole records are ever
+               counted in audit.len, so whatever is written is complete.
+  @param sig The signal.
+*/
+void eshell_audit_signal(int sig) {
+  // Nothing here but write(2), which is safe in a handler
+  if (audit.fd >= 0) {
+    eshell_write_all(audit.fd, audit.buf, audit.len);
+  }
+
+  signal(sig, SIG_DFL);
+  raise(sig);
+}
+
+/**
+  @brief Open the audit log named by ESHELL_AUDIT_LOG, if any, and start this
+           session's records.
+*/
+void eshell_audit_open(void) {
+  const char *path = getenv("ESHELL_AUDIT_LOG");
+  struct eshell_audit_record rec = { 0 };
+
+  if (path == NULL || *path == '\0') {
+    return;
+  }
+
+  audit.fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+  audit.buf = malloc(ESHELL_AUDIT_BUFSIZE);
+
+  if (audit.fd < 0) {
+    perror("eshell: audit log");
+
+    return;
+  }
+
+  if (!audit.buf) {
+    fprintf(stderr, "eshell: allocation error\n");
+
+    exit(EXIT_FAILURE);
+  }
+
+  rec.type = ESHELL_AUDIT_SESSION;
+  rec.pid = getpid();
+  rec.uid = getuid();
+  rec.timestamp_ns = eshell_wall_ns();
+  eshell_audit_append(&rec, NULL, 0);
+  audit.last_flush = eshell_now_ns();
+
+  // Whatever is buffered goes out however the shell exits
+  atexit(eshell_audit_flush);
+  signal(SIGHUP, eshell_audit_signal);
+  signal(SIGTERM, eshell_audit_signal);
+}
+
+/**
+  @brief        Record a command that has just finished.
+  @param  args  The command.
+  @param  start When it started, from eshell_now_ns().
+*/
+void eshell_audit_command(char **args, uint64_t start) {
+  struct eshell_audit_record rec = { 0 };
+  uint64_t now;
+  char cwd[PATH_MAX];
+  int argc;
+
+  if (audit.fd < 0) {
+    return;
+  }
+
+  now = eshell_now_ns();
+  rec.pid = getpid();
+  rec.uid = getuid();
+
+  // Directories are logged once, then referred to by id
+  if (getcwd(cwd, sizeof(cwd)) != NULL && strcmp(cwd, audit.cwd) != 0) {
+    char *strs[1] = { cwd };
+
+    memcpy(audit.cwd, cwd, sizeof(cwd));
+    rec.type = ESHELL_AUDIT_CWD;
+    rec.cwd_id = ++audit.cwd_id;
+    eshell_audit_append(&rec, strs, 1);
+  }
+
+  for (argc = 0; args[argc]; argc++);
+
+  // argc is 16 bits on disk; a longer command is logged as far as it goes
+  if (argc > UINT16_MAX) {
+    argc = UINT16_MAX;
+    rec.flags |= ESHELL_AUDIT_TRUNCATED;
+  }
+
+  rec.type = ESHELL_AUDIT_COMMAND;
+  rec.argc = argc;
+  rec.cwd_id = audit.cwd_id;
+  rec.status = eshell_status;
+  rec.timestamp_ns = eshell_wall_ns() - (now - start);
+  rec.duration_ns = now - start;
+  eshell_audit_append(&rec, args, argc);
+
+  if (now - audit.last_flush >= ESHELL_AUDIT_FLUSH_NS) {
+    eshell_audit_flush();
+  }
+}
+
+/*
+  Execution tracing, `set -x`. Each command is rendered as a line into a
+  per-session buffer, without stdio, and the buffer goes out in one write to
+  ESHELL_XTRACEFD (standard error by default) once it fills, once a tenth of
+  a second has passed since the last write, when the shell is about to wait
+  at the terminal, when tracing stops, or when the shell exits. ESHELL_XTRACE
+  may ask for "time", when each command started, and "duration", how long it
+  took and its status; a command's line is then written when it finishes.
+  Pluses show how deeply it's nested in function calls. Both are read when
+  tracing starts. When it's off, running a command only tests xtrace.on.
+*/
+#define ESHELL_XTRACE_BUFSIZE (64 * 1024)
+#define ESHELL_XTRACE_FLUSH_NS 100000000ULL
+
+struct eshell_xtrace {
+  bool on;
+  bool time;                        // Timestamps
+  bool duration;                    // Durations and statuses
+  bool quiet;                       // The next command was traced already
+  int fd;
+  int depth;
+  char *buf;
+  size_t len;
+  uint64_t last_flush;
+  time_t second;                    // The second clock holds the time of
+  char clock[9];                    //   as HH:MM:SS
+  unsigned long lines;
+  unsigned long flushes;
+  unsigned long bytes;
+} xtrace;
+
+/**
+  @brief Write out the buffered trace.
+*/
+void eshell_xtrace_flush(void) {
+  if (xtrace.len == 0) {
+    return;
+  }
+
+  eshell_write_all(xtrace.fd, xtrace.buf, xtrace.len);
+  xtrace.flushes++;
+  xtrace.bytes += xtrace.len;
+  xtrace.len = 0;
+  xtrace.last_flush = eshell_now_ns();
+}
+
+/**
+  @brief        Render a number.
+  @param  p      Where.
+  @param  n      The number.
+  @param  digits The least number of digits, with leading zeros.
+  @return        Past its last digit.
+*/
+char *eshell_xtrace_number(char *p, uint64_t n, int digits) {
+  char tmp[20];
+  int k = 0;
+
+  do {
+    tmp[k++] = '0' + n % 10;
+    n /= 10;
+  } while (n > 0 || k < digits);
+
+  while (k > 0) {
+    *p++ = tmp[--k];
+  }
+
+  return p;
+}
+
+/**
+  @brief        Render a command's trace line into the buffer, or write it
+                  out by itself if it can't fit there.
+  @param  args   The command.
+  @param  start  When it started, from eshell_now_ns().
+  @param  status Its status, or -1 if it hasn't finished.
+*/
+void eshell_xtrace_line(char **args, uint64_t start, int status) {
+  size_t need = 96 + xtrace.depth;
+  char *line;
+  char *p;
+  int i;
+
+  // The most a word can grow by quoting is four bytes for each quote
+  for (i = 0; args[i]; i++) {
+    need += 4 * strlen(args[i]) + 3;
+  }
+
+  if (xtrace.len + need > ESHELL_XTRACE_BUFSIZE) {
+    eshell_xtrace_flush();
+  }
+
+  if (need > ESHELL_XTRACE_BUFSIZE) {
+    line = malloc(need);
+
+    if (!line) {
+      fprintf(stderr, "eshell: allocation error\n");
+
+      exit(EXIT_FAILURE);
+    }
+  } else {
+    line = xtrace.buf + xtrace.len;
+  }
+
+  p = line;
+  memset(p, '+', xtrace.depth + 1);
+  p += xtrace.depth + 1;
+  *p++ = ' ';
+
+  if (xtrace.time) {
+    uint64_t wall = eshell_wall_ns() - (eshell_now_ns() - start);
+    time_t second = wall / 1000000000ULL;
+
+    // localtime_r only once a second
+    if (second != xtrace.second) {
+      struct tm tm;
+
+      localtime_r(&second, &tm);
+      eshell_xtrace_number(xtrace.clock, tm.tm_hour, 2)[0] = ':';
+      eshell_xtrace_number(xtrace.clock + 3, tm.tm_min, 2)[0] = ':';
+      eshell_xtrace_number(xtrace.clock + 6, tm.tm_sec, 2);
+      xtrace.second = second;
+    }
+
+    *p++ = '[';
+    memcpy(p, xtrace.clock, 8);
+    p += 8;
+    *p++ = '.';
+    p = eshell_xtrace_number(p, wall / 1000 % 1000000, 6);
+    *p++ = ']';
+    *p++ = ' ';
+  }
+
+  // Words that wouldn't read back as themselves are single quoted
+  for (i = 0; args[i]; i++) {
+    const char *s = args[i];
+    bool plain = *s != '\0';
+
+    for (; *s && plain; s++) {
+      plain = isalnum((unsigned char) *s) || strchr("_-+=/.,:@%^", *s);
+    }
+
+    // Bars between pipeline stages too
+    plain = plain || strcmp(args[i], "|") == 0;
+
+    if (i > 0) {
+      *p++ = ' ';
+    }
+
+    if (plain) {
+      size_t len = strlen(args[i]);
+
+      memcpy(p, args[i], len);
+      p += len;
+
+      continue;
+    }
+
+    *p++ = '\'';
+
+    for (s = args[i]; *s; s++) {
+      if (*s == '\'') {
+        memcpy(p, "'\\''", 4);
+        p += 4;
+      } else {
+        *p++ = *s;
+      }
+    }
+
+    *p++ = '\'';
+  }
+
+  if (status >= 0) {
+    uint64_t us = (eshell_now_ns() - start) / 1000;
+
+    memcpy(p, "  # ", 4);
+    p = eshell_xtrace_number(p + 4, us / 1000, 1);
+    *p++ = '.';
+    p = eshell_xtrace_number(p, us % 1000, 3);
+    memcpy(p, " ms, status ", 12);
+    p = eshell_xtrace_number(p + 12, status, 1);
+  }
+
+  *p++ = '\n';
+  xtrace.lines++;
+
+  if (line != xtrace.buf + xtrace.len) {
+    // The buffer was flushed above, so this still comes out in order
+    eshell_write_all(xtrace.fd, line, p - line);
+    xtrace.flushes++;
+    xtrace.bytes += p - line;
+    xtrace.last_flush = eshell_now_ns();
+    free(line);
+
+    return;
+  }
+
+  xtrace.len = p - xtrace.buf;
+
+  if (eshell_now_ns() - xtrace.last_flush >= ESHELL_XTRACE_FLUSH_NS) {
+    eshell_xtrace_flush();
+  }
+}
+
+/**
+  @brief      Start tracing, or stop.
+  @param  on  Which.
+*/
+void eshell_xtrace_set(bool on) {
+  const char *fd = getenv("ESHELL_XTRACEFD");
+  const char *what = getenv("ESHELL_XTRACE");
+
+  eshell_xtrace_flush();
+  xtrace.on = on;
+
+  if (!on) {
+    return;
+  }
+
+  if (xtrace.buf == NULL) {
+    if ((xtrace.buf = malloc(ESHELL_XTRACE_BUFSIZE)) == NULL) {
+      fprintf(stderr, "eshell: allocation error\n");
+
+      exit(EXIT_FAILURE);
+    }
+
+    // Whatever is buffered goes out however the shell exits
+    atexit(eshell_xtrace_flush);
+  }
+
+  xtrace.fd = STDERR_FILENO;
+
+  if (fd && *fd) {
+    char *end;
+    long n = strtol(fd, &end, 10);
+
+    if (*end || n < 0 || n > INT_MAX || fcntl(n, F_GETFD) < 0) {
+      fprintf(stderr, "eshell: set: ESHELL_XTRACEFD: not an open "
+              "descriptor: %s\n", fd);
+    } else {
+      xtrace.fd = n;
+    }
+  }
+
+  xtrace.time = what && strstr(what, "time");
+  xtrace.duration = what && strstr(what, "duration");
+  xtrace.second = -1;
+  xtrace.last_flush = eshell_now_ns();
+}
+
+int eshell_execute(char **args);
+
+/**
+  @brief       Run a command, tracing it.
+  @param  args The command, not yet traced.
+  @return      What eshell_execute returns.
+*/
+int eshell_xtrace_execute(char **args) {
+  uint64_t start = eshell_now_ns();
+  int status;
+
+  if (!xtrace.duration) {
+    eshell_xtrace_line(args, start, -1);
+  }
+
+  xtrace.quiet = true;
+  xtrace.depth++;
+  status = eshell_execute(args);
+  xtrace.depth--;
+
+  // Tracing may have been turned off, or on, by the command itself
+  if (xtrace.on && xtrace.duration) {
+    eshell_xtrace_line(args, start, eshell_status);
+  }
+
+  return status;
+}
+
+/**
+  @brief       Builtin command: set shell options. Only tracing so far.
+  @param  args `set -x` or `set -o xtrace` to trace commands, `set +x` or
+                 `set +o xtrace` to stop; `set` shows whether it's on.
+  @return      Always return 1 to continue executing the shell.
+*/
+int eshell_set(char **args) {
+  int i;
+
+  if (args[1] == NULL) {
+    printf("xtrace %s\n", xtrace.on ? "on" : "off");
+
+    return 1;
+  }
+
+  for (i = 1; args[i]; i++) {
+    bool on = args[i][0] == '-';
+
+    if (strcmp(args[i] + 1, "x") == 0 && (on || args[i][0] == '+')) {
+      eshell_xtrace_set(on);
+    } else if (strcmp(args[i] + 1, "o") == 0 && (on || args[i][0] == '+') &&
+               args[i + 1] && strcmp(args[i + 1], "xtrace") == 0) {
+      eshell_xtrace_set(on);
+      i++;
+    } else {
+      fprintf(stderr, "eshell: set: %s: unsupported option\n", args[i]);
+      eshell_status = 2;
+
+      return 1;
+    }
+  }
+
+  return 1;
+}
+
+/*
+  Variables. Plain variables are environment variables, so `PATH=...` takes
+  effect straight away and children see every assignment. Indexed arrays are
+  shell-only: all of an array's elements sit back to back, null terminated,
+  in one buffer, with a vector of offsets to where each starts, so indexing
+  is O(1) and loading a file with `mapfile` is one read and one pass over the
+  bytes with no allocation per line. Replacing an array retires the old one
+  until the command that may be using its elements finishes.
+
+  Big values stay out of the heap and out of the environment. `$(<FILE)`
+  copies a large file in the kernel into a memfd and maps that privately
+  instead of reading it, so the value is a snapshot that never passes
+  through user space, and only a page written to (for the null after the
+  text) is copied again. Mapping the file itself would let later writes to
+  it change the value, and truncating it would fault the shell.
+  `NAME=$(<FILE)` binds that mapping to NAME and `NAME=$OTHER` shares
+  OTHER's array, counting references; an array with more than one name is
+  never changed in place. Values too long for execve are kept unexported.
+*/
+#define ESHELL_MAP_MIN (1024 * 1024)  // Smaller files are just read
+#define ESHELL_ENV_MAX (128 * 1024)   // MAX_ARG_STRLEN on Linux
+
+struct eshell_array {
+  char *text;                       // Elements, back to back
+  size_t len;
+  size_t capacity;
+  size_t *offsets;                  // Where each element starts in text
+  size_t count;
+  size_t offsets_capacity;
+  size_t mapped;                    // Length of the mapping text is in, if any
+  int refs;                         // Names bound to it
+  struct eshell_array *next;        // Next retired array
+};
+
+struct eshell_vars {
+  struct eshell_atom_map arrays;    // Name to struct eshell_array
+  struct eshell_array *retired;
+  char **frame;                     // $0, $1, ... of the running function
+  unsigned long expansions;
+  unsigned long lines_mapped;
+  unsigned long files_mapped;
+  unsigned long bytes_mapped;
+  unsigned long files_read;
+  unsigned long shared;
+} vars;
+
+/**
+  @brief      Allocate an empty array.
+  @return     The array.
+*/
+struct eshell_array *eshell_array_new(void) {
+  struct eshell_array *a = calloc(1, sizeof(struct eshell_array));
+
+  if (!a) {
+    fprintf(stderr, "eshell: allocation error\n");
+
+    exit(EXIT_FAILURE);
+  }
+
+  a->refs = 1;
+
+  return a;
+}
+
+/**
+  @brief   Free an array.
+  @param a The array.
+*/
+void eshell_array_free(struct eshell_array *a) {
+  if (a->mapped) {
+    munmap(a->text, a->mapped);
+  } else {
+    free(a->text);
+  }
+
+  free(a->offsets);
+  free(a);
+}
+
+/**
+  @brief        Record where the next element starts.
+  @param a      The array.
+  @param offset Offset of the element in the text.
+*/
+void eshell_array_mark(struct eshell_array *a, size_t offset) {
+  if (a->count >= a->offsets_capacity) {
+    a->offsets_capacity = a->offsets_capacity ? a->offsets_capacity * 2 : 64;
+    a->offsets = realloc(a->offsets, a->offsets_capacity * sizeof(size_t));
+
+    if (!a->offsets) {
+      fprintf(stderr, "eshell: allocation error\n");
+
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  a->offsets[a->count++] = offset;
+}
+
+/**
+  @brief     Append an element.
+  @param a   The array.
+  @param s   The element.
+*/
+void eshell_array_push(struct eshell_array *a, const char *s) {
+  size_t n = strlen(s) + 1;
+
+  if (a->len + n > a->capacity) {
+    while (a->len + n > a->capacity) {
+      a->capacity = a->capacity ? a->capacity * 2 : 256;
+    }
+
+    a->text = realloc(a->text, a->capacity);
+
+    if (!a->text) {
+      fprintf(stderr, "eshell: allocation error\n");
+
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  memcpy(a->text + a->len, s, n);
+  eshell_array_mark(a, a->len);
+  a->len += n;
+}
+
+/**
+  @brief     Find element i of an array.
+  @param a   The array.
+  @param i   Index.
+  @return    The element, or NULL past the end.
+*/
+char *eshell_array_at(struct eshell_array *a, size_t i) {
+  return i < a->count ? a->text + a->offsets[i] : NULL;
+}
+
+/**
+  @brief     Split text into lines in place: each newline becomes a null and
+               the start of every line is recorded. The text must have room
+               for a null after its last byte.
+  @param a   Array whose text holds the bytes.
+*/
+void eshell_array_split_lines(struct eshell_array *a) {
+  char *text = a->text;
+  size_t len = a->len;
+  size_t start = 0;
+  size_t i = 0;
+
+#ifdef __SSE2__
+  // Sixteen bytes at a time: compare against a vector of newlines and walk
+  //   the set bits of the mask
+  const __m128i nl = _mm_set1_epi8('\n');
+
+  for (; i + 16 <= len; i += 16) {
+    unsigned mask = _mm_movemask_epi8(
+        _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (text + i)), nl));
+
+    while (mask) {
+      size_t pos = i + __builtin_ctz(mask);
+
+      text[pos] = '\0';
+      eshell_array_mark(a, start);
+      start = pos + 1;
+      mask &= mask - 1;
+    }
+  }
+#endif
+
+  for (; i < len; i++) {
+    if (text[i] == '\n') {
+      text[i] = '\0';
+      eshell_array_mark(a, start);
+      start = i + 1;
+    }
+  }
+
+  // A last line without a newline
+  if (start < len) {
+    text[len] = '\0';
+    eshell_array_mark(a, start);
+  }
+
+  a->len = len + 1;
+}
+
+/**
+  @brief     Read everything left on a descriptor into an empty array's
+               text, leaving room for a null after the last byte.
+  @param a   The array.
+  @param fd  The descriptor.
+  @return    0, or -1 with errno set if a read failed.
+*/
+int eshell_array_read(struct eshell_array *a, int fd) {
+  struct stat st;
+  bool regular;
+  ssize_t n = 0;
+
+  // Files are read in one go at their full size; pipes grow as they fill
+  regular = fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+  a->capacity = regular ? (size_t) st.st_size + 1 : 64 * 1024;
+
+  while (!regular || a->len < (size_t) st.st_size) {
+    if (a->text == NULL || a->len + 1 >= a->capacity) {
+      a->capacity = a->text ? a->capacity * 2 : a->capacity;
+      a->text = realloc(a->text, a->capacity);
+
+      if (!a->text) {
+        fprintf(stderr, "eshell: allocation error\n");
+
+        exit(EXIT_FAILURE);
+      }
+    }
+
+    n = read(fd, a->text + a->len, a->capacity - a->len - 1);
+
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+
+    if (n <= 0) {
+      break;
+    }
+
+    a->len += n;
+  }
+
+  // An empty file still needs somewhere to put the null
+  if (a->text == NULL && (a->text = malloc(1)) == NULL) {
+    fprintf(stderr, "eshell: allocation error\n");
+
+    exit(EXIT_FAILURE);
+  }
+
+  return n < 0 ? -1 : 0;
+}
+
+/**
+  @brief      Map a snapshot of a regular file as an empty array's text. The
+                file is copied in the kernel into a memfd of the shell's own,
+                so later writes to it, or its being truncated, can't reach
+                the variable. The mapping is private, so writing to it copies
+                just the page written, and sits at the front of an anonymous
+                reservation, so there is always a zero byte after the last
+                byte.
+  @param a    The array.
+  @param fd   The file, at its start.
+  @param size Its size.
+  @return     True if it was mapped.
+*/
+bool eshell_array_map(struct eshell_array *a, int fd, size_t size) {
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t copied = 0;
+  size_t span;
+  ssize_t n;
+  char *base;
+  int copy;
+
+  if ((copy = memfd_create("eshell-var", MFD_CLOEXEC)) < 0) {
+    return false;
+  }
+
+  // The file may have shrunk since it was measured; the copy is what counts
+  while (copied < size &&
+         (n = sendfile(copy, fd, NULL, size - copied)) > 0) {
+    copied += n;
+  }
+
+  if (copied == 0 || lseek(fd, 0, SEEK_SET) != 0) {
+    close(copy);
+
+    return false;
+  }
+
+  size = copied;
+  span = (size + page) & ~(page - 1);
+  base = mmap(NULL, span, PROT_READ | PROT_WRITE,
+              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+  if (base == MAP_FAILED) {
+    close(copy);
+
+    return false;
+  }
+
+  if (mmap(base, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, copy,
+           0) == MAP_FAILED) {
+    munmap(base, span);
+    close(copy);
+
+    return false;
+  }
+
+  close(copy);
+
+  a->text = base;
+  a->len = size;
+  a->capacity = span;
+  a->mapped = span;
+  vars.files_mapped++;
+  vars.bytes_mapped += size;
+
+  return true;
+}
+
+/**
+  @brief       Load a file as a one-element array, the way `$(<FILE)` sees
+                 it: without its trailing newlines. Large regular files are
+                 mapped, anything else read.
+  @param  path The file.
+  @return      The array, empty if the file couldn't be read.
+*/
+struct eshell_array *eshell_array_load(const char *path) {
+  struct eshell_array *a = eshell_array_new();
+  struct stat st;
+  size_t n;
+  int fd;
+
+  if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+    fprintf(stderr, "eshell: %s: %s\n", path, strerror(errno));
+    eshell_status = 1;
+
+    return a;
+  }
+
+  if (!(fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+        st.st_size >= ESHELL_MAP_MIN && eshell_array_map(a, fd, st.st_size))) {
+    if (eshell_array_read(a, fd) != 0) {
+      fprintf(stderr, "eshell: %s: %s\n", path, strerror(errno));
+      eshell_status = 1;
+    }
+
+    vars.files_read++;
+  }
+
+  close(fd);
+
+  // Only a page holding a trailing newline gets written, and so copied
+  for (n = a->len; n > 0 && a->text[n - 1] == '\n'; n--);
+
+  if (n < a->len || a->mapped == 0) {
+    a->text[n] = '\0';
+  }
+
+  a->len = n + 1;
+  eshell_array_mark(a, 0);
+
+  return a;
+}
+
+/**
+  @brief       Find an array.
+  @param  name Its name.
+  @return      The array, or NULL if there's no such array.
+*/
+struct eshell_array *eshell_array_find(const char *name) {
+  return eshell_atom_map_get(&vars.arrays, name);
+}
+
+/**
+  @brief       Give an array a name, retiring whatever had it before. The
+                 name takes over the caller's reference.
+  @param  name The name.
+  @param  a    The array, or NULL to remove the name.
+*/
+void eshell_array_set(const char *name, struct eshell_array *a) {
+  struct eshell_atom_entry *slot;
+
+  if (a == NULL && eshell_array_find(name) == NULL) {
+    return;
+  }
+
+  slot = eshell_atom_map_put(&vars.arrays, name);
+
+  // The old array goes once no name is left on it
+  if (slot->value != NULL &&
+      --((struct eshell_array *) slot->value)->refs == 0) {
+    ((struct eshell_array *) slot->value)->next = vars.retired;
+    vars.retired = slot->value;
+  }
+
+  slot->value = a;
+}
+
+/**
+  @brief Free retired arrays. Only called between commands, when none of
+           their elements can be in use.
+*/
+void eshell_vars_sweep(void) {
+  while (vars.retired) {
+    struct eshell_array *next = vars.retired->next;
+
+    eshell_array_free(vars.retired);
+    vars.retired = next;
+  }
+}
+
+/**
+  @brief       Check for a variable name.
+  @param  s    Start of the name.
+  @param  len  Its length.
+  @return      True if it's letters, digits and underscores, not starting
+                 with a digit.
+*/
+bool eshell_var_name(const char *s, size_t len) {
+  size_t i;
+
+  if (len == 0 || (s[0] >= '0' && s[0] <= '9')) {
+    return false;
+  }
+
+  for (i = 0; i < len; i++) {
+    if (!(s[i] == '_' || (s[i] >= 'a' && s[i] <= 'z') ||
+          (s[i] >= 'A' && s[i] <= 'Z') || (s[i] >= '0' && s[i] <= '9'))) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/**
+  @brief       Length of the assignment at the start of a command, in words.
+  @param  args Tokens of the command.
+  @return      0 if it doesn't start with NAME=value or NAME=(...).
+*/
+int eshell_assignment(char **args) {
+  const char *eq;
+  int i;
+
+  if (args[0] == NULL || (eq = strchr(args[0], '=')) == NULL ||
+      !eshell_var_name(args[0], eq - args[0])) {
+    return 0;
+  }
+
+  if (eq[1] != '(') {
+    return 1;
+  }
+
+  // An array runs to the word ending in a parenthesis
+  for (i = 0; args[i]; i++) {
+    size_t n = strlen(args[i]);
+
+    if (n > (size_t) (i == 0 ? eq - args[0] + 1 : 0) && args[i][n - 1] == ')') {
+      return i + 1;
+    }
+  }
+
+  return 0;
+}
+
+/**
+  @brief        Check for an assignment value that can be bound without
+                  copying it: `$(<FILE)`, or a lone `$NAME` or `${NAME}`.
+  @param  value The value as written.
+  @return       True if it is one.
+*/
+bool eshell_value_shared(const char *value) {
+  size_t n = strlen(value);
+
+  if (n < 2 || value[0] != '$') {
+    return false;
+  }
+
+  if (value[1] == '(') {
+    return n > 4 && value[2] == '<' && strchr(value, ')') == value + n - 1;
+  }
+
+  if (value[1] == '{') {
+    return n > 3 && value[n - 1] == '}' && eshell_var_name(value + 2, n - 3);
+  }
+
+  return eshell_var_name(value + 1, n - 1);
+}
+
+char *eshell_interpolate(const char *t);
+
+/**
+  @brief       Expand one word.
+  @param  t    The word.
+  @param  out  Receives the words it expands to, or NULL just to count them.
+  @param  num  Room for a number the word may expand to.
+  @return      How many words it expands to; a variable that isn't set
+                 expands to none.
+*/
+int eshell_expand_word(char *t, char **out, char *num) {
+  char **frame = vars.frame;
+  char name[256];
+  const char *sub = NULL;
+  const char *close;
+  struct eshell_array *a;
+  int argc = 0;
+  char *end;
+  long k;
+  size_t i;
+
+  while (frame && frame[argc]) {
+    argc++;
+  }
+
+  if (t[0] != '$' || t[1] == '\0') {
+    if (out) {
+      out[0] = t;
+    }
+
+    return 1;
+  }
+
+  // The contents of a file, which last until the command is done
+  if (t[1] == '(') {
+    if (t[2] != '<' || (close = strchr(t, ')')) == NULL || close[1] != '\0') {
+      goto literal;
+    }
+
+    if (out) {
+      char *path = strndup(t + 3, close - t - 3);
+      char *expanded;
+
+      if (!path) {
+        fprintf(stderr, "eshell: allocation error\n");
+
+        exit(EXIT_FAILURE);
+      }
+
+      expanded = eshell_interpolate(path);
+      a = eshell_array_load(expanded);
+      a->next = vars.retired;
+      vars.retired = a;
+      out[0] = eshell_array_at(a, 0);
+      free(expanded);
+      free(path);
+    }
+
+    return 1;
+  }
+
+  // Function parameters
+  if (strcmp(t, "$@") == 0) {
+    for (k = 1; k < argc && out; k++) {
+      out[k - 1] = frame[k];
+    }
+
+    return argc > 0 ? argc - 1 : 0;
+  }
+
+  if (strcmp(t, "$#") == 0 || strcmp(t, "$?") == 0) {
+    snprintf(num, 24, "%d", t[1] == '?' ? eshell_status :
+                            argc > 0 ? argc - 1 : 0);
+
+    if (out) {
+      out[0] = num;
+    }
+
+    return 1;
+  }
+
+  if (t[1] >= '0' && t[1] <= '9') {
+    k = strtol(t + 1, &end, 10);
+
+    if (*end != '\0') {
+      return 0;
+    }
+
+    if (k < argc && out) {
+      out[0] = frame[k];
+    }
+
+    return k < argc;
+  }
+
+  // $NAME, ${NAME}, ${NAME[N]}, ${NAME[@]} and ${#NAME[@]}
+  if (t[1] == '{') {
+    bool count = t[2] == '#';
+    const char *s = t + (count ? 3 : 2);
+    const char *bracket;
+
+    if ((close = strchr(s, '}')) == NULL || close[1] != '\0') {
+      goto literal;
+    }
+
+    bracket = memchr(s, '[', close - s);
+    i = (bracket ? bracket : close) - s;
+
+    if (i >= sizeof(name) || !eshell_var_name(s, i)) {
+      goto literal;
+    }
+
+    memcpy(name, s, i);
+    name[i] = '\0';
+
+    if (bracket) {
+      if (close[-1] != ']') {
+        goto literal;
+      }
+
+      sub = bracket + 1;
+    }
+
+    a = eshell_array_find(name);
+
+    // ${#NAME} is the length of the value, ${#NAME[@]} the number of elements
+    if (count && !bracket) {
+      sub = a ? eshell_array_at(a, 0) : getenv(name);
+      snprintf(num, 24, "%zu", sub ? strlen(sub) : 0);
+
+      if (out) {
+        out[0] = num;
+      }
+
+      return 1;
+    }
+
+    if (count) {
+      snprintf(num, 24, "%zu", a ? a->count : getenv(name) ? 1 : 0);
+
+      if (out) {
+        out[0] = num;
+      }
+
+      return 1;
+    }
+
+    if (a && sub && sub[0] == '@' && sub[1] == ']') {
+      for (i = 0; i < a->count && out; i++) {
+        out[i] = eshell_array_at(a, i);
+      }
+
+      return a->count;
+    }
+
+    if (a) {
+      k = sub ? strtol(sub, &end, 10) : 0;
+
+      if (k < 0 || eshell_array_at(a, k) == NULL) {
+        return 0;
+      }
+
+      if (out) {
+        out[0] = eshell_array_at(a, k);
+      }
+
+      return 1;
+    }
+  } else {
+    if (!eshell_var_name(t + 1, strlen(t + 1)) ||
+        strlen(t + 1) >= sizeof(name)) {
+      goto literal;
+    }
+
+    strcpy(name, t + 1);
+
+    // An array on its own is its first element
+    if ((a = eshell_array_find(name)) != NULL) {
+      if (a->count > 0 && out) {
+        out[0] = eshell_array_at(a, 0);
+      }
+
+      return a->count > 0;
+    }
+  }
+
+  if ((sub = getenv(name)) == NULL) {
+    return 0;
+  }
+
+  if (out) {
+    out[0] = (char *) sub;
+  }
+
+  return 1;
+
+literal:
+  if (out) {
+    out[0] = t;
+  }
+
+  return 1;
+}
+
+/**
+  @brief    Length of the reference at the start of some text: $NAME, ${...},
+              $(<FILE), $0-$9, $@, $# or $?.
+  @param  t The text, starting with a dollar sign.
+  @return   Its length, or 0 if it isn't a reference.
+*/
+size_t eshell_ref_len(const char *t) {
+  const char *end = t + 1;
+
+  if (t[1] == '(') {
+    end = t[2] == '<' ? strchr(t, ')') : NULL;
+
+    return end ? end - t + 1 : 0;
+  }
+
+  if (t[1] == '{') {
+    end = strchr(t, '}');
+
+    return end ? end - t + 1 : 0;
+  }
+
+  if (t[1] != '\0' && (strchr("@#?", t[1]) || (t[1] >= '0' && t[1] <= '9'))) {
+    return 2;
+  }
+
+  while (*end == '_' || (*end >= 'a' && *end <= 'z') ||
+         (*end >= 'A' && *end <= 'Z') || (*end >= '0' && *end <= '9')) {
+    end++;
+  }
+
+  return end - t > 1 ? end - t : 0;
+}
+
+/**
+  @brief      Expand the references inside a word that is more than a single
+                reference, like `$HOME/bin`; several words from one
+                reference are joined with spaces.
+  @param  t   The word.
+  @return     Newly allocated text.
+*/
+char *eshell_interpolate(const char *t) {
+  size_t cap = strlen(t) + 1;
+  size_t len = 0;
+  char *out = malloc(cap);
+
+  if (!out) {
+    fprintf(stderr, "eshell: allocation error\n");
+
+    exit(EXIT_FAILURE);
+  }
+
+  while (*t) {
+    size_t n = *t == '$' ? eshell_ref_len(t) : 0;
+    char ref[256];
+    char num[24];
+    char *words[1];
+    char **all;
+    const char *piece = t;
+    size_t piece_len = 1;
+    int count, k;
+
+    if (n == 0 || n >= sizeof(ref)) {
+      n = 1;
+      count = 0;
+      all = NULL;
+    } else {
+      memcpy(ref, t, n);
+      ref[n] = '\0';
+      count = eshell_expand_word(ref, NULL, num);
+      all = count > 1 ? malloc(count * sizeof(char *)) : words;
+
+      if (!all) {
+        fprintf(stderr, "eshell: allocation error\n");
+
+        exit(EXIT_FAILURE);
+      }
+
+      eshell_expand_word(ref, all, num);
+      piece_len = 0;
+    }
+
+    // The literal byte, or each word of the reference with spaces between
+    for (k = -1; k < count; k++) {
+      if (k >= 0) {
+        piece = all[k];
+        piece_len = strlen(piece) + (k > 0);
+      }
+
+      if (len + piece_len + 1 > cap) {
+        while (len + piece_len + 1 > cap) {
+          cap *= 2;
+        }
+
+        if ((out = realloc(out, cap)) == NULL) {
+          fprintf(stderr, "eshell: allocation error\n");
+
+          exit(EXIT_FAILURE);
+        }
+      }
+
+      if (k > 0) {
+        out[len++] = ' ';
+        piece_len--;
+      }
+
+      memcpy(out + len, piece, piece_len);
+      len += piece_len;
+    }
+
+    if (all != words) {
+      free(all);
+    }
+
+    t += n;
+  }
+
+  out[len] = '\0';
+
+  return out;
+}
+
+/**
+  @brief        Expand parameters and variables in a command's words.
+  @param  args  The words.
+  @return       args itself if nothing needed expanding, otherwise newly
+                  allocated words; the strings belong to the variables or the
+                  end of the same allocation.
+*/
+char **eshell_expand(char **args) {
+  char **expanded;
+  char **joined;
+  char *tail;
+  size_t extra = 0;
+  int words = 0;
+  int i, n = 0;
+
+  for (i = 0; args[i] && strchr(args[i], '$') == NULL; i++);
+
+  if (args[i] == NULL) {
+    return args;
+  }
+
+  // An assignment on its own that eshell_assign can bind without a copy
+  if (args[1] == NULL && eshell_assignment(args) == 1 &&
+      eshell_value_shared(strchr(args[0], '=') + 1)) {
+    return args;
+  }
+
+  for (i = 0; args[i]; i++);
+
+  if ((joined = calloc(i, sizeof(char *))) == NULL) {
+    fprintf(stderr, "eshell: allocation error\n");
+
+    exit(EXIT_FAILURE);
+  }
+
+  // Count first, then fill in. A word that is a single reference can become
+  //   any number of words, with room for a number; anything else with a
+  //   reference in it is built up as one new word.
+  for (i = 0; args[i]; i++) {
+    char num[24];
+
+    if (args[i][0] == '$' && eshell_ref_len(args[i]) == strlen(args[i])) {
+      words += eshell_expand_word(args[i], NULL, num);
+      extra += 24;
+    } else if (strchr(args[i], '$') != NULL) {
+      joined[i] = eshell_interpolate(args[i]);
+      extra += strlen(joined[i]) + 1;
+      words++;
+    } else {
+      words++;
+    }
+  }
+
+  expanded = malloc((words + 1) * sizeof(char *) + extra);
+
+  if (!expanded) {
+    fprintf(stderr, "eshell: allocation error\n");
+
+    exit(EXIT_FAILURE);
+  }
+
+  tail = (char *) (expanded + words + 1);
+
+  for (i = 0; args[i]; i++) {
+    if (joined[i] != NULL) {
+      expanded[n++] = strcpy(tail, joined[i]);
+      tail += strlen(joined[i]) + 1;
+      free(joined[i]);
+    } else if (args[i][0] == '$' &&
+               eshell_ref_len(args[i]) == strlen(args[i])) {
+      n += eshell_expand_word(args[i], expanded + n, tail);
+      tail += 24;
+    } else {
+      expanded[n++] = args[i];
+    }
+  }
+
+  expanded[n] = NULL;
+  free(joined);
+  vars.expansions++;
+
+  return expanded;
+}
+
+/**
+  @brief       Set a plain variable. It is exported, unless it's too long to
+                 be passed to a program at all.
+  @param  name  Its name.
+  @param  value Its value.
+*/
+void eshell_assign_value(const char *name, const char *value) {
+  struct eshell_array *a;
+
+  if (strlen(name) + strlen(value) + 2 <= ESHELL_ENV_MAX) {
+    // A plain value replaces an array of the same name
+    eshell_array_set(name, NULL);
+    setenv(name, value, 1);
+
+    return;
+  }
+
+  a = eshell_array_new();
+  eshell_array_push(a, value);
+  eshell_array_set(name, a);
+  unsetenv(name);
+}
+
+/**
+  @brief       Carry out one assignment.
+  @param  args The words of the assignment.
+  @param  n    How many there are.
+*/
+void eshell_assign(char **args, int n) {
+  char *eq = strchr(args[0], '=');
+  char *name = strndup(args[0], eq - args[0]);
+  int i;
+
+  if (!name) {
+    fprintf(stderr, "eshell: allocation error\n");
+
+    exit(EXIT_FAILURE);
+  }
+
+  if (eq[1] == '(') {
+    struct eshell_array *a = eshell_array_new();
+
+    for (i = 0; i < n; i++) {
+      char *word = strdup(i == 0 ? eq + 2 : args[i]);
+
+      if (!word) {
+        fprintf(stderr, "eshell: allocation error\n");
+
+        exit(EXIT_FAILURE);
+      }
+
+      if (i == n - 1) {
+        word[strlen(word) - 1] = '\0';
+      }
+
+      if (word[0] != '\0') {
+        eshell_array_push(a, word);
+      }
+
+      free(word);
+    }
+
+    eshell_array_set(name, a);
+  } else if (eshell_value_shared(eq + 1)) {
+    // Left unexpanded by eshell_expand: a file is loaded as it is, and a
+    //   variable with one value shares its array
+    size_t skip = eq[2] == '(' ? 3 : eq[2] == '{' ? 2 : 1;
+    char *ref = strndup(eq + 1 + skip, strlen(eq + 1) - skip - (skip > 1));
+    struct eshell_array *a;
+
+    if (!ref) {
+      fprintf(stderr, "eshell: allocation error\n");
+
+      exit(EXIT_FAILURE);
+    }
+
+    // Either is kept out of the environment only if it's too long for it
+    if (eq[2] == '(') {
+      char *path = eshell_interpolate(ref);
+
+      a = eshell_array_load(path);
+
+      if (strlen(name) + a->len + 1 <= ESHELL_ENV_MAX) {
+        eshell_assign_value(name, eshell_array_at(a, 0));
+        eshell_array_free(a);
+      } else {
+        eshell_array_set(name, a);
+        unsetenv(name);
+      }
+
+      free(path);
+    } else if ((a = eshell_array_find(ref)) != NULL && a->count == 1 &&
+               strlen(name) + a->len + 1 <= ESHELL_ENV_MAX) {
+      eshell_assign_value(name, eshell_array_at(a, 0));
+    } else if (a != NULL && a->count == 1) {
+      a->refs++;
+      vars.shared++;
+      eshell_array_set(name, a);
+      unsetenv(name);
+    } else {
+      char *value = eshell_interpolate(eq + 1);
+
+      eshell_assign_value(name, value);
+      free(value);
+    }
+
+    free(ref);
+  } else {
+    eshell_assign_value(name, eq + 1);
+  }
+
+  free(name);
+}
+
+/**
+  @brief       Builtin command: read lines into an array.
+  @param  args `mapfile [-t] NAME [FILE]`. Lines are read from FILE, or
+                 standard input; their newlines are always dropped, so -t is
+                 accepted only for compatibility.
+  @return      Always return 1 to continue executing the shell.
+*/
+int eshell_mapfile(char **args) {
+  struct eshell_array *a;
+  int i = 1;
+  int fd = STDIN_FILENO;
+
+  if (args[i] && strcmp(args[i], "-t") == 0) {
+    i++;
+  }
+
+  if (args[i] == NULL || !eshell_var_name(args[i], strlen(args[i]))) {
+    fprintf(stderr, "eshell: usage: mapfile [-t] NAME [FILE]\n");
+    eshell_status = 2;
+
+    return 1;
+  }
+
+  if (args[i + 1] && strcmp(args[i + 1], "-") != 0 &&
+      (fd = open(args[i + 1], O_RDONLY | O_CLOEXEC)) < 0) {
+    fprintf(stderr, "eshell: mapfile: %s: %s\n", args[i + 1],
+            strerror(errno));
+    eshell_status = 1;
+
+    return 1;
+  }
+
+  a = eshell_array_new();
+
+  if (eshell_array_read(a, fd) != 0) {
+    fprintf(stderr, "eshell: mapfile: %s\n", strerror(errno));
+    eshell_status = 1;
+  }
+
+  if (fd != STDIN_FILENO) {
+    close(fd);
+  }
+
+  eshell_array_split_lines(a);
+  vars.lines_mapped += a->count;
+  eshell_array_set(args[i], a);
+
+  return 1;
+}
+
+/**
+  @brief       Builtin command: remove variables and arrays.
+  @param  args Names to remove.
+  @return      Always return 1 to continue executing the shell.
+*/
+int eshell_unset(char **args) {
+  int i;
+
+  for (i = 1; args[i]; i++) {
+    eshell_array_set(args[i], NULL);
+    unsetenv(args[i]);
+  }
+
+  return 1;
+}
+
+/*
+  Buffered line reading. Each descriptor read line by line gets a buffer that
+  lives across calls, so `read` in a loop, `for-lines` and the shell's own
+  non-terminal input do one read per buffer instead of one per line. Reading
+  ahead moves the descriptor's offset past what has been consumed, so before
+  anything else can see the descriptor (a child being started, or a loop that
+  stops early) the extra is given back with lseek on files that can seek.
+*/
+#define ESHELL_FDBUF_SIZE (64 * 1024)
+
+struct eshell_fdbuf {
+  char *data;
+  size_t start;                     // First byte not yet consumed
+  size_t end;                       // One past the last byte read
+  size_t size;
+};
+
+struct eshell_fdbufs {
+  struct eshell_fdbuf *fds;         // Indexed by descriptor
+  int count;
+  unsigned long fills;
+  unsigned long lines;
+  unsigned long seeks;
+} fdbufs;
+
+/**
+  @brief      Find the buffer for a descriptor, making one if needed.
+  @param  fd  The descriptor.
+  @return     Its buffer.
+*/
+struct eshell_fdbuf *eshell_fdbuf_get(int fd) {
+  struct eshell_fdbuf *b;
+
+  if (fd >= fdbufs.count) {
+    int count = fd + 16;
+
+    fdbufs.fds = realloc(fdbufs.fds, count * sizeof(struct eshell_fdbuf));
+
+    if (!fdbufs.fds) {
+      fprintf(stderr, "eshell: allocation error\n");
+
+      exit(EXIT_FAILURE);
+    }
+
+    memset(fdbufs.fds + fdbufs.count, 0,
+           (count - fdbufs.count) * sizeof(struct eshell_fdbuf));
+    fdbufs.count = count;
+  }
+
+  b = &fdbufs.fds[fd];
+
+  if (b->data == NULL) {
+    b->size = ESHELL_FDBUF_SIZE;
+
+    if ((b->data = malloc(b->size)) == NULL) {
+      fprintf(stderr, "eshell: allocation error\n");
+
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  return b;
+}
+
+/**
+  @brief      Read the next line from a descriptor.
+  @param  fd  The descriptor.
+  @param  len Receives the length of the line.
+  @return     The line without its newline, valid until the next call for the
+                same descriptor, or NULL at the end of input.
+*/
+char *eshell_fdbuf_line(int fd, size_t *len) {
+  struct eshell_fdbuf *b = eshell_fdbuf_get(fd);
+  size_t scanned = 0;
+  char *line;
+  ssize_t n;
+
+  for (;;) {
+    char *nl = memchr(b->data + b->start + scanned, '\n',
+                      b->end - b->start - scanned);
+
+    if (nl != NULL) {
+      *nl = '\0';
+      line = b->data + b->start;
+      *len = nl - line;
+      b->start = nl + 1 - b->data;
+      fdbufs.lines++;
+
+      return line;
+    }
+
+    scanned = b->end - b->start;
+
+    // Slide what's left to the front, and grow for a line longer than the
+    //   buffer; one byte is always kept free for a null
+    if (b->start > 0) {
+      memmove(b->data, b->data + b->start, scanned);
+      b->start = 0;
+      b->end = scanned;
+    }
+
+    if (b->end + 1 >= b->size) {
+      b->size *= 2;
+
+      if ((b->data = realloc(b->data, b->size)) == NULL) {
+        fprintf(stderr, "eshell: allocation error\n");
+
+        exit(EXIT_FAILURE);
+      }
+    }
+
+    do {
+      n = read(fd, b->data + b->end, b->size - b->end - 1);
+    } while (n < 0 && errno == EINTR);
+
+    if (n > 0) {
+      b->end += n;
+      fdbufs.fills++;
+
+      continue;
+    }
+
+    // The end of input, with or without a last unterminated line
+    if (b->end == b->start) {
+      return NULL;
+    }
+
+    b->data[b->end] = '\0';
+    line = b->data + b->start;
+    *len = b->end - b->start;
+    b->start = b->end;
+    fdbufs.lines++;
+
+    return line;
+  }
+}
+
+/**
+  @brief      Give back what was read ahead on a descriptor, so its offset is
+                just past the last line consumed. Only possible on descriptors
+                that can seek; for pipes the data stays buffered for the
+                shell's next read.
+  @param  fd  The descriptor.
+*/
+void eshell_fdbuf_sync(int fd) {
+  struct eshell_fdbuf *b;
+
+  if (fd >= fdbufs.count) {
+    return;
+  }
+
+  b = &fdbufs.fds[fd];
+
+  if (b->start == b->end) {
+    return;
+  }
+
+  if (lseek(fd, -(off_t) (b->end - b->start), SEEK_CUR) >= 0) {
+    b->start = b->end = 0;
+    fdbufs.seeks++;
+  }
+}
+
+/**
+  @brief Sync every buffered descriptor a child would inherit. Called before
+           forking.
+*/
+void eshell_fdbuf_sync_all(void) {
+  int fd;
+
+  for (fd = 0; fd < fdbufs.count; fd++) {
+    if (fdbufs.fds[fd].start != fdbufs.fds[fd].end &&
+        (fcntl(fd, F_GETFD) & FD_CLOEXEC) == 0) {
+      eshell_fdbuf_sync(fd);
+    }
+  }
+}
+
+/**
+  @brief      Forget a descriptor's buffer, say because it is being closed.
+  @param  fd  The descriptor.
+*/
+void eshell_fdbuf_drop(int fd) {
+  if (fd < fdbufs.count) {
+    free(fdbufs.fds[fd].data);
+    memset(&fdbufs.fds[fd], 0, sizeof(struct eshell_fdbuf));
+  }
+}
+
+/**
+  @brief       Set a shell variable, one that isn't exported. It is kept as an
+                 array of one element, reused in place, so a loop setting it
+                 for every line doesn't allocate.
+  @param  name  Its name.
+  @param  value Its value.
+*/
+void eshell_scalar_set(const char *name, const char *value) {
+  struct eshell_array *a = eshell_array_find(name);
+
+  // Shared and mapped arrays are left alone and replaced
+  if (a == NULL || a->refs > 1 || a->mapped) {
+    a = eshell_array_new();
+    eshell_array_set(name, a);
+  }
+
+  a->len = 0;
+  a->count = 0;
+  eshell_array_push(a, value);
+}
+
+/**
+  @brief       Parse a descriptor number.
+  @param  s    The text.
+  @return      The descriptor, or -1 if it isn't one.
+*/
+int eshell_parse_fd(const char *s) {
+  char *end;
+  long fd = strtol(s, &end, 10);
+
+  return *s != '\0' && *end == '\0' && fd >= 0 && fd < INT_MAX ? fd : -1;
+}
+
+/**
+  @brief       Builtin command: read a line into variables.
+  @param  args `read [-u FD] [NAME...]`. The line is split on blanks, one
+                 word per name and the rest in the last; with no names it all
+                 goes in REPLY.
+  @return      Always return 1 to continue executing the shell; the status is
+                 1 at the end of input.
+*/
+int eshell_read(char **args) {
+  int fd = STDIN_FILENO;
+  char *line;
+  size_t len;
+  int i = 1;
+
+  if (args[i] && strcmp(args[i], "-u") == 0) {
+    if (args[i + 1] == NULL || (fd = eshell_parse_fd(args[i + 1])) < 0) {
+      fprintf(stderr, "eshell: usage: read [-u FD] [NAME...]\n");
+      eshell_status = 2;
+
+      return 1;
+    }
+
+    i += 2;
+  }
+
+  if ((line = eshell_fdbuf_line(fd, &len)) == NULL) {
+    eshell_status = 1;
+
+    return 1;
+  }
+
+  if (args[i] == NULL) {
+    eshell_scalar_set("REPLY", line);
+
+    return 1;
+  }
+
+  for (; args[i]; i++) {
+    char *word;
+
+    line += strspn(line, " \t");
+    word = line;
+
+    // The last name takes whatever is left
+    if (args[i + 1] != NULL) {
+      line += strcspn(line, " \t");
+
+      if (*line != '\0') {
+        *line++ = '\0';
+      }
+    }
+
+    eshell_scalar_set(args[i], word);
+  }
+
+  return 1;
+}
+
+void eshell_metrics_command(const char *name);
+pid_t eshell_fork(void);
+void eshell_command_done(char **args, uint64_t start);
+
+/**
+  @brief       Run a binary and wait for it to finish.
+  @param  path Path of the binary.
+  @param  args Null terminated list of arguments.
+  @return      Always returns 1, to continue executing.
+*/
+int eshell_launch_path(const char *path, char **args) {
+  pid_t pid;
+
+  // The child must find stdin where the shell's reading left off
+  eshell_fdbuf_sync_all();
+
+  // Make a copy of the currently running process
+  pid = eshell_fork();
+
+  // If the PID is 0, make that process a child process
+  if (pid == 0) {
+    // Make the child process run the program desired
+    if (execv(path, args) == -1) {
+      perror("eshell: child process failed\n");
+    }
+
+    exit(EXIT_FAILURE);
+
+  // The PID is less than 0, so it's a forking error
+  } else if (pid < 0) {
+    perror("eshell: error forking parent process\n");
+
+  // Fork executed properly
+  } else {
+    // Wait for the process to finish; the SIGCHLD handler reaps it
+    eshell_status = eshell_wait_child(pid);
+  }
+
+  return 1;
+}
+
+/**
+  @brief       Launches an external program.
+  @param  args List of arguments, including the program to execute.
+  @return      Always return 1 to continue executing the shell.
+*/
+int eshell_launch(char **args) {
+  char path[PATH_MAX];
+
+  // Find the binary, ideally already resolved while the line was typed
+  if (!eshell_resolve(args[0], path, sizeof(path))) {
+    return 1;
+  }
+
+  return eshell_launch_path(path, args);
+}
+
+/**
+  @brief       Hand a builtin's command to the program of the same name, for
+                 options the builtin doesn't do itself.
+  @param  args The command.
+  @return      Always return 1 to continue executing the shell.
+*/
+int eshell_builtin_external(char **args) {
+  // Pipelines and pfor only give a worker what it can do alone
+  if (eshell_worker || eshell_capture || eshell_in_fd != STDIN_FILENO ||
+      eshell_out_fd != STDOUT_FILENO) {
+    fprintf(stderr, "eshell: %s: options not supported here\n", args[0]);
+    eshell_status = 2;
+
+    return 1;
+  }
+
+  return eshell_launch(args);
+}
+
+bool eshell_pipeline_find(char **args);
+int eshell_pipeline(char **args);
+struct eshell_function *eshell_function_find(const char *name);
+int eshell_function_call(struct eshell_function *fn, char **args);
+
+/**
+  @brief       Execute shell built-in, function or launch program.
+  @param  args Null terminated list of arguments.
+  @return      0 if the shell should terminate, non-zero if the shell continues
+                 to run.
+*/
+int eshell_execute(char **args) {
+  uint64_t start = eshell_now_ns();
+  struct eshell_function *fn;
+  int status;
+  int i, n;
+
+  // Traced once, on the way in
+  if (xtrace.on) {
+    if (xtrace.quiet) {
+      xtrace.quiet = false;
+    } else if (args[0]) {
+      return eshell_xtrace_execute(args);
+    }
+  }
+
+  // An empty command was entered, just show the loop again
+  if (args[0] == NULL) {
+    return 1;
+  }
+
+  // Named in the metrics from here, so a long one shows while it runs
+  eshell_metrics_command(args[0]);
+
+  if (eshell_pipeline_find(args)) {
+    return eshell_pipeline(args);
+  }
+
+  // Assignments on their own set variables; in front of a command they only
+  //   last as long as it does
+  if ((n = eshell_assignment(args)) > 0) {
+    char *eq = strchr(args[0], '=');
+    char *name;
+    char *old;
+
+    if (args[n] == NULL || eq[1] == '(') {
+      eshell_status = 0;
+      eshell_assign(args, n);
+      xtrace.quiet = xtrace.on;
+
+      return eshell_execute(args + n);
+    }
+
+    name = strndup(args[0], eq - args[0]);
+    old = getenv(name) ? strdup(getenv(name)) : NULL;
+
+    setenv(name, eq + 1, 1);
+    xtrace.quiet = xtrace.on;
+    status = eshell_execute(args + 1);
+
+    if (old) {
+      setenv(name, old, 1);
+    } else {
+      unsetenv(name);
+    }
+
+    free(name);
+    free(old);
+
+    return status;
+  }
+
+  // It was a legitamite program, so see whether it's one of the built-in
+  //   commands
+  if ((i = eshell_builtin_find(args[0])) >= 0) {
+
+    // Run the built-in program
+    eshell_status = 0;
+    status = (*builtin_func[i])(args);
+    eshell_command_done(args, start);
+
+    return status;
+  }
+
+  // Then the functions that have been defined
+  if ((fn = eshell_function_find(args[0])) != NULL) {
+    status = eshell_function_call(fn, args);
+    eshell_command_done(args, start);
+
+    return status;
+  }
+
+  // A command was passed but it wasn't a built-in one, so try and launch it
+  //   externally
+  status = eshell_launch(args);
+  eshell_command_done(args, start);
+
+  return status;
+}
+
+/*
+  File I/O for builtins. Work is described as a list of chunks to copy from
+  files to an output descriptor. The sync engine does each with pread and
+  write; the uring engine reads a window of chunks (possibly from many files)
+  into registered buffers with one io_uring_enter, then writes them out as one
+  linked chain with another. ESHELL_IO=uring, or `io uring`, selects it; if the
+  kernel refuses io_uring the sync engine is used.
+*/
+#define ESHELL_IO_BUFSIZE (128 * 1024)
+#define ESHELL_IO_DEPTH 16
+
+enum { ESHELL_IO_SYNC, ESHELL_IO_URING };
+
+struct eshell_uring {
+  int fd;
+  void *sq_ring;
+  void *cq_ring;
+  size_t sq_ring_size;
+  size_t cq_ring_size;
+  struct io_uring_sqe *sqes;
+  size_t sqes_size;
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_cqe *cqes;
+};
+
+struct eshell_io {
+  int engine;
+  bool configured;                  // ESHELL_IO has been looked at
+  struct eshell_uring ring;         // fd is -1 until set up
+  char *bufs;                       // ESHELL_IO_DEPTH registered buffers
+  unsigned long submits;            // System calls that submitted work
+  unsigned long ops;
+  unsigned long bytes;
+} io = { .ring.fd = -1 };
+
+/*
+  A piece of a file to copy to the output
+*/
+struct eshell_io_chunk {
+  int fd;
+  off_t offset;
+  size_t len;
+};
+
+/**
+  @brief  Set up the ring and register its buffers.
+  @return True if io_uring is usable.
+*/
+bool eshell_uring_setup(void) {
+  struct io_uring_params p;
+  struct eshell_uring *r = &io.ring;
+  struct iovec iov[ESHELL_IO_DEPTH];
+  char *sq, *cq;
+  int i;
+
+  memset(&p, 0, sizeof(p));
+  r->fd = syscall(__NR_io_uring_setup, ESHELL_IO_DEPTH * 2, &p);
+
+  if (r->fd < 0) {
+    return false;
+  }
+
+  r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  r->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    r->sq_ring_size = r->cq_ring_size = r->sq_ring_size > r->cq_ring_size ?
+                                        r->sq_ring_size : r->cq_ring_size;
+  }
+
+  r->sq_ring = mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+  r->cq_ring = (p.features & IORING_FEAT_SINGLE_MMAP) ? r->sq_ring :
+               mmap(NULL, r->cq_ring_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+  r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+
+  if (r->sq_ring == MAP_FAILED || r->cq_ring == MAP_FAILED ||
+      r->sqes == MAP_FAILED) {
+    close(r->fd);
+    r->fd = -1;
+
+    return false;
+  }
+
+  sq = r->sq_ring;
+  cq = r->cq_ring;
+  r->sq_head = (unsigned *) (sq + p.sq_off.head);
+  r->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+  r->sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+  r->sq_array = (unsigned *) (sq + p.sq_off.array);
+  r->cq_head = (unsigned *) (cq + p.cq_off.head);
+  r->cq_tail = (unsigned *) (cq + p.cq_off.tail);
+  r->cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+  // Pin the buffers once so fixed reads and writes skip the page walk
+  for (i = 0; i < ESHELL_IO_DEPTH; i++) {
+    iov[i].iov_base = io.bufs + (size_t) i * ESHELL_IO_BUFSIZE;
+    iov[i].iov_len = ESHELL_IO_BUFSIZE;
+  }
+
+  if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_BUFFERS, iov,
+              ESHELL_IO_DEPTH) != 0) {
+    munmap(r->sqes, r->sqes_size);
+
+    if (r->cq_ring != r->sq_ring) {
+      munmap(r->cq_ring, r->cq_ring_size);
+    }
+
+    munmap(r->sq_ring, r->sq_ring_size);
+    close(r->fd);
+    r->fd = -1;
+
+    return false;
+  }
+
+  return true;
+}
+
+/**
+  @brief        Pick an engine.
+  @param engine ESHELL_IO_SYNC or ESHELL_IO_URING.
+  @return       The engine actually in use.
+*/
+int eshell_io_select(int engine) {
+  if (!io.bufs) {
+    io.bufs = mmap(NULL, (size_t) ESHELL_IO_DEPTH * ESHELL_IO_BUFSIZE,
+                   PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (io.bufs == MAP_FAILED) {
+      fprintf(stderr, "eshell: allocation error\n");
+
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  io.configured = true;
+  io.engine = ESHELL_IO_SYNC;
+
+  if (engine == ESHELL_IO_URING && (io.ring.fd >= 0 || eshell_uring_setup())) {
+    io.engine = ESHELL_IO_URING;
+  }
+
+  return io.engine;
+}
+
+/**
+  @brief        Queue one operation on the ring.
+  @param op     IORING_OP_READ_FIXED or IORING_OP_WRITE_FIXED.
+  @param fd     Descriptor.
+  @param buf    Index of the registered buffer.
+  @param len    Bytes to transfer.
+  @param offset File offset, or -1 for the current position.
+  @param flags  SQE flags, such as IOSQE_IO_LINK.
+*/
+void eshell_uring_queue(int op, int fd, int buf, size_t len, off_t offset,
+                        int flags) {
+  struct eshell_uring *r = &io.ring;
+  unsigned tail = *r->sq_tail;
+  unsigned index = tail & *r->sq_mask;
+  struct io_uring_sqe *sqe = &r->sqes[index];
+
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = op;
+  sqe->fd = fd;
+  sqe->flags = flags;
+  sqe->addr = (unsigned long) (io.bufs + (size_t) buf * ESHELL_IO_BUFSIZE);
+  sqe->len = len;
+  sqe->off = offset;
+  sqe->buf_index = buf;
+  sqe->user_data = buf;
+  r->sq_array[index] = index;
+
+  // The kernel must see the entry before the new tail
+  __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/**
+  @brief         Submit everything queued and wait for all of it.
+  @param count   Number of operations queued.
+  @param results Receives each operation's result, indexed by buffer.
+  @return        False if the ring failed.
+*/
+bool eshell_uring_complete(int count, int *results) {
+  struct eshell_uring *r = &io.ring;
+  int done = 0;
+
+  if (syscall(__NR_io_uring_enter, r->fd, count, count,
+              IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR) {
+    return false;
+  }
+
+  io.submits++;
+  io.ops += count;
+
+  while (done < count) {
+    unsigned head = *r->cq_head;
+
+    if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+      // Interrupted before everything finished; wait for the rest
+      if (syscall(__NR_io_uring_enter, r->fd, 0, count - done,
+                  IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR) {
+        return false;
+      }
+
+      continue;
+    }
+
+    results[r->cqes[head & *r->cq_mask].user_data] =
+        r->cqes[head & *r->cq_mask].res;
+    __atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+    done++;
+  }
+
+  return true;
+}
+
+/**
+  @brief        Copy chunks with pread and write.
+  @param chunks Chunks to copy, in output order.
+  @param n      Number of chunks.
+  @param out    Output descriptor.
+  @return       True if everything was copied.
+*/
+bool eshell_io_copy_sync(const struct eshell_io_chunk *chunks, int n,
+                         int out) {
+  int i;
+
+  for (i = 0; i < n; i++) {
+    size_t left = chunks[i].len;
+    off_t offset = chunks[i].offset;
+
+    while (left > 0) {
+      size_t want = left < ESHELL_IO_BUFSIZE ? left : ESHELL_IO_BUFSIZE;
+      ssize_t got = pread(chunks[i].fd, io.bufs, want, offset);
+
+      if (got < 0 && errno == EINTR) {
+        continue;
+      }
+
+      // The file shrank, so there's nothing more of it
+      if (got <= 0) {
+        break;
+      }
+
+      if (!eshell_write_all(out, io.bufs, got)) {
+        return false;
+      }
+
+      io.ops += 2;
+      io.submits += 2;
+      io.bytes += got;
+      offset += got;
+      left -= got;
+    }
+  }
+
+  return true;
+}
+
+/**
+  @brief        Copy chunks a window at a time through the ring.
+  @param chunks Chunks to copy, in output order; none longer than a buffer.
+  @param n      Number of chunks.
+  @param out    Output descriptor.
+  @return       True if everything was copied.
+*/
+bool eshell_io_copy_uring(const struct eshell_io_chunk *chunks, int n,
+                          int out) {
+  int got[ESHELL_IO_DEPTH];
+  int wrote[ESHELL_IO_DEPTH];
+  int base, i;
+
+  for (base = 0; base < n; base += ESHELL_IO_DEPTH) {
+    int count = n - base < ESHELL_IO_DEPTH ? n - base : ESHELL_IO_DEPTH;
+
+    // Every read of the window goes in one submission
+    for (i = 0; i < count; i++) {
+      eshell_uring_queue(IORING_OP_READ_FIXED, chunks[base + i].fd, i,
+                         chunks[base + i].len, chunks[base + i].offset, 0);
+    }
+
+    if (!eshell_uring_complete(count, got)) {
+      return false;
+    }
+
+    // Then the writes, linked so they land in order
+    for (i = 0; i < count; i++) {
+      got[i] = got[i] > 0 ? got[i] : 0;
+      io.bytes += got[i];
+      eshell_uring_queue(IORING_OP_WRITE_FIXED, out, i, got[i], -1,
+                         i + 1 < count ? IOSQE_IO_LINK : 0);
+    }
+
+    if (!eshell_uring_complete(count, wrote)) {
+      return false;
+    }
+
+    // A short write cancels the rest of the chain, so finish those by hand
+    for (i = 0; i < count; i++) {
+      int w = wrote[i] > 0 ? wrote[i] : 0;
+
+      if (w < got[i] &&
+          !eshell_write_all(out, io.bufs + (size_t) i * ESHELL_IO_BUFSIZE + w,
+                            got[i] - w)) {
+        return false;
+      }
+    }
+  }
+
+  return true;
+}
+
+/**
+  @brief Pick the engine named by ESHELL_IO the first time I/O is done.
+*/
+void eshell_io_configure(void) {
+  const char *engine = getenv("ESHELL_IO");
+
+  if (!io.configured) {
+    eshell_io_select(engine && strcmp(engine, "uring") == 0 ?
+                     ESHELL_IO_URING : ESHELL_IO_SYNC);
+  }
+}
+
+/**
+  @brief        Copy chunks through whichever engine is selected.
+  @param chunks Chunks to copy, in output order; none longer than a buffer.
+  @param n      Number of chunks.
+  @param out    Output descriptor.
+  @return       True if everything was copied.
+*/
+bool eshell_io_copy(const struct eshell_io_chunk *chunks, int n, int out) {
+  eshell_io_configure();
+
+  if (io.engine == ESHELL_IO_URING) {
+    return eshell_io_copy_uring(chunks, n, out);
+  }
+
+  return eshell_io_copy_sync(chunks, n, out);
+}
+
+/**
+  @brief       Copy whole files to an output descriptor.
+  @param  fds  Open files, in output order.
+  @param  n    Number of files.
+  @param  out  Output descriptor.
+  @return      True if everything was copied.
+*/
+bool eshell_io_cat(const int *fds, int n, int out) {
+  struct eshell_io_chunk *chunks = NULL;
+  int num_chunks = 0;
+  int capacity = 0;
+  bool ok = true;
+  int i;
+
+  for (i = 0; i < n && ok; i++) {
+    struct stat st;
+    off_t offset;
+
+    // Pipes and terminals have no size to plan with, so stream them
+    if (fstat(fds[i], &st) != 0 || !S_ISREG(st.st_mode)) {
+      char buf[16384];
+      ssize_t got;
+
+      ok = eshell_io_copy(chunks, num_chunks, out);
+      num_chunks = 0;
+
+      while (ok && ((got = read(fds[i], buf, sizeof(buf))) > 0 ||
+                    (got < 0 && errno == EINTR))) {
+        ok = got < 0 || eshell_write_all(out, buf, got);
+      }
+
+      continue;
+    }
+
+    // Regular files are planned as buffer-sized chunks across all the files
+    for (offset = 0; offset < st.st_size; offset += ESHELL_IO_BUFSIZE) {
+      if (num_chunks >= capacity) {
+        capacity = capacity ? capacity * 2 : 64;
+        chunks = realloc(chunks, capacity * sizeof(struct eshell_io_chunk));
+
+        if (!chunks) {
+          fprintf(stderr, "eshell: allocation error\n");
+
+          exit(EXIT_FAILURE);
+        }
+      }
+
+      chunks[num_chunks].fd = fds[i];
+      chunks[num_chunks].offset = offset;
+      chunks[num_chunks].len = st.st_size - offset < ESHELL_IO_BUFSIZE ?
+                               st.st_size - offset : ESHELL_IO_BUFSIZE;
+      num_chunks++;
+    }
+  }
+
+  ok = ok && eshell_io_copy(chunks, num_chunks, out);
+  free(chunks);
+
+  return ok;
+}
+
+/**
+  @brief       Check that cat has only files to copy.
+  @param  args Its arguments.
+  @return      True if there are no options.
+*/
+bool eshell_cat_plain(char **args) {
+  int i;
+
+  for (i = 1; args[i]; i++) {
+    if (args[i][0] == '-' && args[i][1] != '\0') {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/**
+  @brief       Concatenate files to stdout. Options are left to the real cat.
+  @param  args List of arguments: "cat [FILE...]", where "-" is stdin.
+  @return      Always return 1 to continue executing the shell.
+*/
+int eshell_cat(char **args) {
+  int *fds;
+  int n = 0;
+  int i;
+
+  if (!eshell_cat_plain(args)) {
+    return eshell_builtin_external(args);
+  }
+
+  for (i = 1; args[i]; i++);
+
+  fds = malloc((i > 1 ? i : 2) * sizeof(int));
+
+  if (!fds) {
+    fprintf(stderr, "eshell: allocation error\n");
+
+    exit(EXIT_FAILURE);
+  }
+
+  if (args[1] == NULL) {
+    fds[n++] = eshell_in_fd;
+  }
+
+  for (i = 1; args[i]; i++) {
+    if (strcmp(args[i], "-") == 0) {
+      fds[n++] = eshell_in_fd;
+    } else if ((fds[n] = open(args[i], O_RDONLY | O_CLOEXEC)) >= 0) {
+      n++;
+    } else {
+      fprintf(stderr, "eshell: cat: %s: %s\n", args[i], strerror(errno));
+      eshell_status = 1;
+    }
+  }
+
+  fflush(stdout);
+
+  // Workers simply copy through a buffer; the engines are the main thread's
+  if (eshell_worker || eshell_capture) {
+    for (i = 0; i < n; i++) {
+      char buf[16384];
+      ssize_t got;
+
+      while ((got = read(fds[i], buf, sizeof(buf))) > 0 ||
+             (got < 0 && errno == EINTR)) {
+        if (got > 0 && !eshell_out_write(buf, got)) {
+          break;
+        }
+      }
+    }
+  } else if (!eshell_io_cat(fds, n, eshell_out_fd)) {
+    perror("eshell: cat");
+    eshell_status = 1;
+  }
+
+  for (i = 0; i < n; i++) {
+    if (fds[i] != eshell_in_fd) {
+      close(fds[i]);
+    }
+  }
+
+  free(fds);
+
+  return 1;
+}
+
+/**
+  @brief       Show or select the file I/O engine.
+  @param  args List of arguments: "io [sync|uring]".
+  @return      Always return 1 to continue executing the shell.
+*/
+int eshell_io_builtin(char **args) {
+  if (args[1] != NULL) {
+    if (strcmp(args[1], "uring") == 0) {
+      if (eshell_io_select(ESHELL_IO_URING) != ESHELL_IO_URING) {
+        fprintf(stderr, "eshell: io: io_uring is unavailable, using sync\n");
+      }
+    } else if (strcmp(args[1], "sync") == 0) {
+      eshell_io_select(ESHELL_IO_SYNC);
+    } else {
+      fprintf(stderr, "eshell: usage: io [sync|uring]\n");
+    }
+
+    return 1;
+  }
+
+  eshell_io_configure();
+  printf("%s\n", io.engine == ESHELL_IO_URING ? "uring" : "sync");
+
+  return 1;
+}
+/*
+  Text tools: cut, tr, uniq and csv, done in the shell so that a pipeline of
+  them costs no fork or exec. Input is read in large blocks and each tool is
+  handed as many whole lines (for csv, whole records) as a block holds, with
+  field and line boundaries found sixteen bytes at a time. Options a tool
+  doesn't know are left to the program of the same name.
+*/
+#define ESHELL_TEXT_BUFSIZE (1024 * 1024)
+#define ESHELL_TEXT_FLUSH   (64 * 1024)
+#define ESHELL_TEXT_RANGES  32
+
+/*
+  A tool's block function. It is given bytes ending in a newline (unless the
+  tool works on bytes rather than lines) and returns how many it used; the
+  rest are handed back with more input after them. At the end of the input
+  it must use everything.
+*/
+typedef size_t (*eshell_text_fn)(void *tool, char *p, size_t len, bool eof,
+                                 struct eshell_buffer *out);
+
+struct eshell_text_stats {
+  unsigned long runs;
+  unsigned long bytes;
+} text;
+
+/**
+  @brief     Find the first of up to three bytes.
+  @param p   Where to start.
+  @param end Where to stop.
+  @param a   A byte to look for.
+  @param b   Another, or a again.
+  @param c   Another, or a again.
+  @return    The first one found, or end.
+*/
+const char *eshell_text_scan(const char *p, const char *end, char a, char b,
+                             char c) {
+#ifdef __SSE2__
+  // Compare sixteen bytes against each byte and take the first set bit
+  const __m128i va = _mm_set1_epi8(a);
+  const __m128i vb = _mm_set1_epi8(b);
+  const __m128i vc = _mm_set1_epi8(c);
+
+  for (; p + 16 <= end; p += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *) p);
+    unsigned mask = _mm_movemask_epi8(
+        _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, va), _mm_cmpeq_epi8(v, vb)),
+                     _mm_cmpeq_epi8(v, vc)));
+
+    if (mask) {
+      return p + __builtin_ctz(mask);
+    }
+  }
+#endif
+
+  for (; p < end; p++) {
+    if (*p == a || *p == b || *p == c) {
+      return p;
+    }
+  }
+
+  return end;
+}
+
+/**
+  @brief       Run a tool over its files, or the builtin's standard input.
+  @param  name  The tool, for messages.
+  @param  files Files to read, NULL-terminated; none means standard input
+                  and "-" stands for it.
+  @param  lines The tool works on lines, so a last line without a newline
+                  gets one.
+  @param  fn    The tool's block function.
+  @param  tool  Its state.
+  @return       Always return 1 to continue executing the shell.
+*/
+int eshell_text_run(const char *name, char **files, bool lines,
+                    eshell_text_fn fn, void *tool) {
+  struct eshell_buffer out = { 0 };
+  char *stdin_only[] = { "-", NULL };
+  size_t capacity = ESHELL_TEXT_BUFSIZE;
+  char *buf = malloc(capacity);
+  unsigned long bytes = 0;
+  bool ok = true;
+  int i;
+
+  if (!buf) {
+    fprintf(stderr, "eshell: allocation error\n");
+
+    exit(EXIT_FAILURE);
+  }
+
+  if (files[0] == NULL) {
+    files = stdin_only;
+  }
+
+  // The shell's own reading may be ahead of standard input
+  if (!eshell_worker) {
+    eshell_fdbuf_sync(eshell_in_fd);
+  }
+
+  for (i = 0; files[i] && ok; i++) {
+    bool std = strcmp(files[i], "-") == 0;
+    int fd = std ? eshell_in_fd : open(files[i], O_RDONLY | O_CLOEXEC);
+    size_t len = 0;
+    size_t used;
+    ssize_t n;
+
+    if (fd < 0) {
+      fprintf(stderr, "eshell: %s: %s: %s\n", name, files[i],
+              strerror(errno));
+      eshell_status = 1;
+
+      continue;
+    }
+
+    for (;;) {
+      // Keep a byte spare for a missing last newline
+      if (len + 1 >= capacity) {
+        capacity *= 2;
+
+        if ((buf = realloc(buf, capacity)) == NULL) {
+          fprintf(stderr, "eshell: allocation error\n");
+
+          exit(EXIT_FAILURE);
+        }
+      }
+
+      n = read(fd, buf + len, capacity - len - 1);
+
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+
+      if (n < 0) {
+        fprintf(stderr, "eshell: %s: %s: %s\n", name, std ? "-" : files[i],
+                strerror(errno));
+        eshell_status = 1;
+      }
+
+      if (n <= 0) {
+        if (lines && len > 0 && buf[len - 1] != '\n') {
+          buf[len++] = '\n';
+        }
+
+        fn(tool, buf, len, true, &out);
+
+        break;
+      }
+
+      len += n;
+      bytes += n;
+      used = fn(tool, buf, len, false, &out);
+      memmove(buf, buf + used, len - used);
+      len -= used;
+
+      // A reader that has gone away ends the tool, like SIGPIPE would
+      if (out.len >= ESHELL_TEXT_FLUSH) {
+        ok = eshell_out_write(out.data, out.len);
+        out.len = 0;
+
+        if (!ok) {
+          break;
+        }
+      }
+    }
+
+    if (!std) {
+      close(fd);
+    }
+  }
+
+  if (ok && out.len > 0 && !eshell_out_write(out.data, out.len)) {
+    ok = false;
+  }
+
+  if (!ok) {
+    eshell_status = 1;
+  }
+
+  // Pipeline stages run on threads
+  __atomic_fetch_add(&text.runs, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&text.bytes, bytes, __ATOMIC_RELAXED);
+  free(out.data);
+  free(buf);
+
+  return 1;
+}
+
+/**
+  @brief        Parse a list of positions like `1,3-5,7-` into sorted ranges,
+                  merging any that overlap.
+  @param  list  The list.
+  @param  lo    Receives the first position of each range.
+  @param  hi    Receives the last, SIZE_MAX for an open end.
+  @return       The number of ranges, or 0 if the list is bad.
+*/
+int eshell_text_ranges(const char *list, size_t *lo, size_t *hi) {
+  int n = 0;
+  int i, j;
+
+  while (*list) {
+    char *end;
+
+    if (n == ESHELL_TEXT_RANGES) {
+      return 0;
+    }
+
+    // N, N-M, N- or -M
+    lo[n] = *list == '-' ? 1 : strtoul(list, &end, 10);
+
+    if (*list != '-') {
+      if (end == list || lo[n] == 0) {
+        return 0;
+      }
+
+      list = end;
+    }
+
+    hi[n] = lo[n];
+
+    if (*list == '-') {
+      list++;
+      hi[n] = *list >= '0' && *list <= '9' ? strtoul(list, &end, 10) :
+              SIZE_MAX;
+
+      if (hi[n] != SIZE_MAX) {
+        list = end;
+      }
+
+      if (hi[n] < lo[n]) {
+        return 0;
+      }
+    }
+
+    if (*list == ',') {
+      list++;
+    } else if (*list != '\0') {
+      return 0;
+    }
+
+    n++;
+  }
+
+  // Insertion sort; there are only a few
+  for (i = 1; i < n; i++) {
+    size_t l = lo[i];
+    size_t h = hi[i];
+
+    for (j = i; j > 0 && lo[j - 1] > l; j--) {
+      lo[j] = lo[j - 1];
+      hi[j] = hi[j - 1];
+    }
+
+    lo[j] = l;
+    hi[j] = h;
+  }
+
+  for (i = j = 0; i < n; i++) {
+    if (j > 0 && lo[i] <= hi[j - 1] + 1 && hi[j - 1] != SIZE_MAX) {
+      hi[j - 1] = hi[i] > hi[j - 1] ? hi[i] : hi[j - 1];
+    } else if (j == 0 || hi[j - 1] != SIZE_MAX) {
+      lo[j] = lo[i];
+      hi[j++] = hi[i];
+    }
+  }
+
+  return j;
+}
+
+/*
+  cut: -f fields (split on -d, a tab by default, with -s dropping lines
+  that have none) or -b/-c byte positions.
+*/
+struct eshell_cut {
+  char delim;
+  bool fields;
+  bool only_delimited;
+  size_t lo[ESHELL_TEXT_RANGES];
+  size_t hi[ESHELL_TEXT_RANGES];
+  int num_ranges;
+  int files;                        // Where the files start in the args
+};
+
+/**
+  @brief       Parse cut's options.
+  @param  args The command.
+  @param  c    Receives them.
+  @return      False if there's anything cut should do instead.
+*/
+bool eshell_cut_parse(char **args, struct eshell_cut *c) {
+  const char *list = NULL;
+  bool delim = false;
+  int i;
+
+  memset(c, 0, sizeof(struct eshell_cut));
+  c->delim = '\t';
+
+  for (i = 1; args[i] && args[i][0] == '-' && args[i][1] != '\0'; i++) {
+    char opt = args[i][1];
+    const char *value = args[i][2] ? args[i] + 2 : args[i + 1];
+
+    if (strcmp(args[i], "--") == 0) {
+      i++;
+
+      break;
+    }
+
+    if (opt == 's' && args[i][2] == '\0') {
+      c->only_delimited = true;
+
+      continue;
+    }
+
+    if (strchr("dfbc", opt) == NULL || value == NULL || list != NULL ||
+        (opt == 'd' && (delim || strlen(value) != 1))) {
+      return false;
+    }
+
+    if (args[i][2] == '\0') {
+      i++;
+    }
+
+    if (opt == 'd') {
+      c->delim = value[0];
+      delim = true;
+    } else {
+      list = value;
+      c->fields = opt == 'f';
+    }
+  }
+
+  c->files = i;
+
+  // Delimiters only mean something for fields
+  return list != NULL && (c->fields || (!delim && !c->only_delimited)) &&
+         (c->num_ranges = eshell_text_ranges(list, c->lo, c->hi)) > 0;
+}
+
+/**
+  @brief Block function for cut.
+*/
+size_t eshell_cut_block(void *tool, char *p, size_t len, bool eof,
+                        struct eshell_buffer *out) {
+  struct eshell_cut *c = tool;
+  const char *line = p;
+  const char *end;
+  const char *last = len ? memrchr(p, '\n', len) : NULL;
+
+  if (last == NULL) {
+    return 0;
+  }
+
+  end = last + 1;
+
+  while (line < end) {
+    const char *nl;
+    const char *f = line;
+    const char *s;
+    size_t k = 1;
+    bool any = false;
+    int r = 0;
+
+    if (!c->fields) {
+      nl = memchr(line, '\n', end - line);
+
+      // Each range of bytes that the line reaches
+      for (r = 0; r < c->num_ranges && c->lo[r] <= (size_t) (nl - line); r++) {
+        size_t stop = c->hi[r] < (size_t) (nl - line) ? c->hi[r] :
+                      (size_t) (nl - line);
+
+        eshell_buffer_append(out, line + c->lo[r] - 1, stop - c->lo[r] + 1);
+      }
+
+      *eshell_buffer_reserve(out, 1) = '\n';
+      out->len++;
+      line = nl + 1;
+
+      continue;
+    }
+
+    s = eshell_text_scan(f, end, c->delim, '\n', '\n');
+
+    // A line without the delimiter is passed through, or dropped with -s
+    if (*s == '\n') {
+      if (!c->only_delimited) {
+        eshell_buffer_append(out, line, s - line + 1);
+      }
+
+      line = s + 1;
+
+      continue;
+    }
+
+    for (;;) {
+      while (r < c->num_ranges && c->hi[r] < k) {
+        r++;
+      }
+
+      if (r < c->num_ranges && c->lo[r] <= k) {
+        char *o = eshell_buffer_reserve(out, s - f + 1);
+
+        if (any) {
+          *o++ = c->delim;
+          out->len++;
+        }
+
+        memcpy(o, f, s - f);
+        out->len += s - f;
+        any = true;
+      }
+
+      if (*s == '\n') {
+        break;
+      }
+
+      // Past the last range the rest of the line can be skipped
+      if (r == c->num_ranges) {
+        s = memchr(s, '\n', end - s);
+
+        break;
+      }
+
+      f = s + 1;
+      k++;
+      s = eshell_text_scan(f, end, c->delim, '\n', '\n');
+    }
+
+    *eshell_buffer_reserve(out, 1) = '\n';
+    out->len++;
+    line = s + 1;
+  }
+
+  return end - p;
+}
+
+/**
+  @brief       Builtin command: select fields or bytes from each line.
+  @param  args `cut -f LIST [-d DELIM] [-s] [FILE...]` or `cut -b LIST
+                 [FILE...]` (-c is taken to mean bytes); anything else is
+                 left to cut itself.
+  @return      Always return 1 to continue executing the shell.
+*/
+int eshell_cut(char **args) {
+  struct eshell_cut c;
+
+  if (!eshell_cut_parse(args, &c)) {
+    return eshell_builtin_external(args);
+  }
+
+  return eshell_text_run("cut", args + c.files, true, eshell_cut_block, &c);
+}
+
+/*
+  tr: translate bytes of SET1 to SET2, delete SET1 (-d), and squeeze runs of
+  a byte from the last set given (-s).
+*/
+struct eshell_tr {
+  unsigned char map[256];
+  bool del[256];
+  bool squeeze[256];
+  char dels[3];                     // The bytes deleted, if three or fewer
+  int num_dels;
+  bool squeezing;
+  int last;                         // Last byte written, for squeezing
+};
+
+/**
+  @brief       Expand a set like `a-z`, `[:upper:]` or `\n` into its bytes.
+  @param  set  The set as written.
+  @param  out  Receives the bytes, room for 256 at most.
+  @return      How many there are, or -1 if tr should handle it.
+*/
+int eshell_tr_set(const char *set, unsigned char *out) {
+  static const struct {
+    const char *name;
+    const char *ranges;             // Pairs of first and last byte
+  } classes[] = {
+    { "[:upper:]", "AZ" },
+    { "[:lower:]", "az" },
+    { "[:digit:]", "09" },
+    { "[:alpha:]", "AZaz" },
+    { "[:alnum:]", "09AZaz" },
+    { "[:space:]", "\t\r  " },
+    { "[:blank:]", "\t\t  " },
+    { "[:punct:]", "!/:@[`{~" },
+  };
+  int n = 0;
+  int c;
+  size_t k;
+
+  while (*set) {
+    for (k = 0; k < sizeof(classes) / sizeof(classes[0]); k++) {
+      if (strncmp(set, classes[k].name, strlen(classes[k].name)) == 0) {
+        const char *r;
+
+        for (r = classes[k].ranges; *r; r += 2) {
+          for (c = (unsigned char) r[0]; c <= (unsigned char) r[1]; c++) {
+            if (n == 256) {
+              return -1;
+            }
+
+            out[n++] = c;
+          }
+        }
+
+        set += strlen(classes[k].name);
+
+        break;
+      }
+    }
+
+    if (k < sizeof(classes) / sizeof(classes[0])) {
+      continue;
+    }
+
+    // Other bracket forms, like [=c=] or [c*n], are tr's
+    if (*set == '[' && (set[1] == ':' || set[1] == '=' ||
+                        strchr(set, '*') != NULL)) {
+      return -1;
+    }
+
+    c = (unsigned char) *set++;
+
+    if (c == '\\' && *set) {
+      const char *esc = strchr("n\nt\tr\r\\\\", *set);
+
+      if (esc == NULL || (esc - "n\nt\tr\r\\\\") % 2 != 0) {
+        return -1;
+      }
+
+      c = (unsigned char) esc[1];
+      set++;
+    }
+
+    // A range runs to the byte after the dash
+    if (set[0] == '-' && set[1] != '\0') {
+      int last = (unsigned char) set[1];
+
+      if (last < c || set[1] == '\\') {
+        return -1;
+      }
+
+      for (; c <= last; c++) {
+        if (n == 256) {
+          return -1;
+        }
+
+        out[n++] = c;
+      }
+
+      set += 2;
+
+      continue;
+    }
+
+    if (n == 256) {
+      return -1;
+    }
+
+    out[n++] = c;
+  }
+
+  return n;
+}
+
+/**
+  @brief       Parse tr's options and sets.
+  @param  args The command.
+  @param  t    Receives them.
+  @return      False if there's anything tr should do instead.
+*/
+bool eshell_tr_parse(char **args, struct eshell_tr *t) {
+  unsigned char one[256];
+  unsigned char two[256];
+  bool del = false;
+  bool squeeze = false;
+  int n1, n2 = 0;
+  int i, k;
+
+  memset(t, 0, sizeof(struct eshell_tr));
+  t->last = -1;
+
+  for (i = 1; args[i] && args[i][0] == '-' && args[i][1] != '\0'; i++) {
+    for (k = 1; args[i][k]; k++) {
+      if (args[i][k] == 'd') {
+        del = true;
+      } else if (args[i][k] == 's') {
+        squeeze = true;
+      } else {
+        return false;
+      }
+    }
+  }
+
+  // SET1, and SET2 to translate to (or, with -d -s, to squeeze)
+  if (args[i] == NULL || (args[i + 1] && args[i + 2]) ||
+      (del && !squeeze && args[i + 1]) || (!del && !squeeze && !args[i + 1]) ||
+      (n1 = eshell_tr_set(args[i], one)) < 0 ||
+      (args[i + 1] && ((n2 = eshell_tr_set(args[i + 1], two)) <= 0))) {
+    return false;
+  }
+
+  for (k = 0; k < 256; k++) {
+    t->map[k] = k;
+  }
+
+  for (k = 0; k < n1; k++) {
+    if (del) {
+      if (!t->del[one[k]] && t->num_dels < 3) {
+        t->dels[t->num_dels] = one[k];
+      }
+
+      t->num_dels += !t->del[one[k]];
+      t->del[one[k]] = true;
+    } else if (args[i + 1]) {
+      // A short SET2 is padded with its last byte
+      t->map[one[k]] = two[k < n2 ? k : n2 - 1];
+    }
+  }
+
+  if ((t->squeezing = squeeze)) {
+    const unsigned char *set = args[i + 1] ? two : one;
+    int n = args[i + 1] ? n2 : n1;
+
+    for (k = 0; k < n; k++) {
+      t->squeeze[set[k]] = true;
+    }
+  }
+
+  return true;
+}
+
+/**
+  @brief Block function for tr.
+*/
+size_t eshell_tr_block(void *tool, char *p, size_t len, bool eof,
+                       struct eshell_buffer *out) {
+  struct eshell_tr *t = tool;
+  const char *end = p + len;
+  unsigned char *o = (unsigned char *) eshell_buffer_reserve(out, len);
+  unsigned char *start = o;
+  size_t i;
+
+  if (t->num_dels == 0 && !t->squeezing) {
+    // Plain translation
+    for (i = 0; i < len; i++) {
+      o[i] = t->map[(unsigned char) p[i]];
+    }
+
+    o += len;
+  } else if (t->num_dels > 0 && t->num_dels <= 3) {
+    const char *q = p;
+
+    // Few bytes to delete: copy the runs between them
+    while (q < end) {
+      const char *hit = eshell_text_scan(q, end, t->dels[0],
+                                         t->dels[t->num_dels > 1],
+                                         t->dels[t->num_dels - 1]);
+
+      for (; q < hit; q++) {
+        unsigned char b = t->map[(unsigned char) *q];
+
+        if (!t->squeeze[b] || b != t->last) {
+          *o++ = b;
+        }
+
+        t->last = b;
+      }
+
+      q = hit + 1;
+    }
+  } else {
+    for (i = 0; i < len; i++) {
+      unsigned char b = (unsigned char) p[i];
+
+      if (t->del[b]) {
+        continue;
+      }
+
+      b = t->map[b];
+
+      if (!t->squeeze[b] || b != t->last) {
+        *o++ = b;
+      }
+
+      t->last = b;
+    }
+  }
+
+  out->len += o - start;
+
+  return len;
+}
+
+/**
+  @brief       Builtin command: translate, delete or squeeze bytes.
+  @param  args `tr [-d] [-s] SET1 [SET2]`, reading standard input; sets may
+                 have ranges, `[:class:]` names and \n, \t, \r and \\. Anything
+                 else is left to tr itself.
+  @return      Always return 1 to continue executing the shell.
+*/
+int eshell_tr(char **args) {
+  struct eshell_tr t;
+  char *none[] = { NULL };
+
+  if (!eshell_tr_parse(args, &t)) {
+    return eshell_builtin_external(args);
+  }
+
+  return eshell_text_run("tr", none, false, eshell_tr_block, &t);
+}
+
+/*
+  uniq: collapse runs of equal lines, optionally counting them (-c) or only
+  printing repeated (-d) or unrepeated (-u) ones. The line a run started
+  with is kept where it is in the block, and only copied when the block
+  moves on.
+*/
+struct eshell_uniq {
+  bool count;
+  bool repeated;
+  bool unique;
+  int files;
+  const char *prev;                 // First line of the current run
+  size_t prev_len;                  // With its newline
+  unsigned long run;
+  struct eshell_buffer saved;       // prev, once its block is gone
+};
+
+/**
+  @brief       Parse uniq's options.
+  @param  args The command.
+  @param  u    Receives them.
+  @return      False if there's anything uniq should do instead.
+*/
+bool eshell_uniq_parse(char **args, struct eshell_uniq *u) {
+  int i, k;
+
+  memset(u, 0, sizeof(struct eshell_uniq));
+
+  for (i = 1; args[i] && args[i][0] == '-' && args[i][1] != '\0'; i++) {
+    for (k = 1; args[i][k]; k++) {
+      if (args[i][k] == 'c') {
+        u->count = true;
+      } else if (args[i][k] == 'd') {
+        u->repeated = true;
+      } else if (args[i][k] == 'u') {
+        u->unique = true;
+      } else {
+        return false;
+      }
+    }
+  }
+
+  // One input; an output file is uniq's
+  u->files = i;
+
+  return args[i] == NULL || args[i + 1] == NULL;
+}
+
+/**
+  @brief   Print the current run.
+  @param u The tool.
+  @param out Where to.
+*/
+void eshell_uniq_emit(struct eshell_uniq *u, struct eshell_buffer *out) {
+  char num[24];
+  char *d = num + sizeof(num);
+  unsigned long n = u->run;
+
+  if (u->run == 0 || (u->repeated && u->run < 2) ||
+      (u->unique && u->run > 1)) {
+    return;
+  }
+
+  // The count as "%7lu ", without going through printf for every line
+  if (u->count) {
+    *--d = ' ';
+
+    do {
+      *--d = '0' + n % 10;
+      n /= 10;
+    } while (n);
+
+    while (d > num + sizeof(num) - 8) {
+      *--d = ' ';
+    }
+
+    eshell_buffer_append(out, d, num + sizeof(num) - d);
+  }
+
+  eshell_buffer_append(out, u->prev, u->prev_len);
+}
+
+/**
+  @brief Block function for uniq.
+*/
+size_t eshell_uniq_block(void *tool, char *p, size_t len, bool eof,
+                         struct eshell_buffer *out) {
+  struct eshell_uniq *u = tool;
+  const char *line = p;
+  const char *end = p + len;
+  const char *nl;
+
+  while (line < end && (nl = memchr(line, '\n', end - line)) != NULL) {
+    size_t n = nl + 1 - line;
+
+    if (u->run > 0 && n == u->prev_len && memcmp(line, u->prev, n) == 0) {
+      u->run++;
+    } else {
+      eshell_uniq_emit(u, out);
+      u->prev = line;
+      u->prev_len = n;
+      u->run = 1;
+    }
+
+    line = nl + 1;
+  }
+
+  if (eof) {
+    eshell_uniq_emit(u, out);
+    u->run = 0;
+  } else if (u->run > 0 && u->prev != u->saved.data) {
+    // The block is about to be reused
+    u->saved.len = 0;
+    eshell_buffer_append(&u->saved, u->prev, u->prev_len);
+    u->prev = u->saved.data;
+  }
+
+  return line - p;
+}
+
+/**
+  @brief       Builtin command: collapse repeated lines.
+  @param  args `uniq [-c] [-d] [-u] [FILE]`; anything else is left to uniq
+                 itself.
+  @return      Always return 1 to continue executing the shell.
+*/
+int eshell_uniq(char **args) {
+  struct eshell_uniq u;
+  int status;
+
+  if (!eshell_uniq_parse(args, &u)) {
+    return eshell_builtin_external(args);
+  }
+
+  status = eshell_text_run("uniq", args + u.files, true, eshell_uniq_block,
+                           &u);
+  free(u.saved.data);
+
+  return status;
+}
+
+/*
+  csv: pick fields out of CSV records. A field in double quotes may hold the
+  delimiter, newlines and doubled quotes; it is copied as it is, quotes and
+  all, so the output is CSV too.
+*/
+struct eshell_csv {
+  char delim;
+  size_t lo[ESHELL_TEXT_RANGES];
+  size_t hi[ESHELL_TEXT_RANGES];
+  int num_ranges;
+  int files;
+};
+
+/**
+  @brief       Parse csv's options.
+  @param  args The command.
+  @param  c    Receives them.
+  @return      False if they don't make sense.
+*/
+bool eshell_csv_parse(char **args, struct eshell_csv *c) {
+  int i;
+
+  memset(c, 0, sizeof(struct eshell_csv));
+  c->delim = ',';
+
+  for (i = 1; args[i] && args[i][0] == '-' && args[i][1] != '\0'; i++) {
+    const char *value = args[i][2] ? args[i] + 2 : args[i + 1];
+
+    if (value == NULL) {
+      return false;
+    }
+
+    if (args[i][1] == 'd' && strlen(value) == 1 && value[0] != '"' &&
+        value[0] != '\n') {
+      c->delim = value[0];
+    } else if (args[i][1] == 'f') {
+      if ((c->num_ranges = eshell_text_ranges(value, c->lo, c->hi)) == 0) {
+        return false;
+      }
+    } else {
+      return false;
+    }
+
+    if (args[i][2] == '\0') {
+      i++;
+    }
+  }
+
+  c->files = i;
+
+  return c->num_ranges > 0;
+}
+
+/**
+  @brief Block function for csv.
+*/
+size_t eshell_csv_block(void *tool, char *p, size_t len, bool eof,
+                        struct eshell_buffer *out) {
+  struct eshell_csv *c = tool;
+  const char *end = p + len;
+  const char *rec = p;
+
+  while (rec < end) {
+    size_t mark = out->len;
+    const char *f = rec;
+    const char *s;
+    size_t k = 1;
+    bool any = false;
+    int r = 0;
+
+    for (;;) {
+      const char *stop;
+
+      // A quoted field runs to a quote that isn't doubled
+      if (f < end && *f == '"') {
+        s = f + 1;
+
+        while ((s = eshell_text_scan(s, end, '"', '"', '"')) + 1 < end &&
+               s[1] == '"') {
+          s += 2;
+        }
+
+        if (s + 1 >= end) {
+          // The record isn't all here yet
+          if (!eof) {
+            out->len = mark;
+
+            return rec - p;
+          }
+
+          s = end - 1;
+        }
+
+        s = eshell_text_scan(s + 1, end, c->delim, '\n', '\n');
+      } else {
+        s = eshell_text_scan(f, end, c->delim, '\n', '\n');
+      }
+
+      if (s == end) {
+        if (!eof) {
+          out->len = mark;
+
+          return rec - p;
+        }
+
+        s = end - 1;
+      }
+
+      // A CRLF record ending isn't part of the last field
+      stop = *s == '\n' && s > f && s[-1] == '\r' ? s - 1 : s;
+
+      while (r < c->num_ranges && c->hi[r] < k) {
+        r++;
+      }
+
+      if (r < c->num_ranges && c->lo[r] <= k) {
+        char *o = eshell_buffer_reserve(out, stop - f + 1);
+
+        if (any) {
+          *o++ = c->delim;
+          out->len++;
+        }
+
+        memcpy(o, f, stop - f);
+        out->len += stop - f;
+        any = true;
+      }
+
+      if (*s == '\n' || (eof && s + 1 >= end)) {
+        break;
+      }
+
+      // A delimiter at the very end; the next field isn't here yet
+      if (s + 1 >= end) {
+        out->len = mark;
+
+        return rec - p;
+      }
+
+      f = s + 1;
+      k++;
+    }
+
+    *eshell_buffer_reserve(out, 1) = '\n';
+    out->len++;
+    rec = s + 1;
+  }
+
+  return rec - p;
+}
+
+/**
+  @brief       Builtin command: select fields from CSV records.
+  @param  args `csv -f LIST [-d DELIM] [FILE...]`, with a comma as the
+                 default delimiter.
+  @return      Always return 1 to continue executing the shell.
+*/
+int eshell_csv(char **args) {
+  struct eshell_csv c;
+
+  if (!eshell_csv_parse(args, &c)) {
+    fprintf(stderr, "eshell: usage: csv -f LIST [-d DELIM] [FILE...]\n");
+    eshell_status = 2;
+
+    return 1;
+  }
+
+  return eshell_text_run("csv", args + c.files, true, eshell_csv_block, &c);
+}
+
+/*
+  json: pull values out of newline-delimited JSON, in two stages the way
+  simdjson does. The first finds every structural character ({}[]:, and the
+  quotes), sixty-four bytes at a time: compares give bitmasks of quotes,
+  backslashes and operators, escaped quotes are dropped with carry
+  arithmetic on runs of backslashes, a prefix XOR of the quotes masks out
+  everything inside strings, and what's left is flattened into an index of
+  positions. The second walks the index along each path without looking at
+  the bytes in between. A block of records is cut into chunks at newlines,
+  which can't be inside a string, and the chunks are indexed and walked on
+  threads of their own.
+*/
+#define ESHELL_JSON_PATHS  16
+#define ESHELL_JSON_DEPTH  16
+#define ESHELL_JSON_JOBS   64
+#define ESHELL_JSON_CHUNK  (64 * 1024)  // Smallest chunk worth a thread
+
+struct eshell_json_part {
+  const char *key;                  // NULL for an array index
+  size_t key_len;
+  long index;
+};
+
+struct eshell_json_path {
+  struct eshell_json_part parts[ESHELL_JSON_DEPTH];
+  int num_parts;
+};
+
+struct eshell_json_chunk {
+  const struct eshell_json *json;
+  const char *p;
+  size_t len;
+  uint32_t *index;
+  size_t index_capacity;
+  unsigned long records;
+  struct eshell_buffer out;
+  pthread_t thread;
+};
+
+struct eshell_json {
+  struct eshell_json_path paths[ESHELL_JSON_PATHS];
+  int num_paths;
+  int jobs;
+  int files;
+  struct eshell_json_chunk chunks[ESHELL_JSON_JOBS];
+};
+
+struct eshell_json_stats {
+  unsigned long records;
+  unsigned long chunks;             // Run on threads of their own
+} json;
+
+/**
+  @brief      Classify sixty-four bytes.
+  @param b    The bytes.
+  @param quote     Receives a bit for each double quote.
+  @param backslash Receives a bit for each backslash.
+  @param op        Receives a bit for each of {}[]:, and newline.
+*/
+void eshell_json_classify(const char *b, uint64_t *quote, uint64_t *backslash,
+                          uint64_t *op) {
+  int j;
+
+  *quote = *backslash = *op = 0;
+
+#ifdef __SSE2__
+  // Setting bit 5 turns [ and ] into { and }, so two compares cover four
+  for (j = 0; j < 64; j += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *) (b + j));
+    __m128i folded = _mm_or_si128(v, _mm_set1_epi8(0x20));
+    __m128i ops = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(folded, _mm_set1_epi8('{')),
+                     _mm_cmpeq_epi8(folded, _mm_set1_epi8('}'))),
+        _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(':')),
+                         _mm_cmpeq_epi8(v, _mm_set1_epi8(','))),
+            _mm_cmpeq_epi8(v, _mm_set1_epi8('\n'))));
+
+    *quote |= (uint64_t) (unsigned) _mm_movemask_epi8(
+        _mm_cmpeq_epi8(v, _mm_set1_epi8('"'))) << j;
+    *backslash |= (uint64_t) (unsigned) _mm_movemask_epi8(
+        _mm_cmpeq_epi8(v, _mm_set1_epi8('\\'))) << j;
+    *op |= (uint64_t) (unsigned) _mm_movemask_epi8(ops) << j;
+  }
+#else
+  for (j = 0; j < 64; j++) {
+    *quote |= (uint64_t) (b[j] == '"') << j;
+    *backslash |= (uint64_t) (b[j] == '\\') << j;
+    *op |= (uint64_t) (strchr("{}[]:,\n", b[j]) != NULL && b[j]) << j;
+  }
+#endif
+}
+
+/**
+  @brief     Stage one: index the structural characters of some records.
+  @param p   The records.
+  @param len Their length.
+  @param ix  Receives the positions, room for len of them.
+  @return    How many there are.
+*/
+size_t eshell_json_index(const char *p, size_t len, uint32_t *ix) {
+  const uint64_t even = 0x5555555555555555ULL;
+  uint64_t prev_escaped = 0;
+  uint64_t prev_in_string = 0;
+  size_t n = 0;
+  size_t i;
+
+  for (i = 0; i < len; i += 64) {
+    uint64_t quote, backslash, op, escaped, in_string, bits;
+    const char *b = p + i;
+    char tail[64];
+
+    if (len - i < 64) {
+      memset(tail, ' ', sizeof(tail));
+      memcpy(tail, b, len - i);
+      b = tail;
+    }
+
+    eshell_json_classify(b, &quote, &backslash, &op);
+
+    // A character is escaped if it follows an odd run of backslashes.
+    //   Adding the odd-position run starts to the backslashes carries
+    //   through each run and flips the parity of where it ends.
+    if (backslash == 0) {
+      escaped = prev_escaped;
+      prev_escaped = 0;
+    } else {
+      uint64_t follows, odd_starts, even_runs;
+
+      backslash &= ~prev_escaped;
+      follows = backslash << 1 | prev_escaped;
+      odd_starts = backslash & ~even & ~follows;
+      prev_escaped = __builtin_add_overflow(odd_starts, backslash, &even_runs);
+      escaped = (even ^ (even_runs << 1)) & follows;
+    }
+
+    // Each real quote toggles being in a string; a prefix XOR spreads that
+    quote &= ~escaped;
+    in_string = quote;
+    in_string ^= in_string << 1;
+    in_string ^= in_string << 2;
+    in_string ^= in_string << 4;
+    in_string ^= in_string << 8;
+    in_string ^= in_string << 16;
+    in_string ^= in_string << 32;
+    in_string ^= prev_in_string;
+    prev_in_string = (uint64_t) ((int64_t) in_string >> 63);
+
+    for (bits = (op & ~in_string) | quote; bits; bits &= bits - 1) {
+      ix[n++] = i + __builtin_ctzll(bits);
+    }
+  }
+
+  return n;
+}
+
+/**
+  @brief     Skip spaces, tabs and carriage returns.
+  @param s   Where to start.
+  @return    The first other byte.
+*/
+const char *eshell_json_space(const char *s) {
+  while (*s == ' ' || *s == '\t' || *s == '\r') {
+    s++;
+  }
+
+  return s;
+}
+
+/**
+  @brief     Skip over a value in the index.
+  @param p   The records.
+  @param ix  The index.
+  @param k   Index of the value's first structural at or after its start.
+  @param n   Where the record's index ends.
+  @return    Index of the first structural after the value.
+*/
+size_t eshell_json_skip(const char *p, const uint32_t *ix, size_t k,
+                        size_t n) {
+  int depth = 0;
+  char c;
+
+  if (k >= n) {
+    return n;
+  }
+
+  c = p[ix[k]];
+
+  if (c == '"') {
+    return k + 2;
+  }
+
+  // A scalar ends where the next structural is
+  if (c != '{' && c != '[') {
+    return k;
+  }
+
+  for (; k < n; k++) {
+    c = p[ix[k]];
+
+    if (c == '{' || c == '[') {
+      depth++;
+    } else if ((c == '}' || c == ']') && --depth == 0) {
+      return k + 1;
+    } else if (c == '"') {
+      k++;
+    }
+  }
+
+  return n;
+}
+
+/**
+  @brief       Append a string's contents with its escapes undone.
+  @param  s    Just after the opening quote.
+  @param  end  The closing quote.
+  @param  out  Where to.
+*/
+void eshell_json_unescape(const char *s, const char *end,
+                          struct eshell_buffer *out) {
+  while (s < end) {
+    const char *bs = memchr(s, '\\', end - s);
+    char *o;
+    unsigned long cp;
+
+    if (bs == NULL) {
+      eshell_buffer_append(out, s, end - s);
+
+      return;
+    }
+
+    eshell_buffer_append(out, s, bs - s);
+    s = bs + 2;
+
+    if (s > end) {
+      return;
+    }
+
+    switch (bs[1]) {
+      case 'b': cp = '\b'; break;
+      case 'f': cp = '\f'; break;
+      case 'n': cp = '\n'; break;
+      case 'r': cp = '\r'; break;
+      case 't': cp = '\t'; break;
+      case 'u':
+        if (end - s < 4) {
+          return;
+        }
+
+        cp = strtoul((char [5]) { s[0], s[1], s[2], s[3], 0 }, NULL, 16);
+        s += 4;
+
+        // A surrogate pair makes one code point
+        if (cp >= 0xD800 && cp < 0xDC00 && end - s >= 6 && s[0] == '\\' &&
+            s[1] == 'u') {
+          unsigned long lo = strtoul((char [5]) { s[2], s[3], s[4], s[5], 0 },
+                                     NULL, 16);
+
+          if (lo >= 0xDC00 && lo < 0xE000) {
+            cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+            s += 6;
+          }
+        }
+
+        break;
+      default: cp = (unsigned char) bs[1];
+    }
+
+    // UTF-8
+    o = eshell_buffer_reserve(out, 4);
+
+    if (cp < 0x80) {
+      o[0] = cp;
+      out->len += 1;
+    } else if (cp < 0x800) {
+      o[0] = 0xC0 | cp >> 6;
+      o[1] = 0x80 | (cp & 0x3F);
+      out->len += 2;
+    } else if (cp < 0x10000) {
+      o[0] = 0xE0 | cp >> 12;
+      o[1] = 0x80 | (cp >> 6 & 0x3F);
+      o[2] = 0x80 | (cp & 0x3F);
+      out->len += 3;
+    } else {
+      o[0] = 0xF0 | cp >> 18;
+      o[1] = 0x80 | (cp >> 12 & 0x3F);
+      o[2] = 0x80 | (cp >> 6 & 0x3F);
+      o[3] = 0x80 | (cp & 0x3F);
+      out->len += 4;
+    }
+  }
+}
+
+/**
+  @brief       Stage two: follow a path through one record and print the
+                 value there, or null if there isn't one.
+  @param  path The path.
+  @param  p    The records.
+  @param  ix   The index.
+  @param  k    Index of the record's first structural.
+  @param  n    Where the record's index ends, at its newline.
+  @param  s    Start of the record's value.
+  @param  out  Where to print.
+*/
+void eshell_json_extract(const struct eshell_json_path *path, const char *p,
+                         const uint32_t *ix, size_t k, size_t n,
+                         const char *s, struct eshell_buffer *out) {
+  const char *end;
+  int i;
+
+  for (i = 0; i < path->num_parts; i++) {
+    const struct eshell_json_part *part = &path->parts[i];
+    long element = 0;
+
+    if (k >= n || p + ix[k] != s || *s != (part->key ? '{' : '[')) {
+      goto missing;
+    }
+
+    // Each member or element in turn: its value starts after a colon,
+    //   or after the opening bracket or a comma
+    for (k++; ; element++) {
+      bool match;
+
+      if (part->key) {
+        if (k + 2 >= n || p[ix[k]] != '"' || p[ix[k + 2]] != ':') {
+          goto missing;
+        }
+
+        match = ix[k + 1] - ix[k] - 1 == part->key_len &&
+                memcmp(p + ix[k] + 1, part->key, part->key_len) == 0;
+        k += 2;
+      } else {
+        match = element == part->index;
+        k--;
+      }
+
+      s = eshell_json_space(p + ix[k] + 1);
+      k++;
+
+      if (*s == ']' || *s == '}') {
+        goto missing;
+      }
+
+      if (match) {
+        break;
+      }
+
+      k = eshell_json_skip(p, ix, k, n);
+
+      if (k >= n || p[ix[k]] != ',') {
+        goto missing;
+      }
+
+      k++;
+    }
+  }
+
+  if (*s == '"' && k + 1 < n) {
+    eshell_json_unescape(s + 1, p + ix[k + 1], out);
+  } else if (*s == '{' || *s == '[') {
+    end = p + ix[eshell_json_skip(p, ix, k, n) - 1] + 1;
+    eshell_buffer_append(out, s, end - s);
+  } else {
+    // A scalar, up to the structural after it, less any spaces
+    for (end = p + ix[k]; end > s && (end[-1] == ' ' || end[-1] == '\t' ||
+                                      end[-1] == '\r'); end--);
+
+    eshell_buffer_append(out, s, end - s);
+  }
+
+  return;
+
+missing:
+  eshell_buffer_append(out, "null", 4);
+}
+
+/**
+  @brief     Thread: index a chunk of records and print their values.
+  @param arg The chunk.
+  @return    NULL.
+*/
+void *eshell_json_chunk_run(void *arg) {
+  struct eshell_json_chunk *c = arg;
+  const struct eshell_json *j = c->json;
+  size_t n, k, start;
+
+  if (c->index_capacity < c->len + 1) {
+    c->index_capacity = c->len + 1;
+    free(c->index);
+
+    if ((c->index = malloc(c->index_capacity * sizeof(uint32_t))) == NULL) {
+      fprintf(stderr, "eshell: allocation error\n");
+
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  n = eshell_json_index(c->p, c->len, c->index);
+
+  // One record per newline; blank lines have no values
+  for (start = k = 0; k < n; k++) {
+    const char *s;
+    int i;
+
+    if (c->p[c->index[k]] != '\n') {
+      continue;
+    }
+
+    s = eshell_json_space(c->p + (start ? c->index[start - 1] + 1 : 0));
+
+    if (*s != '\n') {
+      for (i = 0; i < j->num_paths; i++) {
+        if (i > 0) {
+          eshell_buffer_append(&c->out, "\t", 1);
+        }
+
+        eshell_json_extract(&j->paths[i], c->p, c->index, start, k, s,
+                            &c->out);
+      }
+
+      eshell_buffer_append(&c->out, "\n", 1);
+      c->records++;
+    }
+
+    start = k + 1;
+  }
+
+  return NULL;
+}
+
+/**
+  @brief Block function for json: cut the records into chunks, one per job,
+           and run them side by side.
+*/
+size_t eshell_json_block(void *tool, char *p, size_t len, bool eof,
+                         struct eshell_buffer *out) {
+  struct eshell_json *j = tool;
+  const char *last = len ? memrchr(p, '\n', len) : NULL;
+  const char *at = p;
+  size_t whole;
+  int chunks, i;
+
+  if (last == NULL) {
+    return 0;
+  }
+
+  whole = last + 1 - p;
+  chunks = whole / ESHELL_JSON_CHUNK + 1;
+  chunks = chunks < j->jobs ? chunks : j->jobs;
+
+  for (i = 0; i < chunks; i++) {
+    struct eshell_json_chunk *c = &j->chunks[i];
+    const char *end = p + whole * (i + 1) / chunks;
+
+    // Each chunk ends at a newline
+    if (i < chunks - 1) {
+      end = end > at ? memchr(end - 1, '\n', last + 1 - (end - 1)) + 1 : at;
+    } else {
+      end = last + 1;
+    }
+
+    c->json = j;
+    c->p = at;
+    c->len = end - at;
+    c->out.len = 0;
+    c->records = 0;
+    at = end;
+  }
+
+  if (chunks > 1) {
+    sigset_t all, old;
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+
+    for (i = 1; i < chunks; i++) {
+      if (pthread_create(&j->chunks[i].thread, NULL, eshell_json_chunk_run,
+                         &j->chunks[i]) != 0) {
+        j->chunks[i].thread = pthread_self();
+      }
+    }
+
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+  }
+
+  eshell_json_chunk_run(&j->chunks[0]);
+
+  // In order, as they finish
+  for (i = 0; i < chunks; i++) {
+    struct eshell_json_chunk *c = &j->chunks[i];
+
+    if (i > 0) {
+      if (pthread_equal(c->thread, pthread_self())) {
+        eshell_json_chunk_run(c);
+      } else {
+        pthread_join(c->thread, NULL);
+        __atomic_fetch_add(&json.chunks, 1, __ATOMIC_RELAXED);
+      }
+    }
+
+    eshell_buffer_append(out, c->out.data, c->out.len);
+    __atomic_fetch_add(&json.records, c->records, __ATOMIC_RELAXED);
+  }
+
+  return whole;
+}
+
+/**
+  @brief       Parse a path like `.a.b[2].c`.
+  @param  s    The path, NUL or comma terminated.
+  @param  path Receives it; its keys point into s.
+  @return      Where the path ended, or NULL if it's bad.
+*/
+const char *eshell_json_path_parse(const char *s,
+                                   struct eshell_json_path *path) {
+  path->num_parts = 0;
+
+  if (*s++ != '.') {
+    return NULL;
+  }
+
+  // A lone dot is the whole record
+  while (*s && *s != ',') {
+    struct eshell_json_part *part = &path->parts[path->num_parts];
+    char *end;
+
+    if (path->num_parts == ESHELL_JSON_DEPTH) {
+      return NULL;
+    }
+
+    if (*s == '[') {
+      part->key = NULL;
+      part->index = strtol(s + 1, &end, 10);
+
+      if (end == s + 1 || *end != ']' || part->index < 0) {
+        return NULL;
+      }
+
+      s = end + 1;
+    } else {
+      part->key = s;
+
+      while (*s && *s != ',' && *s != '.' && *s != '[') {
+        s++;
+      }
+
+      part->key_len = s - part->key;
+
+      if (part->key_len == 0) {
+        return NULL;
+      }
+    }
+
+    path->num_parts++;
+
+    if (*s == '.') {
+      s++;
+    }
+  }
+
+  return s;
+}
+
+/**
+  @brief       Builtin command: print values from newline-delimited JSON.
+  @param  args `json [-j N] PATH[,PATH...] [FILE...]`, with paths like
+                 `.user.name` or `.items[0]`. Each record gives a line of its
+                 values separated by tabs: strings without their quotes or
+                 escapes, anything else as written, and null for a path that
+                 isn't there. -j sets how many threads work on a block of
+                 records, by default one per CPU.
+  @return      Always return 1 to continue executing the shell.
+*/
+int eshell_json(char **args) {
+  struct eshell_json *j = calloc(1, sizeof(struct eshell_json));
+  const char *s;
+  int i = 1;
+
+  if (!j) {
+    fprintf(stderr, "eshell: allocation error\n");
+
+    exit(EXIT_FAILURE);
+  }
+
+  j->jobs = sysconf(_SC_NPROCESSORS_ONLN);
+
+  if (args[i] && strcmp(args[i], "-j") == 0 && args[i + 1]) {
+    j->jobs = atoi(args[i + 1]);
+    i += 2;
+  }
+
+  j->jobs = j->jobs < 1 ? 1 : j->jobs > ESHELL_JSON_JOBS ? ESHELL_JSON_JOBS :
+            j->jobs;
+
+  for (s = args[i]; s && j->num_paths < ESHELL_JSON_PATHS; s++) {
+    if ((s = eshell_json_path_parse(s, &j->paths[j->num_paths])) == NULL) {
+      break;
+    }
+
+    j->num_paths++;
+
+    if (*s == '\0') {
+      break;
+    }
+  }
+
+  if (args[i] == NULL || s == NULL || *s != '\0') {
+    fprintf(stderr, "eshell: usage: json [-j N] PATH[,PATH...] [FILE...]\n");
+    eshell_status = 2;
+  } else {
+    eshell_text_run("json", args + i + 1, true, eshell_json_block, j);
+  }
+
+  for (i = 0; i < ESHELL_JSON_JOBS; i++) {
+    free(j->chunks[i].index);
+    free(j->chunks[i].out.data);
+  }
+
+  free(j);
+
+  return 1;
+}
+
+/*
+  Parallel tree walks, for du, rm -r and cp -r. Each worker has a deque of
+  directories to scan. It pushes the subdirectories it finds onto its own
+  end and takes from there, so it goes depth first and keeps little queued;
+  a worker with nothing to do steals from the other end of someone else's,
+  where the directories nearest the top of the tree, and so the most work,
+  are. Directories are read with getdents64 and their entries handed to the
+  tool with the directory's descriptor, to statx or unlinkat relative to.
+  Nothing below the paths given is reached by a path: each directory is
+  opened relative to its parent's descriptor, which stays open until the
+  directory is finished, so a parent swapped for a symlink mid-walk can't
+  send the walk elsewhere and depth isn't limited by PATH_MAX. A directory
+  is finished once it and everything under it has been, which is when rm
+  removes it and du adds its total to its parent's. A tool can also queue
+  tasks of its own, like cp's ranges of a big file, which workers take
+  before directories and which hold their directory open until they're
+  done. There is a worker per CPU: on an SSD the time goes on the kernel's
+  side of statx and unlinkat rather than on waiting, so more would only
+  take turns.
+*/
+#define ESHELL_WALK_JOBS    64
+#define ESHELL_WALK_BUFSIZE (64 * 1024)
+
+struct eshell_walk_dir {
+  struct eshell_walk_dir *parent;   // NULL for one named on the command line
+  struct eshell_walk_dir *children; // In the order they were found
+  struct eshell_walk_dir *last_child;
+  struct eshell_walk_dir *sibling;
+  int pending;                      // Its own scan and unfinished children
+  int fd;                           // Open from its scan until it's finished
+  size_t index;                     // Its place in its parent's listing
+  size_t listed;                    // Its entries handed over so far
+  bool failed;                      // Something under it couldn't be done
+  uint64_t size;                    // du's total, in bytes
+  int target;                       // cp's copy, open until it's finished
+  void *data;                       // The tool's own
+  char name[];
+};
+
+struct eshell_walk;
+
+/*
+  A tool's own piece of work
+*/
+struct eshell_walk_task {
+  struct eshell_walk_task *next;
+  struct eshell_walk_dir *dir;      // Not finished until this is, or NULL
+  void (*run)(struct eshell_walk *w, struct eshell_walk_task *task);
+};
+
+struct eshell_walk_deque {
+  pthread_mutex_t lock;
+  struct eshell_walk_dir **dirs;
+  size_t head;                      // Where thieves take from
+  size_t tail;                      // Where the owner pushes and takes
+  size_t capacity;
+};
+
+/*
+  A tool's handlers. entry gets everything in a directory that isn't a
+  directory, and returns false if it couldn't be dealt with; enter gets each
+  directory as it's opened, and leave once it and everything under it are
+  finished, while its parent's descriptor is still open.
+*/
+typedef bool (*eshell_walk_entry_fn)(struct eshell_walk *w,
+                                     struct eshell_walk_dir *dir, int fd,
+                                     const char *name, unsigned char type);
+typedef void (*eshell_walk_dir_fn)(struct eshell_walk *w,
+                                   struct eshell_walk_dir *dir, int fd);
+
+struct eshell_walk {
+  const char *tool;                 // For messages
+  eshell_walk_entry_fn entry;
+  eshell_walk_dir_fn enter;
+  eshell_walk_dir_fn leave;         // Given -1 if it couldn't be opened
+  bool keep;                        // Keep finished directories, for du
+  struct eshell_walk_deque deques[ESHELL_WALK_JOBS];
+  struct eshell_walk_task *tasks;   // Under idle_lock
+  int num_workers;
+  long queued;                      // Directories and tasks waiting
+  long outstanding;                 // Queued or being scanned
+  int errors;
+  pthread_mutex_t idle_lock;
+  pthread_cond_t idle;
+  int waiting;                      // Workers asleep on idle
+  void *tool_data;
+};
+
+struct eshell_walk_stats {
+  unsigned long walks;
+  unsigned long dirs;
+  unsigned long entries;
+  unsigned long steals;
+} walks;
+
+/*
+  The layout getdents64 fills in
+*/
+struct eshell_dirent64 {
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+/**
+  @brief       Build a directory's path from its ancestors' names.
+  @param  dir  The directory.
+  @param  path Receives the path.
+  @param  size Size of path.
+  @return      False if it doesn't fit.
+*/
+bool eshell_walk_path(struct eshell_walk_dir *dir, char *path, size_t size) {
+  size_t len, at;
+
+  if (dir->parent == NULL) {
+    len = strlen(dir->name);
+
+    if (len >= size) {
+      return false;
+    }
+
+    memcpy(path, dir->name, len + 1);
+
+    return true;
+  }
+
+  if (!eshell_walk_path(dir->parent, path, size)) {
+    return false;
+  }
+
+  at = strlen(path);
+  len = strlen(dir->name);
+
+  if (at + len + 2 > size) {
+    return false;
+  }
+
+  if (at > 0 && path[at - 1] != '/') {
+    path[at++] = '/';
+  }
+
+  memcpy(path + at, dir->name, len + 1);
+
+  return true;
+}
+
+/**
+  @brief       Report a failure on something in a walk.
+  @param  w    The walk.
+  @param  dir  The directory it's in, or NULL.
+  @param  name Its name, or NULL for the directory itself.
+  @param  what What couldn't be done, like "cannot remove".
+  @param  err  The errno.
+*/
+void eshell_walk_error(struct eshell_walk *w, struct eshell_walk_dir *dir,
+                       const char *name, const char *what, int err) {
+  char path[PATH_MAX];
+
+  if (dir == NULL) {
+    snprintf(path, sizeof(path), "%s", name);
+  } else if (!eshell_walk_path(dir, path, sizeof(path))) {
+    snprintf(path, sizeof(path), ".../%s", name ? name : dir->name);
+  } else if (name) {
+    size_t len = strlen(path);
+
+    snprintf(path + len, sizeof(path) - len, "%s%s",
+             len && path[len - 1] == '/' ? "" : "/", name);
+  }
+
+  fprintf(stderr, "eshell: %s: %s '%s': %s\n", w->tool, what, path,
+          strerror(err));
+  __atomic_fetch_add(&w->errors, 1, __ATOMIC_RELAXED);
+}
+
+/**
+  @brief       Make a directory to be walked.
+  @param  parent Its parent, or NULL.
+  @param  name   Its name, or path if it has no parent.
+  @return      The directory.
+*/
+struct eshell_walk_dir *eshell_walk_dir_new(struct eshell_walk_dir *parent,
+                                            const char *name) {
+  size_t len = strlen(name);
+  struct eshell_walk_dir *dir = calloc(1, sizeof(*dir) + len + 1);
+
+  if (!dir) {
+    fprintf(stderr, "eshell: allocation error\n");
+
+    exit(EXIT_FAILURE);
+  }
+
+  dir->parent = parent;
+  dir->pending = 1;
+  dir->fd = -1;
+  dir->target = -1;
+  memcpy(dir->name, name, len + 1);
+
+  return dir;
+}
+
+/**
+  @brief      The descriptor a directory's name is relative to.
+  @param  dir The directory.
+  @return     Its parent's descriptor, or AT_FDCWD for a path given.
+*/
+int eshell_walk_at(struct eshell_walk_dir *dir) {
+  return dir->parent ? dir->parent->fd : AT_FDCWD;
+}
+
+/**
+  @brief      Queue a directory on a worker's deque.
+  @param  w   The walk.
+  @param  i   The worker.
+  @param  dir The directory.
+*/
+void eshell_walk_push(struct eshell_walk *w, int i,
+                      struct eshell_walk_dir *dir) {
+  struct eshell_walk_deque *q = &w->deques[i];
+
+  __atomic_fetch_add(&w->outstanding, 1, __ATOMIC_SEQ_CST);
+  pthread_mutex_lock(&q->lock);
+
+  // A ring that doubles when full, unrolled into the new space
+  if (q->tail - q->head == q->capacity) {
+    size_t capacity = q->capacity ? q->capacity * 2 : 64;
+    struct eshell_walk_dir **dirs = malloc(capacity * sizeof(*dirs));
+    size_t k;
+
+    if (!dirs) {
+      fprintf(stderr, "eshell: allocation error\n");
+
+      exit(EXIT_FAILURE);
+    }
+
+    for (k = q->head; k < q->tail; k++) {
+      dirs[k - q->head] = q->dirs[k % q->capacity];
+    }
+
+    free(q->dirs);
+    q->dirs = dirs;
+    q->tail -= q->head;
+    q->head = 0;
+    q->capacity = capacity;
+  }
+
+  q->dirs[q->tail++ % q->capacity] = dir;
+  __atomic_fetch_add(&w->queued, 1, __ATOMIC_SEQ_CST);
+  pthread_mutex_unlock(&q->lock);
+
+  if (__atomic_load_n(&w->waiting, __ATOMIC_SEQ_CST) > 0) {
+    pthread_mutex_lock(&w->idle_lock);
+    pthread_cond_signal(&w->idle);
+    pthread_mutex_unlock(&w->idle_lock);
+  }
+}
+
+/**
+  @brief      Take a directory to scan: the newest from the worker's own
+                deque, or else the oldest from someone else's.
+  @param  w   The walk.
+  @param  i   The worker.
+  @return     The directory, or NULL if none are queued.
+*/
+struct eshell_walk_dir *eshell_walk_take(struct eshell_walk *w, int i) {
+  struct eshell_walk_dir *dir = NULL;
+  int k;
+
+  for (k = 0; k < w->num_workers && dir == NULL; k++) {
+    struct eshell_walk_deque *q = &w->deques[(i + k) % w->num_workers];
+
+    pthread_mutex_lock(&q->lock);
+
+    if (q->tail > q->head) {
+      dir = k == 0 ? q->dirs[--q->tail % q->capacity] :
+            q->dirs[q->head++ % q->capacity];
+      __atomic_fetch_sub(&w->queued, 1, __ATOMIC_SEQ_CST);
+    }
+
+    pthread_mutex_unlock(&q->lock);
+
+    if (dir && k > 0) {
+      __atomic_fetch_add(&walks.steals, 1, __ATOMIC_RELAXED);
+    }
+  }
+
+  return dir;
+}
+
+/**
+  @brief      Queue a task, holding its directory open until it's run.
+  @param  w    The walk.
+  @param  task The task, with its directory and function set.
+*/
+void eshell_walk_task_push(struct eshell_walk *w,
+                           struct eshell_walk_task *task) {
+  if (task->dir) {
+    __atomic_fetch_add(&task->dir->pending, 1, __ATOMIC_RELAXED);
+  }
+
+  __atomic_fetch_add(&w->outstanding, 1, __ATOMIC_SEQ_CST);
+  pthread_mutex_lock(&w->idle_lock);
+  task->next = w->tasks;
+  __atomic_store_n(&w->tasks, task, __ATOMIC_SEQ_CST);
+  __atomic_fetch_add(&w->queued, 1, __ATOMIC_SEQ_CST);
+  pthread_cond_signal(&w->idle);
+  pthread_mutex_unlock(&w->idle_lock);
+}
+
+/**
+  @brief     Take a queued task.
+  @param  w  The walk.
+  @return    The task, or NULL if none are queued.
+*/
+struct eshell_walk_task *eshell_walk_task_take(struct eshell_walk *w) {
+  struct eshell_walk_task *task;
+
+  if (__atomic_load_n(&w->tasks, __ATOMIC_SEQ_CST) == NULL) {
+    return NULL;
+  }
+
+  pthread_mutex_lock(&w->idle_lock);
+  task = w->tasks;
+
+  if (task) {
+    __atomic_store_n(&w->tasks, task->next, __ATOMIC_SEQ_CST);
+    __atomic_fetch_sub(&w->queued, 1, __ATOMIC_SEQ_CST);
+  }
+
+  pthread_mutex_unlock(&w->idle_lock);
+
+  return task;
+}
+
+/**
+  @brief      Finish a directory's scan, and with it any ancestors that were
+                only waiting on it.
+  @param  w   The walk.
+  @param  dir The directory.
+*/
+void eshell_walk_finish(struct eshell_walk *w, struct eshell_walk_dir *dir) {
+  while (dir && __atomic_sub_fetch(&dir->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+    struct eshell_walk_dir *parent = dir->parent;
+
+    if (w->leave) {
+      w->leave(w, dir, dir->fd);
+    }
+
+    if (dir->fd >= 0) {
+      close(dir->fd);
+      dir->fd = -1;
+    }
+
+    if (parent && dir->failed) {
+      __atomic_store_n(&parent->failed, true, __ATOMIC_RELAXED);
+    }
+
+    if (!w->keep) {
+      free(dir);
+    }
+
+    dir = parent;
+  }
+}
+
+/**
+  @brief      Scan a directory: queue its subdirectories and hand everything
+                else to the tool.
+  @param  w   The walk.
+  @param  i   The worker.
+  @param  dir The directory.
+  @param  buf A buffer of ESHELL_WALK_BUFSIZE bytes.
+*/
+void eshell_walk_scan(struct eshell_walk *w, int i, struct eshell_walk_dir *dir,
+                      char *buf) {
+  unsigned long entries = 0;
+  long n;
+  int fd;
+
+  fd = openat(eshell_walk_at(dir), dir->name,
+              O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+
+  if (fd < 0) {
+    eshell_walk_error(w, dir, NULL, "cannot open directory", errno);
+    dir->failed = true;
+
+    return;
+  }
+
+  if (w->enter) {
+    w->enter(w, dir, fd);
+  }
+
+  while ((n = syscall(SYS_getdents64, fd, buf, ESHELL_WALK_BUFSIZE)) > 0) {
+    long off;
+
+    for (off = 0; off < n;) {
+      struct eshell_dirent64 *d = (struct eshell_dirent64 *) (buf + off);
+      const char *name = d->d_name;
+      unsigned char type = d->d_type;
+
+      off += d->d_reclen;
+
+      if (name[0] == '.' && (name[1] == '\0' ||
+                             (name[1] == '.' && name[2] == '\0'))) {
+        continue;
+      }
+
+      entries++;
+      dir->listed = entries;
+
+      // Some filesystems leave the type to be looked up
+      if (type == DT_UNKNOWN) {
+        struct statx stx;
+
+        if (statx(fd, name, AT_SYMLINK_NOFOLLOW, STATX_TYPE, &stx) == 0) {
+          type = IFTODT(stx.stx_mode);
+        }
+      }
+
+      if (type == DT_DIR) {
+        struct eshell_walk_dir *child = eshell_walk_dir_new(dir, name);
+
+        child->index = entries;
+        __atomic_fetch_add(&dir->pending, 1, __ATOMIC_RELAXED);
+
+        // Children are only linked in a tree that's kept: otherwise one
+        //   might be finished and freed before its next sibling's found
+        if (w->keep) {
+          if (dir->last_child) {
+            dir->last_child->sibling = child;
+          } else {
+            dir->children = child;
+          }
+
+          dir->last_child = child;
+        }
+
+        eshell_walk_push(w, i, child);
+      } else if (!w->entry(w, dir, fd, name, type)) {
+        dir->failed = true;
+      }
+    }
+  }
+
+  if (n < 0) {
+    eshell_walk_error(w, dir, NULL, "cannot read directory", errno);
+    dir->failed = true;
+  }
+
+  // Kept for its subdirectories to be opened and removed relative to
+  dir->fd = fd;
+  __atomic_fetch_add(&walks.dirs, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&walks.entries, entries, __ATOMIC_RELAXED);
+}
+
+struct eshell_walk_worker {
+  struct eshell_walk *w;
+  int index;
+  pthread_t thread;
+};
+
+/**
+  @brief     Thread: scan directories and run tasks until the walk is over.
+  @param arg The worker.
+  @return    NULL.
+*/
+void *eshell_walk_worker(void *arg) {
+  struct eshell_walk_worker *worker = arg;
+  struct eshell_walk *w = worker->w;
+  char *buf = malloc(ESHELL_WALK_BUFSIZE);
+
+  if (!buf) {
+    fprintf(stderr, "eshell: allocation error\n");
+
+    exit(EXIT_FAILURE);
+  }
+
+  for (;;) {
+    struct eshell_walk_task *task = eshell_walk_task_take(w);
+    struct eshell_walk_dir *dir = task ? NULL :
+                                  eshell_walk_take(w, worker->index);
+
+    if (task || dir) {
+      // The task may be freed once it's run
+      if (task) {
+        dir = task->dir;
+        task->run(w, task);
+      } else {
+        eshell_walk_scan(w, worker->index, dir, buf);
+      }
+
+      eshell_walk_finish(w, dir);
+
+      // The last one out wakes the rest to leave too
+      if (__atomic_sub_fetch(&w->outstanding, 1, __ATOMIC_SEQ_CST) == 0) {
+        pthread_mutex_lock(&w->idle_lock);
+        pthread_cond_broadcast(&w->idle);
+        pthread_mutex_unlock(&w->idle_lock);
+      }
+
+      continue;
+    }
+
+    // Nothing to take: sleep until something's queued or it's all done
+    pthread_mutex_lock(&w->idle_lock);
+    __atomic_fetch_add(&w->waiting, 1, __ATOMIC_SEQ_CST);
+
+    while (__atomic_load_n(&w->queued, __ATOMIC_SEQ_CST) == 0 &&
+           __atomic_load_n(&w->outstanding, __ATOMIC_SEQ_CST) > 0) {
+      pthread_cond_wait(&w->idle, &w->idle_lock);
+    }
+
+    __atomic_fetch_sub(&w->waiting, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&w->idle_lock);
+
+    if (__atomic_load_n(&w->outstanding, __ATOMIC_SEQ_CST) == 0) {
+      break;
+    }
+  }
+
+  free(buf);
+
+  return NULL;
+}
+
+/**
+  @brief       Walk the directories queued on a walk to the end.
+  @param  w    The walk, with its tool's handlers and its roots pushed.
+*/
+void eshell_walk_run(struct eshell_walk *w) {
+  struct eshell_walk_worker workers[ESHELL_WALK_JOBS];
+  sigset_t all, old;
+  int i;
+
+  walks.walks++;
+
+  if (w->outstanding > 0) {
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+
+    for (i = 0; i < w->num_workers; i++) {
+      workers[i].w = w;
+      workers[i].index = i;
+
+      if (i > 0 && pthread_create(&workers[i].thread, NULL, eshell_walk_worker,
+                                  &workers[i]) != 0) {
+        workers[i].thread = pthread_self();
+      }
+    }
+
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    eshell_walk_worker(&workers[0]);
+
+    for (i = 1; i < w->num_workers; i++) {
+      if (!pthread_equal(workers[i].thread, pthread_self())) {
+        pthread_join(workers[i].thread, NULL);
+      }
+    }
+  }
+
+  for (i = 0; i < w->num_workers; i++) {
+    pthread_mutex_destroy(&w->deques[i].lock);
+    free(w->deques[i].dirs);
+  }
+
+  pthread_mutex_destroy(&w->idle_lock);
+  pthread_cond_destroy(&w->idle);
+}
+
+/**
+  @brief       Start a walk.
+  @param  tool The tool, for messages.
+  @return      The walk, to set handlers on and push roots to.
+*/
+struct eshell_walk *eshell_walk_new(const char *tool) {
+  struct eshell_walk *w = calloc(1, sizeof(struct eshell_walk));
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int i;
+
+  if (!w) {
+    fprintf(stderr, "eshell: allocation error\n");
+
+    exit(EXIT_FAILURE);
+  }
+
+  w->tool = tool;
+  w->num_workers = cpus < 1 ? 1 : cpus > ESHELL_WALK_JOBS ?
+                   ESHELL_WALK_JOBS : cpus;
+
+  for (i = 0; i < w->num_workers; i++) {
+    pthread_mutex_init(&w->deques[i].lock, NULL);
+  }
+
+  pthread_mutex_init(&w->idle_lock, NULL);
+  pthread_cond_init(&w->idle, NULL);
+
+  return w;
+}
+
+/*
+  du: disk usage. Each file's blocks are added to its directory, and each
+  directory's total to its parent when it's finished. A file with several
+  links, or with several paths given any file, is counted once, where
+  coreutils would count it: at the first of its names in traversal order.
+  Which name a parallel walk reaches first is down to timing, so these
+  files are only noted against their directory, with their place in its
+  listing, during the walk; afterwards one pass goes through the tree in
+  listing order, counting each the first time it comes up and adding it to
+  its directory's total and its ancestors'. With several paths a directory
+  met a second time is left out, with everything under it, as coreutils
+  does. Totals are printed afterwards, children before parents.
+*/
+struct eshell_du {
+  bool summary;                     // -s
+  bool human;                       // -h
+  bool apparent;                    // -b: sizes in bytes, not blocks
+  bool total;                       // -c
+  bool every;                       // Remember every file, not just links
+  int files;                        // First path in args
+  pthread_mutex_t lock;             // For the links seen
+  uint64_t *links;                  // Device and inode pairs, open addressed
+  size_t num_links;
+  size_t links_capacity;            // In pairs
+};
+
+/*
+  A file that may have been counted under another name, noted in its
+  directory's data
+*/
+struct eshell_du_file {
+  uint64_t dev;
+  uint64_t ino;
+  uint64_t size;
+  size_t index;                     // Its place in the directory's listing
+};
+
+struct eshell_du_files {
+  uint64_t dev;                     // The directory's own, with several paths
+  uint64_t ino;
+  bool skip;                        // It was counted under another path
+  size_t count;
+  size_t capacity;
+  struct eshell_du_file files[];
+};
+
+/**
+  @brief       Parse du's options.
+  @param  args The command.
+  @param  du   Receives them.
+  @return      False if some are left to the program.
+*/
+bool eshell_du_parse(char **args, struct eshell_du *du) {
+  int i;
+  char *c;
+
+  memset(du, 0, sizeof(*du));
+
+  for (i = 1; args[i] && args[i][0] == '-' && args[i][1]; i++) {
+    if (strcmp(args[i], "--") == 0) {
+      i++;
+
+      break;
+    }
+
+    for (c = args[i] + 1; *c; c++) {
+      switch (*c) {
+        case 's': du->summary = true; break;
+        case 'h': du->human = true; break;
+        case 'b': du->apparent = true; break;
+        case 'c': du->total = true; break;
+        case 'k': du->human = false; break;
+        default: return false;
+      }
+    }
+  }
+
+  du->files = i;
+
+  return true;
+}
+
+/**
+  @brief      Note a file with several links. Only called once the walk is
+                over, in traversal order.
+  @param  du  The du.
+  @param  dev Its device.
+  @param  ino Its inode.
+  @return     True the first time it's seen.
+*/
+bool eshell_du_link(struct eshell_du *du, uint64_t dev, uint64_t ino) {
+  size_t k, mask;
+  bool first = true;
+
+  pthread_mutex_lock(&du->lock);
+
+  // Keep it under half full
+  if (2 * (du->num_links + 1) > du->links_capacity) {
+    size_t capacity = du->links_capacity ? du->links_capacity * 2 : 1024;
+    uint64_t *links = calloc(capacity, 2 * sizeof(uint64_t));
+
+    if (!links) {
+      fprintf(stderr, "eshell: allocation error\n");
+
+      exit(EXIT_FAILURE);
+    }
+
+    for (k = 0; k < du->links_capacity; k++) {
+      if (du->links[2 * k + 1]) {
+        size_t j = (du->links[2 * k] * 31 + du->links[2 * k + 1]) *
+                   0x9E3779B97F4A7C15ULL >> 20 & (capacity - 1);
+
+        while (links[2 * j + 1]) {
+          j = (j + 1) & (capacity - 1);
+        }
+
+        links[2 * j] = du->links[2 * k];
+        links[2 * j + 1] = du->links[2 * k + 1];
+      }
+    }
+
+    free(du->links);
+    du->links = links;
+    du->links_capacity = capacity;
+  }
+
+  mask = du->links_capacity - 1;
+
+  for (k = (dev * 31 + ino) * 0x9E3779B97F4A7C15ULL >> 20 & mask;
+       du->links[2 * k + 1]; k = (k + 1) & mask) {
+    if (du->links[2 * k] == dev && du->links[2 * k + 1] == ino) {
+      first = false;
+
+      break;
+    }
+  }
+
+  // Inode 0 never names a file, so marks an empty slot
+  if (first) {
+    du->links[2 * k] = dev;
+    du->links[2 * k + 1] = ino;
+    du->num_links++;
+  }
+
+  pthread_mutex_unlock(&du->lock);
+
+  return first;
+}
+
+/**
+  @brief      Size of something, for du.
+  @param  du  The du.
+  @param  fd  The directory it's in, or AT_FDCWD.
+  @param  name Its name; empty for fd itself.
+  @param  size Receives its size in bytes.
+  @param  file Receives its device, inode and size.
+  @return     1, or 0 if it's to be counted once with eshell_du_link, or
+                -1 if it couldn't be looked at.
+*/
+int eshell_du_size(struct eshell_du *du, int fd, const char *name,
+                   uint64_t *size, struct eshell_du_file *file) {
+  unsigned int mask = STATX_TYPE | STATX_NLINK | STATX_INO |
+                      (du->apparent ? STATX_SIZE : STATX_BLOCKS);
+  struct statx stx;
+
+  if (statx(fd, name, AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC |
+            (*name ? 0 : AT_EMPTY_PATH), mask, &stx) != 0) {
+    return -1;
+  }
+
+  *size = du->apparent ? stx.stx_size : stx.stx_blocks * 512;
+
+  file->dev = (uint64_t) stx.stx_dev_major << 32 | stx.stx_dev_minor;
+  file->ino = stx.stx_ino;
+  file->size = *size;
+
+  // With several paths, which might overlap, every file is remembered
+  return (stx.stx_nlink > 1 || du->every) && !S_ISDIR(stx.stx_mode) ? 0 : 1;
+}
+
+/**
+  @brief      A directory's list of files to be counted once, made or grown
+                to take more.
+  @param  dir  The directory.
+  @param  more How many more files it must have room for.
+  @return     The list.
+*/
+struct eshell_du_files *eshell_du_files(struct eshell_walk_dir *dir,
+                                        size_t more) {
+  struct eshell_du_files *files = dir->data;
+
+  if (files == NULL || files->count + more > files->capacity) {
+    size_t capacity = files ? files->capacity * 2 : 16;
+
+    if (!(files = realloc(files, sizeof(*files) +
+                          capacity * sizeof(struct eshell_du_file)))) {
+      fprintf(stderr, "eshell: allocation error\n");
+
+      exit(EXIT_FAILURE);
+    }
+
+    if (dir->data == NULL) {
+      memset(files, 0, sizeof(*files));
+    }
+
+    files->capacity = capacity;
+    dir->data = files;
+  }
+
+  return files;
+}
+
+/**
+  @brief Entry handler for du: add a file's size to its directory.
+*/
+bool eshell_du_entry(struct eshell_walk *w, struct eshell_walk_dir *dir,
+                     int fd, const char *name, unsigned char type) {
+  struct eshell_du_files *files;
+  struct eshell_du_file file;
+  uint64_t size;
+  int counted = eshell_du_size(w->tool_data, fd, name, &size, &file);
+
+  if (counted < 0) {
+    eshell_walk_error(w, dir, name, "cannot access", errno);
+
+    return false;
+  }
+
+  if (counted) {
+    __atomic_fetch_add(&dir->size, size, __ATOMIC_RELAXED);
+
+    return true;
+  }
+
+  // Only the worker scanning the directory adds to its list
+  files = eshell_du_files(dir, 1);
+  file.index = dir->listed;
+  files->files[files->count++] = file;
+
+  return true;
+}
+
+/**
+  @brief Enter handler for du: count the directory itself.
+*/
+void eshell_du_enter(struct eshell_walk *w, struct eshell_walk_dir *dir,
+                     int fd) {
+  struct eshell_du *du = w->tool_data;
+  struct eshell_du_files *files;
+  struct eshell_du_file file;
+  uint64_t size;
+
+  if (eshell_du_size(du, fd, "", &size, &file) < 0) {
+    return;
+  }
+
+  __atomic_fetch_add(&dir->size, size, __ATOMIC_RELAXED);
+
+  // Kept to tell if it's met again under another path
+  if (du->every) {
+    files = eshell_du_files(dir, 0);
+    files->dev = file.dev;
+    files->ino = file.ino;
+  }
+}
+
+/**
+  @brief Leave handler for du: add the directory's total to its parent's.
+*/
+void eshell_du_leave(struct eshell_walk *w, struct eshell_walk_dir *dir,
+                     int fd) {
+  if (dir->parent) {
+    __atomic_fetch_add(&dir->parent->size, dir->size, __ATOMIC_RELAXED);
+  }
+}
+
+/**
+  @brief      Count the files noted in a directory and under it that weren't
+                seen earlier in traversal order, adding them to the totals.
+                A directory's files and subdirectories are taken in the order
+                they were listed, as a sequential walk would come to them.
+  @param  du  The du.
+  @param  dir The directory.
+  @return     What was added to its total, modulo 2^64: a directory left out
+                takes its whole total back.
+*/
+uint64_t eshell_du_resolve(struct eshell_du *du, struct eshell_walk_dir *dir) {
+  struct eshell_du_files *files = dir->data;
+  struct eshell_walk_dir *child = dir->children;
+  uint64_t added = 0;
+  size_t k = 0;
+
+  if (du->every && files && !eshell_du_link(du, files->dev, files->ino)) {
+    added = -dir->size;
+    dir->size = 0;
+    files->skip = true;
+
+    return added;
+  }
+
+  while (child || (files && k < files->count)) {
+    if (child && (files == NULL || k == files->count ||
+                  child->index < files->files[k].index)) {
+      added += eshell_du_resolve(du, child);
+      child = child->sibling;
+    } else {
+      struct eshell_du_file *file = &files->files[k++];
+
+      if (eshell_du_link(du, file->dev, file->ino)) {
+        added += file->size;
+      }
+    }
+  }
+
+  dir->size += added;
+
+  return added;
+}
+
+/**
+  @brief      Print a size and path as du does.
+  @param  du   The du.
+  @param  size The size in bytes.
+  @param  path The path.
+*/
+void eshell_du_print(struct eshell_du *du, uint64_t size, const char *path) {
+  static const char units[] = "KMGTPE";
+  uint64_t unit = 1024;
+  uint64_t n;
+  char text[32];
+  int u = 0;
+
+  if (du->human && size >= 1024) {
+    while (size / unit >= 1024 && units[u + 1]) {
+      unit *= 1024;
+      u++;
+    }
+
+    // Round up, to a tenth below ten and to a whole number above
+    if ((n = (size * 10 + unit - 1) / unit) < 100) {
+      snprintf(text, sizeof(text), "%d.%d%c", (int) n / 10, (int) n % 10,
+               units[u]);
+    } else if ((n = (size + unit - 1) / unit) < 1024 || !units[u + 1]) {
+      snprintf(text, sizeof(text), "%llu%c", (unsigned long long) n,
+               units[u]);
+    } else {
+      snprintf(text, sizeof(text), "1.0%c", units[u + 1]);
+    }
+  } else if (du->human || du->apparent) {
+    snprintf(text, sizeof(text), "%llu", (unsigned long long) size);
+  } else {
+    snprintf(text, sizeof(text), "%llu",
+             (unsigned long long) (size + 1023) / 1024);
+  }
+
+  eshell_out_printf("%s\t%s\n", text, path);
+}
+
+/**
+  @brief      Print a directory's subdirectories, then it, and free them.
+  @param  du   The du.
+  @param  dir  The directory.
+  @param  path Its path, with room to add to, or NULL to print nothing.
+*/
+void eshell_du_report(struct eshell_du *du, struct eshell_walk_dir *dir,
+                      char *path) {
+  struct eshell_du_files *files = dir->data;
+  struct eshell_walk_dir *child, *next;
+  size_t len = path ? strlen(path) : 0;
+
+  // One counted under another path is left out, with all under it
+  if (files && files->skip) {
+    path = NULL;
+  }
+
+  for (child = dir->children; child; child = next) {
+    next = child->sibling;
+
+    if (path && len + strlen(child->name) + 2 <= PATH_MAX) {
+      snprintf(path + len, PATH_MAX - len, "%s%s",
+               len && path[len - 1] == '/' ? "" : "/", child->name);
+      eshell_du_report(du, child, path);
+      path[len] = '\0';
+    } else {
+      eshell_du_report(du, child, NULL);
+    }
+  }
+
+  if (path && (!du->summary || dir->parent == NULL)) {
+    eshell_du_print(du, dir->size, path);
+  }
+
+  for (child = dir->children; child; child = next) {
+    next = child->sibling;
+    free(child);
+  }
+
+  free(files);
+  dir->data = NULL;
+}
+
+/**
+  @brief       Builtin command: show disk usage.
+  @param  args `du [-s] [-h] [-k] [-b] [-c] [PATH...]`; anything else is
+                 left to du itself.
+  @return      Always return 1 to continue executing the shell.
+*/
+int eshell_du(char **args) {
+  struct eshell_du du;
+  struct eshell_walk *w;
+  struct eshell_walk_dir **roots;
+  char *here[] = { ".", NULL };
+  char **paths;
+  char path[PATH_MAX];
+  uint64_t *sizes;
+  uint64_t total = 0;
+  struct eshell_du_file *files;     // Files given, to be counted once
+  int *counted;                     // 1 if a file's counted, 0 if yet to be
+  int num_paths, i;
+
+  if (!eshell_du_parse(args, &du)) {
+    return eshell_builtin_external(args);
+  }
+
+  paths = args[du.files] ? args + du.files : here;
+
+  for (num_paths = 0; paths[num_paths]; num_paths++);
+
+  roots = calloc(num_paths, sizeof(*roots));
+  sizes = calloc(num_paths, sizeof(*sizes));
+  counted = calloc(num_paths, sizeof(*counted));
+  files = calloc(num_paths, sizeof(*files));
+  w = eshell_walk_new("du");
+
+  if (!roots || !sizes || !counted || !files) {
+    fprintf(stderr, "eshell: allocation error\n");
+
+    exit(EXIT_FAILURE);
+  }
+
+  pthread_mutex_init(&du.lock, NULL);
+  w->tool_data = &du;
+  w->entry = eshell_du_entry;
+  w->enter = eshell_du_enter;
+  w->leave = eshell_du_leave;
+  w->keep = true;
+
+  for (du.every = num_paths > 1, i = 0; i < num_paths; i++) {
+    struct stat st;
+
+    if (lstat(paths[i], &st) != 0) {
+      eshell_walk_error(w, NULL, paths[i], "cannot access", errno);
+      counted[i] = -1;
+    } else if (S_ISDIR(st.st_mode)) {
+      roots[i] = eshell_walk_dir_new(NULL, paths[i]);
+      eshell_walk_push(w, i % w->num_workers, roots[i]);
+    } else if ((counted[i] = eshell_du_size(&du, AT_FDCWD, paths[i],
+                                            &sizes[i], &files[i])) < 0) {
+      eshell_walk_error(w, NULL, paths[i], "cannot access", errno);
+    }
+  }
+
+  eshell_walk_run(w);
+
+  // Files met more than once are counted at the first, in the paths' order
+  for (i = 0; i < num_paths; i++) {
+    if (roots[i]) {
+      eshell_du_resolve(&du, roots[i]);
+    } else if (counted[i] == 0) {
+      counted[i] = eshell_du_link(&du, files[i].dev, files[i].ino);
+    }
+  }
+
+  for (i = 0; i < num_paths; i++) {
+    if (roots[i]) {
+      snprintf(path, sizeof(path), "%s", paths[i]);
+      total += roots[i]->size;
+      eshell_du_report(&du, roots[i], path);
+      free(roots[i]);
+    } else if (counted[i] == 1) {
+      total += sizes[i];
+      eshell_du_print(&du, sizes[i], paths[i]);
+    }
+  }
+
+  if (du.total) {
+    eshell_du_print(&du, total, "total");
+  }
+
+  eshell_status = w->errors > 0;
+  pthread_mutex_destroy(&du.lock);
+  free(du.links);
+  free(roots);
+  free(sizes);
+  free(counted);
+  free(files);
+  free(w);
+
+  return 1;
+}
+
+/*
+  rm: files are unlinked relative to their directory as it's scanned, and
+  each directory removed once everything under it has been.
+*/
+struct eshell_rm {
+  bool recursive;                   // -r or -R
+  bool force;                       // -f
+  int files;                        // First path in args
+};
+
+/**
+  @brief       Parse rm's options.
+  @param  args The command.
+  @param  rm   Receives them.
+  @return      False if some are left to the program.
+*/
+bool eshell_rm_parse(char **args, struct eshell_rm *rm) {
+  int i;
+  char *c;
+
+  memset(rm, 0, sizeof(*rm));
+
+  for (i = 1; args[i] && args[i][0] == '-' && args[i][1]; i++) {
+    if (strcmp(args[i], "--") == 0) {
+      i++;
+
+      break;
+    }
+
+    for (c = args[i] + 1; *c; c++) {
+      switch (*c) {
+        case 'r': case 'R': rm->recursive = true; break;
+        case 'f': rm->force = true; break;
+        default: return false;
+      }
+    }
+  }
+
+  rm->files = i;
+
+  return true;
+}
+
+/**
+  @brief Entry handler for rm: unlink it.
+*/
+bool eshell_rm_entry(struct eshell_walk *w, struct eshell_walk_dir *dir,
+                     int fd, const char *name, unsigned char type) {
+  struct eshell_rm *rm = w->tool_data;
+
+  if (unlinkat(fd, name, 0) != 0 && !(rm->force && errno == ENOENT)) {
+    eshell_walk_error(w, dir, name, "cannot remove", errno);
+
+    return false;
+  }
+
+  return true;
+}
+
+/**
+  @brief Leave handler for rm: remove the emptied directory. One that
+           couldn't be emptied has had its failure reported already.
+*/
+void eshell_rm_leave(struct eshell_walk *w, struct eshell_walk_dir *dir,
+                     int fd) {
+  if (dir->failed ||
+      unlinkat(eshell_walk_at(dir), dir->name, AT_REMOVEDIR) == 0) {
+    return;
+  }
+
+  eshell_walk_error(w, dir, NULL, "cannot remove", errno);
+  dir->failed = true;
+}
+
+/**
+  @brief       Builtin command: remove files, and with -r directories.
+  @param  args `rm [-r] [-f] PATH...`; anything else is left to rm itself.
+  @return      Always return 1 to continue executing the shell.
+*/
+int eshell_rm(char **args) {
+  struct eshell_rm rm;
+  struct eshell_walk *w;
+  int i;
+
+  if (!eshell_rm_parse(args, &rm)) {
+    return eshell_builtin_external(args);
+  }
+
+  if (args[rm.files] == NULL && !rm.force) {
+    fprintf(stderr, "eshell: usage: rm [-r] [-f] PATH...\n");
+    eshell_status = 2;
+
+    return 1;
+  }
+
+  w = eshell_walk_new("rm");
+  w->tool_data = &rm;
+  w->entry = eshell_rm_entry;
+  w->leave = eshell_rm_leave;
+
+  for (i = rm.files; args[i]; i++) {
+    const char *base = strrchr(args[i], '/');
+    struct stat st;
+
+    base = base && base[1] ? base + 1 : args[i];
+
+    if (strcmp(base, ".") == 0 || strcmp(base, "..") == 0 ||
+        strcmp(args[i], "/") == 0) {
+      fprintf(stderr, "eshell: rm: refusing to remove '%s'\n", args[i]);
+      w->errors++;
+    } else if (lstat(args[i], &st) != 0) {
+      if (!(rm.force && errno == ENOENT)) {
+        eshell_walk_error(w, NULL, args[i], "cannot remove", errno);
+      }
+    } else if (!S_ISDIR(st.st_mode)) {
+      eshell_rm_entry(w, NULL, AT_FDCWD, args[i], DT_REG);
+    } else if (!rm.recursive) {
+      eshell_walk_error(w, NULL, args[i], "cannot remove", EISDIR);
+    } else {
+      eshell_walk_push(w, i % w->num_workers,
+                       eshell_walk_dir_new(NULL, args[i]));
+    }
+  }
+
+  eshell_walk_run(w);
+  eshell_status = w->errors > 0;
+  free(w);
+
+  return 1;
+}
+
+/*
+  cp: directories are made as they're scanned, and everything else in them
+  copied by whichever worker scanned them: regular files with a clone where
+  the filesystem can share their blocks, or else copy_file_range, which keeps
+  the data in the kernel; files of at least two ranges are cut into ranges
+  queued as tasks, so all the workers share a big file. Like the sources,
+  each copy is made and opened relative to its parent's copy, and gets its
+  mode, and its times with -p, through its own descriptor once everything
+  under it is copied.
+*/
+#define ESHELL_CP_RANGE (8 * 1024 * 1024)
+
+struct eshell_cp_stats {
+  unsigned long files;
+  unsigned long bytes;
+  unsigned long cloned;             // Files copied by sharing their blocks
+  unsigned long ranges;             // Ranges of big files copied as tasks
+} copies;
+
+/*
+  A file with several links, by device and inode, and where its first copy
+  went
+*/
+struct eshell_cp_link {
+  uint64_t dev;
+  uint64_t ino;
+  char *path;
+};
+
+struct eshell_cp {
+  bool recursive;                   // -r or -R
+  bool preserve;                    // -p: mode, ownership and times
+  bool links;                       // -a: -r -p, and hard links kept
+  bool no_clone;                    // Cloning isn't supported here
+  int files;                        // First path in args
+  mode_t umask;
+  int num_roots;
+  struct eshell_walk_dir **roots;   // Directories copied, and where to
+  char **targets;
+  pthread_mutex_t lock;             // For the links seen
+  struct eshell_cp_link *seen;      // Open addressed
+  size_t num_seen;
+  size_t seen_capacity;
+};
+
+/*
+  A regular file copied in ranges. The last range to finish gives the copy
+  its attributes and closes both.
+*/
+struct eshell_cp_file {
+  struct eshell_walk_dir *dir;      // Where it is, for messages
+  int in;
+  int out;
+  struct stat st;
+  int remaining;                    // Ranges still to copy
+  int err;                          // The first error, if any
+  char name[];
+};
+
+struct eshell_cp_range {
+  struct eshell_walk_task task;     // First, to be found from the task
+  struct eshell_cp_file *file;
+  off_t offset;
+  off_t len;
+};
+
+/**
+  @brief       Parse cp's options.
+  @param  args The command.
+  @param  cp   Receives them.
+  @return      False if some are left to the program.
+*/
+bool eshell_cp_parse(char **args, struct eshell_cp *cp) {
+  int i;
+  char *c;
+
+  memset(cp, 0, sizeof(*cp));
+
+  for (i = 1; args[i] && args[i][0] == '-' && args[i][1]; i++) {
+    if (strcmp(args[i], "--") == 0) {
+      i++;
+
+      break;
+    }
+
+    for (c = args[i] + 1; *c; c++) {
+      switch (*c) {
+        case 'r': case 'R': cp->recursive = true; break;
+        case 'p': cp->preserve = true; break;
+        case 'a': cp->recursive = cp->preserve = cp->links = true; break;
+        default: return false;
+      }
+    }
+  }
+
+  cp->files = i;
+
+  return true;
+}
+
+/**
+  @brief      Where a directory is copied to.
+  @param  cp   The cp.
+  @param  dir  The directory.
+  @param  path Receives the path.
+  @param  size Its size.
+  @return      False if it's too long.
+*/
+bool eshell_cp_target(struct eshell_cp *cp, struct eshell_walk_dir *dir,
+                      char *path, size_t size) {
+  size_t len, at;
+  int k;
+
+  if (dir->parent == NULL) {
+    for (k = 0; cp->roots[k] != dir; k++);
+
+    len = strlen(cp->targets[k]);
+
+    if (len >= size) {
+      return false;
+    }
+
+    memcpy(path, cp->targets[k], len + 1);
+
+    return true;
+  }
+
+  if (!eshell_cp_target(cp, dir->parent, path, size)) {
+    return false;
+  }
+
+  at = strlen(path);
+  len = strlen(dir->name);
+
+  if (at + len + 2 > size) {
+    return false;
+  }
+
+  if (at > 0 && path[at - 1] != '/') {
+    path[at++] = '/';
+  }
+
+  memcpy(path + at, dir->name, len + 1);
+
+  return true;
+}
+
+/**
+  @brief      Note a file with several links, for -a.
+  @param  cp   The cp.
+  @param  st   The file.
+  @param  path Where it's being copied to.
+  @return      Where its first copy went, or NULL if this is it.
+*/
+const char *eshell_cp_link(struct eshell_cp *cp, struct stat *st,
+                           const char *path) {
+  uint64_t dev = st->st_dev;
+  uint64_t ino = st->st_ino;
+  const char *first = NULL;
+  size_t k, mask;
+
+  pthread_mutex_lock(&cp->lock);
+
+  // Keep it under half full
+  if (2 * (cp->num_seen + 1) > cp->seen_capacity) {
+    size_t capacity = cp->seen_capacity ? cp->seen_capacity * 2 : 256;
+    struct eshell_cp_link *seen = calloc(capacity, sizeof(*seen));
+
+    if (!seen) {
+      fprintf(stderr, "eshell: allocation error\n");
+
+      exit(EXIT_FAILURE);
+    }
+
+    for (k = 0; k < cp->seen_capacity; k++) {
+      if (cp->seen[k].path) {
+        size_t j = (cp->seen[k].dev * 31 + cp->seen[k].ino) *
+                   0x9E3779B97F4A7C15ULL >> 20 & (capacity - 1);
+
+        while (seen[j].path) {
+          j = (j + 1) & (capacity - 1);
+        }
+
+        seen[j] = cp->seen[k];
+      }
+    }
+
+    free(cp->seen);
+    cp->seen = seen;
+    cp->seen_capacity = capacity;
+  }
+
+  mask = cp->seen_capacity - 1;
+
+  for (k = (dev * 31 + ino) * 0x9E3779B97F4A7C15ULL >> 20 & mask;
+       cp->seen[k].path; k = (k + 1) & mask) {
+    if (cp->seen[k].dev == dev && cp->seen[k].ino == ino) {
+      first = cp->seen[k].path;
+
+      break;
+    }
+  }
+
+  if (first == NULL) {
+    cp->seen[k].dev = dev;
+    cp->seen[k].ino = ino;
+    cp->seen[k].path = strdup(path);
+    cp->num_seen++;
+
+    if (!cp->seen[k].path) {
+      fprintf(stderr, "eshell: allocation error\n");
+
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  pthread_mutex_unlock(&cp->lock);
+
+  return first;
+}
+
+/**
+  @brief        Copy part of a file, in the kernel if it can be.
+  @param  in     The file.
+  @param  out    The copy.
+  @param  offset Where the part starts.
+  @param  len    Its length.
+  @return        0, or an error number.
+*/
+int eshell_cp_data(int in, int out, off_t offset, off_t len) {
+  off_t end = offset + len;
+  char *buf = NULL;
+  ssize_t n;
+
+  while (offset < end) {
+    loff_t from = offset, to = offset;
+
+    n = copy_file_range(in, &from, out, &to, end - offset, 0);
+
+    if (n > 0) {
+      offset += n;
+    } else if (n == 0) {
+      break;
+    } else if (errno == EINTR) {
+      continue;
+    } else if (errno == EXDEV || errno == ENOSYS || errno == EINVAL ||
+               errno == EOPNOTSUPP) {
+      break;
+    } else {
+      return errno;
+    }
+  }
+
+  // Between filesystems that can't, or on older kernels, it's read through
+  while (offset < end) {
+    ssize_t m, done;
+
+    if (!buf && !(buf = malloc(ESHELL_MAP_MIN))) {
+      fprintf(stderr, "eshell: allocation error\n");
+
+      exit(EXIT_FAILURE);
+    }
+
+    n = pread(in, buf, end - offset < ESHELL_MAP_MIN ? end - offset :
+              ESHELL_MAP_MIN, offset);
+
+    if (n <= 0) {
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+
+      free(buf);
+
+      return n < 0 ? errno : 0;
+    }
+
+    for (done = 0; done < n; done += m) {
+      m = pwrite(out, buf + done, n - done, offset + done);
+
+      if (m < 0 && errno != EINTR) {
+        int err = errno;
+
+        free(buf);
+
+        return err;
+      }
+
+      m = m < 0 ? 0 : m;
+    }
+
+    offset += n;
+  }
+
+  free(buf);
+
+  return 0;
+}
+
+/**
+  @brief     Give a copied file its owner, mode and times, for -p.
+  @param  fd  The copy.
+  @param  st  The file's.
+  @return     0, or an error number.
+*/
+int eshell_cp_attrs(int fd, struct stat *st) {
+  struct timespec times[2] = { st->st_atim, st->st_mtim };
+  mode_t mode = st->st_mode & 07777;
+
+  // Only root can give files away; set-ID bits don't outlive that
+  if (fchown(fd, st->st_uid, st->st_gid) != 0) {
+    mode &= ~(S_ISUID | S_ISGID);
+  }
+
+  if (fchmod(fd, mode) != 0 || futimens(fd, times) != 0) {
+    return errno;
+  }
+
+  return 0;
+}
+
+/**
+  @brief      Finish copying a file in ranges.
+  @param  w    The walk.
+  @param  file The file.
+*/
+void eshell_cp_file_done(struct eshell_walk *w, struct eshell_cp_file *file) {
+  struct eshell_cp *cp = w->tool_data;
+
+  if (file->err == 0 && cp->preserve) {
+    file->err = eshell_cp_attrs(file->out, &file->st);
+  }
+
+  if (close(file->out) != 0 && file->err == 0) {
+    file->err = errno;
+  }
+
+  if (file->err) {
+    eshell_walk_error(w, file->dir, file->name, "cannot copy", file->err);
+
+    if (file->dir) {
+      __atomic_store_n(&file->dir->failed, true, __ATOMIC_RELAXED);
+    }
+  }
+
+  close(file->in);
+  free(file);
+}
+
+/**
+  @brief      Task: copy a range of a big file.
+  @param  w    The walk.
+  @param  task The range.
+*/
+void eshell_cp_range_run(struct eshell_walk *w, struct eshell_walk_task *task) {
+  struct eshell_cp_range *range = (struct eshell_cp_range *) task;
+  struct eshell_cp_file *file = range->file;
+  int err = eshell_cp_data(file->in, file->out, range->offset, range->len);
+
+  if (err) {
+    int none = 0;
+
+    __atomic_compare_exchange_n(&file->err, &none, err, false,
+                                __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+  }
+
+  __atomic_fetch_add(&copies.ranges, 1, __ATOMIC_RELAXED);
+
+  if (__atomic_sub_fetch(&file->remaining, 1, __ATOMIC_ACQ_REL) == 0) {
+    eshell_cp_file_done(w, file);
+  }
+
+  free(range);
+}
+
+/**
+  @brief      Copy a regular file.
+  @param  w    The walk.
+  @param  dir  The directory it's in, for messages, or NULL.
+  @param  in   The file, open.
+  @param  st   The file's.
+  @param  to   The directory to copy it to, or AT_FDCWD.
+  @param  name The copy's name.
+  @param  src  The file's name, for messages.
+  @return      0, or an error number.
+*/
+int eshell_cp_regular(struct eshell_walk *w, struct eshell_walk_dir *dir,
+                      int in, struct stat *st, int to, const char *name,
+                      const char *src) {
+  struct eshell_cp *cp = w->tool_data;
+  int out, err = 0;
+
+  out = openat(to, name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+               st->st_mode & 0777);
+
+  if (out < 0) {
+    return errno;
+  }
+
+  __atomic_fetch_add(&copies.files, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&copies.bytes, st->st_size, __ATOMIC_RELAXED);
+
+  // Sharing the blocks is quickest, where the filesystem can
+  if (!__atomic_load_n(&cp->no_clone, __ATOMIC_RELAXED) && st->st_size > 0) {
+    if (ioctl(out, FICLONE, in) == 0) {
+      __atomic_fetch_add(&copies.cloned, 1, __ATOMIC_RELAXED);
+      st->st_size = 0;
+    } else if (errno == EOPNOTSUPP || errno == ENOTTY || errno == EINVAL ||
+               errno == EXDEV || errno == ENOSYS) {
+      __atomic_store_n(&cp->no_clone, true, __ATOMIC_RELAXED);
+    }
+  }
+
+  // A big file is cut into ranges for whichever workers are free
+  if (st->st_size >= 2 * ESHELL_CP_RANGE && w->num_workers > 1 &&
+      ftruncate(out, st->st_size) == 0) {
+    size_t len = strlen(src);
+    struct eshell_cp_file *file = malloc(sizeof(*file) + len + 1);
+    off_t offset;
+
+    if (!file) {
+      fprintf(stderr, "eshell: allocation error\n");
+
+      exit(EXIT_FAILURE);
+    }
+
+    file->dir = dir;
+    file->in = in;
+    file->out = out;
+    file->st = *st;
+    file->err = 0;
+    file->remaining = (st->st_size + ESHELL_CP_RANGE - 1) / ESHELL_CP_RANGE;
+    memcpy(file->name, src, len + 1);
+
+    for (offset = 0; offset < st->st_size; offset += ESHELL_CP_RANGE) {
+      struct eshell_cp_range *range = malloc(sizeof(*range));
+
+      if (!range) {
+        fprintf(stderr, "eshell: allocation error\n");
+
+        exit(EXIT_FAILURE);
+      }
+
+      range->task.dir = dir;
+      range->task.run = eshell_cp_range_run;
+      range->file = file;
+      range->offset = offset;
+      range->len = st->st_size - offset < ESHELL_CP_RANGE ?
+                   st->st_size - offset : ESHELL_CP_RANGE;
+      eshell_walk_task_push(w, &range->task);
+    }
+
+    return -1;
+  }
+
+  if (st->st_size > 0) {
+    err = eshell_cp_data(in, out, 0, st->st_size);
+  }
+
+  if (err == 0 && cp->preserve) {
+    err = eshell_cp_attrs(out, st);
+  }
+
+  if (close(out) != 0 && err == 0) {
+    err = errno;
+  }
+
+  return err;
+}
+
+/**
+  @brief      Copy something that isn't a directory.
+  @param  w    The walk.
+  @param  dir  The directory it's in, or NULL for a path of its own.
+  @param  fd   That directory, or AT_FDCWD.
+  @param  name Its name.
+  @param  to   The directory to copy it to, or AT_FDCWD.
+  @param  dest The copy's name.
+  @return      False if it couldn't be copied, which has been reported.
+*/
+bool eshell_cp_copy(struct eshell_walk *w, struct eshell_walk_dir *dir,
+                    int fd, const char *name, int to, const char *dest) {
+  struct eshell_cp *cp = w->tool_data;
+  int follow = cp->recursive ? O_NOFOLLOW : 0;
+  const char *what = "cannot copy";
+  struct stat st;
+  int in = -1, err = 0;
+
+  if (fstatat(fd, name, &st, cp->recursive ? AT_SYMLINK_NOFOLLOW : 0) != 0) {
+    eshell_walk_error(w, dir, name, "cannot stat", errno);
+
+    return false;
+  }
+
+  // With -a, later links to a file are linked to its first copy
+  if (cp->links && st.st_nlink > 1) {
+    char path[PATH_MAX];
+    const char *first;
+
+    if (dir == NULL) {
+      snprintf(path, sizeof(path), "%s", dest);
+    } else if (!eshell_cp_target(cp, dir, path, sizeof(path)) ||
+               strlen(path) + strlen(dest) + 2 > sizeof(path)) {
+      eshell_walk_error(w, dir, name, what, ENAMETOOLONG);
+
+      return false;
+    } else {
+      strcat(strcat(path, "/"), dest);
+    }
+
+    if ((first = eshell_cp_link(cp, &st, path))) {
+      if (linkat(AT_FDCWD, first, to, dest, 0) != 0) {
+        eshell_walk_error(w, dir, name, "cannot create hard link", errno);
+
+        return false;
+      }
+
+      return true;
+    }
+  }
+
+  if (S_ISREG(st.st_mode)) {
+    if ((in = openat(fd, name, O_RDONLY | O_CLOEXEC | follow)) < 0) {
+      eshell_walk_error(w, dir, name, "cannot open", errno);
+
+      return false;
+    }
+
+    // Once it's cut into ranges, they see to the rest
+    if ((err = eshell_cp_regular(w, dir, in, &st, to, dest, name)) < 0) {
+      return true;
+    }
+
+    close(in);
+  } else if (S_ISLNK(st.st_mode)) {
+    char target[PATH_MAX];
+    ssize_t len = readlinkat(fd, name, target, sizeof(target) - 1);
+
+    what = "cannot create symbolic link";
+
+    if (len < 0) {
+      err = errno;
+    } else {
+      struct timespec times[2] = { st.st_atim, st.st_mtim };
+
+      target[len] = '\0';
+
+      if (symlinkat(target, to, dest) != 0) {
+        err = errno;
+      } else if (cp->preserve) {
+        if (fchownat(to, dest, st.st_uid, st.st_gid,
+                     AT_SYMLINK_NOFOLLOW) != 0) {
+          errno = 0;
+        }
+
+        if (utimensat(to, dest, times, AT_SYMLINK_NOFOLLOW) != 0) {
+          err = errno;
+        }
+      }
+    }
+  } else {
+    struct timespec times[2] = { st.st_atim, st.st_mtim };
+
+    what = "cannot create special file";
+
+    if (mknodat(to, dest, st.st_mode & (S_IFMT | 0777), st.st_rdev) != 0) {
+      err = errno;
+    } else if (cp->preserve) {
+      mode_t mode = st.st_mode & 07777;
+
+      if (fchownat(to, dest, st.st_uid, st.st_gid, 0) != 0) {
+        mode &= ~(S_ISUID | S_ISGID);
+      }
+
+      if (fchmodat(to, dest, mode, 0) != 0 ||
+          utimensat(to, dest, times, 0) != 0) {
+        err = errno;
+      }
+    }
+  }
+
+  if (err) {
+    eshell_walk_error(w, dir, name, what, err);
+
+    return false;
+  }
+
+  return true;
+}
+
+/**
+  @brief Entry handler for cp: copy it into the directory's copy.
+*/
+bool eshell_cp_entry(struct eshell_walk *w, struct eshell_walk_dir *dir,
+                     int fd, const char *name, unsigned char type) {
+  if (dir->target < 0) {
+    return false;
+  }
+
+  return eshell_cp_copy(w, dir, fd, name, dir->target, name);
+}
+
+/**
+  @brief      Report a failure on a directory's copy, by the copy's path.
+  @param  w    The walk.
+  @param  dir  The directory.
+  @param  what What couldn't be done.
+  @param  err  The errno.
+*/
+void eshell_cp_target_error(struct eshell_walk *w, struct eshell_walk_dir *dir,
+                            const char *what, int err) {
+  char path[PATH_MAX];
+
+  if (eshell_cp_target(w->tool_data, dir, path, sizeof(path))) {
+    eshell_walk_error(w, NULL, path, what, err);
+  } else {
+    eshell_walk_error(w, dir, NULL, what, err);
+  }
+}
+
+/**
+  @brief Enter handler for cp: make the directory's copy, with room for its
+           owner to fill it, in its parent's copy, and open it.
+*/
+void eshell_cp_enter(struct eshell_walk *w, struct eshell_walk_dir *dir,
+                     int fd) {
+  struct eshell_cp *cp = w->tool_data;
+  const char *name = dir->name;
+  int at = AT_FDCWD;
+  struct stat st;
+  bool made;
+  int k;
+
+  if (fstat(fd, &st) != 0) {
+    eshell_walk_error(w, dir, NULL, "cannot stat", errno);
+
+    return;
+  }
+
+  // A copy named on the command line is a path, anything under it a name
+  if (dir->parent == NULL) {
+    for (k = 0; cp->roots[k] != dir; k++);
+
+    name = cp->targets[k];
+  } else if ((at = dir->parent->target) < 0) {
+    // Its parent's copy failed, which has been reported
+    dir->failed = true;
+
+    return;
+  }
+
+  made = mkdirat(at, name, (st.st_mode & 0777) | S_IRWXU) == 0;
+
+  if (!made && errno != EEXIST) {
+    eshell_cp_target_error(w, dir, "cannot create directory", errno);
+
+    return;
+  }
+
+  dir->target = openat(at, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC |
+                       (dir->parent ? O_NOFOLLOW : 0));
+
+  if (dir->target < 0) {
+    eshell_cp_target_error(w, dir, "cannot open directory", errno);
+
+    return;
+  }
+
+  // Kept for when it's left if there's anything to set then
+  if (cp->preserve || (made && (st.st_mode & S_IRWXU) != S_IRWXU)) {
+    if (!(dir->data = malloc(sizeof(st)))) {
+      fprintf(stderr, "eshell: allocation error\n");
+
+      exit(EXIT_FAILURE);
+    }
+
+    if (!cp->preserve) {
+      st.st_mode &= ~cp->umask;
+    }
+
+    memcpy(dir->data, &st, sizeof(st));
+  }
+}
+
+/**
+  @brief Leave handler for cp: give the directory's copy its mode, and with
+           -p its owner and times, now nothing more is made in it, and close
+           it.
+*/
+void eshell_cp_leave(struct eshell_walk *w, struct eshell_walk_dir *dir,
+                     int fd) {
+  struct eshell_cp *cp = w->tool_data;
+  struct stat *st = dir->data;
+  mode_t mode;
+
+  if (dir->target < 0) {
+    return;
+  }
+
+  if (st) {
+    mode = st->st_mode & 07777;
+
+    if (cp->preserve) {
+      struct timespec times[2] = { st->st_atim, st->st_mtim };
+
+      if (fchown(dir->target, st->st_uid, st->st_gid) != 0) {
+        mode &= ~(S_ISUID | S_ISGID);
+      }
+
+      if (fchmod(dir->target, mode) != 0 ||
+          futimens(dir->target, times) != 0) {
+        eshell_cp_target_error(w, dir, "cannot preserve attributes of",
+                               errno);
+      }
+    } else if (fchmod(dir->target, mode) != 0) {
+      eshell_cp_target_error(w, dir, "cannot set permissions of", errno);
+    }
+
+    free(dir->data);
+    dir->data = NULL;
+  }
+
+  close(dir->target);
+  dir->target = -1;
+}
+
+/**
+  @brief  The umask, read without changing it while other threads might be
+            making files.
+  @return The umask.
+*/
+mode_t eshell_cp_umask(void) {
+  char line[128];
+  unsigned int mask = 022;
+  FILE *f = fopen("/proc/self/status", "re");
+
+  if (f) {
+    while (fgets(line, sizeof(line), f) &&
+           sscanf(line, "Umask: %o", &mask) != 1);
+
+    fclose(f);
+  }
+
+  return mask;
+}
+
+/**
+  @brief       Builtin command: copy files, and trees with -r, spreading
+                 directories and the ranges of big files across the CPUs.
+  @param  args `cp [-r] [-p] [-a] SOURCE... DEST`; anything else is left to
+                 cp itself.
+  @return      Always return 1 to continue executing the shell.
+*/
+int eshell_cp(char **args) {
+  struct eshell_cp cp;
+  struct eshell_walk *w;
+  struct stat st, to;
+  char real[PATH_MAX], parent[PATH_MAX], inside[PATH_MAX];
+  char *dest;
+  bool into;
+  size_t k;
+  int num, i;
+
+  if (!eshell_cp_parse(args, &cp)) {
+    return eshell_builtin_external(args);
+  }
+
+  for (num = 0; args[cp.files + num]; num++);
+
+  if (num < 2) {
+    fprintf(stderr, "eshell: usage: cp [-r] [-p] [-a] SOURCE... DEST\n");
+    eshell_status = 2;
+
+    return 1;
+  }
+
+  dest = args[cp.files + --num];
+  into = stat(dest, &to) == 0 && S_ISDIR(to.st_mode);
+
+  if (num > 1 && !into) {
+    fprintf(stderr, "eshell: cp: target '%s' is not a directory\n", dest);
+    eshell_status = 1;
+
+    return 1;
+  }
+
+  cp.umask = eshell_cp_umask();
+  cp.num_roots = num;
+  cp.roots = calloc(num, sizeof(*cp.roots));
+  cp.targets = calloc(num, sizeof(*cp.targets));
+
+  if (!cp.roots || !cp.targets) {
+    fprintf(stderr, "eshell: allocation error\n");
+
+    exit(EXIT_FAILURE);
+  }
+
+  pthread_mutex_init(&cp.lock, NULL);
+  w = eshell_walk_new("cp");
+  w->tool_data = &cp;
+  w->entry = eshell_cp_entry;
+  w->enter = eshell_cp_enter;
+  w->leave = eshell_cp_leave;
+
+  for (i = 0; i < num; i++) {
+    char *src = args[cp.files + i];
+    char *target;
+    size_t len = strlen(src);
+
+    // Into a directory, a copy takes the last part of its source's name
+    if (into) {
+      char *base;
+
+      while (len > 1 && src[len - 1] == '/') {
+        len--;
+      }
+
+      for (base = src + len; base > src && base[-1] != '/'; base--);
+
+      if (asprintf(&target, "%s%s%.*s", dest, dest[strlen(dest) - 1] == '/' ?
+                   "" : "/", (int) (src + len - base), base) < 0) {
+        target = NULL;
+      }
+    } else {
+      target = strdup(dest);
+    }
+
+    if (!target) {
+      fprintf(stderr, "eshell: allocation error\n");
+
+      exit(EXIT_FAILURE);
+    }
+
+    cp.targets[i] = target;
+
+    if ((cp.recursive ? lstat(src, &st) : stat(src, &st)) != 0) {
+      eshell_walk_error(w, NULL, src, "cannot stat", errno);
+    } else if (S_ISDIR(st.st_mode)) {
+      char *slash;
+
+      if (!cp.recursive) {
+        fprintf(stderr, "eshell: cp: -r not specified; omitting directory "
+                "'%s'\n", src);
+        w->errors++;
+
+        continue;
+      }
+
+      // The copy's directory mustn't be inside the source
+      snprintf(parent, sizeof(parent), "%s", target);
+      slash = strrchr(parent, '/');
+
+      if (slash == parent) {
+        slash[1] = '\0';
+      } else if (slash) {
+        *slash = '\0';
+      } else {
+        strcpy(parent, ".");
+      }
+
+      if (realpath(src, real) && realpath(parent, inside) &&
+          strncmp(inside, real, strlen(real)) == 0 &&
+          (inside[strlen(real)] == '\0' || inside[strlen(real)] == '/' ||
+           strcmp(real, "/") == 0)) {
+        fprintf(stderr, "eshell: cp: cannot copy a directory, '%s', into "
+                "itself, '%s'\n", src, target);
+        w->errors++;
+
+        continue;
+      }
+
+      cp.roots[i] = eshell_walk_dir_new(NULL, src);
+      eshell_walk_push(w, i % w->num_workers, cp.roots[i]);
+    } else if (stat(target, &to) == 0 && to.st_dev == st.st_dev &&
+               to.st_ino == st.st_ino) {
+      fprintf(stderr, "eshell: cp: '%s' and '%s' are the same file\n", src,
+              target);
+      w->errors++;
+    } else {
+      eshell_cp_copy(w, NULL, AT_FDCWD, src, AT_FDCWD, target);
+    }
+  }
+
+  eshell_walk_run(w);
+  eshell_status = w->errors > 0;
+
+  for (i = 0; i < num; i++) {
+    free(cp.targets[i]);
+  }
+
+  for (k = 0; k < cp.seen_capacity; k++) {
+    free(cp.seen[k].path);
+  }
+
+  pthread_mutex_destroy(&cp.lock);
+  free(cp.seen);
+  free(cp.roots);
+  free(cp.targets);
+  free(w);
+
+  return 1;
+}
+
+/**
+  @brief       Check whether a thread-safe builtin can carry out a command by
+                 itself, without the program of the same name.
+  @param  i    The builtin.
+  @param  args The command.
+  @return      True if it can.
+*/
+bool eshell_builtin_inline(int i, char **args) {
+  int (*fn)(char **) = builtin_func[i];
+  union {
+    struct eshell_cut cut;
+    struct eshell_tr tr;
+    struct eshell_uniq uniq;
+    struct eshell_du du;
+    struct eshell_rm rm;
+    struct eshell_cp cp;
+  } opts;
+
+  if (fn == eshell_cat) {
+    return eshell_cat_plain(args);
+  }
+
+  if (fn == eshell_cut) {
+    return eshell_cut_parse(args, &opts.cut);
+  }
+
+  if (fn == eshell_tr) {
+    return eshell_tr_parse(args, &opts.tr);
+  }
+
+  if (fn == eshell_uniq) {
+    return eshell_uniq_parse(args, &opts.uniq);
+  }
+
+  if (fn == eshell_du) {
+    return eshell_du_parse(args, &opts.du);
+  }
+
+  if (fn == eshell_rm) {
+    return eshell_rm_parse(args, &opts.rm);
+  }
+
+  if (fn == eshell_cp) {
+    return eshell_cp_parse(args, &opts.cp);
+  }
+
+  return true;
+}
+/*
+  Plugins: shared objects whose builtins run in the shell like its own. They
+  get the table of eshell_plugin.h rather than linking against the shell, so
+  one built for an ABI keeps working with every shell that speaks it. Their
+  builtins go after the shell's in the builtin tables, which have room for
+  them, so nothing moves while other threads might be looking; the dispatch
+  generation is bumped so call sites that resolved the name to something
+  else look again.
+*/
+struct eshell_plugin {
+  struct eshell_plugin *next;
+  void *handle;
+  char *path;
+  int first;                        // Its builtins, in the tables
+  int count;
+};
+
+struct eshell_plugin_stats {
+  unsigned long loaded;
+  unsigned long builtins;
+} plugins;
+
+struct eshell_plugin *plugin_list;
+struct eshell_plugin *plugin_loading;  // Whose init is running
+
+/**
+  @brief       Add a plugin's builtin.
+  @param  name  Its name.
+  @param  fn    Its function.
+  @param  flags ESHELL_PLUGIN_THREADSAFE, or 0.
+  @return       0, or -1 if there's no room or the name is taken.
+*/
+int eshell_plugin_register(const char *name, int (*fn)(char **args),
+                           unsigned int flags) {
+  int n = eshell_num_builtins();
+  char *copy;
+
+  if (plugin_loading == NULL || eshell_worker ||
+      eshell_builtin_find(name) >= 0) {
+    return -1;
+  }
+
+  if (n >= ESHELL_BUILTIN_MAX || (copy = strdup(name)) == NULL) {
+    return -1;
+  }
+
+  if (plugin_loading->count == 0) {
+    plugin_loading->first = n;
+  }
+
+  // Filled in before it's counted, for anything reading on other threads
+  builtin_str[n] = copy;
+  builtin_func[n] = fn;
+  builtin_flags[n] = flags & ESHELL_BUILTIN_THREADSAFE;
+  __atomic_store_n(&builtin_count, n + 1, __ATOMIC_RELEASE);
+
+  plugin_loading->count++;
+  plugins.builtins++;
+  free(builtin_atoms);
+  builtin_atoms = NULL;
+  eshell_dispatch_generation++;
+
+  return 0;
+}
+
+/**
+  @brief      Write a plugin builtin's output.
+  @param buf  Bytes to write.
+  @param len  Number of bytes.
+  @return     0, or -1 if not everything was written.
+*/
+int eshell_plugin_write(const void *buf, size_t len) {
+  return eshell_out_write(buf, len) ? 0 : -1;
+}
+
+/**
+  @brief  Where a plugin builtin's input is.
+  @return The descriptor.
+*/
+int eshell_plugin_input(void) {
+  return eshell_in_fd;
+}
+
+/**
+  @brief        Set a plugin builtin's exit status.
+  @param status The status.
+*/
+void eshell_plugin_status(int status) {
+  eshell_status = status;
+}
+
+/**
+  @brief     Read a line of a plugin builtin's input.
+  @param len Receives its length.
+  @return    The line, or NULL at the end or off the shell's thread.
+*/
+const char *eshell_plugin_read_line(size_t *len) {
+  return eshell_worker ? NULL : eshell_fdbuf_line(eshell_in_fd, len);
+}
+
+/**
+  @brief      A variable's value, for a plugin.
+  @param name Its name.
+  @return     The value, the first element of an array, or NULL.
+*/
+const char *eshell_plugin_get(const char *name) {
+  struct eshell_array *a;
+
+  if (eshell_worker) {
+    return NULL;
+  }
+
+  a = eshell_array_find(name);
+
+  return a ? eshell_array_at(a, 0) : getenv(name);
+}
+
+/**
+  @brief       Set a variable, for a plugin.
+  @param  name  Its name.
+  @param  value Its value.
+  @return       0, or -1 if it can't be set.
+*/
+int eshell_plugin_set(const char *name, const char *value) {
+  if (eshell_worker || !eshell_var_name(name, strlen(name))) {
+    return -1;
+  }
+
+  eshell_assign_value(name, value);
+
+  return 0;
+}
+
+/**
+  @brief      Space in the arena, for a plugin.
+  @param size Bytes wanted.
+  @return     The space, or NULL off the shell's thread.
+*/
+void *eshell_plugin_alloc(size_t size) {
+  // Kept aligned for whatever the plugin puts there
+  return eshell_worker ? NULL : eshell_arena_alloc((size + 15) & ~15);
+}
+
+/**
+  @brief   Intern a string, for a plugin.
+  @param s The string.
+  @return  Its atom, or NULL off the shell's thread.
+*/
+const char *eshell_plugin_intern(const char *s) {
+  return eshell_worker ? NULL : eshell_intern(s);
+}
+
+/**
+  @brief  The arena's generation, for a plugin.
+  @return The generation.
+*/
+unsigned long eshell_plugin_generation(void) {
+  return intern.generation;
+}
+
+const struct eshell_plugin_api eshell_plugin_table = {
+  .abi = ESHELL_PLUGIN_ABI,
+  .size = sizeof(struct eshell_plugin_api),
+  .register_builtin = eshell_plugin_register,
+  .write = eshell_plugin_write,
+  .printf = eshell_out_printf,
+  .input = eshell_plugin_input,
+  .status = eshell_plugin_status,
+  .read_line = eshell_plugin_read_line,
+  .get = eshell_plugin_get,
+  .set = eshell_plugin_set,
+  .alloc = eshell_plugin_alloc,
+  .intern = eshell_plugin_intern,
+  .generation = eshell_plugin_generation
+};
+
+/**
+  @brief      Load a plugin and let it register its builtins.
+  @param path The shared object; without a slash it's looked for where the
+                dynamic linker looks.
+  @return     True if it was loaded, or had been already.
+*/
+bool eshell_plugin_load(const char *path) {
+  struct eshell_plugin *p;
+  const uint32_t *abi;
+  int (*init)(const struct eshell_plugin_api *);
+  void *handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+
+  if (handle == NULL) {
+    fprintf(stderr, "eshell: plugin: %s\n", dlerror());
+
+    return false;
+  }
+
+  // The same object opened again has the same handle
+  for (p = plugin_list; p; p = p->next) {
+    if (p->handle == handle) {
+      dlclose(handle);
+
+      return true;
+    }
+  }
+
+  abi = dlsym(handle, "eshell_plugin_abi");
+  *(void **) &init = dlsym(handle, "eshell_plugin_init");
+
+  if (abi == NULL || init == NULL) {
+    fprintf(stderr, "eshell: plugin: %s: not an eshell plugin\n", path);
+    dlclose(handle);
+
+    return false;
+  }
+
+  if (*abi != ESHELL_PLUGIN_ABI) {
+    fprintf(stderr, "eshell: plugin: %s: built for ABI %u, not %u\n", path,
+            *abi, ESHELL_PLUGIN_ABI);
+    dlclose(handle);
+
+    return false;
+  }
+
+  if ((p = calloc(1, sizeof(*p))) == NULL ||
+      (p->path = strdup(path)) == NULL) {
+    fprintf(stderr, "eshell: allocation error\n");
+
+    exit(EXIT_FAILURE);
+  }
+
+  p->handle = handle;
+  plugin_loading = p;
+
+  if (init(&eshell_plugin_table) != 0) {
+    plugin_loading = NULL;
+
+    // Builtins it registered stay in the tables, so it can't be unloaded
+    if (p->count > 0) {
+      fprintf(stderr, "eshell: plugin: %s: failed after adding builtins\n",
+              path);
+    } else {
+      fprintf(stderr, "eshell: plugin: %s: failed to start\n", path);
+      dlclose(handle);
+      free(p->path);
+      free(p);
+
+      return false;
+    }
+  }
+
+  plugin_loading = NULL;
+  p->next = plugin_list;
+  plugin_list = p;
+  plugins.loaded++;
+
+  return true;
+}
+
+/**
+  @brief       Builtin command: load plugins, or list those loaded.
+  @param  args `plugin [FILE...]`.
+  @return      Always return 1 to continue executing the shell.
+*/
+int eshell_plugin(char **args) {
+  struct eshell_plugin *p;
+  int i;
+
+  if (args[1] == NULL) {
+    for (p = plugin_list; p; p = p->next) {
+      printf("%s:", p->path);
+
+      for (i = p->first; i < p->first + p->count; i++) {
+        printf(" %s", builtin_str[i]);
+      }
+
+      printf("\n");
+    }
+
+    return 1;
+  }
+
+  for (i = 1; args[i]; i++) {
+    if (!eshell_plugin_load(args[i])) {
+      eshell_status = 1;
+    }
+  }
+
+  return 1;
+}
+
+/*
+  Pipelines. `A | B | C`, with the bars as words of their own, connects the
+  stages with pipes. A thread-safe builtin that can carry out its stage by
+  itself runs as a thread of the shell, reading and writing the pipes
+  directly, and the last stage runs on the shell's own thread; other stages
+  are forked, binaries straight into execv. Every stage is expanded when the
+  pipeline starts, except constructs, which expand as they go. The status is
+  the last stage's.
+*/
+struct eshell_stage {
+  char **args;
+  char **expanded;
+  int in;                           // Descriptors it reads and writes
+  int out;
+  int builtin;                      // Builtin run as a thread, or -1
+  pid_t pid;
+  pthread_t thread;
+  bool started;
+  int status;
+};
+
+struct eshell_pipeline_stats {
+  unsigned long runs;
+  unsigned long threaded;           // Stages run as threads
+  unsigned long forked;             // Stages run as children
+} pipelines;
+
+/**
+  @brief       Check whether a command is a pipeline.
+  @param  args The command.
+  @return      True if any of its words is a bar.
+*/
+bool eshell_pipeline_find(char **args) {
+  int i;
+
+  for (i = 0; args[i]; i++) {
+    if (strcmp(args[i], "|") == 0) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+/**
+  @brief Prepare a forked copy of the shell to run a stage by itself. It
+           waits for its own children through an eventfd and epoll set of its
+           own, and leaves auditing to the shell, which records the pipeline
+           as a whole.
+*/
+void eshell_subshell_init(void) {
+  // The shell's coroutines, if it was forked from one, are the shell's to run
+  executor.list = NULL;
+  executor.current = NULL;
+
+  close(child_ring.efd);
+  child_ring.efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+  if (executor.epfd >= 0) {
+    close(executor.epfd);
+    executor.epfd = -1;
+    executor.children = false;
+  }
+
+  if (audit.fd >= 0) {
+    close(audit.fd);
+    audit.fd = -1;
+    audit.len = 0;
+  }
+
+  // The shell traced the whole command already
+  xtrace.on = false;
+  xtrace.len = 0;
+}
+
+/**
+  @brief     Thread: run one builtin stage.
+  @param arg The stage.
+  @return    NULL.
+*/
+void *eshell_stage_thread(void *arg) {
+  struct eshell_stage *st = arg;
+
+  eshell_worker = true;
+  eshell_in_fd = st->in;
+  eshell_out_fd = st->out;
+  eshell_status = 0;
+  (*builtin_func[st->builtin])(st->expanded);
+  st->status = eshell_status;
+
+  // Let the stages either side see the end of their pipes
+  if (st->in != STDIN_FILENO) {
+    close(st->in);
+  }
+
+  if (st->out != STDOUT_FILENO) {
+    close(st->out);
+  }
+
+  return NULL;
+}
+
+/**
+  @brief       Run a pipeline.
+  @param  args The command, with its stages separated by bars.
+  @return      Always return 1 to continue executing the shell.
+*/
+int eshell_pipeline(char **args) {
+  uint64_t start = eshell_now_ns();
+  struct eshell_stage *stages;
+  char path[PATH_MAX];
+  sigset_t all, old;
+  char **words;
+  int *pipes;
+  int num_stages = 1;
+  int i, k;
+
+  for (i = 0; args[i]; i++) {
+    num_stages += strcmp(args[i], "|") == 0;
+  }
+
+  // The words are cut up in a copy; args may be a call site's
+  stages = calloc(num_stages, sizeof(struct eshell_stage));
+  pipes = malloc(2 * num_stages * sizeof(int));
+  words = malloc((i + 1) * sizeof(char *));
+
+  if (!stages || !pipes || !words) {
+    fprintf(stderr, "eshell: allocation error\n");
+
+    exit(EXIT_FAILURE);
+  }
+
+  memcpy(words, args, (i + 1) * sizeof(char *));
+
+  // Cut the words at the bars, and connect each stage to the next
+  for (i = k = 0; k < num_stages; k++) {
+    struct eshell_stage *st = &stages[k];
+
+    st->args = &words[i];
+
+    while (words[i] && strcmp(words[i], "|") != 0) {
+      i++;
+    }
+
+    if (words[i]) {
+      words[i++] = NULL;
+    }
+
+    st->expanded = st->args[0] && !eshell_construct(st->args[0]) ?
+                   eshell_expand(st->args) : st->args;
+    st->builtin = -1;
+    st->in = k == 0 ? STDIN_FILENO : pipes[2 * k - 2];
+    st->out = STDOUT_FILENO;
+
+    if (k < num_stages - 1) {
+      if (pipe2(&pipes[2 * k], O_CLOEXEC) != 0) {
+        perror("eshell: pipe");
+        pipes[2 * k] = pipes[2 * k + 1] = -1;
+      }
+
+      st->out = pipes[2 * k + 1];
+    }
+
+    if (st->expanded[0] && (st->builtin = eshell_builtin_find(
+                                st->expanded[0])) >= 0 &&
+        !((builtin_flags[st->builtin] & ESHELL_BUILTIN_THREADSAFE) &&
+          eshell_builtin_inline(st->builtin, st->expanded))) {
+      st->builtin = -1;
+    }
+  }
+
+  pipelines.runs++;
+  fflush(stdout);
+  eshell_fdbuf_sync_all();
+
+  // Children first, while the shell has no threads of its own running here
+  for (k = 0; k < num_stages; k++) {
+    struct eshell_stage *st = &stages[k];
+    bool binary;
+
+    if (st->builtin >= 0 || st->expanded[0] == NULL || st->in < 0 ||
+        st->out < 0) {
+      continue;
+    }
+
+    binary = !eshell_assignment(st->expanded) &&
+             eshell_builtin_find(st->expanded[0]) < 0 &&
+             eshell_function_find(st->expanded[0]) == NULL;
+
+    if (binary && !eshell_resolve(st->expanded[0], path, sizeof(path))) {
+      st->status = eshell_status;
+
+      continue;
+    }
+
+    st->pid = eshell_fork();
+
+    if (st->pid == 0) {
+      dup2(st->in, STDIN_FILENO);
+      dup2(st->out, STDOUT_FILENO);
+
+      for (i = 0; i < 2 * (num_stages - 1); i++) {
+        if (pipes[i] > STDOUT_FILENO) {
+          close(pipes[i]);
+        }
+      }
+
+      if (binary) {
+        execv(path, st->expanded);
+        perror("eshell: child process failed");
+
+        _exit(127);
+      }
+
+      // Anything else runs in a copy of the shell
+      eshell_subshell_init();
+      eshell_execute(st->expanded);
+      fflush(stdout);
+
+      _exit(eshell_status);
+    }
+
+    if (st->pid < 0) {
+      perror("eshell: error forking parent process");
+      st->status = 1;
+    }
+
+    pipelines.forked++;
+  }
+
+  // The ends the children have are theirs now
+  for (k = 0; k < num_stages; k++) {
+    struct eshell_stage *st = &stages[k];
+
+    if (st->builtin < 0) {
+      if (st->in > STDIN_FILENO) {
+        close(st->in);
+      }
+
+      if (st->out > STDOUT_FILENO) {
+        close(st->out);
+      }
+    }
+  }
+
+  // Builtins other than the last get threads, with signals left to the shell
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &old);
+
+  for (k = 0; k < num_stages - 1; k++) {
+    struct eshell_stage *st = &stages[k];
+
+    if (st->builtin >= 0) {
+      st->started = pthread_create(&st->thread, NULL, eshell_stage_thread,
+                                   st) == 0;
+      pipelines.threaded++;
+
+      // Without a thread it runs here; a full pipe would stop it, though
+      if (!st->started) {
+        eshell_stage_thread(st);
+      }
+    }
+  }
+
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+  if (stages[num_stages - 1].builtin >= 0) {
+    struct eshell_stage *st = &stages[num_stages - 1];
+
+    eshell_in_fd = st->in;
+    eshell_status = 0;
+    (*builtin_func[st->builtin])(st->expanded);
+    st->status = eshell_status;
+    eshell_in_fd = STDIN_FILENO;
+    pipelines.threaded++;
+
+    if (st->in != STDIN_FILENO) {
+      close(st->in);
+    }
+  }
+
+  for (k = 0; k < num_stages; k++) {
+    struct eshell_stage *st = &stages[k];
+
+    if (st->pid > 0) {
+      st->status = eshell_wait_child(st->pid);
+    }
+
+    if (st->started) {
+      pthread_join(st->thread, NULL);
+    }
+
+    if (st->expanded != st->args) {
+      free(st->expanded);
+    }
+  }
+
+  eshell_status = stages[num_stages - 1].status;
+  eshell_command_done(args, start);
+  free(stages);
+  free(pipes);
+  free(words);
+
+  return 1;
+}
+
+
+
+/*
+  Memoization of deterministic commands. The key is an XXH64 hash of the
+  command line, the working directory, a few environment variables and the
+  contents of the declared input files; the cached stdout, stderr and exit
+  status live in one file per key under $XDG_CACHE_HOME/eshell/memo.
+*/
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+
+#define ESHELL_MEMO_MAGIC 0x4f4d454dU    // "MEMO"
+
+struct eshell_memo_header {
+  uint32_t magic;
+  int32_t status;
+  uint64_t out_len;
+  uint64_t err_len;
+};
+
+struct eshell_memo_stats {
+  unsigned long hits;
+  unsigned long misses;
+  unsigned long bytes_replayed;
+} memo;
+
+/**
+  @brief Read 8 bytes from a possibly unaligned address.
+*/
+uint64_t eshell_read64(const unsigned char *p) {
+  uint64_t v;
+
+  memcpy(&v, p, sizeof(v));
+
+  return v;
+}
+
+/**
+  @brief Read 4 bytes from a possibly unaligned address.
+*/
+uint32_t eshell_read32(const unsigned char *p) {
+  uint32_t v;
+
+  memcpy(&v, p, sizeof(v));
+
+  return v;
+}
+
+/**
+  @brief One round of an XXH64 accumulator.
+*/
+uint64_t eshell_xxh_round(uint64_t acc, uint64_t input) {
+  acc += input * XXH_PRIME64_2;
+  acc = (acc << 31) | (acc >> 33);
+
+  return acc * XXH_PRIME64_1;
+}
+
+/**
+  @brief Fold an accumulator into the XXH64 result.
+*/
+uint64_t eshell_xxh_merge(uint64_t acc, uint64_t val) {
+  acc ^= eshell_xxh_round(0, val);
+
+  return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+/**
+  @brief       Mix the last bytes of an XXH64 input into the hash.
+  @param  h    The hash so far, with the length added.
+  @param  p    Bytes left over after the last whole stripe.
+  @param  end  Their end.
+  @return      The hash.
+*/
+uint64_t eshell_xxh_finish(uint64_t h, const unsigned char *p,
+                           const unsigned char *end) {
+  for (; p + 8 <= end; p += 8) {
+    h ^= eshell_xxh_round(0, eshell_read64(p));
+    h = ((h << 27) | (h >> 37)) * XXH_PRIME64_1 + XXH_PRIME64_4;
+  }
+
+  if (p + 4 <= end) {
+    h ^= (uint64_t) eshell_read32(p) * XXH_PRIME64_1;
+    h = ((h << 23) | (h >> 41)) * XXH_PRIME64_2 + XXH_PRIME64_3;
+    p += 4;
+  }
+
+  for (; p < end; p++) {
+    h ^= *p * XXH_PRIME64_5;
+    h = ((h << 11) | (h >> 53)) * XXH_PRIME64_1;
+  }
+
+  h ^= h >> 33;
+  h *= XXH_PRIME64_2;
+  h ^= h >> 29;
+  h *= XXH_PRIME64_3;
+  h ^= h >> 32;
+
+  return h;
+}
+
+/**
+  @brief       XXH64 of a buffer. The four accumulators are independent, so
+                 the bulk loop runs at memory speed on a superscalar core.
+  @param  data Bytes to hash.
+  @param  len  Number of bytes.
+  @param  seed Seed, used to chain several buffers into one hash.
+  @return      The hash.
+*/
+uint64_t eshell_xxh64(const void *data, size_t len, uint64_t seed) {
+  const unsigned char *p = data;
+  const unsigned char *end = p + len;
+  uint64_t h;
+
+  if (len >= 32) {
+    uint64_t v1 = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+    uint64_t v2 = seed + XXH_PRIME64_2;
+    uint64_t v3 = seed;
+    uint64_t v4 = seed - XXH_PRIME64_1;
+
+    do {
+      v1 = eshell_xxh_round(v1, eshell_read64(p));
+      v2 = eshell_xxh_round(v2, eshell_read64(p + 8));
+      v3 = eshell_xxh_round(v3, eshell_read64(p + 16));
+      v4 = eshell_xxh_round(v4, eshell_read64(p + 24));
+      p += 32;
+    } while (p + 32 <= end);
+
+    h = ((v1 << 1) | (v1 >> 63)) + ((v2 << 7) | (v2 >> 57)) +
+        ((v3 << 12) | (v3 >> 52)) + ((v4 << 18) | (v4 >> 46));
+    h = eshell_xxh_merge(h, v1);
+    h = eshell_xxh_merge(h, v2);
+    h = eshell_xxh_merge(h, v3);
+    h = eshell_xxh_merge(h, v4);
+  } else {
+    h = seed + XXH_PRIME64_5;
+  }
+
+  return eshell_xxh_finish(h + len, p, end);
+}
+
+/**
+  @brief       Fold a file's name and contents into a hash.
+  @param  path File to hash.
+  @param  h    Hash so far.
+  @return      The new hash, or 0 if the file couldn't be read.
+*/
+uint64_t eshell_xxh64_file(const char *path, uint64_t h) {
+  struct stat st;
+  void *data;
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    if (fd >= 0) {
+      close(fd);
+    }
+
+    return 0;
+  }
+
+  h = eshell_xxh64(path, strlen(path) + 1, h);
+
+  if (st.st_size > 0) {
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    if (data == MAP_FAILED) {
+      close(fd);
+
+      return 0;
+    }
+
+    h = eshell_xxh64(data, st.st_size, h);
+    munmap(data, st.st_size);
+  }
+
+  close(fd);
+
+  return h;
+}
+
+/**
+  @brief       Work out where memoized results are kept, creating it if needed.
+  @param  dir  Buffer to receive the directory.
+  @param  size Size of the buffer.
+  @return      True if the directory exists.
+*/
+bool eshell_memo_dir(char *dir, size_t size) {
+  const char *cache = getenv("XDG_CACHE_HOME");
+  const char *home = getenv("HOME");
+  char *p;
+
+  if (cache && *cache) {
+    snprintf(dir, size, "%s/eshell/memo", cache);
+  } else if (home) {
+    snprintf(dir, size, "%s/.cache/eshell/memo", home);
+  } else {
+    return false;
+  }
+
+  // mkdir -p
+  for (p = dir + 1; *p; p++) {
+    if (*p == '/') {
+      *p = '\0';
+      mkdir(dir, 0755);
+      *p = '/';
+    }
+  }
+
+  return mkdir(dir, 0755) == 0 || errno == EEXIST;
+}
+
+/**
+  @brief       Replay a memoized result.
+  @param  path The cache entry.
+  @return      True if the entry was valid and has been replayed.
+*/
+bool eshell_memo_replay(const char *path) {
+  struct eshell_memo_header hdr;
+  struct stat st;
+  unsigned char *data;
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  bool ok = false;
+
+  if (fd < 0) {
+    return false;
+  }
+
+  if (fstat(fd, &st) == 0 && (size_t) st.st_size >= sizeof(hdr) &&
+      (data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) !=
+      MAP_FAILED) {
+    memcpy(&hdr, data, sizeof(hdr));
+
+    // Anything truncated or foreign is treated as a miss
+    if (hdr.magic == ESHELL_MEMO_MAGIC &&
+        sizeof(hdr) + hdr.out_len + hdr.err_len == (uint64_t) st.st_size) {
+      fflush(stdout);
+      eshell_write_all(STDOUT_FILENO, data + sizeof(hdr), hdr.out_len);
+      eshell_write_all(STDERR_FILENO, data + sizeof(hdr) + hdr.out_len,
+                       hdr.err_len);
+      eshell_status = hdr.status;
+      memo.bytes_replayed += hdr.out_len + hdr.err_len;
+      ok = true;
+    }
+
+    munmap(data, st.st_size);
+  }
+
+  close(fd);
+
+  return ok;
+}
+
+/*
+  One captured output stream of a memoized command
+*/
+struct eshell_memo_stream {
+  int fd;                           // Read end of the child's pipe
+  int out;                          // Where to pass it through to
+  char *buf;
+  size_t len;
+  size_t cap;
+};
+
+/**
+  @brief     Coroutine: copy a stream through to ours while capturing it.
+  @param arg The stream.
+*/
+void eshell_memo_tee(void *arg) {
+  struct eshell_memo_stream *s = arg;
+  char chunk[16384];
+
+  while (1) {
+    ssize_t n = read(s->fd, chunk, sizeof(chunk));
+
+    if (n < 0 && errno == EAGAIN) {
+      eshell_co_wait_fd(s->fd, EPOLLIN);
+
+      continue;
+    }
+
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+
+    if (n <= 0) {
+      break;
+    }
+
+    eshell_write_all(s->out, chunk, n);
+
+    if (s->len + n > s->cap) {
+      s->cap = (s->len + n) * 2;
+      s->buf = realloc(s->buf, s->cap);
+
+      if (!s->buf) {
+        fprintf(stderr, "eshell: allocation error\n");
+
+        exit(EXIT_FAILURE);
+      }
+    }
+
+    memcpy(s->buf + s->len, chunk, n);
+    s->len += n;
+  }
+
+  close(s->fd);
+}
+
+/*
+  A child being waited on by a coroutine
+*/
+struct eshell_memo_child {
+  pid_t pid;
+  int status;
+};
+
+/**
+  @brief     Coroutine: reap the memoized command.
+  @param arg The child.
+*/
+void eshell_memo_reap(void *arg) {
+  struct eshell_memo_child *child = arg;
+
+  child->status = eshell_co_wait_child(child->pid);
+}
+
+/**
+  @brief       Run a command, passing its output through while capturing it.
+  @param  args Command to run.
+  @param  out  Receives the captured stdout, which must be freed.
+  @param  err  Receives the captured stderr, which must be freed.
+  @param  lens Receives the lengths of the two.
+  @return      True if the command ran; its exit status is in eshell_status.
+*/
+bool eshell_memo_run(char **args, char **out, char **err, size_t lens[2]) {
+  struct eshell_memo_stream streams[2];
+  struct eshell_memo_child child;
+  char path[PATH_MAX];
+  int pipes[2][2];
+  int i;
+
+  if (!eshell_resolve(args[0], path, sizeof(path))) {
+    return false;
+  }
+
+  if (pipe2(pipes[0], O_CLOEXEC) != 0 || pipe2(pipes[1], O_CLOEXEC) != 0) {
+    perror("eshell: pipe");
+
+    return false;
+  }
+
+  fflush(stdout);
+  eshell_fdbuf_sync_all();
+  child.pid = eshell_fork();
+
+  if (child.pid == 0) {
+    dup2(pipes[0][1], STDOUT_FILENO);
+    dup2(pipes[1][1], STDERR_FILENO);
+    execv(path, args);
+    perror("eshell: child process failed");
+
+    exit(EXIT_FAILURE);
+  } else if (child.pid < 0) {
+    perror("eshell: error forking parent process");
+
+    for (i = 0; i < 2; i++) {
+      close(pipes[i][0]);
+      close(pipes[i][1]);
+    }
+
+    return false;
+  }
+
+  // One coroutine per stream plus one for the child, all on this thread
+  for (i = 0; i < 2; i++) {
+    close(pipes[i][1]);
+    fcntl(pipes[i][0], F_SETFL, O_NONBLOCK);
+    memset(&streams[i], 0, sizeof(streams[i]));
+    streams[i].fd = pipes[i][0];
+    streams[i].out = i == 0 ? STDOUT_FILENO : STDERR_FILENO;
+    eshell_co_spawn(eshell_memo_tee, &streams[i]);
+  }
+
+  eshell_co_spawn(eshell_memo_reap, &child);
+  eshell_co_run();
+
+  eshell_status = child.status;
+  *out = streams[0].buf;
+  *err = streams[1].buf;
+  lens[0] = streams[0].len;
+  lens[1] = streams[1].len;
+
+  return true;
+}
+
+/**
+  @brief       Run a deterministic command, or replay its output if it has
+                 already been run with the same inputs.
+  @param  args List of arguments: "memo [--inputs FILE...] [--env VAR...] --
+                 command args...".
+  @return      Always return 1 to continue executing the shell.
+*/
+int eshell_memo(char **args) {
+  static const char *default_env[] = { "PATH", "LANG", "LC_ALL", NULL };
+  struct eshell_memo_header hdr;
+  char dir[PATH_MAX];
+  char path[PATH_MAX + 32];
+  char tmp[PATH_MAX + 48];
+  char cwd[PATH_MAX];
+  char *out = NULL;
+  char *err = NULL;
+  size_t lens[2];
+  uint64_t h = 0;
+  bool inputs = false;
+  int i, fd;
+
+  // Hash the options first, which also finds where the command starts
+  for (i = 1; args[i] && strcmp(args[i], "--") != 0; i++) {
+    if (strcmp(args[i], "--inputs") == 0) {
+      inputs = true;
+    } else if (strcmp(args[i], "--env") == 0) {
+      inputs = false;
+    } else if (inputs) {
+      if ((h = eshell_xxh64_file(args[i], h)) == 0) {
+        fprintf(stderr, "eshell: memo: cannot read %s\n", args[i]);
+
+        return 1;
+      }
+    } else {
+      const char *value = getenv(args[i]);
+
+      h = eshell_xxh64(args[i], strlen(args[i]) + 1, h);
+      h = eshell_xxh64(value ? value : "", value ? strlen(value) + 1 : 0, h);
+    }
+  }
+
+  if (args[i] == NULL || args[i + 1] == NULL) {
+    fprintf(stderr, "eshell: usage: memo [--inputs FILE...] [--env VAR...] "
+                    "-- command [args...]\n");
+
+    return 1;
+  }
+
+  args += i + 1;
+
+  for (i = 0; default_env[i]; i++) {
+    const char *value = getenv(default_env[i]);
+
+    h = eshell_xxh64(value ? value : "", value ? strlen(value) + 1 : 0, h);
+  }
+
+  if (getcwd(cwd, sizeof(cwd)) != NULL) {
+    h = eshell_xxh64(cwd, strlen(cwd) + 1, h);
+  }
+
+  for (i = 0; args[i]; i++) {
+    h = eshell_xxh64(args[i], strlen(args[i]) + 1, h);
+  }
+
+  if (!eshell_memo_dir(dir, sizeof(dir))) {
+    fprintf(stderr, "eshell: memo: no cache directory\n");
+
+    return 1;
+  }
+
+  snprintf(path, sizeof(path), "%s/%016llx", dir, (unsigned long long) h);
+
+  if (eshell_memo_replay(path)) {
+    memo.hits++;
+
+    return 1;
+  }
+
+  memo.misses++;
+
+  if (!eshell_memo_run(args, &out, &err, lens)) {
+    return 1;
+  }
+
+  // Write the entry beside its final name and rename it into place
+  snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int) getpid());
+  hdr.magic = ESHELL_MEMO_MAGIC;
+  hdr.status = eshell_status;
+  hdr.out_len = lens[0];
+  hdr.err_len = lens[1];
+
+  if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) >= 0) {
+    bool ok = eshell_write_all(fd, &hdr, sizeof(hdr)) &&
+              eshell_write_all(fd, out, lens[0]) &&
+              eshell_write_all(fd, err, lens[1]);
+
+    if (close(fd) != 0 || !ok || rename(tmp, path) != 0) {
+      unlink(tmp);
+    }
+  }
+
+  free(out);
+  free(err);
+
+  return 1;
+}
+
+/*
+  checksum: hash files with CRC32C, xxHash64 or SHA-256, several files at a
+  time on threads of its own, and print the `HASH  FILE` lines the *sum
+  programs print and check. CRC32C uses the SSE4.2 instruction and SHA-256
+  the SHA extensions when the CPU has them. Large files are mapped and hashed
+  in place; the rest are read into a page-aligned buffer per thread.
+*/
+#define ESHELL_SUM_CRC32C  0
+#define ESHELL_SUM_XXH64   1
+#define ESHELL_SUM_SHA256  2
+
+#define ESHELL_SUM_BUFSIZE (1024 * 1024)
+#define ESHELL_SUM_JOBS    64
+
+const char *eshell_sum_names[] = { "crc32c", "xxh64", "sha256" };
+const int eshell_sum_digits[] = { 8, 16, 64 };
+
+struct eshell_sum {
+  int algorithm;
+  uint32_t crc;
+  uint64_t xxh[4];
+  uint32_t sha[8];
+  unsigned char block[64];          // Waiting for a whole stripe or block
+  size_t block_len;
+  uint64_t total;
+};
+
+struct eshell_sum_job {
+  const char *path;
+  int fd;                           // Already open, or -1
+  char hex[65];
+  int error;                        // errno, or 0
+};
+
+struct eshell_sum_run {
+  struct eshell_sum_job *jobs;
+  int num_jobs;
+  int next;                         // Next job to claim
+  int algorithm;
+};
+
+struct eshell_sum_stats {
+  unsigned long files;
+  unsigned long bytes;
+  unsigned long mapped;
+} sums;
+
+uint32_t eshell_crc32c_table[256];
+pthread_once_t eshell_crc32c_once = PTHREAD_ONCE_INIT;
+
+const uint32_t eshell_sha256_k[64] = {
+  0x428A2F98, 0x71374491, 0xB5C0FBCF, 0xE9B5DBA5, 0x3956C25B, 0x59F111F1,
+  0x923F82A4, 0xAB1C5ED5, 0xD807AA98, 0x12835B01, 0x243185BE, 0x550C7DC3,
+  0x72BE5D74, 0x80DEB1FE, 0x9BDC06A7, 0xC19BF174, 0xE49B69C1, 0xEFBE4786,
+  0x0FC19DC6, 0x240CA1CC, 0x2DE92C6F, 0x4A7484AA, 0x5CB0A9DC, 0x76F988DA,
+  0x983E5152, 0xA831C66D, 0xB00327C8, 0xBF597FC7, 0xC6E00BF3, 0xD5A79147,
+  0x06CA6351, 0x14292967, 0x27B70A85, 0x2E1B2138, 0x4D2C6DFC, 0x53380D13,
+  0x650A7354, 0x766A0ABB, 0x81C2C92E, 0x92722C85, 0xA2BFE8A1, 0xA81A664B,
+  0xC24B8B70, 0xC76C51A3, 0xD192E819, 0xD6990624, 0xF40E3585, 0x106AA070,
+  0x19A4C116, 0x1E376C08, 0x2748774C, 0x34B0BCB5, 0x391C0CB3, 0x4ED8AA4A,
+  0x5B9CCA4F, 0x682E6FF3, 0x748F82EE, 0x78A5636F, 0x84C87814, 0x8CC70208,
+  0x90BEFFFA, 0xA4506CEB, 0xBEF9A3F7, 0xC67178F2
+};
+
+/**
+  @brief Fill the CRC32C table for CPUs without the instruction.
+*/
+void eshell_crc32c_init(void) {
+  uint32_t crc;
+  int i, k;
+
+  for (i = 0; i < 256; i++) {
+    for (crc = i, k = 0; k < 8; k++) {
+      crc = (crc >> 1) ^ (0x82F63B78U & -(crc & 1));
+    }
+
+    eshell_crc32c_table[i] = crc;
+  }
+}
+
+#ifdef __x86_64__
+/**
+  @brief     CRC32C with the SSE4.2 instruction, eight bytes at a time.
+  @param crc The CRC so far, not inverted.
+  @param p   Bytes.
+  @param len How many.
+  @return    The CRC.
+*/
+__attribute__((target("sse4.2")))
+uint32_t eshell_crc32c_hw(uint32_t crc, const unsigned char *p, size_t len) {
+  uint64_t c = crc;
+  uint64_t v;
+
+  for (; len >= 8; p += 8, len -= 8) {
+    memcpy(&v, p, 8);
+    c = _mm_crc32_u64(c, v);
+  }
+
+  for (crc = c; len > 0; len--) {
+    crc = _mm_crc32_u8(crc, *p++);
+  }
+
+  return crc;
+}
+
+/**
+  @brief       SHA-256 blocks with the SHA extensions. The state is kept as
+                 ABEF and CDGH, the order the instructions want.
+  @param state The state.
+  @param p     Whole blocks.
+  @param len   Their length.
+*/
+__attribute__((target("sha,sse4.1")))
+void eshell_sha256_hw(uint32_t state[8], const unsigned char *p, size_t len) {
+  const __m128i swap = _mm_set_epi64x(0x0C0D0E0F08090A0BULL,
+                                      0x0405060700010203ULL);
+  __m128i abef, cdgh, abef_saved, cdgh_saved, msg, tmp;
+  __m128i w[16];
+  int i;
+
+  tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) &state[0]), 0xB1);
+  cdgh = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) &state[4]), 0x1B);
+  abef = _mm_alignr_epi8(tmp, cdgh, 8);
+  cdgh = _mm_blend_epi16(cdgh, tmp, 0xF0);
+
+  for (; len >= 64; p += 64, len -= 64) {
+    abef_saved = abef;
+    cdgh_saved = cdgh;
+
+    // Four rounds at a time, each taking two rounds from each half
+    for (i = 0; i < 16; i++) {
+      if (i < 4) {
+        w[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (p + 16 * i)),
+                                swap);
+      } else {
+        w[i] = _mm_sha256msg2_epu32(
+            _mm_add_epi32(_mm_sha256msg1_epu32(w[i - 4], w[i - 3]),
+                          _mm_alignr_epi8(w[i - 1], w[i - 2], 4)),
+            w[i - 1]);
+      }
+
+      msg = _mm_add_epi32(w[i], _mm_loadu_si128(
+                                    (const __m128i *) &eshell_sha256_k[4 * i]));
+      cdgh = _mm_sha256rnds2_epu32(cdgh, abef, msg);
+      abef = _mm_sha256rnds2_epu32(abef, cdgh, _mm_shuffle_epi32(msg, 0x0E));
+    }
+
+    abef = _mm_add_epi32(abef, abef_saved);
+    cdgh = _mm_add_epi32(cdgh, cdgh_saved);
+  }
+
+  tmp = _mm_shuffle_epi32(abef, 0x1B);
+  cdgh = _mm_shuffle_epi32(cdgh, 0xB1);
+  _mm_storeu_si128((__m128i *) &state[0], _mm_blend_epi16(tmp, cdgh, 0xF0));
+  _mm_storeu_si128((__m128i *) &state[4], _mm_alignr_epi8(cdgh, tmp, 8));
+}
+#endif
+
+/**
+  @brief     Extend a CRC32C.
+  @param crc The CRC so far, not inverted.
+  @param p   Bytes.
+  @param len How many.
+  @return    The CRC.
+*/
+uint32_t eshell_crc32c(uint32_t crc, const unsigned char *p, size_t len) {
+#ifdef __x86_64__
+  if (__builtin_cpu_supports("sse4.2")) {
+    return eshell_crc32c_hw(crc, p, len);
+  }
+#endif
+
+  pthread_once(&eshell_crc32c_once, eshell_crc32c_init);
+
+  while (len--) {
+    crc = eshell_crc32c_table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+  }
+
+  return crc;
+}
+
+#define ESHELL_ROTR(x, n) ((x) >> (n) | (x) << (32 - (n)))
+
+/**
+  @brief       Run SHA-256 over whole blocks.
+  @param state The state.
+  @param p     The blocks.
+  @param len   Their length, a multiple of 64.
+*/
+void eshell_sha256(uint32_t state[8], const unsigned char *p, size_t len) {
+  uint32_t w[64], s[8], t1, t2;
+  int i;
+
+#ifdef __x86_64__
+  if (__builtin_cpu_supports("sha") && __builtin_cpu_supports("sse4.1")) {
+    eshell_sha256_hw(state, p, len);
+
+    return;
+  }
+#endif
+
+  for (; len >= 64; p += 64, len -= 64) {
+    for (i = 0; i < 16; i++) {
+      w[i] = (uint32_t) p[4 * i] << 24 | p[4 * i + 1] << 16 |
+             p[4 * i + 2] << 8 | p[4 * i + 3];
+    }
+
+    for (; i < 64; i++) {
+      w[i] = w[i - 16] + w[i - 7] +
+             (ESHELL_ROTR(w[i - 15], 7) ^ ESHELL_ROTR(w[i - 15], 18) ^
+              w[i - 15] >> 3) +
+             (ESHELL_ROTR(w[i - 2], 17) ^ ESHELL_ROTR(w[i - 2], 19) ^
+              w[i - 2] >> 10);
+    }
+
+    memcpy(s, state, sizeof(s));
+
+    for (i = 0; i < 64; i++) {
+      t1 = s[7] + (ESHELL_ROTR(s[4], 6) ^ ESHELL_ROTR(s[4], 11) ^
+                   ESHELL_ROTR(s[4], 25)) + ((s[4] & s[5]) ^ (~s[4] & s[6])) +
+           eshell_sha256_k[i] + w[i];
+      t2 = (ESHELL_ROTR(s[0], 2) ^ ESHELL_ROTR(s[0], 13) ^
+            ESHELL_ROTR(s[0], 22)) +
+           ((s[0] & s[1]) ^ (s[0] & s[2]) ^ (s[1] & s[2]));
+      memmove(s + 1, s, 7 * sizeof(uint32_t));
+      s[4] += t1;
+      s[0] = t1 + t2;
+    }
+
+    for (i = 0; i < 8; i++) {
+      state[i] += s[i];
+    }
+  }
+}
+
+/**
+  @brief       Run xxHash64 over whole 32-byte stripes.
+  @param lanes The four lanes.
+  @param p     The stripes.
+  @param len   Their length, a multiple of 32.
+*/
+void eshell_xxh_stripes(uint64_t lanes[4], const unsigned char *p,
+                        size_t len) {
+  int i;
+
+  for (; len >= 32; p += 32, len -= 32) {
+    for (i = 0; i < 4; i++) {
+      lanes[i] = eshell_xxh_round(lanes[i], eshell_read64(p + 8 * i));
+    }
+  }
+}
+
+/**
+  @brief           Start a checksum.
+  @param s         The checksum.
+  @param algorithm One of the ESHELL_SUM_ constants.
+*/
+void eshell_sum_init(struct eshell_sum *s, int algorithm) {
+  static const uint32_t sha[8] = {
+    0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A,
+    0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19
+  };
+
+  memset(s, 0, sizeof(*s));
+  s->algorithm = algorithm;
+  s->crc = 0xFFFFFFFFU;
+  s->xxh[0] = XXH_PRIME64_1 + XXH_PRIME64_2;
+  s->xxh[1] = XXH_PRIME64_2;
+  s->xxh[3] = -XXH_PRIME64_1;
+  memcpy(s->sha, sha, sizeof(sha));
+}
+
+/**
+  @brief     Hash whole stripes or blocks.
+  @param s   The checksum.
+  @param p   The bytes.
+  @param len How many, a multiple of the stripe or block.
+*/
+void eshell_sum_blocks(struct eshell_sum *s, const unsigned char *p,
+                       size_t len) {
+  if (s->algorithm == ESHELL_SUM_SHA256) {
+    eshell_sha256(s->sha, p, len);
+  } else {
+    eshell_xxh_stripes(s->xxh, p, len);
+  }
+}
+
+/**
+  @brief     Add bytes to a checksum.
+  @param s   The checksum.
+  @param p   The bytes.
+  @param len How many.
+*/
+void eshell_sum_update(struct eshell_sum *s, const unsigned char *p,
+                       size_t len) {
+  size_t stripe = s->algorithm == ESHELL_SUM_SHA256 ? 64 : 32;
+  size_t n;
+
+  s->total += len;
+
+  if (s->algorithm == ESHELL_SUM_CRC32C) {
+    s->crc = eshell_crc32c(s->crc, p, len);
+
+    return;
+  }
+
+  // Top up a partial block first
+  if (s->block_len > 0) {
+    n = stripe - s->block_len < len ? stripe - s->block_len : len;
+    memcpy(s->block + s->block_len, p, n);
+    s->block_len += n;
+    p += n;
+    len -= n;
+
+    if (s->block_len < stripe) {
+      return;
+    }
+
+    eshell_sum_blocks(s, s->block, stripe);
+    s->block_len = 0;
+  }
+
+  n = len / stripe * stripe;
+  eshell_sum_blocks(s, p, n);
+  memcpy(s->block, p + n, len - n);
+  s->block_len = len - n;
+}
+
+/**
+  @brief     Finish a checksum.
+  @param s   The checksum.
+  @param hex Receives it in hex, as the *sum programs print it.
+*/
+void eshell_sum_final(struct eshell_sum *s, char hex[65]) {
+  uint64_t h;
+  int i;
+
+  switch (s->algorithm) {
+    case ESHELL_SUM_CRC32C:
+      snprintf(hex, 65, "%08x", ~s->crc);
+
+      break;
+
+    case ESHELL_SUM_XXH64:
+      if (s->total >= 32) {
+        h = (s->xxh[0] << 1 | s->xxh[0] >> 63) +
+            (s->xxh[1] << 7 | s->xxh[1] >> 57) +
+            (s->xxh[2] << 12 | s->xxh[2] >> 52) +
+            (s->xxh[3] << 18 | s->xxh[3] >> 46);
+
+        for (i = 0; i < 4; i++) {
+          h = eshell_xxh_merge(h, s->xxh[i]);
+        }
+      } else {
+        h = XXH_PRIME64_5;
+      }
+
+      h = eshell_xxh_finish(h + s->total, s->block, s->block + s->block_len);
+      snprintf(hex, 65, "%016llx", (unsigned long long) h);
+
+      break;
+
+    case ESHELL_SUM_SHA256:
+      // Pad with a one bit, zeroes and the length in bits
+      h = s->total * 8;
+      s->block[s->block_len++] = 0x80;
+
+      if (s->block_len > 56) {
+        memset(s->block + s->block_len, 0, 64 - s->block_len);
+        eshell_sha256(s->sha, s->block, 64);
+        s->block_len = 0;
+      }
+
+      memset(s->block + s->block_len, 0, 56 - s->block_len);
+
+      for (i = 0; i < 8; i++) {
+        s->block[56 + i] = h >> (56 - 8 * i);
+      }
+
+      eshell_sha256(s->sha, s->block, 64);
+
+      for (i = 0; i < 8; i++) {
+        snprintf(hex + 8 * i, 9, "%08x", s->sha[i]);
+      }
+
+      break;
+  }
+}
+
+/**
+  @brief           Hash one file.
+  @param job       The file.
+  @param algorithm Which checksum.
+  @param buf       A buffer of ESHELL_SUM_BUFSIZE bytes for reading.
+*/
+void eshell_sum_file(struct eshell_sum_job *job, int algorithm, char *buf) {
+  struct eshell_sum s;
+  struct stat st;
+  int fd = job->fd >= 0 ? job->fd :
+           open(job->path, O_RDONLY | O_CLOEXEC);
+  ssize_t n;
+
+  if (fd < 0) {
+    job->error = errno;
+
+    return;
+  }
+
+  eshell_sum_init(&s, algorithm);
+
+  // Big regular files are hashed where they lie
+  if (job->fd < 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+      st.st_size >= ESHELL_MAP_MIN) {
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    if (map != MAP_FAILED) {
+      madvise(map, st.st_size, MADV_SEQUENTIAL);
+      eshell_sum_update(&s, map, st.st_size);
+      munmap(map, st.st_size);
+      close(fd);
+      eshell_sum_final(&s, job->hex);
+      __atomic_fetch_add(&sums.bytes, st.st_size, __ATOMIC_RELAXED);
+      __atomic_fetch_add(&sums.mapped, 1, __ATOMIC_RELAXED);
+      __atomic_fetch_add(&sums.files, 1, __ATOMIC_RELAXED);
+
+      return;
+    }
+  }
+
+  while ((n = read(fd, buf, ESHELL_SUM_BUFSIZE)) != 0) {
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+
+    if (n < 0) {
+      job->error = errno;
+
+      break;
+    }
+
+    eshell_sum_update(&s, (unsigned char *) buf, n);
+  }
+
+  if (job->fd < 0) {
+    close(fd);
+  }
+
+  eshell_sum_final(&s, job->hex);
+  __atomic_fetch_add(&sums.bytes, s.total, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&sums.files, 1, __ATOMIC_RELAXED);
+}
+
+/**
+  @brief     Thread: hash files until none are left.
+  @param arg The run.
+  @return    NULL.
+*/
+void *eshell_sum_thread(void *arg) {
+  struct eshell_sum_run *run = arg;
+  char *buf;
+  int i;
+
+  if (posix_memalign((void **) &buf, 4096, ESHELL_SUM_BUFSIZE) != 0) {
+    fprintf(stderr, "eshell: allocation error\n");
+
+    exit(EXIT_FAILURE);
+  }
+
+  while ((i = __atomic_fetch_add(&run->next, 1, __ATOMIC_RELAXED)) <
+         run->num_jobs) {
+    eshell_sum_file(&run->jobs[i], run->algorithm, buf);
+  }
+
+  free(buf);
+
+  return NULL;
+}
+
+/**
+  @brief      Hash all of a run's files, on up to `jobs` threads.
+  @param run  The run.
+  @param jobs How many threads may work on it, counting this one.
+*/
+void eshell_sum_all(struct eshell_sum_run *run, int jobs) {
+  pthread_t threads[ESHELL_SUM_JOBS];
+  int started = 0;
+  int i;
+
+  jobs = jobs < run->num_jobs ? jobs : run->num_jobs;
+
+  if (jobs > 1) {
+    sigset_t all, old;
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+
+    for (i = 1; i < jobs; i++) {
+      started += pthread_create(&threads[started], NULL, eshell_sum_thread,
+                                run) == 0;
+    }
+
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+  }
+
+  eshell_sum_thread(run);
+
+  for (i = 0; i < started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+}
+
+/**
+  @brief       Print a file name the way the *sum programs do: a name with a
+                 backslash or newline in it is escaped, and its line starts
+                 with a backslash.
+  @param  hex  The checksum.
+  @param  name The file.
+*/
+void eshell_sum_print(const char *hex, const char *name) {
+  struct eshell_buffer line = { 0 };
+  const char *c;
+
+  if (strpbrk(name, "\\\n")) {
+    eshell_buffer_append(&line, "\\", 1);
+  }
+
+  eshell_buffer_append(&line, hex, strlen(hex));
+  eshell_buffer_append(&line, "  ", 2);
+
+  for (c = name; *c; c++) {
+    if (*c == '\\' || *c == '\n') {
+      eshell_buffer_append(&line, *c == '\\' ? "\\\\" : "\\n", 2);
+    } else {
+      eshell_buffer_append(&line, c, 1);
+    }
+  }
+
+  eshell_buffer_append(&line, "\n", 1);
+  eshell_out_write(line.data, line.len);
+  free(line.data);
+}
+
+/**
+  @brief           Read lists of checksums into jobs to check them.
+  @param  lists     The lists, or "-" for standard input.
+  @param  run       Receives a job per well-formed line; its paths point
+                      into `text`.
+  @param  expected  Receives each job's expected checksum, lowercased.
+  @param  text      Receives the lists' text.
+  @param  algorithm The checksum, or -1 to tell from the first line.
+  @return           Number of lines that weren't checksums, or lists that
+                      couldn't be read.
+*/
+int eshell_sum_lists(char **lists, struct eshell_sum_run *run,
+                     char ***expected, struct eshell_buffer *text,
+                     int *algorithm) {
+  int bad = 0;
+  char *line, *next, *end;
+  int i, n;
+
+  // Read them all first; the jobs point into the text
+  for (i = 0; lists[i]; i++) {
+    bool std = strcmp(lists[i], "-") == 0;
+    int fd = std ? eshell_in_fd : open(lists[i], O_RDONLY | O_CLOEXEC);
+    ssize_t got;
+
+    if (fd < 0) {
+      fprintf(stderr, "eshell: checksum: %s: %s\n", lists[i], strerror(errno));
+      bad++;
+
+      continue;
+    }
+
+    while ((got = read(fd, eshell_buffer_reserve(text, 65536), 65536)) != 0) {
+      if (got < 0 && errno == EINTR) {
+        continue;
+      }
+
+      if (got < 0) {
+        fprintf(stderr, "eshell: checksum: %s: %s\n", lists[i],
+                strerror(errno));
+        bad++;
+
+        break;
+      }
+
+      text->len += got;
+    }
+
+    if (!std) {
+      close(fd);
+    }
+
+    if (text->len > 0 && text->data[text->len - 1] != '\n') {
+      eshell_buffer_append(text, "\n", 1);
+    }
+  }
+
+  eshell_buffer_append(text, "", 1);
+
+  for (line = text->data; line && *line; line = next) {
+    struct eshell_sum_job *job;
+    bool escaped = *line == '\\';
+    char *r, *w;
+
+    next = strchr(line, '\n');
+    *next++ = '\0';
+    line += escaped;
+
+    for (end = line; isxdigit((unsigned char) *end); end++) {
+      *end = tolower((unsigned char) *end);
+    }
+
+    n = end - line;
+
+    if (*algorithm < 0) {
+      *algorithm = n == 8 ? ESHELL_SUM_CRC32C : n == 16 ? ESHELL_SUM_XXH64 :
+                   ESHELL_SUM_SHA256;
+    }
+
+    if (n != eshell_sum_digits[*algorithm] || end[0] != ' ' ||
+        (end[1] != ' ' && end[1] != '*') || end[2] == '\0') {
+      bad++;
+
+      continue;
+    }
+
+    *end = '\0';
+
+    // Undo the escapes in place
+    for (r = w = end + 2; *r; r++) {
+      if (escaped && r[0] == '\\' && (r[1] == '\\' || r[1] == 'n')) {
+        *w++ = *++r == 'n' ? '\n' : '\\';
+      } else {
+        *w++ = *r;
+      }
+    }
+
+    *w = '\0';
+    run->jobs = realloc(run->jobs, (run->num_jobs + 1) *
+                                   sizeof(struct eshell_sum_job));
+    *expected = realloc(*expected, (run->num_jobs + 1) * sizeof(char *));
+
+    if (!run->jobs || !*expected) {
+      fprintf(stderr, "eshell: allocation error\n");
+
+      exit(EXIT_FAILURE);
+    }
+
+    job = &run->jobs[run->num_jobs];
+    memset(job, 0, sizeof(*job));
+    job->path = end + 2;
+    job->fd = -1;
+    (*expected)[run->num_jobs++] = line;
+  }
+
+  return bad;
+}
+
+/**
+  @brief       Builtin command: print or check checksums.
+  @param  args `checksum [-a crc32c|xxh64|sha256] [-j N] [FILE...]` prints a
+                 `HASH  FILE` line per file, SHA-256 by default, so sha256sum
+                 -c can check them. With -c the files are lists of such
+                 lines, and each file listed is checked; the checksum is told
+                 from the length of the first one unless -a says. -j sets how
+                 many files are hashed at once, by default one per CPU.
+  @return      Always return 1 to continue executing the shell.
+*/
+int eshell_checksum(char **args) {
+  struct eshell_sum_run run = { 0 };
+  struct eshell_buffer text = { 0 };
+  char *stdin_only[] = { "-", NULL };
+  char **expected = NULL;
+  char **files;
+  int algorithm = -1;
+  int jobs = sysconf(_SC_NPROCESSORS_ONLN);
+  bool check = false;
+  bool usage = false;
+  int bad = 0;
+  int failed = 0;
+  int i;
+
+  for (i = 1; args[i] && args[i][0] == '-' && args[i][1] && !usage; i++) {
+    if (strcmp(args[i], "--") == 0) {
+      i++;
+
+      break;
+    } else if (strcmp(args[i], "-c") == 0) {
+      check = true;
+    } else if (strcmp(args[i], "-j") == 0 && args[i + 1]) {
+      jobs = atoi(args[++i]);
+    } else if (strcmp(args[i], "-a") == 0 && args[i + 1]) {
+      for (algorithm = 2; algorithm >= 0; algorithm--) {
+        if (strcmp(args[i + 1], eshell_sum_names[algorithm]) == 0) {
+          break;
+        }
+      }
+
+      usage = algorithm < 0;
+      i++;
+    } else {
+      usage = true;
+    }
+  }
+
+  if (usage) {
+    fprintf(stderr, "eshell: usage: checksum [-a crc32c|xxh64|sha256] "
+            "[-j N] [-c] [FILE...]\n");
+    eshell_status = 2;
+
+    return 1;
+  }
+
+  jobs = jobs < 1 ? 1 : jobs > ESHELL_SUM_JOBS ? ESHELL_SUM_JOBS : jobs;
+  files = args[i] ? args + i : stdin_only;
+
+  // The shell's own reading may be ahead of standard input
+  if (!eshell_worker) {
+    eshell_fdbuf_sync(eshell_in_fd);
+  }
+
+  if (check) {
+    bad = eshell_sum_lists(files, &run, &expected, &text, &algorithm);
+  } else {
+    algorithm = algorithm < 0 ? ESHELL_SUM_SHA256 : algorithm;
+
+    for (run.num_jobs = 0; files[run.num_jobs]; run.num_jobs++);
+
+    if ((run.jobs = calloc(run.num_jobs, sizeof(struct eshell_sum_job))) ==
+        NULL) {
+      fprintf(stderr, "eshell: allocation error\n");
+
+      exit(EXIT_FAILURE);
+    }
+
+    // Standard input belongs to this thread, so is opened here
+    for (i = 0; i < run.num_jobs; i++) {
+      run.jobs[i].path = files[i];
+      run.jobs[i].fd = strcmp(files[i], "-") == 0 ? eshell_in_fd : -1;
+    }
+  }
+
+  run.algorithm = algorithm;
+  eshell_sum_all(&run, jobs);
+
+  for (i = 0; i < run.num_jobs; i++) {
+    struct eshell_sum_job *job = &run.jobs[i];
+
+    if (job->error) {
+      fprintf(stderr, "eshell: checksum: %s: %s\n", job->path,
+              strerror(job->error));
+    }
+
+    if (!check) {
+      failed += job->error != 0;
+
+      if (!job->error) {
+        eshell_sum_print(job->hex, job->path);
+      }
+    } else if (job->error) {
+      eshell_out_printf("%s: FAILED open or read\n", job->path);
+      failed++;
+    } else if (strcmp(job->hex, expected[i]) != 0) {
+      eshell_out_printf("%s: FAILED\n", job->path);
+      failed++;
+    } else {
+      eshell_out_printf("%s: OK\n", job->path);
+    }
+  }
+
+  if (bad > 0) {
+    fprintf(stderr, "eshell: checksum: WARNING: %d line%s improperly "
+            "formatted\n", bad, bad == 1 ? " is" : "s are");
+  }
+
+  if (check && failed > 0) {
+    fprintf(stderr, "eshell: checksum: WARNING: %d of %d files did not "
+            "match\n", failed, run.num_jobs);
+  }
+
+  eshell_status = failed > 0 || (check && (bad > 0 || run.num_jobs == 0));
+  free(run.jobs);
+  free(expected);
+  free(text.data);
+
+  return 1;
+}
+
+/*
+  watch-run: rerun a command whenever files under some paths change. Bursts of
+  events are coalesced over a debounce window, and a run still going when new
+  changes arrive is cancelled so the next one starts from fresh files.
+*/
+#define ESHELL_WATCH_DEBOUNCE_MS 100
+#define ESHELL_WATCH_MASK (IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | \
+                           IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB)
+
+struct eshell_watch_stats {
+  unsigned long runs;
+  unsigned long cancelled;
+  unsigned long events;
+  uint64_t latency_total;           // Nanoseconds from first event to start
+  uint64_t latency_min;
+  uint64_t latency_max;
+} watch;
+
+/*
+  The inotify instance for one watch-run, with the path behind each watch so
+  directories created later can be watched as well.
+*/
+struct eshell_watch_set {
+  int fd;
+  char **paths;                     // Indexed by watch descriptor
+  int capacity;
+};
+
+volatile sig_atomic_t watch_interrupted;
+
+/**
+  @brief     Note that ^C was pressed while watching.
+  @param sig Unused.
+*/
+void eshell_watch_sigint(int sig) {
+  watch_interrupted = 1;
+}
+
+/**
+  @brief      Watch a path, and every directory below it.
+  @param set  The watches so far.
+  @param path File or directory to watch.
+  @return     Number of watches added.
+*/
+int eshell_watch_add(struct eshell_watch_set *set, const char *path) {
+  struct dirent *ent;
+  DIR *d;
+  int added;
+  int wd = inotify_add_watch(set->fd, path, ESHELL_WATCH_MASK);
+
+  if (wd < 0) {
+    return 0;
+  }
+
+  // Remember where it points
+  if (wd >= set->capacity) {
+    int n = set->capacity;
+
+    set->capacity = wd * 2 + 16;
+    set->paths = realloc(set->paths, set->capacity * sizeof(char *));
+
+    if (!set->paths) {
+      fprintf(stderr, "eshell: allocation error\n");
+
+      exit(EXIT_FAILURE);
+    }
+
+    memset(set->paths + n, 0, (set->capacity - n) * sizeof(char *));
+  }
+
+  free(set->paths[wd]);
+  set->paths[wd] = strdup(path);
+  added = 1;
+
+  if ((d = opendir(path)) == NULL) {
+    return added;
+  }
+
+  while ((ent = readdir(d)) != NULL) {
+    char sub[PATH_MAX];
+
+    if (ent->d_type != DT_DIR || strcmp(ent->d_name, ".") == 0 ||
+        strcmp(ent->d_name, "..") == 0) {
+      continue;
+    }
+
+    snprintf(sub, sizeof(sub), "%s/%s", path, ent->d_name);
+    added += eshell_watch_add(set, sub);
+  }
+
+  closedir(d);
+
+  return added;
+}
+
+/**
+  @brief     Close an inotify instance and forget its paths.
+  @param set The watches.
+*/
+void eshell_watch_free(struct eshell_watch_set *set) {
+  int i;
+
+  for (i = 0; i < set->capacity; i++) {
+    free(set->paths[i]);
+  }
+
+  free(set->paths);
+  close(set->fd);
+}
+
+/**
+  @brief       Start the watched command in its own process group, so the
+                 whole of it can be cancelled.
+  @param path  Resolved binary.
+  @param args  Command to run.
+  @return      The child's pid, or -1 on error.
+*/
+pid_t eshell_watch_start(const char *path, char **args) {
+  pid_t pid;
+
+  fflush(stdout);
+  eshell_fdbuf_sync_all();
+  pid = eshell_fork();
+
+  if (pid == 0) {
+    setpgid(0, 0);
+    signal(SIGINT, SIG_DFL);
+    execv(path, args);
+    perror("eshell: child process failed");
+
+    exit(EXIT_FAILURE);
+  } else if (pid < 0) {
+    perror("eshell: error forking parent process");
+
+    return -1;
+  }
+
+  // Set it from both sides so there's no window where a kill misses
+  setpgid(pid, pid);
+
+  return pid;
+}
+
+/**
+  @brief       Run a command, then run it again whenever files change.
+  @param  args List of arguments: "watch-run [-d MS] [-i GLOB] PATH... --
+                 command args...".
+  @return      Always return 1 to continue executing the shell.
+*/
+int eshell_watch_run(char **args) {
+  struct sigaction sa, old_sa;
+  struct eshell_watch_set set = { -1, NULL, 0 };
+  char path[PATH_MAX];
+  char **command;
+  char *ignore = NULL;
+  int debounce = ESHELL_WATCH_DEBOUNCE_MS;
+  uint64_t first_event = 0;
+  uint64_t deadline = 0;
+  bool pending = true;
+  pid_t pid = -1;
+  int i;
+
+  set.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+  if (set.fd < 0) {
+    perror("eshell: watch-run: inotify");
+
+    return 1;
+  }
+
+  for (i = 1; args[i] && strcmp(args[i], "--") != 0; i++) {
+    if (strcmp(args[i], "-d") == 0 && args[i + 1]) {
+      debounce = atoi(args[++i]);
+    } else if (strcmp(args[i], "-i") == 0 && args[i + 1]) {
+      ignore = args[++i];
+    } else if (eshell_watch_add(&set, args[i]) == 0) {
+      fprintf(stderr, "eshell: watch-run: cannot watch %s\n", args[i]);
+    }
+  }
+
+  if (args[i] == NULL || args[i + 1] == NULL) {
+    fprintf(stderr, "eshell: usage: watch-run [-d MS] [-i GLOB] PATH... -- "
+                    "command [args...]\n");
+    eshell_watch_free(&set);
+
+    return 1;
+  }
+
+  command = args + i + 1;
+
+  if (!eshell_resolve(command[0], path, sizeof(path))) {
+    eshell_watch_free(&set);
+
+    return 1;
+  }
+
+  // ^C ends the watch rather than the shell
+  watch_interrupted = 0;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = eshell_watch_sigint;
+  sigaction(SIGINT, &sa, &old_sa);
+
+  while (!watch_interrupted) {
+    struct pollfd fds[2];
+    int timeout = -1;
+    uint64_t now = eshell_now_ns();
+
+    // The debounce window closed: cancel what's running and start again
+    if (pending && now >= deadline) {
+      if (pid > 0) {
+        kill(-pid, SIGTERM);
+        eshell_wait_child(pid);
+        watch.cancelled++;
+        printf("eshell: watch-run: cancelled\n");
+      }
+
+      pid = eshell_watch_start(path, command);
+      pending = false;
+
+      if (first_event) {
+        uint64_t latency = eshell_now_ns() - first_event;
+
+        watch.latency_total += latency;
+        watch.latency_min = watch.runs == 0 || latency < watch.latency_min ?
+                            latency : watch.latency_min;
+        watch.latency_max = latency > watch.latency_max ? latency
+                                                        : watch.latency_max;
+        watch.runs++;
+        first_event = 0;
+      }
+    }
+
+    if (pending) {
+      timeout = (deadline - now) / 1000000 + 1;
+    }
+
+    fds[0].fd = set.fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = child_ring.efd;
+    fds[1].events = POLLIN;
+
+    if (poll(fds, 2, timeout) < 0 && errno != EINTR) {
+      break;
+    }
+
+    if (fds[1].revents & POLLIN) {
+      eshell_children_drain();
+    }
+
+    // The run finished by itself
+    if (pid > 0 && eshell_child_poll(pid, &eshell_status)) {
+      printf("eshell: watch-run: exited with status %d\n", eshell_status);
+      pid = -1;
+    }
+
+    if (fds[0].revents & POLLIN) {
+      char buf[4096]
+          __attribute__((aligned(__alignof__(struct inotify_event))));
+      ssize_t len;
+
+      while ((len = read(set.fd, buf, sizeof(buf))) > 0) {
+        char *p;
+
+        for (p = buf; p < buf + len; ) {
+          const struct inotify_event *ev = (const struct inotify_event *) p;
+
+          p += sizeof(struct inotify_event) + ev->len;
+
+          if (ev->len > 0 && ignore && fnmatch(ignore, ev->name, 0) == 0) {
+            continue;
+          }
+
+          // Newly created directories are watched too
+          if ((ev->mask & IN_CREATE) && (ev->mask & IN_ISDIR) &&
+              ev->wd < set.capacity && set.paths[ev->wd]) {
+            char sub[PATH_MAX];
+
+            snprintf(sub, sizeof(sub), "%s/%s", set.paths[ev->wd], ev->name);
+            eshell_watch_add(&set, sub);
+          }
+
+          watch.events++;
+
+          if (!pending) {
+            first_event = eshell_now_ns();
+          }
+
+          pending = true;
+          deadline = eshell_now_ns() + (uint64_t) debounce * 1000000;
+        }
+      }
+    }
+  }
+
+  // Tidy up whatever is still running
+  if (pid > 0) {
+    kill(-pid, SIGTERM);
+    eshell_wait_child(pid);
+  }
+
+  eshell_watch_free(&set);
+  sigaction(SIGINT, &old_sa, NULL);
+  printf("\n");
+
+  if (watch.runs > 0) {
+    printf("eshell: watch-run: %lu reruns, %lu cancelled, event to start "
+           "%.1f ms avg, %.1f ms min, %.1f ms max\n", watch.runs,
+           watch.cancelled, watch.latency_total / 1e6 / watch.runs,
+           watch.latency_min / 1e6, watch.latency_max / 1e6);
+  }
+
+  return 1;
+}
+
+#define ESHELL_RL_BUFSIZE 1024
+
+#define ANSI_COLOR_BLUE    "\x1b[34m"
+#define ANSI_COLOR_MAGENTA "\x1b[35m"
+#define ANSI_COLOR_RESET   "\x1b[0m"
+
+/**
+  @brief     Print the prompt.
+  @param cwd The current working directory.
+*/
+void eshell_print_prompt(const char *cwd) {
+  printf(ANSI_COLOR_BLUE "%s " ANSI_COLOR_MAGENTA "> " ANSI_COLOR_RESET, cwd);
+  fflush(stdout);
+}
+
+/**
+  @brief         Track one completion candidate.
+  @param  name   The candidate.
+  @param  match  First candidate seen so far.
+  @param  common Length of the prefix shared by every candidate.
+  @param  count  Number of candidates seen so far.
+*/
+void eshell_complete_candidate(const char *name, const char **match,
+                               size_t *common, int *count) {
+  size_t k = 0;
+
+  if (*count == 0) {
+    *match = name;
+    *common = strlen(name);
+  } else {
+    while (k < *common && name[k] == (*match)[k]) {
+      k++;
+    }
+
+    *common = k;
+  }
+
+  (*count)++;
+}
+
+/**
+  @brief         Complete the command name being typed at the start of a line.
+  @param  line   The line so far.
+  @param  list   Print every candidate if there's nothing to add.
+  @param  listed Set to true if candidates were printed.
+  @return        Newly allocated text to append to the line, or NULL.
+*/
+char *eshell_complete(const char *line, bool list, bool *listed) {
+  size_t n = strlen(line);
+  const char *match = NULL;
+  size_t common = 0;
+  int count = 0;
+  int first, last, i;
+  char *add;
+
+  // Only the command name is completed
+  if (strchr(line, ' ') != NULL) {
+    return NULL;
+  }
+
+  for (i = 0; i < eshell_num_builtins(); i++) {
+    if (strncmp(builtin_str[i], line, n) == 0) {
+      eshell_complete_candidate(builtin_str[i], &match, &common, &count);
+    }
+  }
+
+  // The same name in several PATH directories is one candidate
+  last = eshell_path_prefix(line, &first);
+
+  for (i = first; i < last; i++) {
+    if (i == first ||
+        path_index.entries[i].name != path_index.entries[i - 1].name) {
+      eshell_complete_candidate(path_index.entries[i].name, &match, &common,
+                                &count);
+    }
+  }
+
+  if (count == 0) {
+    return NULL;
+  }
+
+  // A single candidate is finished off, ready for its arguments
+  if (count == 1) {
+    add = malloc(strlen(match) - n + 2);
+    sprintf(add, "%s ", match + n);
+
+    return add;
+  }
+
+  if (common > n) {
+    return strndup(match + n, common - n);
+  }
+
+  if (list) {
+    printf("\n");
+
+    for (i = 0; i < eshell_num_builtins(); i++) {
+      if (strncmp(builtin_str[i], line, n) == 0) {
+        printf("%s\n", builtin_str[i]);
+      }
+    }
+
+    for (i = first; i < last; i++) {
+      if (i == first ||
+          path_index.entries[i].name != path_index.entries[i - 1].name) {
+        printf("%s\n", path_index.entries[i].name);
+      }
+    }
+
+    *listed = true;
+  }
+
+  return NULL;
+}
+
+/**
+  @brief  Read a line from the terminal, handling editing keys and completion.
+  @return The line, or NULL at end of input.
+*/
+char *eshell_edit_line(void) {
+  int bufsize = ESHELL_RL_BUFSIZE;
+  int position = 0;
+  int tabs = 0;
+  char *buffer = malloc(sizeof(char) * bufsize);
+  struct termios saved, raw;
+  unsigned char c;
+
+  if (!buffer) {
+    fprintf(stderr, "eshell: allocation error\n");
+
+    exit(EXIT_FAILURE);
+  }
+
+  // Take keys one at a time and do our own echoing
+  tcgetattr(STDIN_FILENO, &saved);
+  raw = saved;
+  raw.c_lflag &= ~(ICANON | ECHO);
+  raw.c_cc[VMIN] = 1;
+  raw.c_cc[VTIME] = 0;
+  tcsetattr(STDIN_FILENO, TCSANOW, &raw);
+
+  while (1) {
+    char key[2] = { 0, 0 };
+    char *add = NULL;
+    char *p;
+    bool had_word = memchr(buffer, ' ', position) != NULL;
+
+    buffer[position] = '\0';
+
+    // End of input, or ^D on an empty line
+    if (read(STDIN_FILENO, &c, 1) != 1 || (c == 4 && position == 0)) {
+      printf("\n");
+      tcsetattr(STDIN_FILENO, TCSANOW, &saved);
+      free(buffer);
+
+      return NULL;
+    }
+
+    tabs = c == '\t' ? tabs + 1 : 0;
+
+    if (c == '\n' || c == '\r') {
+      break;
+    } else if (c == '\t') {
+      bool listed = false;
+
+      add = eshell_complete(buffer, tabs > 1, &listed);
+
+      // Candidates were printed over the prompt, so draw it again
+      if (listed) {
+        char cwd[1024];
+
+        if (getcwd(cwd, sizeof(cwd)) != NULL) {
+          eshell_print_prompt(cwd);
+        }
+
+        printf("%s", buffer);
+      }
+    } else if (c == 127 || c == '\b') {
+      if (position > 0) {
+        position--;
+        printf("\b \b");
+      }
+    } else if (c == 21) {
+      // ^U clears the line
+      for (; position > 0; position--) {
+        printf("\b \b");
+      }
+    } else if (c == 27) {
+      // Swallow escape sequences such as the arrow keys
+      if (read(STDIN_FILENO, &c, 1) == 1 && (c == '[' || c == 'O')) {
+        while (read(STDIN_FILENO, &c, 1) == 1 && (c < 0x40 || c > 0x7e));
+      }
+    } else if (c >= 32) {
+      key[0] = c;
+      add = strdup(key);
+    }
+
+    // Append whatever the key produced, growing the buffer as we go
+    for (p = add; p && *p; p++) {
+      buffer[position++] = *p;
+      putchar(*p);
+
+      if (position >= bufsize) {
+        bufsize += ESHELL_RL_BUFSIZE;
+        buffer = realloc(buffer, bufsize);
+
+        if (!buffer) {
+          fprintf(stderr, "eshell: allocation error\n");
+
+          exit(EXIT_FAILURE);
+        }
+      }
+    }
+
+    free(add);
+    fflush(stdout);
+
+    // Resolve the command name as it's typed, so a line of just the name
+    //   is ready too; a lookup that changes nothing queues no work
+    buffer[position] = '\0';
+
+    if (!had_word && buffer[0] != ' ' && buffer[0] != '\0') {
+      p = buffer + strcspn(buffer, " ");
+      c = *p;
+      *p = '\0';
+      eshell_speculate(buffer);
+      *p = c;
+    }
+  }
+
+  printf("\n");
+  tcsetattr(STDIN_FILENO, TCSANOW, &saved);
+  buffer[position] = '\0';
+
+  return buffer;
+}
+
+/**
+  @brief  Read a line of input from stdin.
+  @return The line from stdin, or NULL at end of input.
+*/
+char *eshell_read_line(void) {
+  char *line;
+  size_t len;
+
+  // Terminals get line editing and completion, and see the trace so far
+  if (isatty(STDIN_FILENO)) {
+    eshell_xtrace_flush();
+    eshell_audit_flush();
+
+    return eshell_edit_line();
+  }
+
+  // Anything else goes through the same buffer `read` uses, so a script fed
+  //   on standard input can read its own following lines
+  if ((line = eshell_fdbuf_line(STDIN_FILENO, &len)) == NULL) {
+    return NULL;
+  }
+
+  if ((line = strndup(line, len)) == NULL) {
+    fprintf(stderr, "eshell: allocation error\n");
+
+    exit(EXIT_FAILURE);
+  }
+
+  return line;
+}
+
+#define ESHELL_TOK_BUFSIZE 64
+#define ESHELL_TOK_DELIM " \t\r\n\a"
+
+/**
+  @brief       Super naively split a line into tokens
+  @param  line The line to tokenize
+  @return      Null-terminated array of tokens
+*/
+char **eshell_split_line(char *line) {
+  int bufsize = ESHELL_TOK_BUFSIZE;
+  int position = 0;
+  char **tokens = malloc(bufsize * sizeof(char*));
+  char *token;
+  char **tokens_backup;
+
+  // There aren't any tokens, so something went wrong with allocation
+  if (!tokens) {
+    fprintf(stderr, "eshell: allocation error\n");
+
+    exit(EXIT_FAILURE);
+  }
+
+  // Start the tokenization
+  token = strtok(line, ESHELL_TOK_DELIM);
+  while (token != NULL) {
+    // Add each token to the array
+    tokens[position] = token;
+
+    position++;
+
+    // We've reached the end of the buffer
+    if (position >= bufsize) {
+
+      // Attempt to reallocate some memory to increase the buffer size
+      bufsize += ESHELL_TOK_BUFSIZE;
+      tokens_backup = tokens;
+      tokens = realloc(tokens, bufsize * sizeof(char*));
+
+      // If there's still no tokens, quit
+      if (!tokens) {
+        free(tokens_backup);
+        fprintf(stderr, "eshell: allocation error\n");
+
+        exit(EXIT_FAILURE);
+      }
+    }
+
+    // Run the tokenization again to get the next toekn
+    token = strtok(NULL, ESHELL_TOK_DELIM);
+  }
+
+  tokens[position] = NULL;
+
+  return tokens;
+}
+
+/*
+  Aliases. Each definition is split into tokens once, when it is made, so
+  applying it is just splicing those tokens in front of the rest of the
+  command. Definitions live in an atom map keyed by the alias name.
+  Redefining or removing an alias retires the old definition rather than
+  freeing it, since a command being run may still point at its tokens;
+  retired definitions are freed once the command finishes.
+*/
+#define ESHELL_ALIAS_DEPTH 16
+
+struct eshell_alias_def {
+  char *value;                      // As given, for listing
+  char *text;                       // Copy of the value the tokens point into
+  char **tokens;
+  int num_tokens;
+  struct eshell_alias_def *next;    // Next retired definition
+};
+
+struct eshell_aliases {
+  struct eshell_atom_map map;       // Name to struct eshell_alias_def
+  struct eshell_alias_def *retired;
+  unsigned long expansions;
+  unsigned long spliced;            // Tokens spliced in by expansions
+} aliases;
+
+/**
+  @brief       Retire whatever an alias is defined as and give it a new
+                 definition.
+  @param  name  Alias name.
+  @param  value Text to expand to, or NULL to remove the alias.
+*/
+void eshell_alias_define(const char *name, const char *value) {
+  struct eshell_atom_entry *slot;
+  struct eshell_alias_def *def = NULL;
+
+  if (value != NULL) {
+    def = malloc(sizeof(struct eshell_alias_def));
+
+    if (!def || !(def->value = strdup(value)) ||
+        !(def->text = strdup(value))) {
+      fprintf(stderr, "eshell: allocation error\n");
+
+      exit(EXIT_FAILURE);
+    }
+
+    def->tokens = eshell_split_line(def->text);
+
+    for (def->num_tokens = 0; def->tokens[def->num_tokens];
+         def->num_tokens++);
+  }
+
+  slot = eshell_atom_map_put(&aliases.map, name);
+
+  if (slot->value != NULL) {
+    ((struct eshell_alias_def *) slot->value)->next = aliases.retired;
+    aliases.retired = slot->value;
+  }
+
+  slot->value = def;
+}
+
+/**
+  @brief       Find what an alias expands to.
+  @param  name Command name.
+  @return      The definition, or NULL if it isn't an alias.
+*/
+struct eshell_alias_def *eshell_alias_find(const char *name) {
+  return eshell_atom_map_get(&aliases.map, name);
+}
+
+/**
+  @brief Free retired definitions. Only called between commands, when none of
+           their tokens can be in use.
+*/
+void eshell_alias_sweep(void) {
+  while (aliases.retired) {
+    struct eshell_alias_def *next = aliases.retired->next;
+
+    free(aliases.retired->value);
+    free(aliases.retired->text);
+    free(aliases.retired->tokens);
+    free(aliases.retired);
+    aliases.retired = next;
+  }
+}
+
+/**
+  @brief       Expand an alias in command position, again and again while the
+                 result starts with another alias, up to ESHELL_ALIAS_DEPTH.
+                 An alias isn't expanded inside its own expansion.
+  @param  args Tokens of the command, which are freed if replaced.
+  @return      The tokens to run.
+*/
+char **eshell_alias_expand(char **args) {
+  struct eshell_alias_def *seen[ESHELL_ALIAS_DEPTH];
+  int depth = 0;
+
+  while (args[0] != NULL) {
+    struct eshell_alias_def *def = eshell_alias_find(args[0]);
+    char **expanded;
+    int rest, i;
+
+    if (def == NULL) {
+      break;
+    }
+
+    for (i = 0; i < depth && seen[i] != def; i++);
+
+    if (i < depth) {
+      break;
+    }
+
+    if (depth == ESHELL_ALIAS_DEPTH) {
+      fprintf(stderr, "eshell: %s: aliases nested too deeply\n", args[0]);
+
+      break;
+    }
+
+    seen[depth++] = def;
+
+    // Splice the stored tokens in place of the name
+    for (rest = 1; args[rest]; rest++);
+
+    expanded = malloc((def->num_tokens + rest) * sizeof(char *));
+
+    if (!expanded) {
+      fprintf(stderr, "eshell: allocation error\n");
+
+      exit(EXIT_FAILURE);
+    }
+
+    memcpy(expanded, def->tokens, def->num_tokens * sizeof(char *));
+    memcpy(expanded + def->num_tokens, args + 1, rest * sizeof(char *));
+    free(args);
+    args = expanded;
+
+    aliases.expansions++;
+    aliases.spliced += def->num_tokens;
+  }
+
+  return args;
+}
+
+/**
+  @brief       Builtin command: define or list aliases.
+  @param  args `alias` lists every alias, `alias NAME` shows one and
+                 `alias NAME=VALUE...` defines one; words after the first are
+                 part of the value.
+  @return      Always return 1 to continue executing the shell.
+*/
+int eshell_alias(char **args) {
+  char *eq;
+  char *name;
+  char *value;
+  size_t i, len;
+  int j;
+
+  if (args[1] == NULL) {
+    for (i = 0; i < aliases.map.capacity; i++) {
+      struct eshell_alias_def *def = aliases.map.slots[i].value;
+
+      if (def != NULL) {
+        printf("alias %s='%s'\n", aliases.map.slots[i].name, def->value);
+      }
+    }
+
+    return 1;
+  }
+
+  if ((eq = strchr(args[1], '=')) == NULL) {
+    struct eshell_alias_def *def = eshell_alias_find(args[1]);
+
+    if (def == NULL) {
+      fprintf(stderr, "eshell: alias: %s: not found\n", args[1]);
+      eshell_status = 1;
+    } else {
+      printf("alias %s='%s'\n", args[1], def->value);
+    }
+
+    return 1;
+  }
+
+  if (eq == args[1]) {
+    fprintf(stderr, "eshell: alias: missing name\n");
+    eshell_status = 1;
+
+    return 1;
+  }
+
+  // Glue the value back together from the words it was split into
+  len = strlen(eq + 1) + 1;
+
+  for (j = 2; args[j]; j++) {
+    len += strlen(args[j]) + 1;
+  }
+
+  name = strndup(args[1], eq - args[1]);
+  value = malloc(len);
+
+  if (!name || !value) {
+    fprintf(stderr, "eshell: allocation error\n");
+
+    exit(EXIT_FAILURE);
+  }
+
+  strcpy(value, eq + 1);
+
+  for (j = 2; args[j]; j++) {
+    strcat(value, " ");
+    strcat(value, args[j]);
+  }
+
+  eshell_alias_define(name, value);
+  free(name);
+  free(value);
+
+  return 1;
+}
+
+/**
+  @brief       Builtin command: remove aliases.
+  @param  args Names of the aliases to remove.
+  @return      Always return 1 to continue executing the shell.
+*/
+int eshell_unalias(char **args) {
+  int i;
+
+  for (i = 1; args[i]; i++) {
+    if (eshell_alias_find(args[i]) == NULL) {
+      fprintf(stderr, "eshell: unalias: %s: not found\n", args[i]);
+      eshell_status = 1;
+    } else {
+      eshell_alias_define(args[i], NULL);
+    }
+  }
+
+  return 1;
+}
+
+/*
+  Shell functions and compiled scripts. `source FILE` and the bodies of
+  `function NAME` ... `end` are split into call sites once, when they are
+  read. Each call site caches what its command name resolved to (a builtin, a
+  function or a binary) together with the dispatch generation it was resolved
+  in, so while nothing has been redefined and PATH is unchanged, running a
+  site costs one compare on top of the command itself.
+*/
+#define ESHELL_CALL_DEPTH 64
+
+enum {
+  ESHELL_SITE_BUILTIN,
+  ESHELL_SITE_FUNCTION,
+  ESHELL_SITE_EXTERNAL,
+  ESHELL_SITE_MISSING,
+  ESHELL_SITE_DYNAMIC               // Assignment, or the name is expanded
+};
+
+struct eshell_function;
+
+struct eshell_site {
+  char **tokens;                    // One block with the strings they point to
+  int num_tokens;
+  bool params;                      // Some token needs expanding
+  struct eshell_function *define;   // Set for a function definition instead
+  unsigned long generation;         // Dispatch generation of the cache
+  int kind;
+  int builtin;
+  struct eshell_function *fn;
+  char *path;
+};
+
+struct eshell_script {
+  struct eshell_site *sites;
+  int num_sites;
+  int capacity;
+};
+
+struct eshell_function {
+  struct eshell_script body;
+  bool installed;                   // Owned by the function table
+  struct eshell_function *next;     // Next retired function
+};
+
+struct eshell_functions {
+  struct eshell_atom_map map;       // Name to struct eshell_function
+  struct eshell_function *retired;
+  int depth;
+  unsigned long calls;
+  unsigned long hits;               // Call sites whose cache was current
+  unsigned long misses;
+} functions;
+
+/**
+  @brief       Find a function by name.
+  @param  name Command name.
+  @return      The function, or NULL if there isn't one.
+*/
+struct eshell_function *eshell_function_find(const char *name) {
+  return eshell_atom_map_get(&functions.map, name);
+}
+
+void eshell_script_free(struct eshell_script *script);
+
+/**
+  @brief    Free a function that nothing can be running any more.
+  @param fn The function.
+*/
+void eshell_function_free(struct eshell_function *fn) {
+  eshell_script_free(&fn->body);
+  free(fn);
+}
+
+/**
+  @brief        Free a compiled script, along with functions it defines that
+                  were never installed.
+  @param script The script.
+*/
+void eshell_script_free(struct eshell_script *script) {
+  int i;
+
+  for (i = 0; i < script->num_sites; i++) {
+    if (script->sites[i].define && !script->sites[i].define->installed) {
+      eshell_function_free(script->sites[i].define);
+    }
+
+    free(script->sites[i].tokens);
+    free(script->sites[i].path);
+  }
+
+  free(script->sites);
+  script->sites = NULL;
+  script->num_sites = script->capacity = 0;
+}
+
+/**
+  @brief       Make a function callable by name. Whatever had the name before
+                 is retired, and every call site resolves again.
+  @param  name Function name.
+  @param  fn   The function.
+*/
+void eshell_function_install(const char *name, struct eshell_function *fn) {
+  struct eshell_atom_entry *slot = eshell_atom_map_put(&functions.map, name);
+
+  if (slot->value != NULL) {
+    ((struct eshell_function *) slot->value)->next = functions.retired;
+    functions.retired = slot->value;
+  }
+
+  slot->value = fn;
+  fn->installed = true;
+  eshell_dispatch_generation++;
+}
+
+/**
+  @brief Free retired functions. Only called between commands, when none of
+           them can be running.
+*/
+void eshell_function_sweep(void) {
+  while (functions.retired) {
+    struct eshell_function *next = functions.retired->next;
+
+    eshell_function_free(functions.retired);
+    functions.retired = next;
+  }
+}
+
+/**
+  @brief        Add a call site for a line of a script.
+  @param script The script.
+  @param args   Tokens of the line, which are copied.
+  @return       The new site.
+*/
+struct eshell_site *eshell_script_add(struct eshell_script *script,
+                                      char **args) {
+  struct eshell_site *site;
+  size_t size = sizeof(char *);
+  char *p;
+  int i;
+
+  if (script->num_sites >= script->capacity) {
+    script->capacity = script->capacity ? script->capacity * 2 : 16;
+    script->sites = realloc(script->sites,
+                            script->capacity * sizeof(struct eshell_site));
+
+    if (!script->sites) {
+      fprintf(stderr, "eshell: allocation error\n");
+
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  site = &script->sites[script->num_sites++];
+  memset(site, 0, sizeof(struct eshell_site));
+
+  // Pointers first, then the strings, all in one allocation
+  for (i = 0; args[i]; i++) {
+    size += sizeof(char *) + strlen(args[i]) + 1;
+  }
+
+  site->num_tokens = i;
+  site->tokens = malloc(size);
+
+  if (!site->tokens) {
+    fprintf(stderr, "eshell: allocation error\n");
+
+    exit(EXIT_FAILURE);
+  }
+
+  p = (char *) (site->tokens + i + 1);
+
+  for (i = 0; args[i]; i++) {
+    site->tokens[i] = strcpy(p, args[i]);
+    site->params |= strchr(args[i], '$') != NULL;
+    p += strlen(p) + 1;
+  }
+
+  site->tokens[i] = NULL;
+  site->kind = site->num_tokens > 0 && (site->tokens[0][0] == '$' ||
+                                        eshell_assignment(site->tokens) ||
+                                        eshell_pipeline_find(site->tokens)) ?
+               ESHELL_SITE_DYNAMIC : ESHELL_SITE_MISSING;
+
+  // Never resolved yet, whatever the generation is now
+  site->generation = eshell_dispatch_generation - 1;
+
+  return site;
+}
+
+/**
+  @brief        Compile lines into a script. Comments and blank lines are
+                  dropped and aliases are expanded as each line is read.
+  @param script Script to add to.
+  @param next   Returns each line in turn, newly allocated, or NULL at the
+                  end.
+  @param ctx    Passed to next.
+  @param body   Reading a function body, which stops at `end`.
+  @return       False on a syntax error, which has been reported.
+*/
+bool eshell_script_compile(struct eshell_script *script,
+                           char *(*next)(void *), void *ctx, bool body) {
+  char *line;
+
+  while ((line = next(ctx)) != NULL) {
+    char **args = eshell_alias_expand(eshell_split_line(line));
+    bool ok = true;
+
+    if (args[0] == NULL || args[0][0] == '#') {
+      // Nothing to run
+    } else if (strcmp(args[0], "end") == 0) {
+      if (body) {
+        free(args);
+        free(line);
+
+        return true;
+      }
+
+      fprintf(stderr, "eshell: end without function\n");
+      ok = false;
+    } else if (strcmp(args[0], "function") == 0) {
+      struct eshell_function *fn;
+
+      if (body || args[1] == NULL || args[2] != NULL) {
+        fprintf(stderr, body ? "eshell: functions can't be nested\n" :
+                               "eshell: usage: function NAME\n");
+        ok = false;
+      } else if ((fn = calloc(1, sizeof(struct eshell_function))) == NULL) {
+        fprintf(stderr, "eshell: allocation error\n");
+
+        exit(EXIT_FAILURE);
+      } else {
+        // The definition itself takes effect when the script reaches it
+        eshell_script_add(script, args)->define = fn;
+        ok = eshell_script_compile(&fn->body, next, ctx, true);
+      }
+    } else {
+      eshell_script_add(script, args);
+    }
+
+    free(args);
+    free(line);
+
+    if (!ok) {
+      return false;
+    }
+  }
+
+  if (body) {
+    fprintf(stderr, "eshell: function without end\n");
+
+    return false;
+  }
+
+  return true;
+}
+
+/**
+  @brief      Work out what a call site's command name runs and cache it.
+  @param site The call site.
+*/
+void eshell_site_resolve(struct eshell_site *site) {
+  const char *name = site->tokens[0];
+  char path[PATH_MAX];
+
+  free(site->path);
+  site->path = NULL;
+
+  // Same order as eshell_execute: builtins, functions, then PATH
+  if ((site->builtin = eshell_builtin_find(name)) >= 0) {
+    site->kind = ESHELL_SITE_BUILTIN;
+  } else if ((site->fn = eshell_function_find(name)) != NULL) {
+    site->kind = ESHELL_SITE_FUNCTION;
+  } else if (strchr(name, '/') != NULL ||
+             eshell_path_lookup(name, path, sizeof(path))) {
+    site->kind = ESHELL_SITE_EXTERNAL;
+    site->path = strdup(strchr(name, '/') ? name : path);
+  } else {
+    site->kind = ESHELL_SITE_MISSING;
+  }
+
+  // The lookup may have refreshed the PATH index and moved the generation
+  site->generation = eshell_dispatch_generation;
+}
+
+/**
+  @brief      Run one call site.
+  @param site The call site.
+  @return     0 if the shell should terminate, non-zero otherwise.
+*/
+int eshell_site_run(struct eshell_site *site) {
+  uint64_t start = eshell_now_ns();
+  char **args = site->params && !eshell_construct(site->tokens[0]) &&
+                !eshell_pipeline_find(site->tokens) ?
+                eshell_expand(site->tokens) : site->tokens;
+  int status = 1;
+  bool traced = false;
+
+  if (args[0] == NULL) {
+    // Nothing left after expansion
+  } else if (site->kind == ESHELL_SITE_DYNAMIC) {
+    status = eshell_execute(args);
+  } else {
+    // Traced here, as it doesn't go through eshell_execute
+    if (xtrace.on) {
+      if (!xtrace.duration) {
+        eshell_xtrace_line(args, start, -1);
+      }
+
+      xtrace.depth++;
+      traced = true;
+    }
+
+    if (site->generation == eshell_dispatch_generation) {
+      functions.hits++;
+    } else {
+      functions.misses++;
+      eshell_site_resolve(site);
+    }
+
+    switch (site->kind) {
+      case ESHELL_SITE_BUILTIN:
+        eshell_status = 0;
+        status = (*builtin_func[site->builtin])(args);
+        break;
+
+      case ESHELL_SITE_FUNCTION:
+        status = eshell_function_call(site->fn, args);
+        break;
+
+      case ESHELL_SITE_EXTERNAL:
+        status = eshell_launch_path(site->path, args);
+        break;
+
+      default:
+        fprintf(stderr, "eshell: command not found: %s\n", args[0]);
+        eshell_status = 127;
+    }
+
+    if (traced) {
+      xtrace.depth--;
+
+      if (xtrace.on && xtrace.duration) {
+        eshell_xtrace_line(args, start, eshell_status);
+      }
+    }
+
+    eshell_command_done(args, start);
+  }
+
+  if (args != site->tokens) {
+    free(args);
+  }
+
+  return status;
+}
+
+/**
+  @brief        Run a compiled script until it ends or asks the shell to exit.
+  @param script The script.
+  @return       0 if the shell should terminate, non-zero otherwise.
+*/
+int eshell_script_run(struct eshell_script *script) {
+  int i;
+
+  for (i = 0; i < script->num_sites; i++) {
+    struct eshell_site *site = &script->sites[i];
+
+    if (site->define) {
+      eshell_function_install(site->tokens[1], site->define);
+    } else if (eshell_site_run(site) == 0) {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+/**
+  @brief       Call a function.
+  @param  fn   The function.
+  @param  args Its name and arguments, which become $0, $1, ...
+  @return      0 if the shell should terminate, non-zero otherwise.
+*/
+int eshell_function_call(struct eshell_function *fn, char **args) {
+  char **frame = vars.frame;
+  int status;
+
+  if (functions.depth >= ESHELL_CALL_DEPTH) {
+    fprintf(stderr, "eshell: %s: functions nested too deeply\n", args[0]);
+    eshell_status = 1;
+
+    return 1;
+  }
+
+  // Call sites trust the generation, so catch up on PATH changes on entry
+  if (functions.depth == 0) {
+    eshell_path_refresh();
+  }
+
+  functions.calls++;
+  functions.depth++;
+  vars.frame = args;
+  eshell_status = 0;
+
+  status = eshell_script_run(&fn->body);
+
+  vars.frame = frame;
+  functions.depth--;
+
+  return status;
+}
+
+/**
+  @brief     Next line of a function typed at the prompt.
+  @param ctx Unused.
+  @return    The line, or NULL at the end of input.
+*/
+char *eshell_function_line(void *ctx) {
+  (void) ctx;
+
+  printf("> ");
+  fflush(stdout);
+
+  return eshell_read_line();
+}
+
+/**
+  @brief       Builtin command: define a function from the lines that follow,
+                 up to `end`, or list the functions there are.
+  @param  args `function NAME`, or just `function` to list.
+  @return      Always return 1 to continue executing the shell.
+*/
+int eshell_function(char **args) {
+  struct eshell_function *fn;
+  size_t i;
+
+  if (args[1] == NULL) {
+    for (i = 0; i < functions.map.capacity; i++) {
+      if (functions.map.slots[i].value != NULL) {
+        printf("%s\n", functions.map.slots[i].name);
+      }
+    }
+
+    return 1;
+  }
+
+  if (args[2] != NULL) {
+    fprintf(stderr, "eshell: usage: function NAME\n");
+    eshell_status = 2;
+
+    return 1;
+  }
+
+  if ((fn = calloc(1, sizeof(struct eshell_function))) == NULL) {
+    fprintf(stderr, "eshell: allocation error\n");
+
+    exit(EXIT_FAILURE);
+  }
+
+  if (!eshell_script_compile(&fn->body, eshell_function_line, NULL, true)) {
+    eshell_function_free(fn);
+    eshell_status = 2;
+
+    return 1;
+  }
+
+  eshell_function_install(args[1], fn);
+
+  return 1;
+}
+
+/**
+  @brief     Next line of a script file.
+  @param ctx The open file.
+  @return    The line without its newline, or NULL at the end.
+*/
+char *eshell_script_line(void *ctx) {
+  char *line = NULL;
+  size_t size = 0;
+  ssize_t len = getline(&line, &size, ctx);
+
+  if (len < 0) {
+    free(line);
+
+    return NULL;
+  }
+
+  if (len > 0 && line[len - 1] == '\n') {
+    line[len - 1] = '\0';
+  }
+
+  return line;
+}
+
+/**
+  @brief       Builtin command: compile a script and run it in this shell.
+  @param  args `source FILE [ARG...]`; FILE is $0 and the arguments $1, ...
+  @return      0 if the script ran `exit`, otherwise 1.
+*/
+int eshell_source(char **args) {
+  struct eshell_script script = { 0 };
+  char **frame = vars.frame;
+  FILE *fp;
+  int status = 1;
+
+  if (args[1] == NULL) {
+    fprintf(stderr, "eshell: usage: source FILE [ARG...]\n");
+    eshell_status = 2;
+
+    return 1;
+  }
+
+  if ((fp = fopen(args[1], "r")) == NULL) {
+    fprintf(stderr, "eshell: source: %s: %s\n", args[1], strerror(errno));
+    eshell_status = 1;
+
+    return 1;
+  }
+
+  if (eshell_script_compile(&script, eshell_script_line, fp, false)) {
+    eshell_path_refresh();
+    vars.frame = args + 1;
+    eshell_status = 0;
+    status = eshell_script_run(&script);
+    vars.frame = frame;
+  } else {
+    eshell_status = 2;
+  }
+
+  fclose(fp);
+  eshell_script_free(&script);
+
+  return status;
+}
+
+/**
+  @brief       Builtin command: run a command once for each line of input.
+  @param  args `for-lines [-n COUNT] [-u FD] NAME [FILE] -- command...`. Each
+                 line in turn is put in the shell variable NAME and the
+                 command, which is compiled once, is expanded and run. Lines
+                 come from FILE, descriptor FD or standard input, through the
+                 same buffer as `read`; after COUNT lines, or if the command
+                 exits the shell, the loop stops and the descriptor is left
+                 just past the last line used.
+  @return      0 if the command exited the shell, otherwise 1.
+*/
+int eshell_for_lines(char **args) {
+  struct eshell_script body = { 0 };
+  char **head;
+  char **words;
+  long max = -1;
+  long count = 0;
+  int fd = STDIN_FILENO;
+  bool owned = false;
+  int status = 1;
+  char *line;
+  size_t len;
+  int i, dash;
+
+  for (dash = 1; args[dash] && strcmp(args[dash], "--") != 0; dash++);
+
+  // The words before -- are expanded now, the command each time round
+  if ((head = malloc((dash + 1) * sizeof(char *))) == NULL) {
+    fprintf(stderr, "eshell: allocation error\n");
+
+    exit(EXIT_FAILURE);
+  }
+
+  memcpy(head, args, dash * sizeof(char *));
+  head[dash] = NULL;
+  words = eshell_expand(head);
+
+  for (i = 1; words[i] && words[i][0] == '-'; i += 2) {
+    if (strcmp(words[i], "-n") == 0 && words[i + 1]) {
+      max = atol(words[i + 1]);
+    } else if (strcmp(words[i], "-u") == 0 && words[i + 1] &&
+               (fd = eshell_parse_fd(words[i + 1])) >= 0) {
+      continue;
+    } else {
+      break;
+    }
+  }
+
+  if (args[dash] == NULL || args[dash + 1] == NULL || words[i] == NULL ||
+      !eshell_var_name(words[i], strlen(words[i])) || fd < 0 ||
+      (words[i + 1] && words[i + 2])) {
+    fprintf(stderr, "eshell: usage: for-lines [-n COUNT] [-u FD] NAME [FILE] "
+                    "-- command...\n");
+    eshell_status = 2;
+  } else if (words[i + 1] &&
+             (fd = open(words[i + 1], O_RDONLY | O_CLOEXEC)) < 0) {
+    fprintf(stderr, "eshell: for-lines: %s: %s\n", words[i + 1],
+            strerror(errno));
+    eshell_status = 1;
+  } else {
+    owned = words[i + 1] != NULL;
+    eshell_script_add(&body, args + dash + 1);
+    eshell_status = 0;
+
+    while (count != max && (line = eshell_fdbuf_line(fd, &len)) != NULL) {
+      eshell_scalar_set(words[i], line);
+      count++;
+
+      if ((status = eshell_site_run(&body.sites[0])) == 0) {
+        break;
+      }
+    }
+
+    // Leave a shared descriptor where the loop stopped reading
+    if (owned) {
+      eshell_fdbuf_drop(fd);
+      close(fd);
+    } else {
+      eshell_fdbuf_sync(fd);
+    }
+
+    eshell_script_free(&body);
+  }
+
+  if (words != head) {
+    free(words);
+  }
+
+  free(head);
+
+  return status;
+}
+
+/*
+  Parallel loops. pfor expands the command for every item on the main thread,
+  which gives each iteration its own binding of the loop variable, then runs
+  the iterations N at a time and prints each one's output whole: in list
+  order, or with -u as soon as it finishes. Thread-safe builtins run on a
+  pool of threads with their output captured in memory, so no iteration
+  costs a fork. Binaries run as children whose output comes back through
+  pipes, all waited on by the coroutine executor. Anything else (functions,
+  other builtins) runs one iteration at a time in the shell itself.
+*/
+struct eshell_pfor_job {
+  char **args;                      // Expanded command
+  struct eshell_buffer out;
+  int status;
+  bool done;
+  bool printed;
+};
+
+struct eshell_pfor_run {
+  struct eshell_pfor_job *jobs;
+  int num_jobs;
+  int next;                         // Next job to start
+  int emitted;                      // Jobs up to here have been printed
+  bool unordered;
+  int builtin;
+  const char *path;
+  pthread_mutex_t lock;
+  pthread_cond_t finished;
+};
+
+struct eshell_pfor_stats {
+  unsigned long runs;
+  unsigned long threaded;           // Iterations run on threads
+  unsigned long spawned;            // Iterations run as children
+  unsigned long serial;             // Iterations run in the shell
+} pfor;
+
+/**
+  @brief       Copy a command's words into one allocation.
+  @param  args The words.
+  @return      The copy.
+*/
+char **eshell_args_dup(char **args) {
+  size_t size = sizeof(char *);
+  char **copy;
+  char *p;
+  int i;
+
+  for (i = 0; args[i]; i++) {
+    size += sizeof(char *) + strlen(args[i]) + 1;
+  }
+
+  if ((copy = malloc(size)) == NULL) {
+    fprintf(stderr, "eshell: allocation error\n");
+
+    exit(EXIT_FAILURE);
+  }
+
+  p = (char *) (copy + i + 1);
+
+  for (i = 0; args[i]; i++) {
+    copy[i] = strcpy(p, args[i]);
+    p += strlen(p) + 1;
+  }
+
+  copy[i] = NULL;
+
+  return copy;
+}
+
+/**
+  @brief     Print the output of every finished job that may go out now.
+               Called on the main thread with the lock held.
+  @param run The loop.
+*/
+void eshell_pfor_emit(struct eshell_pfor_run *run) {
+  int i;
+
+  for (i = run->emitted; i < run->num_jobs; i++) {
+    struct eshell_pfor_job *job = &run->jobs[i];
+
+    if (!job->done) {
+      if (!run->unordered) {
+        break;
+      }
+
+      continue;
+    }
+
+    if (!job->printed) {
+      eshell_write_all(STDOUT_FILENO, job->out.data, job->out.len);
+      free(job->out.data);
+      job->out.data = NULL;
+      job->printed = true;
+    }
+
+    // Everything before here is out, so later scans can start further on
+    if (i == run->emitted) {
+      run->emitted++;
+    }
+  }
+}
+
+/**
+  @brief     Thread: run jobs of a thread-safe builtin, capturing their
+               output, until none are left.
+  @param arg The loop.
+  @return    NULL.
+*/
+void *eshell_pfor_thread(void *arg) {
+  struct eshell_pfor_run *run = arg;
+
+  eshell_worker = true;
+
+  for (;;) {
+    struct eshell_pfor_job *job;
+
+    pthread_mutex_lock(&run->lock);
+    job = run->next < run->num_jobs ? &run->jobs[run->next++] : NULL;
+    pthread_mutex_unlock(&run->lock);
+
+    if (job == NULL) {
+      return NULL;
+    }
+
+    eshell_capture = &job->out;
+    eshell_status = 0;
+    (*builtin_func[run->builtin])(job->args);
+    eshell_capture = NULL;
+
+    pthread_mutex_lock(&run->lock);
+    job->status = eshell_status;
+    job->done = true;
+    pthread_cond_signal(&run->finished);
+    pthread_mutex_unlock(&run->lock);
+  }
+}
+
+/**
+  @brief     Coroutine: run jobs as children, collecting what they write to
+               stdout, until none are left.
+  @param arg The loop.
+*/
+void eshell_pfor_child(void *arg) {
+  struct eshell_pfor_run *run = arg;
+
+  while (run->next < run->num_jobs) {
+    struct eshell_pfor_job *job = &run->jobs[run->next++];
+    char buf[16384];
+    ssize_t got;
+    int fds[2];
+    pid_t pid;
+
+    if (pipe2(fds, O_CLOEXEC) != 0) {
+      perror("eshell: pfor");
+      job->status = 1;
+      job->done = true;
+
+      continue;
+    }
+
+    fflush(stdout);
+    eshell_fdbuf_sync_all();
+    pid = eshell_fork();
+
+    if (pid == 0) {
+      dup2(fds[1], STDOUT_FILENO);
+      execv(run->path, job->args);
+      perror("eshell: child process failed");
+
+      _exit(127);
+    }
+
+    close(fds[1]);
+
+    if (pid < 0) {
+      perror("eshell: error forking parent process");
+      close(fds[0]);
+      job->status = 1;
+      job->done = true;
+
+      continue;
+    }
+
+    do {
+      eshell_co_wait_fd(fds[0], EPOLLIN);
+
+      if ((got = read(fds[0], buf, sizeof(buf))) > 0) {
+        eshell_buffer_append(&job->out, buf, got);
+      }
+    } while (got > 0 || (got < 0 && errno == EINTR));
+
+    close(fds[0]);
+    job->status = eshell_co_wait_child(pid);
+    job->done = true;
+    pfor.spawned++;
+
+    pthread_mutex_lock(&run->lock);
+    eshell_pfor_emit(run);
+    pthread_mutex_unlock(&run->lock);
+  }
+}
+
+/**
+  @brief       Builtin command: run a command for each of a list of words, in
+                 parallel.
+  @param  args `pfor [-j N] [-u] NAME in WORD... -- command...`. The words are
+                 expanded first; then for each one NAME is set to it and the
+                 command expanded. -j sets how many run at once, by default
+                 one per CPU; -u prints each one's output as soon as it is
+                 done instead of in order.
+  @return      0 if a command run in the shell exited it, otherwise 1.
+*/
+int eshell_pfor(char **args) {
+  struct eshell_pfor_run run = { .lock = PTHREAD_MUTEX_INITIALIZER,
+                                 .finished = PTHREAD_COND_INITIALIZER };
+  struct eshell_script body = { 0 };
+  struct eshell_site *site;
+  long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+  const char *name;
+  char **head;
+  char **words;
+  bool threaded;
+  int status = 1;
+  int i, k, dash;
+
+  for (dash = 1; args[dash] && strcmp(args[dash], "--") != 0; dash++);
+
+  // The words before -- are expanded now, the command for each item
+  if ((head = malloc((dash + 1) * sizeof(char *))) == NULL) {
+    fprintf(stderr, "eshell: allocation error\n");
+
+    exit(EXIT_FAILURE);
+  }
+
+  memcpy(head, args, dash * sizeof(char *));
+  head[dash] = NULL;
+  words = eshell_expand(head);
+
+  for (i = 1; words[i] && words[i][0] == '-'; i++) {
+    if (strcmp(words[i], "-j") == 0 && words[i + 1]) {
+      jobs = atol(words[++i]);
+    } else if (strcmp(words[i], "-u") == 0) {
+      run.unordered = true;
+    } else {
+      break;
+    }
+  }
+
+  name = words[i];
+
+  if (args[dash] == NULL || args[dash + 1] == NULL || name == NULL ||
+      !eshell_var_name(name, strlen(name)) || words[i + 1] == NULL ||
+      strcmp(words[i + 1], "in") != 0 || jobs < 1) {
+    fprintf(stderr, "eshell: usage: pfor [-j N] [-u] NAME in WORD... -- "
+                    "command...\n");
+    eshell_status = 2;
+    goto done;
+  }
+
+  // Bind each item and expand the command for it
+  for (k = i + 2; words[k]; k++);
+
+  run.num_jobs = k - (i + 2);
+
+  // An empty list runs nothing
+  if (run.num_jobs == 0) {
+    eshell_status = 0;
+    goto done;
+  }
+
+  run.jobs = calloc(run.num_jobs, sizeof(struct eshell_pfor_job));
+
+  if (!run.jobs) {
+    fprintf(stderr, "eshell: allocation error\n");
+
+    exit(EXIT_FAILURE);
+  }
+
+  site = eshell_script_add(&body, args + dash + 1);
+
+  for (k = 0; k < run.num_jobs; k++) {
+    char **expanded;
+
+    eshell_scalar_set(name, words[i + 2 + k]);
+    expanded = eshell_expand(site->tokens);
+    run.jobs[k].args = eshell_args_dup(expanded);
+
+    if (expanded != site->tokens) {
+      free(expanded);
+    }
+  }
+
+  pfor.runs++;
+  eshell_status = 0;
+
+  if (site->kind != ESHELL_SITE_DYNAMIC) {
+    eshell_site_resolve(site);
+  }
+
+  // Threads only if every item's arguments can be handled without a fork
+  threaded = site->kind == ESHELL_SITE_BUILTIN &&
+             (builtin_flags[site->builtin] & ESHELL_BUILTIN_THREADSAFE);
+
+  for (k = 0; threaded && k < run.num_jobs; k++) {
+    threaded = eshell_builtin_inline(site->builtin, run.jobs[k].args);
+  }
+
+  if (threaded) {
+    pthread_t *threads = malloc(jobs * sizeof(pthread_t));
+    sigset_t all, old;
+    int started = 0;
+
+    if (!threads) {
+      fprintf(stderr, "eshell: allocation error\n");
+
+      exit(EXIT_FAILURE);
+    }
+
+    // Signals stay with the main thread
+    run.builtin = site->builtin;
+    fflush(stdout);
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+
+    for (k = 0; k < jobs && k < run.num_jobs; k++) {
+      started += pthread_create(&threads[started], NULL, eshell_pfor_thread,
+                                &run) == 0;
+    }
+
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    // With no threads at all, do the work here
+    if (started == 0) {
+      eshell_pfor_thread(&run);
+    }
+
+    pthread_mutex_lock(&run.lock);
+
+    while (run.emitted < run.num_jobs) {
+      eshell_pfor_emit(&run);
+
+      if (run.emitted < run.num_jobs) {
+        pthread_cond_wait(&run.finished, &run.lock);
+      }
+    }
+
+    pthread_mutex_unlock(&run.lock);
+
+    for (k = 0; k < started; k++) {
+      pthread_join(threads[k], NULL);
+    }
+
+    free(threads);
+    pfor.threaded += run.num_jobs;
+  } else if (site->kind == ESHELL_SITE_EXTERNAL) {
+    run.path = site->path;
+
+    for (k = 0; k < jobs && k < run.num_jobs; k++) {
+      eshell_co_spawn(eshell_pfor_child, &run);
+    }
+
+    eshell_co_run();
+  } else {
+    // Functions and builtins that need the shell go one at a time
+    for (k = 0; k < run.num_jobs && status != 0; k++) {
+      struct eshell_pfor_job *job = &run.jobs[k];
+
+      // The body sees its own item, not the last one bound above
+      eshell_scalar_set(name, words[i + 2 + k]);
+      eshell_status = 0;
+
+      if (site->kind == ESHELL_SITE_BUILTIN) {
+        status = (*builtin_func[site->builtin])(job->args);
+      } else if (site->kind == ESHELL_SITE_FUNCTION) {
+        status = eshell_function_call(site->fn, job->args);
+      } else if (eshell_pipeline_find(site->tokens)) {
+        // A pipeline expands each stage itself
+        status = eshell_execute(site->tokens);
+      } else {
+        status = eshell_execute(job->args);
+      }
+
+      job->status = eshell_status;
+      pfor.serial++;
+    }
+  }
+
+  // The status is that of the first iteration, in list order, that failed
+  eshell_status = 0;
+
+  for (k = 0; k < run.num_jobs; k++) {
+    if (eshell_status == 0) {
+      eshell_status = run.jobs[k].status;
+    }
+
+    free(run.jobs[k].args);
+    free(run.jobs[k].out.data);
+  }
+
+  free(run.jobs);
+  eshell_script_free(&body);
+
+done:
+  if (words != head) {
+    free(words);
+  }
+
+  free(head);
+
+  return status;
+}
+
+/*
+  Batch runs. `batch` runs each line of a file as a command, several at once
+  with -j, and can keep a journal of which lines were started and which
+  finished so that an interrupted run can be picked up with --resume. Journal
+  records are framed like the audit log and committed in groups: they are
+  buffered and written out with a single fdatasync once enough have piled up
+  or enough time has passed, checked both as records arrive and on a timer.
+  A resumed run cuts the journal back to its last good frame before adding
+  to it, so a frame torn by a crash doesn't hide everything after it.
+*/
+#define ESHELL_JOURNAL_MAGIC 0x4e524a45U  // "EJRN" on disk
+#define ESHELL_JOURNAL_STARTED 1
+#define ESHELL_JOURNAL_FINISHED 2
+#define ESHELL_JOURNAL_GROUP 64          // Records per commit at most
+#define ESHELL_JOURNAL_GROUP_NS 50000000ULL
+
+struct eshell_journal_record {
+  uint32_t type;
+  uint32_t line;                    // Line number in the batch file
+  uint64_t hash;                    // XXH64 of the line's text
+  int32_t status;
+  uint32_t reserved;
+};
+
+#define ESHELL_JOURNAL_FRAME (sizeof(struct eshell_audit_frame) + \
+                             sizeof(struct eshell_journal_record))
+
+struct eshell_journal {
+  int fd;                           // -1 when running without a journal
+  char buf[ESHELL_JOURNAL_GROUP * ESHELL_JOURNAL_FRAME];
+  int pending;
+  uint64_t last_commit;
+  unsigned long commits;
+  unsigned long records;
+};
+
+struct eshell_batch_stats {
+  unsigned long runs;
+  unsigned long commands;
+  unsigned long skipped;
+  unsigned long failed;
+  unsigned long commits;
+} batch;
+
+/**
+  @brief     Write out the buffered journal records and make them durable.
+  @param  j  The journal.
+*/
+void eshell_journal_commit(struct eshell_journal *j) {
+  if (j->fd < 0 || j->pending == 0) {
+    return;
+  }
+
+  if (!eshell_write_all(j->fd, j->buf, j->pending * ESHELL_JOURNAL_FRAME) ||
+      fdatasync(j->fd) != 0) {
+    perror("eshell: batch journal");
+  }
+
+  j->pending = 0;
+  j->commits++;
+  j->last_commit = eshell_now_ns();
+}
+
+/**
+  @brief        Add a record to the journal, committing the group if it's due.
+  @param  j     The journal.
+  @param  type  ESHELL_JOURNAL_STARTED or ESHELL_JOURNAL_FINISHED.
+  @param  line  Line number of the command.
+  @param  hash  Hash of the command's text.
+  @param status Exit status, for finished commands.
+*/
+void eshell_journal_add(struct eshell_journal *j, int type, int line,
+                        uint64_t hash, int status) {
+  struct eshell_journal_record rec = { type, line, hash, status, 0 };
+  struct eshell_audit_frame frame = { ESHELL_JOURNAL_MAGIC, sizeof(rec), 0 };
+  char *p;
+
+  if (j->fd < 0) {
+    return;
+  }
+
+  p = j->buf + j->pending * ESHELL_JOURNAL_FRAME;
+  frame.crc = eshell_audit_crc32c(&rec, sizeof(rec));
+  memcpy(p, &frame, sizeof(frame));
+  memcpy(p + sizeof(frame), &rec, sizeof(rec));
+  j->pending++;
+  j->records++;
+
+  if (j->pending == ESHELL_JOURNAL_GROUP ||
+      eshell_now_ns() - j->last_commit >= ESHELL_JOURNAL_GROUP_NS) {
+    eshell_journal_commit(j);
+  }
+}
+
+/**
+  @brief       Read back a journal, marking lines that finished successfully.
+  @param  fd   The journal, positioned at the start.
+  @param  done Array of flags, one per line, set for finished lines.
+  @param  hash Hash of each line, which the journal must agree with.
+  @param  n    Number of lines.
+  @return      Offset just past the last good frame.
+*/
+off_t eshell_journal_replay(int fd, bool *done, const uint64_t *hash, int n) {
+  struct eshell_audit_frame frame;
+  struct eshell_journal_record rec;
+  char buf[ESHELL_JOURNAL_FRAME];
+  off_t good = 0;
+
+  // Stop at the first torn or damaged frame; everything after it is suspect
+  while (read(fd, buf, sizeof(buf)) == (ssize_t) sizeof(buf)) {
+    memcpy(&frame, buf, sizeof(frame));
+    memcpy(&rec, buf + sizeof(frame), sizeof(rec));
+
+    if (frame.magic != ESHELL_JOURNAL_MAGIC || frame.length != sizeof(rec) ||
+        frame.crc != eshell_audit_crc32c(&rec, sizeof(rec))) {
+      break;
+    }
+
+    if (rec.type == ESHELL_JOURNAL_FINISHED && rec.status == 0 &&
+        rec.line < (uint32_t) n && rec.hash == hash[rec.line]) {
+      done[rec.line] = true;
+    }
+
+    good += sizeof(buf);
+  }
+
+  return good;
+}
+
+/**
+  @brief       Start one command of a batch.
+  @param  line Text of the command; split in place.
+  @return      Pid of the child running it, or -1 if it couldn't start.
+*/
+pid_t eshell_batch_spawn(char *line) {
+  char **args = eshell_split_line(line);
+  struct eshell_function *fn;
+  char path[PATH_MAX];
+  pid_t pid = -1;
+  int i;
+
+  if (args[0] == NULL) {
+    free(args);
+
+    return -1;
+  }
+
+  // Builtins and functions run in the child; anything else is resolved up
+  //   front
+  i = eshell_builtin_find(args[0]);
+  fn = i < 0 ? eshell_function_find(args[0]) : NULL;
+
+  if (i < 0 && fn == NULL && !eshell_resolve(args[0], path,
+                                                    sizeof(path))) {
+    free(args);
+
+    return -1;
+  }
+
+  fflush(stdout);
+  eshell_fdbuf_sync_all();
+  pid = eshell_fork();
+
+  if (pid == 0) {
+    if (i >= 0 || fn != NULL) {
+      // Like a pipeline stage, it waits for its own children
+      eshell_subshell_init();
+      eshell_status = 0;
+
+      if (fn != NULL) {
+        eshell_function_call(fn, args);
+      } else {
+        (*builtin_func[i])(args);
+      }
+
+      fflush(stdout);
+      _exit(eshell_status);
+    }
+
+    execv(path, args);
+    perror("eshell: child process failed");
+
+    _exit(EXIT_FAILURE);
+  } else if (pid < 0) {
+    perror("eshell: error forking parent process");
+  }
+
+  free(args);
+
+  return pid;
+}
+
+/*
+  State shared by the workers of one batch run
+*/
+struct eshell_batch_run {
+  char **lines;
+  uint64_t *hashes;
+  bool *done;                       // Finished in an earlier run
+  int num_lines;
+  int next;                         // Next line to hand out
+  int failed;
+  int workers;                      // Workers still running
+  struct eshell_co *committer;      // Timer that commits the journal
+  struct eshell_journal *journal;
+};
+
+/**
+  @brief     Coroutine: take lines from the batch and run them until none
+               are left.
+  @param arg The batch run.
+*/
+void eshell_batch_worker(void *arg) {
+  struct eshell_batch_run *run = arg;
+
+  while (run->next < run->num_lines) {
+    int n = run->next++;
+    char *text = run->lines[n];
+    size_t start = strspn(text, ESHELL_TOK_DELIM);
+    char *copy;
+    pid_t pid;
+    int status;
+
+    if (run->done[n]) {
+      batch.skipped++;
+
+      continue;
+    }
+
+    // Blank lines and comments
+    if (text[start] == '\0' || text[start] == '#') {
+      continue;
+    }
+
+    copy = strdup(text);
+    pid = eshell_batch_spawn(copy);
+    free(copy);
+
+    if (pid < 0) {
+      run->failed++;
+
+      continue;
+    }
+
+    batch.commands++;
+    eshell_journal_add(run->journal, ESHELL_JOURNAL_STARTED, n, run->hashes[n],
+                       0);
+    status = eshell_co_wait_child(pid);
+    run->failed += status != 0;
+    eshell_journal_add(run->journal, ESHELL_JOURNAL_FINISHED, n,
+                       run->hashes[n], status);
+  }
+
+  // The last one out lets the committer finish without waiting for its timer
+  if (--run->workers == 0 && run->committer) {
+    eshell_co_wake(run->committer);
+  }
+}
+
+/**
+  @brief     Coroutine: commit the journal on a timer while workers run, so
+               records don't wait on the next one to arrive.
+  @param arg The batch run.
+*/
+void eshell_batch_committer(void *arg) {
+  struct eshell_batch_run *run = arg;
+
+  run->committer = executor.current;
+
+  while (run->workers > 0) {
+    eshell_co_sleep(ESHELL_JOURNAL_GROUP_NS / 1000000);
+    eshell_journal_commit(run->journal);
+  }
+
+  run->committer = NULL;
+}
+
+/**
+  @brief       Run every line of a file as a command.
+  @param  args List of arguments: "batch [-j N] [--journal FILE] [--resume]
+                 FILE".
+  @return      Always return 1 to continue executing the shell.
+*/
+int eshell_batch(char **args) {
+  struct eshell_journal journal = { .fd = -1 };
+  struct eshell_batch_run run = { .journal = &journal };
+  const char *journal_path = NULL;
+  const char *file = NULL;
+  bool resume = false;
+  int jobs = 1;
+  char **lines = NULL;
+  uint64_t *hashes = NULL;
+  bool *done;
+  int num_lines = 0;
+  char *line = NULL;
+  size_t len = 0;
+  FILE *fp;
+  int i;
+
+  for (i = 1; args[i]; i++) {
+    if (strcmp(args[i], "-j") == 0 && args[i + 1]) {
+      jobs = atoi(args[++i]);
+    } else if (strcmp(args[i], "--journal") == 0 && args[i + 1]) {
+      journal_path = args[++i];
+    } else if (strcmp(args[i], "--resume") == 0) {
+      resume = true;
+    } else {
+      file = args[i];
+    }
+  }
+
+  if (file == NULL || jobs < 1 || (resume && journal_path == NULL)) {
+    fprintf(stderr, "eshell: usage: batch [-j N] [--journal FILE] [--resume] "
+                    "FILE\n");
+
+    return 1;
+  }
+
+  if ((fp = fopen(file, "r")) == NULL) {
+    perror("eshell: batch");
+
+    return 1;
+  }
+
+  // Load the commands, hashing each so the journal can tell if they changed
+  while (getline(&line, &len, fp) != -1) {
+    line[strcspn(line, "\n")] = '\0';
+    lines = realloc(lines, (num_lines + 1) * sizeof(char *));
+    hashes = realloc(hashes, (num_lines + 1) * sizeof(uint64_t));
+
+    if (!lines || !hashes) {
+      fprintf(stderr, "eshell: allocation error\n");
+
+      exit(EXIT_FAILURE);
+    }
+
+    lines[num_lines] = strdup(line);
+    hashes[num_lines] = eshell_xxh64(line, strlen(line), 0);
+    num_lines++;
+  }
+
+  free(line);
+  fclose(fp);
+
+  done = calloc(num_lines + 1, sizeof(bool));
+
+  if (!done) {
+    fprintf(stderr, "eshell: allocation error\n");
+
+    exit(EXIT_FAILURE);
+  }
+
+  if (journal_path) {
+    journal.fd = open(journal_path, O_RDWR | O_CREAT | O_CLOEXEC |
+                      (resume ? O_APPEND : O_TRUNC), 0644);
+
+    if (journal.fd < 0) {
+      perror("eshell: batch journal");
+    } else if (resume) {
+      off_t good = eshell_journal_replay(journal.fd, done, hashes, num_lines);
+
+      // New records go after the last good frame, not after the damage
+      if (ftruncate(journal.fd, good) != 0) {
+        perror("eshell: batch journal");
+      }
+    }
+
+    journal.last_commit = eshell_now_ns();
+  }
+
+  run.lines = lines;
+  run.hashes = hashes;
+  run.done = done;
+  run.num_lines = num_lines;
+
+  batch.runs++;
+
+  // Each worker runs one command at a time; -j of them share this thread
+  run.workers = jobs;
+
+  for (i = 0; i < jobs; i++) {
+    eshell_co_spawn(eshell_batch_worker, &run);
+  }
+
+  if (journal.fd >= 0) {
+    eshell_co_spawn(eshell_batch_committer, &run);
+  }
+
+  eshell_co_run();
+
+  eshell_journal_commit(&journal);
+  batch.failed += run.failed;
+  batch.commits += journal.commits;
+  eshell_status = run.failed > 0;
+
+  if (journal.fd >= 0) {
+    close(journal.fd);
+  }
+
+  for (i = 0; i < num_lines; i++) {
+    free(lines[i]);
+  }
+
+  free(lines);
+  free(hashes);
+  free(done);
+
+  return 1;
+}
+
+/*
+  Command history. Besides the lines themselves, it counts how often each
+  command follows each other command, which is used to guess what will be run
+  next and to warm the page cache for it while the user types.
+*/
+#define ESHELL_PREDICT_MAX 3
+#define ESHELL_WARM_MAX 64
+
+struct eshell_transition {
+  const char *prev;                 // Atoms
+  const char *next;
+  unsigned long count;
+};
+
+struct eshell_history {
+  char **lines;
+  int num_lines;
+  int capacity;
+  FILE *file;                       // $HOME/.eshell_history, if writable
+  const char *last;                 // Command name of the last line run
+  struct eshell_transition *transitions;
+  int num_transitions;
+  int transitions_capacity;
+  const char *predicted[ESHELL_PREDICT_MAX];
+  int num_predicted;
+  unsigned long predictions;
+  unsigned long hits;
+  unsigned long misses;
+  unsigned long files_warmed;       // Updated from the background thread
+  unsigned long bytes_warmed;
+} history;
+
+/**
+  @brief       Count one more time that a command followed another.
+  @param  prev Atom for the command run first.
+  @param  next Atom for the command run after it.
+*/
+void eshell_history_transition(const char *prev, const char *next) {
+  int i;
+
+  for (i = 0; i < history.num_transitions; i++) {
+    if (history.transitions[i].prev == prev &&
+        history.transitions[i].next == next) {
+      history.transitions[i].count++;
+
+      return;
+    }
+  }
+
+  if (history.num_transitions >= history.transitions_capacity) {
+    history.transitions_capacity = history.transitions_capacity ?
+                                   history.transitions_capacity * 2 : 64;
+    history.transitions = realloc(history.transitions,
+        history.transitions_capacity * sizeof(struct eshell_transition));
+
+    if (!history.transitions) {
+      fprintf(stderr, "eshell: allocation error\n");
+
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  history.transitions[i].prev = prev;
+  history.transitions[i].next = next;
+  history.transitions[i].count = 1;
+  history.num_transitions++;
+}
+
+/**
+  @brief       Remember a line, scoring the last prediction against it.
+  @param  line The line as typed.
+  @param  save Also append it to the history file.
+*/
+void eshell_history_add(const char *line, bool save) {
+  size_t start = strspn(line, ESHELL_TOK_DELIM);
+  const char *name;
+  int i;
+
+  // Blank lines aren't history
+  if (line[start] == '\0') {
+    return;
+  }
+
+  if (history.num_lines >= history.capacity) {
+    history.capacity = history.capacity ? history.capacity * 2 : 256;
+    history.lines = realloc(history.lines, history.capacity * sizeof(char *));
+
+    if (!history.lines) {
+      fprintf(stderr, "eshell: allocation error\n");
+
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  history.lines[history.num_lines++] = strdup(line);
+
+  if (save && history.file) {
+    fprintf(history.file, "%s\n", line);
+    fflush(history.file);
+  }
+
+  name = eshell_intern_n(line + start,
+                         strcspn(line + start, ESHELL_TOK_DELIM));
+
+  // Was this one of the commands we warmed up for?
+  if (history.num_predicted > 0) {
+    for (i = 0; i < history.num_predicted; i++) {
+      if (history.predicted[i] == name) {
+        break;
+      }
+    }
+
+    if (i < history.num_predicted) {
+      history.hits++;
+    } else {
+      history.misses++;
+    }
+  }
+
+  if (history.last) {
+    eshell_history_transition(history.last, name);
+  }
+
+  history.last = name;
+}
+
+/**
+  @brief Load earlier sessions' history from $HOME/.eshell_history and keep
+           the file open to append this session's.
+*/
+void eshell_history_load(void) {
+  const char *home = getenv("HOME");
+  char path[PATH_MAX];
+  char *line = NULL;
+  size_t len = 0;
+  FILE *fp;
+
+  if (home == NULL) {
+    return;
+  }
+
+  snprintf(path, sizeof(path), "%s/.eshell_history", home);
+
+  if ((fp = fopen(path, "r")) != NULL) {
+    while (getline(&line, &len, fp) != -1) {
+      line[strcspn(line, "\n")] = '\0';
+      eshell_history_add(line, false);
     }
+
+    free(line);
+    fclose(fp);
   }
 
-  return 1;
+  history.file = fopen(path, "a");
 }
 
 /**
-  @brief       Print a bit of help.
-  @param  args Arguments that are ignored.
-  @return      Always return 1 to continue executing the shell.
+  @brief      Library search for one DT_NEEDED entry.
+  @param name Library name from the dynamic section.
+  @param rpath DT_RUNPATH or DT_RPATH of the object needing it, or NULL.
+  @param out  Buffer to receive the path found.
+  @param size Size of the buffer.
+  @return     True if the library was found.
 */
-int eshell_help(char **args) {
+bool eshell_find_library(const char *name, const char *rpath, char *out,
+                         size_t size) {
+  static const char *defaults[] = {
+    "/lib/x86_64-linux-gnu", "/usr/lib/x86_64-linux-gnu",
+    "/lib/aarch64-linux-gnu", "/usr/lib/aarch64-linux-gnu",
+    "/lib64", "/usr/lib64", "/lib", "/usr/lib", NULL
+  };
+  const char *p;
   int i;
-  printf("eshell\n");
-  printf("\n");
-  printf("There are a few programs built-in:\n");
 
-  // Print out all of the built-in commands
-  for (i = 0; i < eshell_num_builtins(); i++) {
-    printf("  %s\n", builtin_str[i]);
+  if (strchr(name, '/') != NULL) {
+    snprintf(out, size, "%s", name);
+
+    return access(out, R_OK) == 0;
   }
 
-  return 1;
-}
+  // Runpath entries first, skipping the ones that need $ORIGIN and friends
+  for (p = rpath; p && *p; ) {
+    size_t n = strcspn(p, ":");
 
-/**
-  @brief       Show some debug information.
-  @param  args Arguments that are ignored.
-  @return      Always return 1 to continue executing the shell.
-*/
-int eshell_debug(char **args) {
-  // Print out all of the environment variables that are currently defined.
-  for(char **current = environ; *current; current++) {
-    puts(*current);
+    if (n > 0 && memchr(p, '$', n) == NULL) {
+      snprintf(out, size, "%.*s/%s", (int) n, p, name);
+
+      if (access(out, R_OK) == 0) {
+        return true;
+      }
+    }
+
+    p += n + (p[n] == ':');
   }
 
-  return 1;
+  for (i = 0; defaults[i]; i++) {
+    snprintf(out, size, "%s/%s", defaults[i], name);
+
+    if (access(out, R_OK) == 0) {
+      return true;
+    }
+  }
+
+  return false;
 }
 
 /**
-  @brief       Exit the shell.
-  @param  args Arguments that are ignored.
-  @return      Always returns 0.
+  @brief        Find the shared libraries an ELF object needs.
+  @param  data  The mapped object.
+  @param  size  Its size.
+  @param  queue Paths already queued for warming; new ones are appended.
+  @param  count Number of entries in the queue.
 */
-int eshell_exit(char **args) {
-  return 0;
+void eshell_elf_needed(const unsigned char *data, size_t size, char **queue,
+                       int *count) {
+  const Elf64_Ehdr *eh = (const Elf64_Ehdr *) data;
+  const Elf64_Phdr *ph;
+  const Elf64_Dyn *dyn = NULL;
+  size_t num_dyn = 0;
+  Elf64_Addr strtab = 0;
+  const char *strings = NULL;
+  const char *rpath = NULL;
+  size_t i, j;
+
+  if (size < sizeof(Elf64_Ehdr) || memcmp(eh->e_ident, ELFMAG, SELFMAG) != 0 ||
+      eh->e_ident[EI_CLASS] != ELFCLASS64 ||
+      eh->e_phoff + (size_t) eh->e_phnum * sizeof(Elf64_Phdr) > size) {
+    return;
+  }
+
+  ph = (const Elf64_Phdr *) (data + eh->e_phoff);
+
+  for (i = 0; i < eh->e_phnum; i++) {
+    if (ph[i].p_type == PT_DYNAMIC && ph[i].p_offset + ph[i].p_filesz <= size) {
+      dyn = (const Elf64_Dyn *) (data + ph[i].p_offset);
+      num_dyn = ph[i].p_filesz / sizeof(Elf64_Dyn);
+    }
+  }
+
+  for (i = 0; i < num_dyn && dyn[i].d_tag != DT_NULL; i++) {
+    if (dyn[i].d_tag == DT_STRTAB) {
+      strtab = dyn[i].d_un.d_ptr;
+    }
+  }
+
+  // The string table is given as an address, so find the segment holding it
+  for (i = 0; i < eh->e_phnum && strtab; i++) {
+    if (ph[i].p_type == PT_LOAD && strtab >= ph[i].p_vaddr &&
+        strtab < ph[i].p_vaddr + ph[i].p_filesz &&
+        ph[i].p_offset + (strtab - ph[i].p_vaddr) < size) {
+      strings = (const char *) data + ph[i].p_offset + (strtab - ph[i].p_vaddr);
+    }
+  }
+
+  if (strings == NULL) {
+    return;
+  }
+
+  for (i = 0; i < num_dyn && dyn[i].d_tag != DT_NULL; i++) {
+    if (dyn[i].d_tag == DT_RUNPATH || dyn[i].d_tag == DT_RPATH) {
+      rpath = strings + dyn[i].d_un.d_val;
+    }
+  }
+
+  for (i = 0; i < num_dyn && dyn[i].d_tag != DT_NULL; i++) {
+    char path[PATH_MAX];
+
+    if (dyn[i].d_tag != DT_NEEDED || *count >= ESHELL_WARM_MAX ||
+        !eshell_find_library(strings + dyn[i].d_un.d_val, rpath, path,
+                             sizeof(path))) {
+      continue;
+    }
+
+    for (j = 0; j < (size_t) *count && strcmp(queue[j], path) != 0; j++);
+
+    if (j == (size_t) *count) {
+      queue[(*count)++] = strdup(path);
+    }
+  }
 }
 
 /**
-  @brief       Launches an external program.
-  @param  args List of arguments, including the program to execute.
-  @return      Always return 1 to continue executing the shell.
+  @brief     Background job: pull a binary and everything it links against
+               into the page cache.
+  @param arg Path of the binary, which the job frees.
 */
-int eshell_launch(char **args) {
-  pid_t pid;
-  int status;
+void eshell_warm_job(void *arg) {
+  char *queue[ESHELL_WARM_MAX];
+  int count = 1;
+  int i;
 
-  // Make a copy of the currently running process
-  pid = fork();
+  queue[0] = arg;
 
-  // If the PID is 0, make that process a child process
-  if (pid == 0) {
-    // Make the child process run the program desired
-    if (execvp(args[0], args) == -1) {
-      perror("eshell: child process failed\n");
+  for (i = 0; i < count; i++) {
+    struct stat st;
+    void *data;
+    int fd = open(queue[i], O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0) {
+      continue;
     }
 
-    exit(EXIT_FAILURE);
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+      // Start reading the whole file; this returns without waiting
+      posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+      __atomic_add_fetch(&history.files_warmed, 1, __ATOMIC_RELAXED);
+      __atomic_add_fetch(&history.bytes_warmed, st.st_size, __ATOMIC_RELAXED);
 
-  // The PID is less than 0, so it's a forking error
-  } else if (pid < 0) {
-    perror("eshell: error forking parent process\n");
+      // Follow the dynamic section to the shared libraries
+      data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
 
-  // Fork executed properly
-  } else {
-    // Wait for the process to finish — try once, then if it's exited, stop the
-    //   loop
-    do {
-      waitpid(pid, &status, WUNTRACED);
-    } while (!WIFEXITED(status) && !WIFSIGNALED(status));
+      if (data != MAP_FAILED) {
+        eshell_elf_needed(data, st.st_size, queue, &count);
+        munmap(data, st.st_size);
+      }
+    }
+
+    close(fd);
   }
 
-  return 1;
+  for (i = 0; i < count; i++) {
+    free(queue[i]);
+  }
 }
 
 /**
-  @brief       Execute shell built-in or launch program.
-  @param  args Null terminated list of arguments.
-  @return      0 if the shell should terminate, non-zero if the shell continues
-                 to run.
+  @brief Guess the next commands from what usually follows the last one and
+           start warming their binaries.
 */
-int eshell_execute(char **args) {
-  int i;
+void eshell_history_predict(void) {
+  struct eshell_transition *best[ESHELL_PREDICT_MAX];
+  int i, j;
 
-  // An empty command was entered, just show the loop again
-  if (args[0] == NULL) {
-    return 1;
+  history.num_predicted = 0;
+
+  if (history.last == NULL) {
+    return;
   }
 
-  // It was a legitamite program, so loop through all of the built-in commands
-  for (i = 0; i < eshell_num_builtins(); i++) {
+  // Keep the most frequent successors, best first
+  for (i = 0; i < history.num_transitions; i++) {
+    struct eshell_transition *t = &history.transitions[i];
+
+    if (t->prev != history.last) {
+      continue;
+    }
 
-    // Found a command that matches the one passed
-    if (strcmp(args[0], builtin_str[i]) == 0) {
+    for (j = history.num_predicted; j > 0 && best[j - 1]->count < t->count;
+         j--) {
+      if (j < ESHELL_PREDICT_MAX) {
+        best[j] = best[j - 1];
+      }
+    }
 
-      // Run the built-in program
-      return (*builtin_func[i])(args);
+    if (j < ESHELL_PREDICT_MAX) {
+      best[j] = t;
+
+      if (history.num_predicted < ESHELL_PREDICT_MAX) {
+        history.num_predicted++;
+      }
     }
   }
 
-  // A command was passed but it wasn't a built-in one, so try and launch it
-  //   externally
-  return eshell_launch(args);
-}
+  for (i = 0; i < history.num_predicted; i++) {
+    char path[PATH_MAX];
+    char *copy;
 
-#define ESHELL_RL_BUFSIZE 1024
+    history.predicted[i] = best[i]->next;
+
+    // Builtins have nothing to warm
+    if (eshell_builtin_find(history.predicted[i]) >= 0 ||
+        !eshell_path_lookup(history.predicted[i], path,
+                                       sizeof(path))) {
+      continue;
+    }
+
+    history.predictions++;
+    copy = strdup(path);
+
+    if (!eshell_bg_submit(eshell_warm_job, copy)) {
+      free(copy);
+    }
+  }
+}
 
 /**
-  @brief  Read a line of input from stdin.
-  @return The line from stdin.
+  @brief Reset the intern table once its arena outgrows ESHELL_INTERN_LIMIT,
+           carrying the atoms history and the atom maps hold across. Only
+           called between commands, when nothing else is holding on to one.
 */
-char *eshell_read_line(void) {
-  int bufsize = ESHELL_RL_BUFSIZE;
-  int position = 0;
-  char *buffer = malloc(sizeof(char) * bufsize);
-  int c;
+void eshell_intern_collect(void) {
+  struct eshell_atom_map *maps[] = { &aliases.map, &functions.map,
+                                     &vars.arrays };
+  const int num_maps = sizeof(maps) / sizeof(maps[0]);
+  const char ***held;
+  char **copies;
+  size_t max = 2 * history.num_transitions + 1 + ESHELL_PREDICT_MAX;
+  size_t k;
+  int n = 0;
+  int i;
 
-  // Isn't enough buffer space, exit out.
-  if (!buffer) {
+  if (intern.bytes < ESHELL_INTERN_LIMIT) {
+    return;
+  }
+
+  for (i = 0; i < num_maps; i++) {
+    max += maps[i]->capacity;
+  }
+
+  held = malloc(max * sizeof(char **));
+  copies = malloc(max * sizeof(char *));
+
+  if (!held || !copies) {
     fprintf(stderr, "eshell: allocation error\n");
 
     exit(EXIT_FAILURE);
   }
 
-  // Read the whole input buffer
-  while (1) {
+  for (i = 0; i < history.num_transitions; i++) {
+    held[n++] = &history.transitions[i].prev;
+    held[n++] = &history.transitions[i].next;
+  }
 
-    // Read the next character
-    c = getchar();
+  for (i = 0; i < history.num_predicted; i++) {
+    held[n++] = &history.predicted[i];
+  }
 
-    if (c == EOF || c == '\n') {
-      // If we hit EOF, replace it with a null character and return
-      buffer[position] = '\0';
+  if (history.last) {
+    held[n++] = &history.last;
+  }
 
-      return buffer;
-    } else {
-      // Otherwise, put the character in the right position in the buffer
-      buffer[position] = c;
+  for (i = 0; i < num_maps; i++) {
+    for (k = 0; k < maps[i]->capacity; k++) {
+      if (maps[i]->slots[k].value != NULL) {
+        held[n++] = &maps[i]->slots[k].name;
+      }
     }
+  }
 
-    position++;
+  // Copy the strings out of the arena, reset it, and intern them again
+  for (i = 0; i < n; i++) {
+    copies[i] = strdup(*held[i]);
+  }
 
-    // We've exceeded the buffer size
-    if (position >= bufsize) {
+  eshell_intern_reset();
 
-      // Increase the buffer size
-      bufsize += ESHELL_RL_BUFSIZE;
-      buffer = realloc(buffer, bufsize);
+  for (i = 0; i < n; i++) {
+    *held[i] = eshell_intern(copies[i]);
+    free(copies[i]);
+  }
 
-      if (!buffer) {
-        fprintf(stderr, "eshell: allocation error\n");
+  free(copies);
+  free(held);
 
-        exit(EXIT_FAILURE);
-      }
+  // Atom maps are placed by address
+  for (i = 0; i < num_maps; i++) {
+    if (maps[i]->capacity > 0) {
+      eshell_atom_map_rehash(maps[i], maps[i]->capacity);
     }
   }
 }
 
-#define ESHELL_TOK_BUFSIZE 64
-#define ESHELL_TOK_DELIM " \t\r\n\a"
+/**
+  @brief       Print the command history.
+  @param  args Arguments that are ignored.
+  @return      Always return 1 to continue executing the shell.
+*/
+int eshell_history(char **args) {
+  int i;
+
+  for (i = 0; i < history.num_lines; i++) {
+    printf("%5d  %s\n", i + 1, history.lines[i]);
+  }
+
+  return 1;
+}
+
+/*
+  Live metrics (see eshell_metrics.h). The session's counters are copied into
+  a shared mapping of its own file after every command and every child
+  started, under a sequence count rather than a lock, so eshell-top can read
+  any number of sessions without them ever waiting. Children get no mapping:
+  the fork handler drops it, so only the session writes to its file.
+*/
+struct eshell_metrics_state {
+  struct eshell_metrics *shm;       // NULL when not publishing
+  char path[PATH_MAX];
+  pid_t pid;
+  uint64_t commands;
+  uint64_t failed;
+  uint64_t spawns;
+  uint64_t spawn_ns;
+  uint64_t spawn_buckets[ESHELL_METRICS_BUCKETS];
+  char command[64];                 // Published with the rest
+} metrics;
 
 /**
-  @brief       Super naively split a line into tokens
-  @param  line The line to tokenize
-  @return      Null-terminated array of tokens
+  @brief Publish the counters.
 */
-char **eshell_split_line(char *line) {
-  int bufsize = ESHELL_TOK_BUFSIZE
-  int position = 0;
-  char **tokens = malloc(bufsize * sizeof(char*));
-  char *token;
-  char **tokens_backup;
+void eshell_metrics_publish(void) {
+  struct eshell_metrics *m = metrics.shm;
+  uint32_t seq;
 
-  // There aren't any tokens, so something went wrong with allocation
-  if (!tokens) {
-    fprintf(stderr, "eshell: allocation error\n");
+  if (m == NULL) {
+    return;
+  }
 
-    exit(EXIT_FAILURE);
+  seq = m->seq;
+  __atomic_store_n(&m->seq, seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  m->updated_ns = eshell_wall_ns();
+  m->commands = metrics.commands;
+  m->failed = metrics.failed;
+  m->spawns = metrics.spawns;
+  m->spawn_ns = metrics.spawn_ns;
+  memcpy(m->spawn_buckets, metrics.spawn_buckets,
+         sizeof(metrics.spawn_buckets));
+  m->active_jobs = metrics.spawns > child_ring.delivered ?
+                   metrics.spawns - child_ring.delivered : 0;
+  m->path_lookups = path_index.lookups;
+  m->path_hits = path_index.hits;
+  m->site_hits = functions.hits;
+  m->site_misses = functions.misses;
+  m->intern_lookups = intern.lookups;
+  m->intern_hits = intern.hits;
+  m->memo_hits = memo.hits;
+  m->memo_misses = memo.misses;
+  memcpy(m->command, metrics.command, sizeof(m->command));
+
+  __atomic_store_n(&m->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/**
+  @brief Stop publishing in a child, whose counters would only be a copy.
+*/
+void eshell_metrics_forked(void) {
+  metrics.shm = NULL;
+}
+
+/**
+  @brief Remove the session's file as it exits.
+*/
+void eshell_metrics_close(void) {
+  if (metrics.shm && getpid() == metrics.pid) {
+    unlink(metrics.path);
   }
+}
 
-  // Start the tokenization
-  token = strtok(line, ESHELL_TOK_DELIM);
-  while (token != NULL) {
-    // Add each token to the array
-    tokens[position] = token;
+/**
+  @brief Create the session's metrics file and map it, unless metrics are
+           turned off or there's nowhere to put them.
+*/
+void eshell_metrics_open(void) {
+  char dir[PATH_MAX - 32];
+  struct eshell_metrics *m;
+  int fd;
 
-    position++;
+  if (!eshell_metrics_dir(dir, sizeof(dir)) ||
+      (mkdir(dir, 0700) != 0 && errno != EEXIST)) {
+    return;
+  }
 
-    // We've reached the end of the buffer
-    if (position >= bufsize) {
+  metrics.pid = getpid();
+  snprintf(metrics.path, sizeof(metrics.path), "%s/metrics.%d", dir,
+           (int) metrics.pid);
+  fd = open(metrics.path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
 
-      // Attempt to reallocate some memory to increase the buffer size
-      bufsize += ESHELL_TOK_BUFSIZE;
-      tokens_b = tokens;
-      tokens = realloc(tokens, bufsize * sizeof(char*));
+  if (fd < 0) {
+    return;
+  }
 
-      // If there's still no tokens, quit
-      if (!tokens) {
-        free(tokens_b);
-        fprintf(stderr, "eshell: allocation error\n");
+  if (ftruncate(fd, sizeof(struct eshell_metrics)) != 0 ||
+      (m = mmap(NULL, sizeof(struct eshell_metrics), PROT_READ | PROT_WRITE,
+                MAP_SHARED, fd, 0)) == MAP_FAILED) {
+    close(fd);
+    unlink(metrics.path);
 
-        exit(EXIT_FAILURE);
-      }
-    }
+    return;
+  }
 
-    // Run the tokenization again to get the next toekn
-    token = strtok(NULL, ESHELL_TOK_DELIM);
+  close(fd);
+  m->version = ESHELL_METRICS_VERSION;
+  m->pid = metrics.pid;
+  m->uid = getuid();
+  m->started_ns = eshell_wall_ns();
+  __atomic_store_n(&m->magic, ESHELL_METRICS_MAGIC, __ATOMIC_RELEASE);
+  metrics.shm = m;
+
+  pthread_atfork(NULL, NULL, eshell_metrics_forked);
+  atexit(eshell_metrics_close);
+  eshell_metrics_publish();
+}
+
+/**
+  @brief      Name the command that's running, for the next publish.
+  @param name The command.
+*/
+void eshell_metrics_command(const char *name) {
+  if (metrics.shm) {
+    strncpy(metrics.command, name, sizeof(metrics.command) - 1);
   }
+}
 
-  tokens[position] = NULL;
+/**
+  @brief  Start a child, counting how long it took.
+  @return What fork returns.
+*/
+pid_t eshell_fork(void) {
+  uint64_t start = eshell_now_ns();
+  pid_t pid = fork();
+  uint64_t ns;
+  int k;
 
-  return tokens;
+  if (pid <= 0) {
+    return pid;
+  }
+
+  ns = eshell_now_ns() - start;
+
+  for (k = 0; k < ESHELL_METRICS_BUCKETS - 1 && ns / 1000 >= 1ULL << k; k++);
+
+  metrics.spawns++;
+  metrics.spawn_ns += ns;
+  metrics.spawn_buckets[k]++;
+
+  // So a long one shows up while it's running
+  if (metrics.shm) {
+    eshell_metrics_publish();
+  }
+
+  return pid;
 }
 
-#define ANSI_COLOR_BLUE    "\x1b[34m"
-#define ANSI_COLOR_MAGENTA "\x1b[35m"
-#define ANSI_COLOR_RESET   "\x1b[0m"
+/**
+  @brief        Account for a command that has just finished.
+  @param  args  The command.
+  @param  start When it started, from eshell_now_ns().
+*/
+void eshell_command_done(char **args, uint64_t start) {
+  eshell_audit_command(args, start);
+  metrics.commands++;
+  metrics.failed += eshell_status != 0;
+
+  if (metrics.shm) {
+    eshell_metrics_publish();
+  }
+}
+
+/**
+  @brief       Print the shell's performance counters.
+  @param  args Arguments that are ignored.
+  @return      Always return 1 to continue executing the shell.
+*/
+int eshell_stats(char **args) {
+  unsigned long scored = history.hits + history.misses;
+
+  printf("path index:  %lu lookups, %lu hits, %lu rebuilds, "
+         "%lu inotify updates\n", path_index.lookups, path_index.hits,
+         path_index.rebuilds, path_index.updates);
+  printf("intern:      %zu atoms, %zu KiB arena, %lu lookups, %lu hits, "
+         "%lu resets\n", intern.count, intern.bytes / 1024, intern.lookups,
+         intern.hits, intern.resets);
+  printf("aliases:     %lu expansions, %lu tokens spliced\n",
+         aliases.expansions, aliases.spliced);
+  printf("variables:   %lu expansions, %lu lines mapped, %lu files mapped "
+         "(%lu KiB), %lu read, %lu values shared\n", vars.expansions,
+         vars.lines_mapped, vars.files_mapped, vars.bytes_mapped / 1024,
+         vars.files_read, vars.shared);
+  printf("line input:  %lu lines, %lu reads, %lu seeks back\n",
+         fdbufs.lines, fdbufs.fills, fdbufs.seeks);
+  printf("text tools:  %lu runs, %lu KiB read\n", text.runs,
+         text.bytes / 1024);
+  printf("json:        %lu records, %lu chunks on threads\n", json.records,
+         json.chunks);
+  printf("checksums:   %lu files, %lu KiB, %lu mapped\n", sums.files,
+         sums.bytes / 1024, sums.mapped);
+  printf("tree walks:  %lu walks, %lu directories, %lu entries, %lu "
+         "stolen\n", walks.walks, walks.dirs, walks.entries, walks.steals);
+  printf("copies:      %lu files, %lu KiB, %lu cloned, %lu ranges on "
+         "tasks\n", copies.files, copies.bytes / 1024, copies.cloned,
+         copies.ranges);
+  printf("plugins:     %lu loaded, %lu builtins\n", plugins.loaded,
+         plugins.builtins);
+  printf("pipelines:   %lu run, %lu stages in the shell, %lu forked\n",
+         pipelines.runs, pipelines.threaded, pipelines.forked);
+  printf("pfor:        %lu loops, %lu iterations on threads, %lu as "
+         "children, %lu in the shell\n", pfor.runs, pfor.threaded,
+         pfor.spawned, pfor.serial);
+  printf("functions:   %lu calls, %lu call sites cached, %lu resolved\n",
+         functions.calls, functions.hits, functions.misses);
+  printf("speculation: %lu started, %lu used, %lu missed\n", spec.started,
+         spec.hits, spec.misses);
+  printf("prediction:  %lu commands warmed, %lu hits, %lu misses "
+         "(%.1f%% hit rate), %lu files and %lu KiB advised\n",
+         history.predictions, history.hits, history.misses,
+         scored ? 100.0 * history.hits / scored : 0.0,
+         __atomic_load_n(&history.files_warmed, __ATOMIC_RELAXED),
+         __atomic_load_n(&history.bytes_warmed, __ATOMIC_RELAXED) / 1024);
+  printf("memo:        %lu hits, %lu misses, %lu KiB replayed\n", memo.hits,
+         memo.misses, memo.bytes_replayed / 1024);
+  printf("audit:       %lu records, %lu writes, %lu KiB written\n",
+         audit.records, audit.flushes, audit.bytes / 1024);
+  printf("xtrace:      %lu lines, %lu writes, %lu KiB written\n",
+         xtrace.lines, xtrace.flushes, xtrace.bytes / 1024);
+  printf("batch:       %lu runs, %lu commands, %lu skipped on resume, "
+         "%lu failed, %lu journal commits\n", batch.runs, batch.commands,
+         batch.skipped, batch.failed, batch.commits);
+  printf("io:          %s engine, %lu operations in %lu submissions, "
+         "%lu KiB\n", io.engine == ESHELL_IO_URING ? "uring" : "sync", io.ops,
+         io.submits, io.bytes / 1024);
+  printf("children:    %lu exits delivered, %lu ring overflows\n",
+         child_ring.delivered, child_ring.overflows);
+  printf("metrics:     %s, %lu spawns, %.1f us to spawn avg\n",
+         metrics.shm ? metrics.path : "off", (unsigned long) metrics.spawns,
+         metrics.spawns ? metrics.spawn_ns / 1e3 / metrics.spawns : 0.0);
+  printf("executor:    %lu coroutines, %lu switches, %lu epoll waits\n",
+         executor.spawned, executor.switches, executor.waits);
+  printf("watch-run:   %lu reruns, %lu cancelled, %lu events, event to start "
+         "%.1f ms avg\n", watch.runs, watch.cancelled, watch.events,
+         watch.runs ? watch.latency_total / 1e6 / watch.runs : 0.0);
+
+  return 1;
+}
 
 /**
   @brief  Load the configuration files.
@@ -325,6 +13480,14 @@ void eshell_config() {
     char *vrbl[2];
     int counter = 0;
 
+    // Drop the newline so it doesn't end up in the value
+    line[strcspn(line, "\n")] = '\0';
+
+    // Skip anything that isn't an assignment
+    if (strchr(line, '=') == NULL) {
+      continue;
+    }
+
     // Super naively tokenize each line
     token = strtok(line, s);
 
@@ -350,7 +13513,7 @@ void eshell_config() {
     }
 
     // Finally set the variable
-    setenv(vrbl[0], vrbl[1], 1);
+    setenv(vrbl[0], counter > 1 ? vrbl[1] : "", 1);
   }
 
   // If one of the elements in the configured array isn't true, error out
@@ -379,7 +13542,8 @@ void eshell_config() {
 void eshell_loop(void) {
   char *line;
   char **args;
-  int status;
+  char **expanded;
+  int status = 1;
 
   // Infinitely loop while the return value for executing commands is non-zeo
   do {
@@ -389,19 +13553,45 @@ void eshell_loop(void) {
     if (getcwd(cwd, sizeof(cwd)) != NULL) {
 
       // Print a pretty prompt
-      printf(ANSI_COLOR_BLUE "%s " ANSI_COLOR_MAGENTA "> " ANSI_COLOR_RESET, cwd);
+      eshell_print_prompt(cwd);
 
-      // Read the line
+      // Read the line, stopping at the end of input
       line = eshell_read_line();
 
-      // Split the line
-      args = eshell_split_line(line);
+      if (line == NULL) {
+        break;
+      }
+
+      // Remember it before the tokenizer chops it up
+      eshell_history_add(line, true);
+
+      // Split the line, expand any alias it starts with, then variables
+      args = eshell_alias_expand(eshell_split_line(line));
+      expanded = args[0] && (eshell_construct(args[0]) ||
+                             eshell_pipeline_find(args)) ? args :
+                 eshell_expand(args);
+
+      if (expanded != args) {
+        free(args);
+        args = expanded;
+      }
 
       // Execute the command passed and get back a status
       status = eshell_execute(args);
 
+      // Warm up whatever is likely to be typed next
+      eshell_history_predict();
+
       free(line);
       free(args);
+
+      // Nothing can be using retired definitions any more
+      eshell_alias_sweep();
+      eshell_function_sweep();
+      eshell_vars_sweep();
+
+      // Keep the intern arena from growing without bound
+      eshell_intern_collect();
     } else {
       // Something went wrong with the current directory
       perror("getcwd() error");
@@ -419,6 +13609,16 @@ int main(int argc, char **argv) {
   // Load the configuration
   eshell_config();
 
+  // Pick up where earlier sessions left off
+  eshell_history_load();
+
+  // Start recording commands if asked to
+  eshell_audit_open();
+  eshell_metrics_open();
+
+  // Reap children through the SIGCHLD ring
+  eshell_children_init();
+
   // Run the main loop
   eshell_loop();
 
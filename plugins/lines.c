@@ -0,0 +1,141 @@
+/*******************************************************************************
+
+  @file        lines.c
+
+  @brief       A sample eshell plugin: `lines`, counting lines like wc -l
+                 without starting a program. Load it with
+                 `plugin plugins/lines.so`.
+
+*******************************************************************************/
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "eshell_plugin.h"
+
+#define LINES_BUFSIZE (128 * 1024)
+
+const uint32_t eshell_plugin_abi = ESHELL_PLUGIN_ABI;
+
+const struct eshell_plugin_api *shell;
+
+/**
+  @brief     Count the newlines in a descriptor.
+  @param  fd  The descriptor.
+  @param  buf A buffer of LINES_BUFSIZE bytes.
+  @param  n   Receives the count.
+  @return     0, or an error number.
+*/
+int lines_count(int fd, char *buf, unsigned long *n) {
+  ssize_t len;
+
+  *n = 0;
+
+  while ((len = read(fd, buf, LINES_BUFSIZE)) != 0) {
+    char *p = buf, *end;
+
+    if (len < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      return errno;
+    }
+
+    for (end = buf + len; (p = memchr(p, '\n', end - p)); p++) {
+      (*n)++;
+    }
+  }
+
+  return 0;
+}
+
+/**
+  @brief       Builtin command: count lines.
+  @param  args `lines [-v NAME] [FILE...]`; with -v the total is also put in
+                 the variable NAME.
+  @return      Always return 1 to continue executing the shell.
+*/
+int lines(char **args) {
+  char *buf = malloc(LINES_BUFSIZE);
+  const char *var = NULL;
+  unsigned long n, total = 0;
+  int i = 1, files = 0;
+  int err;
+
+  if (!buf) {
+    fprintf(stderr, "lines: out of memory\n");
+    shell->status(1);
+
+    return 1;
+  }
+
+  if (args[i] && strcmp(args[i], "-v") == 0 && args[i + 1]) {
+    var = args[i + 1];
+    i += 2;
+  }
+
+  shell->status(0);
+
+  for (; args[i]; i++, files++) {
+    int fd = open(args[i], O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0 || (err = lines_count(fd, buf, &n)) != 0) {
+      fprintf(stderr, "lines: %s: %s\n", args[i],
+              strerror(fd < 0 ? errno : err));
+      shell->status(1);
+    } else {
+      shell->printf("%lu %s\n", n, args[i]);
+      total += n;
+    }
+
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+
+  if (files == 0) {
+    if ((err = lines_count(shell->input(), buf, &total)) != 0) {
+      fprintf(stderr, "lines: %s\n", strerror(err));
+      shell->status(1);
+    } else {
+      shell->printf("%lu\n", total);
+    }
+  } else if (files > 1) {
+    shell->printf("%lu total\n", total);
+  }
+
+  if (var) {
+    char num[24];
+
+    snprintf(num, sizeof(num), "%lu", total);
+
+    if (shell->set(var, num) != 0) {
+      fprintf(stderr, "lines: can't set %s here\n", var);
+      shell->status(1);
+    }
+  }
+
+  free(buf);
+
+  return 1;
+}
+
+/**
+  @brief     Register the plugin's builtins.
+  @param api The shell's side of the interface.
+  @return    0.
+*/
+int eshell_plugin_init(const struct eshell_plugin_api *api) {
+  if (api->abi != ESHELL_PLUGIN_ABI) {
+    return -1;
+  }
+
+  shell = api;
+
+  return shell->register_builtin("lines", lines, ESHELL_PLUGIN_THREADSAFE);
+}